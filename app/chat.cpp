@@ -26,6 +26,11 @@ struct Params
     int topk;
     float p;
   } sampler_option;
+  bool import_weights;
+  // -1 picks the device the model runs fastest on
+  int device;
+  // kv caches in q8_0 rather than fp16
+  bool q8_0_kvcache;
 };
 
 #define _H(s) "\033[1m" #s "\033[0m"
@@ -48,6 +53,10 @@ _H(DESCRIPTION)"\n"
 "    " _H(-s) "\tsampler. top_k or top_p are supported. (default: top_k)\n"
 "    " _H(-k) "\tthe k option of top_k sampler. (default: 40)\n"
 "    " _H(-p) "\tthe p option of top_p sampler. (default: 0.75)\n"
+"    " _H(-i) "\tlet the device read weights from the mapped model file\n"
+"    " _H(-d) "\tindex of the device to run on. (default: the fastest one\n"
+"    \tthe model fits on)\n"
+"    " _H(-q) "\tkeep the kv cache in q8_0, about half the memory of fp16\n"
 ;
   // clang-format on
   fprintf (stdout, fmt);
@@ -57,7 +66,7 @@ static int
 parse_params_from_cmdline (int argc, char *const argv[], Params *params)
 {
   int ch = -1;
-  while ((ch = ::getopt (argc, argv, "m:t:a:s:k:p:e:")) != -1)
+  while ((ch = ::getopt (argc, argv, "m:t:a:s:k:p:e:id:q")) != -1)
     {
       switch (ch)
         {
@@ -82,6 +91,15 @@ parse_params_from_cmdline (int argc, char *const argv[], Params *params)
         case 'p':
           params->sampler_option.p = ::atof (optarg);
           break;
+        case 'i':
+          params->import_weights = true;
+          break;
+        case 'd':
+          params->device = ::atoi (optarg);
+          break;
+        case 'q':
+          params->q8_0_kvcache = true;
+          break;
         case '?':
         default:
           show_usage (argc, argv);
@@ -369,7 +387,10 @@ main (int argc, char *const argv[])
                     .system_message = "",
                     .anti_prompt = {},
                     .sampler = "top_k",
-                    .sampler_option = { .topk = 10, .p = 0.9 } };
+                    .sampler_option = { .topk = 10, .p = 0.9 },
+                    .import_weights = false,
+                    .device = -1,
+                    .q8_0_kvcache = false };
 
   if ((ret = parse_params_from_cmdline (argc, argv, &params)) != 0)
     {
@@ -409,7 +430,49 @@ main (int argc, char *const argv[])
       return -1;
     }
 
-  vkllama::Model model;
+  int device = params.device;
+  if (device < 0)
+    {
+      auto selected = vkllama::select_llama2_device (meta, tensors);
+      if (!selected.ok ())
+        {
+          std::cerr << "failed at selecting a device: " << selected.status ()
+                    << std::endl;
+          return -1;
+        }
+      device = *selected;
+    }
+  fprintf (stderr, "running on device %d\n", device);
+
+  // a context the kv caches fit into
+  const auto kvcache_dtype
+      = params.q8_0_kvcache ? vkllama::Q8_0 : vkllama::FP16;
+  auto plan = vkllama::plan_llama2_devices (meta, tensors, { device },
+                                            kvcache_dtype);
+  if (!plan.ok ())
+    {
+      std::cerr << "failed at planning device memory: " << plan.status ()
+                << std::endl;
+      return -1;
+    }
+  if (plan->maxlen < meta["llama.context_length"].val->uint32)
+    {
+      fprintf (stderr, "context length cut to %u tokens to fit the device\n",
+               plan->maxlen);
+    }
+
+  vkllama::Model model (device);
+  model.set_maxlen (plan->maxlen);
+  model.set_kvcache_dtype (kvcache_dtype);
+  model.set_import_weights (params.import_weights);
+  model.set_load_callback ([] (size_t loaded, size_t total) {
+    fprintf (stderr, "\rloading weights: %zu/%zu MiB", loaded >> 20,
+             total >> 20);
+    if (loaded == total)
+      {
+        fprintf (stderr, "\n");
+      }
+  });
   if (auto s = model.init (meta, tensors); !s.ok ())
     {
       std::cerr << "failed at model init: " << s << std::endl;
@@ -117,7 +117,57 @@ main (const int argc, const char *argv[])
     }
   std::cerr << std::endl;
 
-  vkllama::Model model (0);
+  // $VKLLAMA_DEVICE, or the device the model runs fastest on
+  int device = -1;
+  if (const char *env = getenv ("VKLLAMA_DEVICE"))
+    {
+      device = ::atoi (env);
+    }
+  else
+    {
+      auto selected = vkllama::select_llama2_device (gguf_kv, tensors);
+      if (!selected.ok ())
+        {
+          std::cerr << "failed at selecting a device: " << selected.status ()
+                    << std::endl;
+          return -1;
+        }
+      device = *selected;
+    }
+  fprintf (stderr, "running on device %d\n", device);
+
+  // a context the kv caches fit into, q8_0 caches with
+  // $VKLLAMA_KVCACHE_Q8_0
+  const auto kvcache_dtype = getenv ("VKLLAMA_KVCACHE_Q8_0") != nullptr
+                                 ? vkllama::Q8_0
+                                 : vkllama::FP16;
+  auto plan = vkllama::plan_llama2_devices (gguf_kv, tensors, { device },
+                                            kvcache_dtype);
+  if (!plan.ok ())
+    {
+      std::cerr << "failed at planning device memory: " << plan.status ()
+                << std::endl;
+      return -1;
+    }
+  if (plan->maxlen < gguf_kv["llama.context_length"].val->uint32)
+    {
+      fprintf (stderr, "context length cut to %u tokens to fit the device\n",
+               plan->maxlen);
+    }
+
+  vkllama::Model model (device);
+  model.set_maxlen (plan->maxlen);
+  model.set_kvcache_dtype (kvcache_dtype);
+  // the device reads weights out of the mapped file
+  model.set_import_weights (getenv ("VKLLAMA_IMPORT_WEIGHTS") != nullptr);
+  model.set_load_callback ([] (size_t loaded, size_t total) {
+    fprintf (stderr, "\rloading weights: %zu/%zu MiB", loaded >> 20,
+             total >> 20);
+    if (loaded == total)
+      {
+        fprintf (stderr, "\n");
+      }
+  });
   auto ret = model.init (gguf_kv, tensors);
 
   if (!ret.ok ())
@@ -128,8 +178,6 @@ main (const int argc, const char *argv[])
 
   fprintf (stderr, "all weights are uploaded to device\n");
 
-  std::unique_ptr<TopkSampler> samplers (new TopkSampler (1));
-
   for (int r = 0; r < 1; ++r)
     {
       std::vector<uint32_t> prompt_inp;
@@ -137,22 +185,27 @@ main (const int argc, const char *argv[])
           prompt.cbegin (), prompt.cend (), std::back_inserter (prompt_inp),
           [] (const int tok) { return static_cast<uint32_t> (tok); });
 
+      // greedy decoding: every step picks its token on the device, and the
+      // next step is queued before the current one is waited, so printing
+      // runs while the device already works on the following token.
       auto t0 = std::chrono::high_resolution_clock::now ();
-      auto init_out = model (prompt_inp, 0);
-      if (!init_out.ok ())
+      auto step = model.submit (prompt_inp, 0);
+      if (!step.ok ())
         {
-          std::cerr << "model infer failed: " << init_out.status ()
-                    << std::endl;
+          std::cerr << "model infer failed: " << step.status () << std::endl;
+          return -1;
+        }
+
+      auto tok = model.wait (*step);
+      if (!tok.ok ())
+        {
+          std::cerr << "model infer failed: " << tok.status () << std::endl;
           return -1;
         }
       auto t1 = std::chrono::high_resolution_clock::now ();
-      size_t candidate_size = init_out->size ();
 
       std::vector<int> toks (prompt);
-
-      toks.push_back (samplers->sample (init_out->data () + init_out->size ()
-                                            - candidate_size,
-                                        candidate_size));
+      toks.push_back (*tok);
 
       auto milliseconds
           = std::chrono::duration_cast<std::chrono::milliseconds> (t1 - t0)
@@ -161,19 +214,56 @@ main (const int argc, const char *argv[])
                "prompt tokens are generated. prompt speed: %f tokens/s\n",
                prompt.size () * 1000.f / milliseconds);
 
+      auto activations = model.activation_stats ();
+      fprintf (stderr,
+               "activation footprint: %zu bytes in %zu slots, peak live "
+               "%zu bytes, %zu bytes without planning\n",
+               activations.slot_bytes, activations.slots,
+               activations.peak_live_bytes, activations.unplanned_bytes);
+
+      for (int kind = 0; kind < vkllama::MEMORY_KIND_COUNT; ++kind)
+        {
+          auto pool = model.memory_stats ((vkllama::MemoryKind)kind);
+          fprintf (stderr,
+                   "%s memory: %zu bytes in %zu chunks, %zu bytes in use by "
+                   "%zu tensors, peak %zu bytes\n",
+                   vkllama::memory_kind_name ((vkllama::MemoryKind)kind),
+                   pool.allocated_bytes, pool.chunk_count, pool.in_use_bytes,
+                   pool.allocations, pool.peak_in_use_bytes);
+        }
+
       std::cerr << buffer;
 
       auto t2 = std::chrono::high_resolution_clock::now ();
       std::string output_buf;
+      if (pred_tokens > 1)
+        {
+          step = model.submit ({}, toks.size () - 1);
+        }
+
       for (int i = 1; i < pred_tokens; ++i)
         {
-          auto output = model ({ (uint32_t)toks.back () }, toks.size () - 1);
-          if (!output.ok ())
+          if (!step.ok ())
+            {
+              std::cerr << "model infer failed: " << step.status ()
+                        << std::endl;
+              return -1;
+            }
+
+          auto current = *step;
+          if (i + 1 < pred_tokens)
+            {
+              step = model.submit ({}, toks.size ());
+            }
+
+          tok = model.wait (current);
+          if (!tok.ok ())
             {
-              std::cerr << "model infer failed: " << output.status ()
+              std::cerr << "model infer failed: " << tok.status ()
                         << std::endl;
+              return -1;
             }
-          toks.push_back (samplers->sample (output->data (), output->size ()));
+          toks.push_back (*tok);
 
           auto piece = sp.IdToPiece (toks.back ());
 
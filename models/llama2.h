@@ -8,21 +8,29 @@ extern "C"{
 }
 // clang-format on
 #include "absl/status/statusor.h"
+#include "src/core/activation_planner.h"
 #include "src/core/command.h"
 #include "src/core/common.h"
+#include "src/core/kvcache_pool.h"
+#include "src/core/quants.h"
 #include "src/core/tensor.h"
+#include "src/core/weight_loader.h"
 #include "src/ops/argop.h"
 #include "src/ops/cast.h"
+#include "src/ops/device_benchmark.h"
 #include "src/ops/elementwise.h"
 #include "src/ops/embedding.h"
 #include "src/ops/feed_forward.h"
+#include "src/ops/feed_token.h"
 #include "src/ops/multiheadattention_v2.h"
 #include "src/ops/rms_norm.h"
 #include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <cstdio>
+#include <deque>
 #include <fcntl.h>
+#include <functional>
 #include <map>
 #include <memory>
 #include <numeric>
@@ -92,6 +100,10 @@ public:
     int maxlen;
     int dim;
     bool clip_output;
+    // FP16 or Q8_0
+    DType kvcache_dtype = FP16;
+    // the pages of the block in a KVCachePool, none for caches of its own
+    PagedKVCache paged = {};
   };
 
   struct FeedForwardParams
@@ -126,7 +138,8 @@ public:
         gpu_, command_, transformer_params_.Wk, transformer_params_.Wq,
         transformer_params_.Wv, transformer_params_.Wo,
         transformer_params_.maxlen, transformer_params_.dim, true, FP16, true,
-        transformer_params_.clip_output));
+        transformer_params_.clip_output, transformer_params_.kvcache_dtype,
+        transformer_params_.paged));
 
     feedforward_op_.reset (new FeedForward (
         gpu_, command_, feedforward_params_.w1, feedforward_params_.w2,
@@ -160,7 +173,36 @@ public:
   absl::StatusOr<Tensor>
   operator() (Tensor in, const size_t offset)
   {
+    return forward_ (
+        in, [this, offset] (Tensor x) { return (*attn_op_) (x, offset); });
+  }
+
+  // offset lives in a device tensor so the recorded commands can be replayed
+  // for every decode position up to read_len.
+  absl::StatusOr<Tensor>
+  operator() (Tensor in, Tensor offset, const size_t read_len)
+  {
+    return forward_ (in, [this, &offset, read_len] (Tensor x) {
+      return (*attn_op_) (x, offset, read_len);
+    });
+  }
+
+  void
+  print_op_cost ()
+  {
+    fprintf (stderr,
+             "block cost -- attn norm cost: %llu, attn cost: %lld, attn add "
+             "cost: %lld, "
+             "ffn norm cost: %lld, ffn cost: %lld, ffn add cost: %lld\n",
+             norm_op_->time (), attn_op_->time (), add_op_->time (),
+             norm_op2_->time (), feedforward_op_->time (), add_op2_->time ());
+  }
 
+private:
+  template <typename Attn>
+  absl::StatusOr<Tensor>
+  forward_ (Tensor in, Attn &&attn)
+  {
     auto ret = norm_op_->operator() (in);
 
     VKLLAMA_STATUS_OK (ret);
@@ -173,7 +215,7 @@ public:
 
     print_fn (normed_, "block input normed mean");
 
-    ret = attn_op_->operator() (normed_, offset);
+    ret = attn (normed_);
     VKLLAMA_STATUS_OK (ret);
     transformed_ = *ret;
     print_fn (transformed_, "block attn output mean");
@@ -212,18 +254,6 @@ public:
     return out;
   }
 
-  void
-  print_op_cost ()
-  {
-    fprintf (stderr,
-             "block cost -- attn norm cost: %llu, attn cost: %lld, attn add "
-             "cost: %lld, "
-             "ffn norm cost: %lld, ffn cost: %lld, ffn add cost: %lld\n",
-             norm_op_->time (), attn_op_->time (), add_op_->time (),
-             norm_op2_->time (), feedforward_op_->time (), add_op2_->time ());
-  }
-
-private:
   GPUDevice *gpu_;
   Command *command_;
   std::unique_ptr<MultiHeadAttentionV2> attn_op_;
@@ -277,7 +307,13 @@ public:
         return ret;
       }
     argmax_op_.reset (new ArgMax (gpu_, command_, FP16));
-    return argmax_op_->init ();
+    if (!(ret = argmax_op_->init ()).ok ())
+      {
+        return ret;
+      }
+
+    feed_op_.reset (new FeedToken (gpu_, command_));
+    return feed_op_->init ();
   }
 
   absl::StatusOr<Tensor>
@@ -297,6 +333,26 @@ public:
     return out;
   }
 
+  // Greedy sampling on the device: the argmax token of the last row is fed
+  // to toks and history[offset], and offset is advanced by one.
+  absl::Status
+  greedy (Tensor in, Tensor toks, Tensor offset, Tensor history)
+  {
+    auto ret = norm_op_->operator() (in);
+    VKLLAMA_STATUS_OK (ret);
+    norm_output_ = *ret;
+
+    ret = matmul_op_->operator() (norm_output_);
+    VKLLAMA_STATUS_OK (ret);
+    matmul_output_ = *ret;
+
+    ret = (*argmax_op_) (matmul_output_);
+    VKLLAMA_STATUS_OK (ret);
+    argmax_output_ = *ret;
+
+    return (*feed_op_) (argmax_output_, toks, offset, history);
+  }
+
   void
   print_op_cost ()
   {
@@ -313,28 +369,420 @@ private:
   Tensor norm_weight_;
   Tensor norm_output_;
   Tensor matmul_output_;
+  Tensor argmax_output_;
   std::unique_ptr<MatMul> matmul_op_;
   std::unique_ptr<RMSNorm> norm_op_;
   std::unique_ptr<ArgMax> argmax_op_;
   std::unique_ptr<Cast> cast_op_;
+  std::unique_ptr<FeedToken> feed_op_;
 };
 
+// dtype of the device tensor of a gguf tensor type
+inline DType
+gguf_dtype (const uint32_t type)
+{
+  if (type == 0)
+    {
+      return FP32;
+    }
+  if (type == 1)
+    {
+      return FP16;
+    }
+  if (type == 8)
+    {
+      return Q8_0;
+    }
+
+  return INT8;
+}
+
+inline WeightLoader::Upload
+gguf_weight_upload (gguf_tensor const &weight, Tensor const &to)
+{
+  return { (const uint8_t *)weight.weights_data, (size_t)weight.bsize, to };
+}
+
+// what the blocks of a llama2 gguf model are built from
+struct Llama2Config
+{
+  uint32_t head_count;
+  uint32_t block_count;
+  uint32_t maxlen;
+  float norm_eps;
+  // dtype of the kv caches, FP16 or Q8_0
+  DType kvcache_dtype = FP16;
+};
+
+inline Llama2Config
+llama2_config (std::map<std::string, gguf_key> &kv)
+{
+  return { kv["llama.attention.head_count"].val->uint32,
+           kv["llama.block_count"].val->uint32,
+           kv["llama.context_length"].val->uint32,
+           kv["llama.attention.layer_norm_rms_epsilon"].val->float32 };
+}
+
+inline const char *const kLlama2BlockWeights[]
+    = { "attn_norm", "attn_k",   "attn_q",   "attn_v", "attn_output",
+        "ffn_norm",  "ffn_gate", "ffn_down", "ffn_up" };
+
+// bytes of the weights the layers and blocks of a model upload
+inline size_t
+llama2_weight_bytes (std::map<std::string, gguf_tensor> &tensors,
+                     const uint32_t block_count)
+{
+  size_t total = tensors["token_embd.weight"].bsize
+                 + tensors["output.weight"].bsize
+                 + tensors["output_norm.weight"].bsize;
+  char vname[512];
+  for (uint32_t b = 0; b < block_count; ++b)
+    {
+      for (auto *name : kLlama2BlockWeights)
+        {
+          ::snprintf (vname, sizeof (vname), "blk.%u.%s.weight", b, name);
+          total += tensors[vname].bsize;
+        }
+    }
+  return total;
+}
+
+// bytes of the k and v cache rows of one block and one position, for
+// blocks whose k and v projections are kv_dim wide
+inline size_t
+llama2_kvcache_row_bytes (const size_t kv_dim, const DType dtype)
+{
+  const auto property = get_dtype_property (dtype);
+  return 2ul * (kv_dim + property.items_per_block - 1)
+         / property.items_per_block * property.bytes_per_block;
+}
+
+// bytes of the kv caches of all blocks at full context length
+inline size_t
+llama2_kvcache_bytes (Llama2Config const &config, const size_t kv_dim)
+{
+  return config.block_count * config.maxlen
+         * llama2_kvcache_row_bytes (kv_dim, config.kvcache_dtype);
+}
+
+// An estimate of the activations of a pass over tokens tokens: the two
+// norms, q, k and v, the attention output and its projection, the residual
+// adds, the fused up and gate product and the down projection, all fp16.
+// Flash attention keeps the scores on chip, so nothing scales with the
+// context. The activation planner shares them between the blocks, so they
+// count once.
+inline size_t
+llama2_activation_bytes (std::map<std::string, gguf_tensor> &tensors,
+                         const size_t tokens)
+{
+  const size_t dim = tensors["token_embd.weight"].dim[0];
+  const size_t kv_dim = tensors["blk.0.attn_k.weight"].dim[1];
+  const size_t hidden = tensors["blk.0.ffn_up.weight"].dim[1];
+  return tokens * (8 * dim + 2 * kv_dim + hidden)
+         * sizeof (__vkllama_fp16_t);
+}
+
+// The device a model fits on and runs fastest on, see select_device ().
+// A device fits when it holds the weights and kv caches of min_maxlen
+// tokens, the shortest context plan_llama2_memory () shrinks a model to;
+// the caches of the full context are not needed to run it.
+inline absl::StatusOr<int>
+select_llama2_device (std::map<std::string, gguf_key> &kv,
+                      std::map<std::string, gguf_tensor> &tensors,
+                      const uint32_t min_maxlen = 256)
+{
+  auto config = llama2_config (kv);
+  config.maxlen = std::min (config.maxlen, min_maxlen);
+  return select_device (
+      llama2_weight_bytes (tensors, config.block_count)
+      + llama2_kvcache_bytes (config,
+                              tensors["blk.0.attn_k.weight"].dim[1]));
+}
+
+// Where a model goes given the device memory it may use, worked out from
+// its metadata before anything is allocated.
+struct Llama2MemoryPlan
+{
+  // the context length the kv caches are created for
+  uint32_t maxlen;
+  // runs of consecutive blocks, one per device in the order of the budgets;
+  // a single run when the first device holds the whole model
+  std::vector<uint32_t> blocks;
+  // bytes each of those devices is expected to allocate
+  std::vector<size_t> device_bytes;
+};
+
+// Fits a model into devices with budgets bytes of device memory each, see
+// GPUDevice::device_local_available () and DeviceInfo. The context length
+// of the model is kept when the blocks fit on the devices together, filling
+// them in order with the embeddings on the first and the output layer on the
+// last; otherwise it is halved until they do, down to min_maxlen. Every
+// device reserves the activations of a prompt of prompt_tokens tokens.
+// kvcache_dtype is that of the caches, see Model::set_kvcache_dtype ().
+inline absl::StatusOr<Llama2MemoryPlan>
+plan_llama2_memory (std::map<std::string, gguf_key> &kv,
+                    std::map<std::string, gguf_tensor> &tensors,
+                    std::vector<size_t> const &budgets,
+                    const uint32_t min_maxlen = 256,
+                    const size_t prompt_tokens = 512,
+                    const DType kvcache_dtype = FP16)
+{
+  auto config = llama2_config (kv);
+  config.kvcache_dtype = kvcache_dtype;
+  const size_t n = config.block_count;
+  const size_t kv_dim = tensors["blk.0.attn_k.weight"].dim[1];
+  const size_t input_bytes = tensors["token_embd.weight"].bsize;
+  const size_t output_bytes
+      = tensors["output.weight"].bsize + tensors["output_norm.weight"].bsize;
+
+  std::vector<size_t> weight_bytes (n, 0);
+  char vname[512];
+  for (size_t b = 0; b < n; ++b)
+    {
+      for (auto *name : kLlama2BlockWeights)
+        {
+          ::snprintf (vname, sizeof (vname), "blk.%zu.%s.weight", b, name);
+          weight_bytes[b] += tensors[vname].bsize;
+        }
+    }
+
+  const uint32_t full = config.maxlen;
+  for (uint32_t maxlen = full;; maxlen /= 2)
+    {
+      config.maxlen = maxlen;
+      const size_t kvcache
+          = maxlen * llama2_kvcache_row_bytes (kv_dim, kvcache_dtype);
+      const size_t activations = llama2_activation_bytes (
+          tensors, std::min<size_t> (prompt_tokens, maxlen));
+
+      Llama2MemoryPlan plan = { maxlen, {}, {} };
+      size_t b = 0;
+      for (size_t d = 0; d < budgets.size () && b < n; ++d)
+        {
+          size_t used = activations + (d == 0 ? input_bytes : 0);
+          size_t count = 0;
+          while (b + count < n
+                 && used + weight_bytes[b + count] + kvcache <= budgets[d])
+            {
+              used += weight_bytes[b + count] + kvcache;
+              ++count;
+            }
+
+          // the output layer goes with the last block; when it does not fit
+          // the last block moves on with it
+          if (count > 0 && b + count == n && used + output_bytes > budgets[d])
+            {
+              --count;
+              used -= weight_bytes[b + count] + kvcache;
+            }
+
+          if (count == 0)
+            {
+              break;
+            }
+
+          b += count;
+          plan.blocks.push_back (count);
+          plan.device_bytes.push_back (used + (b == n ? output_bytes : 0));
+        }
+
+      if (b == n)
+        {
+          return plan;
+        }
+
+      // nothing is left to try once the context is as short as allowed
+      if (maxlen <= 1 || maxlen / 2 < std::min (min_maxlen, full))
+        {
+          return absl::ResourceExhaustedError (absl::StrFormat (
+              "plan_llama2_memory: %u blocks do not fit into %zu devices "
+              "with %u tokens of context.",
+              config.block_count, budgets.size (), maxlen));
+        }
+    }
+}
+
+// plan_llama2_memory () with what the budgets of the devices devs have
+// left, as enumerate_devices () reports them.
+inline absl::StatusOr<Llama2MemoryPlan>
+plan_llama2_devices (std::map<std::string, gguf_key> &kv,
+                     std::map<std::string, gguf_tensor> &tensors,
+                     std::vector<int> const &devs,
+                     const DType kvcache_dtype = FP16)
+{
+  auto devices = enumerate_devices ();
+  VKLLAMA_STATUS_OK (devices.status ());
+
+  std::vector<size_t> budgets;
+  for (auto dev : devs)
+    {
+      if (dev < 0 || (size_t)dev >= devices->size ())
+        {
+          return absl::NotFoundError (absl::StrFormat (
+              "plan_llama2_devices: device %d not found, %zu devices.", dev,
+              devices->size ()));
+        }
+      budgets.push_back ((*devices)[dev].device_local_available);
+    }
+  return plan_llama2_memory (kv, tensors, budgets, 256, 512, kvcache_dtype);
+}
+
+// The layers and blocks of a model on gpu. Each queues its weights on
+// loader and records its setup into command, which has to be recording;
+// the weights are only in place once the loader has finished.
+inline absl::StatusOr<InputLayer *>
+create_llama2_input (GPUDevice *gpu, Command *command, WeightLoader &loader,
+                     std::map<std::string, gguf_tensor> &tensors)
+{
+  auto embeddings = tensors["token_embd.weight"];
+  Tensor vkembeddings (1, embeddings.dim[1], embeddings.dim[0], gpu,
+                       gguf_dtype (embeddings.type));
+  VKLLAMA_STATUS_OK (vkembeddings.create (WEIGHT_MEMORY));
+  VKLLAMA_STATUS_OK (
+      loader.add ({ gguf_weight_upload (embeddings, vkembeddings) }));
+
+  uint32_t UNK = 0;
+  std::unique_ptr<InputLayer> layer (
+      new InputLayer (gpu, command, vkembeddings, UNK));
+  VKLLAMA_STATUS_OK (layer->init ());
+  return layer.release ();
+}
+
+inline absl::StatusOr<OutputLayer *>
+create_llama2_output (GPUDevice *gpu, Command *command, WeightLoader &loader,
+                      std::map<std::string, gguf_tensor> &tensors)
+{
+  auto output_weight = tensors["output.weight"];
+  auto norm_weight = tensors["output_norm.weight"];
+  Tensor vkoutput_weight (1, output_weight.dim[1], output_weight.dim[0], gpu,
+                          gguf_dtype (output_weight.type));
+  Tensor vknorm_weight (1, 1, norm_weight.dim[0], gpu,
+                        gguf_dtype (norm_weight.type));
+  VKLLAMA_STATUS_OK (vkoutput_weight.create (WEIGHT_MEMORY));
+  VKLLAMA_STATUS_OK (vknorm_weight.create (WEIGHT_MEMORY));
+  VKLLAMA_STATUS_OK (
+      loader.add ({ gguf_weight_upload (output_weight, vkoutput_weight),
+                    gguf_weight_upload (norm_weight, vknorm_weight) }));
+
+  std::unique_ptr<OutputLayer> layer (
+      new OutputLayer (gpu, command, vkoutput_weight, vknorm_weight));
+  VKLLAMA_STATUS_OK (layer->init ());
+  return layer.release ();
+}
+
+inline absl::StatusOr<Llama2Block *>
+create_llama2_block (GPUDevice *gpu, Command *command, WeightLoader &loader,
+                     std::map<std::string, gguf_tensor> &tensors,
+                     Llama2Config const &config, const uint32_t b,
+                     PagedKVCache const &paged = {})
+{
+  char vname[512];
+  auto weight = [&] (const char *name) {
+    ::snprintf (vname, sizeof (vname), "blk.%u.%s.weight", b, name);
+    return tensors[vname];
+  };
+
+  const auto attn_norm_weight = weight ("attn_norm");
+  const auto attn_k_weight = weight ("attn_k");
+  const auto attn_q_weight = weight ("attn_q");
+  const auto attn_v_weight = weight ("attn_v");
+  const auto attn_output_weight = weight ("attn_output");
+  const auto ffn_norm_weight = weight ("ffn_norm");
+  const auto ffn_up_weight = weight ("ffn_up");
+  const auto ffn_down_weight = weight ("ffn_down");
+  const auto ffn_gate_weight = weight ("ffn_gate");
+
+  Tensor vk_attn_norm_weight (1, 1, attn_norm_weight.dim[0], gpu,
+                              gguf_dtype (attn_norm_weight.type));
+  Tensor vk_ffn_norm_weight (1, 1, ffn_norm_weight.dim[0], gpu,
+                             gguf_dtype (ffn_norm_weight.type));
+
+  size_t head_dim = attn_k_weight.dim[1];
+  size_t input_dim = attn_k_weight.dim[0];
+
+  Tensor vkWk (1, head_dim, input_dim, gpu, gguf_dtype (attn_k_weight.type));
+  Tensor vkWq (1, head_dim, input_dim, gpu, gguf_dtype (attn_q_weight.type));
+  Tensor vkWv (1, head_dim, input_dim, gpu, gguf_dtype (attn_v_weight.type));
+  Tensor Wo (1, attn_output_weight.dim[1], attn_output_weight.dim[0], gpu,
+             gguf_dtype (attn_output_weight.type));
+
+  Tensor vkw1 (1, ffn_gate_weight.dim[1], ffn_gate_weight.dim[0], gpu,
+               gguf_dtype (ffn_gate_weight.type));
+  Tensor vkw2 (1, ffn_down_weight.dim[1], ffn_down_weight.dim[0], gpu,
+               gguf_dtype (ffn_down_weight.type));
+  Tensor vkw3 (1, ffn_up_weight.dim[1], ffn_up_weight.dim[0], gpu,
+               gguf_dtype (ffn_up_weight.type));
+
+  for (auto *t : { &vk_attn_norm_weight, &vk_ffn_norm_weight, &vkWk, &vkWq,
+                   &vkWv, &Wo, &vkw1, &vkw2, &vkw3 })
+    {
+      VKLLAMA_STATUS_OK (t->create (WEIGHT_MEMORY));
+    }
+
+  VKLLAMA_STATUS_OK (loader.add (
+      { gguf_weight_upload (attn_norm_weight, vk_attn_norm_weight),
+        gguf_weight_upload (ffn_norm_weight, vk_ffn_norm_weight),
+        gguf_weight_upload (attn_k_weight, vkWk),
+        gguf_weight_upload (attn_q_weight, vkWq),
+        gguf_weight_upload (attn_v_weight, vkWv),
+        gguf_weight_upload (attn_output_weight, Wo),
+        gguf_weight_upload (ffn_gate_weight, vkw1),
+        gguf_weight_upload (ffn_down_weight, vkw2),
+        gguf_weight_upload (ffn_up_weight, vkw3) }));
+
+  const auto dim = head_dim / config.head_count;
+  Llama2Block::RmsNormParams rmsnorm_params
+      = { vk_attn_norm_weight, vk_ffn_norm_weight, config.norm_eps };
+  Llama2Block::TransformerParams transformer_params
+      = { vkWk, vkWq, vkWv, Wo, (int)config.maxlen, (int)dim,
+          b == (config.block_count - 1), config.kvcache_dtype, paged };
+  Llama2Block::FeedForwardParams feedfward_params
+      = { vkw1, vkw2, vkw3, config.norm_eps };
+
+  std::unique_ptr<Llama2Block> block (new Llama2Block (
+      gpu, command, transformer_params, feedfward_params, rmsnorm_params));
+  VKLLAMA_STATUS_OK (block->init ());
+  return block.release ();
+}
+
 class Model
 {
 public:
-  Model (int dev=0)
-      : dev_(dev), gpu_ (nullptr), input_command_ (nullptr), output_command_ (nullptr)
+  // decode graph length is rounded up to this many kv cache rows, so one
+  // recording serves every position within the same bucket.
+  static constexpr size_t kDecodeGraphBucket = 256;
+  // prompt length init () reserves activations for before admitting a model
+  static constexpr size_t kPreflightTokens = 512;
+
+  // Completion callback of a step queued by submit (): the token picked by
+  // the step and the position it was decoded at.
+  using StepCallback = std::function<void (uint32_t tok, size_t offset)>;
+  using LoadCallback
+      = std::function<void (size_t loaded_bytes, size_t total_bytes)>;
+
+  Model (int dev = 0, const bool decode_graph = true)
+      : dev_ (dev), decode_graph_ (decode_graph), import_weights_ (false),
+        gpu_ (nullptr), activations_ (nullptr), input_command_ (nullptr),
+        output_command_ (nullptr), input_layer_ (nullptr),
+        output_layer_ (nullptr), maxlen_ (0), maxlen_limit_ (0),
+        kvcache_dtype_ (FP16), kvcache_pages_ (0),
+        page_rows_ (KVCachePool::kPageRows), sequence_ (0),
+        next_sequence_ (0), graph_len_ (0), greedy_graph_ (false),
+        next_step_ (0), next_offset_ (0), last_tok_ (0), has_next_ (false),
+        device_fed_ (false)
   {
   }
 
   ~Model ()
   {
+    (void)drain_ ();
     delete input_layer_;
     delete output_layer_;
     for (auto *block : blocks_)
       {
         delete block;
       }
+    delete activations_;
 
     delete input_command_;
     delete output_command_;
@@ -342,6 +790,14 @@ public:
       {
         delete c;
       }
+
+    // their memory goes back to the device's pools
+    vktoks_ = Tensor ();
+    vkoffset_ = Tensor ();
+    vkhistory_ = Tensor ();
+    vktable_ = Tensor ();
+    sequences_.clear ();
+    pool_.reset ();
     delete gpu_;
   }
 
@@ -356,6 +812,10 @@ public:
         return ret;
       }
 
+    // intermediates of the blocks; the input and output layers run once
+    // per pass and keep their own buffers
+    activations_ = new ActivationPlanner (gpu_);
+
     input_command_ = new Command (gpu_);
     output_command_ = new Command (gpu_);
     if (!(ret = input_command_->init ()).ok ()
@@ -364,96 +824,119 @@ public:
         return ret;
       }
 
-    auto head_count = kv["llama.attention.head_count"].val->uint32;
-    auto block_count = kv["llama.block_count"].val->uint32;
-    auto norm_eps = kv["llama.attention.layer_norm_rms_epsilon"].val->float32;
-    auto maxlen = kv["llama.context_length"].val->uint32;
-
-    if (ret = input_command_->begin (); !ret.ok ())
+    auto config = llama2_config (kv);
+    if (maxlen_limit_ > 0)
       {
-        return ret;
+        config.maxlen = std::min (config.maxlen, maxlen_limit_);
       }
+    config.kvcache_dtype = kvcache_dtype_;
+    const auto block_count = config.block_count;
+    const auto maxlen = config.maxlen;
+    maxlen_ = maxlen;
 
-    if (ret = output_command_->begin (); !ret.ok ())
+    const size_t kv_dim = tensors["blk.0.attn_k.weight"].dim[1];
+    if (kvcache_pages_ > 0 && kvcache_dtype_ != FP16)
       {
-        return ret;
+        return absl::InvalidArgumentError (
+            "Model: paged kv caches are fp16 kv caches.");
       }
 
-    auto to_dtype = [] (const uint32_t type) {
-      if (type == 0)
-        {
-          return FP32;
-        }
-      if (type == 1)
-        {
-          return FP16;
-        }
-      if (type == 8)
+    // nothing is allocated for a model that cannot fit, see
+    // plan_llama2_memory () for one that does
+    {
+      const size_t weights = llama2_weight_bytes (tensors, block_count);
+      const size_t kvcache
+          = kvcache_pages_ > 0
+                ? KVCachePool::bytes (block_count, config.head_count,
+                                      kv_dim / config.head_count,
+                                      kvcache_pages_, page_rows_)
+                : llama2_kvcache_bytes (config, kv_dim);
+      const uint32_t kv_tokens
+          = kvcache_pages_ > 0 ? kvcache_pages_ * page_rows_ : maxlen;
+      const size_t activations = llama2_activation_bytes (
+          tensors, std::min<size_t> (kPreflightTokens, maxlen));
+      const size_t available = gpu_->device_local_available ();
+      if (weights + kvcache + activations > available)
         {
-          return Q8_0;
+          return absl::ResourceExhaustedError (absl::StrFormat (
+              "the model needs %zu MiB of device memory, %zu MiB for "
+              "weights, %zu MiB for the kv cache of %u tokens and %zu MiB "
+              "for activations, but %zu MiB are available.",
+              (weights + kvcache + activations) >> 20, weights >> 20,
+              kvcache >> 20, kv_tokens, activations >> 20,
+              available >> 20));
         }
+    }
 
-      return INT8;
-    };
+    vktoks_ = Tensor (1, 1, 1, gpu_, UINT32, true);
+    vkoffset_ = Tensor (1, 1, 1, gpu_, UINT32, true);
+    vkhistory_ = Tensor (1, 1, maxlen, gpu_, UINT32, true);
+    if (!(ret = vktoks_.create ()).ok ()
+        || !(ret = vkoffset_.create ()).ok ()
+        || !(ret = vkhistory_.create ()).ok ())
+      {
+        return ret;
+      }
 
-    // input layer
-    {
-      auto embeddings = tensors["token_embd.weight"];
-      auto output_weight = tensors["output.weight"];
-      auto norm_weight = tensors["output_norm.weight"];
-
-      Tensor vkembeddings (1, embeddings.dim[1], embeddings.dim[0], gpu_,
-                           to_dtype (embeddings.type));
-      Tensor vkoutput_weight (1, output_weight.dim[1], output_weight.dim[0],
-                              gpu_, to_dtype (output_weight.type));
-      Tensor vknorm_weight (1, 1, norm_weight.dim[0], gpu_,
-                            to_dtype (norm_weight.type));
-
-      absl::Status ret;
-
-      if (!(ret = vkembeddings.create ()).ok ()
-          || !(ret = vkoutput_weight.create ()).ok ()
-          || !(ret = vknorm_weight.create ()).ok ())
-        {
-          return ret;
-        }
+    if (ret = input_command_->begin (); !ret.ok ())
+      {
+        return ret;
+      }
 
-      ret = input_command_->upload ((const uint8_t *)embeddings.weights_data,
-                                    embeddings.bsize, vkembeddings);
-      if (!ret.ok ())
-        {
-          return ret;
-        }
+    if (ret = output_command_->begin (); !ret.ok ())
+      {
+        return ret;
+      }
 
-      ret = output_command_->upload (
-          (const uint8_t *)output_weight.weights_data, output_weight.bsize,
-          vkoutput_weight);
-      if (!ret.ok ())
-        {
-          return ret;
-        }
+    // the pages are zeroed along with the input layer's uploads, and
+    // sequence 0 is the one selected until select_sequence ()
+    if (kvcache_pages_ > 0)
+      {
+        const uint32_t table_pages = (maxlen + page_rows_ - 1) / page_rows_;
+        pool_ = std::make_unique<KVCachePool> (
+            gpu_, block_count, config.head_count, kv_dim / config.head_count,
+            kvcache_pages_, page_rows_);
+        VKLLAMA_STATUS_OK (pool_->init (input_command_));
+
+        vktable_ = Tensor (1, 1, table_pages, gpu_, UINT32, true);
+        VKLLAMA_STATUS_OK (vktable_.create ());
+        ::memset (vktable_.host (), 0, sizeof (uint32_t) * table_pages);
+        VKLLAMA_STATUS_OK (vktable_.flush ());
+
+        sequences_[0]
+            = std::make_unique<KVCacheBlockTable> (pool_.get (), table_pages);
+        sequence_ = 0;
+        next_sequence_ = 1;
+      }
 
-      ret = input_command_->upload ((const uint8_t *)norm_weight.weights_data,
-                                    norm_weight.bsize, vknorm_weight);
-      if (!ret.ok ())
-        {
-          return ret;
-        }
+    // weights load in groups, the input and output layers first, then a
+    // group per block
+    WeightLoader loader (gpu_, import_weights_);
+    if (ret = loader.init (); !ret.ok ())
+      {
+        return ret;
+      }
 
+    if (load_callback_)
       {
-        uint32_t UNK = 0;
-        input_layer_
-            = new InputLayer (gpu_, input_command_, vkembeddings, UNK);
+        const size_t total = llama2_weight_bytes (tensors, block_count);
+        loader.set_callback (
+            [this, total, loaded = size_t (0)] (size_t, size_t bytes) mutable {
+              loaded += bytes;
+              load_callback_ (loaded, total);
+            });
       }
 
-      output_layer_ = new OutputLayer (gpu_, output_command_, vkoutput_weight,
-                                       vknorm_weight);
+    // input layer
+    {
+      auto input = create_llama2_input (gpu_, input_command_, loader, tensors);
+      VKLLAMA_STATUS_OK (input.status ());
+      input_layer_ = *input;
 
-      if (!(ret = input_layer_->init ()).ok ()
-          || !(ret = output_layer_->init ()).ok ())
-        {
-          return ret;
-        }
+      auto output
+          = create_llama2_output (gpu_, output_command_, loader, tensors);
+      VKLLAMA_STATUS_OK (output.status ());
+      output_layer_ = *output;
 
       if (ret = input_command_->end (); !ret.ok ())
         {
@@ -477,212 +960,207 @@ public:
     }
 
     // blocks
-    {
-
-      char vname[512];
-      for (uint32_t b = 0; b < block_count; ++b)
-        {
-
-          ::snprintf (vname, sizeof (vname), "blk.%u.attn_norm.weight", b);
-          const auto attn_norm_weight = tensors[vname];
-
-          ::snprintf (vname, sizeof (vname), "blk.%u.attn_k.weight", b);
-          const auto attn_k_weight = tensors[vname];
-
-          ::snprintf (vname, sizeof (vname), "blk.%u.attn_q.weight", b);
-          const auto attn_q_weight = tensors[vname];
-
-          ::snprintf (vname, sizeof (vname), "blk.%u.attn_v.weight", b);
-          const auto attn_v_weight = tensors[vname];
-
-          ::snprintf (vname, sizeof (vname), "blk.%u.attn_output.weight", b);
-          const auto attn_output_weight = tensors[vname];
-
-          ::snprintf (vname, sizeof (vname), "blk.%u.ffn_norm.weight", b);
-          const auto ffn_norm_weight = tensors[vname];
-
-          ::snprintf (vname, sizeof (vname), "blk.%u.ffn_up.weight", b);
-          const auto ffn_up_weight = tensors[vname];
-
-          ::snprintf (vname, sizeof (vname), "blk.%u.ffn_down.weight", b);
-          const auto ffn_down_weight = tensors[vname];
-
-          ::snprintf (vname, sizeof (vname), "blk.%u.ffn_gate.weight", b);
-
-          const auto ffn_gate_weight = tensors[vname];
-
-          auto command = new Command (gpu_);
-          if (!(ret = command->init ()).ok ()
-              || !(ret = command->begin ()).ok ())
-            {
-              return ret;
-            }
-
-          block_commands_.push_back (command);
-
-          Tensor vk_attn_norm_weight (1, 1, attn_norm_weight.dim[0], gpu_,
-                                      to_dtype (attn_norm_weight.type));
-
-          Tensor vk_ffn_norm_weight (1, 1, ffn_norm_weight.dim[0], gpu_,
-                                     to_dtype (ffn_norm_weight.type));
-
-          absl::Status ret;
-
-          if (!(ret = vk_attn_norm_weight.create ()).ok ()
-              || !(ret = vk_ffn_norm_weight.create ()).ok ())
-            {
-              return ret;
-            }
-
-          ret = command->upload (
-              (const uint8_t *)attn_norm_weight.weights_data,
-              attn_norm_weight.bsize, vk_attn_norm_weight);
-          if (!ret.ok ())
-            {
-              return ret;
-            }
-
-          ret = command->upload ((const uint8_t *)ffn_norm_weight.weights_data,
-                                 ffn_norm_weight.bsize, vk_ffn_norm_weight);
-          if (!ret.ok ())
-            {
-              return ret;
-            }
-
-          size_t head_dim = attn_k_weight.dim[1];
-          size_t input_dim = attn_k_weight.dim[0];
-
-          Tensor vkWk (1, head_dim, input_dim, gpu_,
-                       to_dtype (attn_k_weight.type));
-          Tensor vkWq (1, head_dim, input_dim, gpu_,
-                       to_dtype (attn_q_weight.type));
-          Tensor vkWv (1, head_dim, input_dim, gpu_,
-                       to_dtype (attn_v_weight.type));
-
-          if (!(ret = vkWk.create ()).ok () || !(ret = vkWq.create ()).ok ()
-              || !(ret = vkWv.create ()).ok ())
-            {
-              return ret;
-            }
-
-          const auto *wk_weight_data
-              = (const uint8_t *)attn_k_weight.weights_data;
-
-          const auto *wq_weight_data
-              = (const uint8_t *)attn_q_weight.weights_data;
-
-          const auto *wv_weight_data
-              = (const uint8_t *)attn_v_weight.weights_data;
+    for (uint32_t b = 0; b < block_count; ++b)
+      {
+        auto command = new Command (gpu_);
+        block_commands_.push_back (command);
+        if (!(ret = command->init ()).ok ()
+            || !(ret = command->begin ()).ok ())
+          {
+            return ret;
+          }
+        command->set_activations (activations_);
 
-          ret = command->upload (wk_weight_data, vkWk.bytes (), vkWk);
-          if (!ret.ok ())
-            {
-              return ret;
-            }
+        // the block's weights go to the device while the next block is
+        // being read
+        auto block = create_llama2_block (
+            gpu_, command, loader, tensors, config, b,
+            pool_ ? pool_->layer (b, vktable_) : PagedKVCache{});
+        VKLLAMA_STATUS_OK (block.status ());
+        blocks_.push_back (*block);
 
-          ret = command->upload (wq_weight_data, vkWq.bytes (), vkWq);
-          if (!ret.ok ())
-            {
-              return ret;
-            }
+        if (ret = command->end (); !ret.ok ())
+          {
+            return ret;
+          }
 
-          ret = command->upload (wv_weight_data, vkWq.bytes (), vkWv);
-          if (!ret.ok ())
-            {
-              return ret;
-            }
+        // only the block's own small uploads are in it, the block commands
+        // are waited together with the weights
+        if (ret = command->submit (); !ret.ok ())
+          {
+            return ret;
+          }
+      }
 
-          Tensor Wo (1, attn_output_weight.dim[1], attn_output_weight.dim[0],
-                     gpu_, to_dtype (attn_output_weight.type));
-          if (!(ret = Wo.create ()).ok ())
-            {
-              return ret;
-            }
-          ret = command->upload (
-              (const uint8_t *)attn_output_weight.weights_data,
-              attn_output_weight.bsize, Wo);
+    if (!(ret = loader.finish ()).ok ()
+        || !(ret = Command::wait (block_commands_)).ok ())
+      {
+        return ret;
+      }
 
-          if (!ret.ok ())
-            {
-              return ret;
-            }
+    return plan_activations_ (tensors["token_embd.weight"].dim[0]);
+  }
 
-          Tensor vkw1 (1, ffn_gate_weight.dim[1], ffn_gate_weight.dim[0], gpu_,
-                       to_dtype (ffn_gate_weight.type));
+  ActivationPlanner::Stats
+  activation_stats () const
+  {
+    return activations_->stats ();
+  }
 
-          Tensor vkw2 (1, ffn_down_weight.dim[1], ffn_down_weight.dim[0], gpu_,
-                       to_dtype (ffn_down_weight.type));
+  // Before init (): called as the weights reach the device, with the bytes
+  // loaded so far and the bytes of all weights.
+  void
+  set_load_callback (LoadCallback callback)
+  {
+    load_callback_ = std::move (callback);
+  }
 
-          Tensor vkw3 (1, ffn_up_weight.dim[1], ffn_up_weight.dim[0], gpu_,
-                       to_dtype (ffn_up_weight.type));
+  // Before init (): have the device copy weights straight out of the
+  // tensors' host memory, a mapped GGUF file, where it can import it with
+  // VK_EXT_external_memory_host. The mapping must outlive init ().
+  void
+  set_import_weights (const bool import)
+  {
+    import_weights_ = import;
+  }
 
-          if (!(ret = vkw1.create ()).ok () || !(ret = vkw2.create ()).ok ()
-              || !(ret = vkw3.create ()).ok ())
-            {
-              return ret;
-            }
+  // Before init (): create the kv caches for at most maxlen tokens instead
+  // of the context length of the model, 0 for that length.
+  void
+  set_maxlen (const uint32_t maxlen)
+  {
+    maxlen_limit_ = maxlen;
+  }
 
-          ret = command->upload ((const uint8_t *)ffn_gate_weight.weights_data,
-                                 ffn_gate_weight.bsize, vkw1);
+  // Before init (): the dtype of the kv caches, FP16 or Q8_0. Q8_0 caches
+  // take 36 bytes per 32 items instead of 64, so about half the memory
+  // holds the same context, for a small loss of precision.
+  void
+  set_kvcache_dtype (const DType dtype)
+  {
+    kvcache_dtype_ = dtype;
+  }
 
-          if (!ret.ok ())
-            {
-              return ret;
-            }
+  // Before init (): keep the kv caches of all blocks in a pool of pages
+  // pages of page_rows positions, 0 for a contiguous cache of maxlen
+  // positions per block. A sequence takes pages as it grows, so sequences
+  // shorter than maxlen share memory a contiguous cache would reserve whole;
+  // see create_sequence (). The caches are fp16.
+  void
+  set_kvcache_pages (const uint32_t pages,
+                     const uint32_t page_rows = KVCachePool::kPageRows)
+  {
+    kvcache_pages_ = pages;
+    page_rows_ = page_rows;
+  }
 
-          ret = command->upload ((const uint8_t *)ffn_down_weight.weights_data,
-                                 ffn_down_weight.bsize, vkw2);
+  size_t
+  maxlen () const
+  {
+    return maxlen_;
+  }
 
-          if (!ret.ok ())
-            {
-              return ret;
-            }
+  // pages no sequence holds, 0 without paged kv caches
+  uint32_t
+  free_kvcache_pages () const
+  {
+    return pool_ ? pool_->free_pages () : 0;
+  }
 
-          ret = command->upload ((const uint8_t *)ffn_up_weight.weights_data,
-                                 ffn_up_weight.bsize, vkw3);
+  // With paged kv caches, a new empty sequence to select_sequence (). Each
+  // sequence has positions of its own, starting from 0.
+  absl::StatusOr<uint32_t>
+  create_sequence ()
+  {
+    if (!pool_)
+      {
+        return absl::FailedPreconditionError (
+            "Model::create_sequence: the kv caches are not paged.");
+      }
 
-          if (!ret.ok ())
-            {
-              return ret;
-            }
+    const uint32_t id = next_sequence_++;
+    sequences_[id] = std::make_unique<KVCacheBlockTable> (
+        pool_.get (), vktable_.width ());
+    return id;
+  }
 
-          const auto dim = head_dim / head_count;
-          Llama2Block::RmsNormParams rmsnorm_params
-              = { vk_attn_norm_weight, vk_ffn_norm_weight, norm_eps };
-          Llama2Block::TransformerParams transformer_params = {
-            vkWk, vkWq, vkWv, Wo, (int)maxlen, (int)dim, b == (block_count - 1)
-          };
-          Llama2Block::FeedForwardParams feedfward_params
-              = { vkw1, vkw2, vkw3, norm_eps };
+  // Makes sequence id the one the following steps decode. Queued steps
+  // finish first, and the next submit () has to be given its tokens.
+  absl::Status
+  select_sequence (const uint32_t id)
+  {
+    auto it = sequences_.find (id);
+    if (it == sequences_.end ())
+      {
+        return absl::NotFoundError (absl::StrFormat (
+            "Model::select_sequence: no sequence %u.", id));
+      }
 
-          auto *block = new Llama2Block (gpu_, command, transformer_params,
-                                         feedfward_params, rmsnorm_params);
+    VKLLAMA_STATUS_OK (drain_ ());
+    sequence_ = id;
+    has_next_ = false;
+    device_fed_ = false;
+    return write_table_ (0);
+  }
 
-          if (!(ret = block->init ()).ok ())
-            {
-              return ret;
-            }
+  // Gives the pages of sequence id back to the pool. The selected sequence
+  // cannot be released.
+  absl::Status
+  release_sequence (const uint32_t id)
+  {
+    auto it = sequences_.find (id);
+    if (it == sequences_.end ())
+      {
+        return absl::NotFoundError (absl::StrFormat (
+            "Model::release_sequence: no sequence %u.", id));
+      }
 
-          blocks_.push_back (block);
+    if (id == sequence_)
+      {
+        return absl::FailedPreconditionError (absl::StrFormat (
+            "Model::release_sequence: sequence %u is selected.", id));
+      }
 
-          if (ret = command->end (); !ret.ok ())
-            {
-              return ret;
-            }
+    sequences_.erase (it);
+    return absl::OkStatus ();
+  }
 
-          if (ret = command->submit_and_wait (); !ret.ok ())
-            {
-              return ret;
-            }
-        }
-    }
+  MemoryPool::Stats
+  memory_stats (const MemoryKind kind) const
+  {
+    return gpu_->memory_pool (kind).stats ();
+  }
 
-    return absl::OkStatus ();
+  MemoryUsage
+  memory_usage ()
+  {
+    return gpu_->memory_usage ();
   }
 
   absl::StatusOr<std::vector<float> >
   operator() (std::vector<uint32_t> const &toks, const size_t offset)
   {
+    // the rope angles of the blocks cover twice the context; the caches
+    // wrap around past it, the angles do not
+    if (offset + toks.size () > 2ul * maxlen_)
+      {
+        return absl::OutOfRangeError (absl::StrFormat (
+            "Model: positions up to %zu past the %zu with rope angles.",
+            offset + toks.size (), 2ul * maxlen_));
+      }
+
+    VKLLAMA_STATUS_OK (drain_ ());
+    device_fed_ = false;
+    VKLLAMA_STATUS_OK (reserve_ (offset + toks.size ()));
+
+    if (decode_graph_ && toks.size () == 1 && offset < maxlen_)
+      {
+        return decode_ (toks[0], offset);
+      }
+
+    // recording rebinds the descriptor sets the decode graph refers to.
+    graph_len_ = 0;
+
     auto t0 = std::chrono::high_resolution_clock::now ();
     Tensor vktoks (1, 1, toks.size (), gpu_, UINT32, true);
     if (!vktoks.create ().ok ())
@@ -720,46 +1198,15 @@ public:
         return ret;
       }
 
-    if (auto ret = input_command_->submit (); !ret.ok ())
-      {
-        return ret;
-      }
-
-    std::vector<Tensor> tmps;
-    tmps.push_back (*X);
-
-    for (int i = 0; i < blocks_.size (); ++i)
+    // the blocks are only submitted once the pass kept to its plan
+    X = record_blocks_ (*X, false, [this, offset] (size_t i, Tensor in) {
+      return (*blocks_[i]) (in, offset);
+    });
+    if (!X.ok ())
       {
-        auto *command = block_commands_[i];
-
-        if (auto ret = command->begin (); !ret.ok ())
-          {
-            throw std::runtime_error (ret.ToString ());
-          }
-
-        auto *block = blocks_[i];
-        X = (*block) (*X, offset);
-        if (!X.ok ())
-          {
-            fprintf (stderr, "infer block %d failed: %s\n", i,
-                     X.status ().message ().data ());
-            return X.status ();
-          }
-
-        // std::string msg = absl::StrFormat ("block %d output mean", i);
-        // VKLLAMA_STATUS_OK (command->print_tensor_mean (msg, *X));
-
-        tmps.push_back (*X);
-
-        if (auto ret = command->end (); !ret.ok ())
-          {
-            throw std::runtime_error (ret.ToString ());
-          }
-
-        if (auto ret = command->submit (); !ret.ok ())
-          {
-            throw std::runtime_error (ret.ToString ());
-          }
+        fprintf (stderr, "infer blocks failed: %s\n",
+                 X.status ().message ().data ());
+        return X.status ();
       }
 
     if (auto ret = output_command_->begin (); !ret.ok ())
@@ -785,29 +1232,15 @@ public:
         return ret;
       }
 
-    ret = output_command_->submit ();
+    // the whole pass goes out in one batch, as a decode step does
+    ret = Command::submit (all_commands_ ());
     if (!ret.ok ())
       {
         return ret;
       }
 
     auto t1 = std::chrono::high_resolution_clock::now ();
-    ret = input_command_->wait ();
-    if (!ret.ok ())
-      {
-        return ret;
-      }
-
-    for (auto *c : block_commands_)
-      {
-        ret = c->wait ();
-        if (!ret.ok ())
-          {
-            return ret;
-          }
-      }
-
-    ret = output_command_->wait ();
+    ret = Command::wait (all_commands_ ());
     if (!ret.ok ())
       {
         return ret;
@@ -831,6 +1264,13 @@ public:
         "record cost = %lldms,  wait cost = %lldms, total cost = %lldms\n",
         record_cost, wait_cost, total_cost);
 
+    auto stats = activations_->stats ();
+    fprintf (stderr,
+             "activations: %zu in %zu slots, slot bytes = %zu, peak live "
+             "bytes = %zu, unplanned bytes = %zu\n",
+             stats.activations, stats.slots, stats.slot_bytes,
+             stats.peak_live_bytes, stats.unplanned_bytes);
+
     input_layer_->print_op_cost ();
     for (int i = 0; i < blocks_.size (); ++i)
       {
@@ -842,15 +1282,423 @@ public:
     return buf_logits;
   }
 
+  // Queues one greedy decode step and returns its id without waiting for
+  // it. The step picks its token with an argmax on the device and feeds it
+  // straight into the token buffer of the next step, so submit ({}, offset
+  // + 1) queues that step while this one still runs and the host never
+  // stands between two steps. toks are the tokens starting at offset; empty
+  // toks continue from the previous step. Prompts are evaluated
+  // synchronously, and without timeline semaphores a step is only queued
+  // once the previous one has finished.
+  absl::StatusOr<uint64_t>
+  submit (std::vector<uint32_t> const &toks, const size_t offset,
+          StepCallback cb = nullptr)
+  {
+    if (toks.empty () && !has_next_)
+      {
+        return absl::FailedPreconditionError (
+            "Model::submit: no previous step to continue from.");
+      }
+
+    if (toks.empty () && offset != next_offset_)
+      {
+        return absl::InvalidArgumentError (absl::StrFormat (
+            "Model::submit: continuation offset is %zu but %zu given.",
+            next_offset_, offset));
+      }
+
+    const size_t len = std::max (toks.size (), (size_t)1);
+    if (!decode_graph_ || len > 1 || offset >= maxlen_)
+      {
+        VKLLAMA_STATUS_OK (drain_ ());
+        auto logits = (*this) (
+            toks.empty () ? std::vector<uint32_t>{ last_tok_ } : toks, offset);
+        VKLLAMA_STATUS_OK (logits.status ());
+
+        const uint32_t tok = std::distance (
+            logits->cbegin (),
+            std::max_element (logits->cbegin (), logits->cend ()));
+        const size_t pos = offset + len - 1;
+        steps_.push_back ({ next_step_++, 0, pos, true, tok, nullptr });
+        last_tok_ = tok;
+        next_offset_ = pos + 1;
+        has_next_ = true;
+        if (cb)
+          {
+            cb (tok, pos);
+          }
+        return steps_.back ().id;
+      }
+
+    const bool host_feed = !toks.empty () || !device_fed_;
+    const size_t read_len = graph_read_len_ (offset);
+    const bool rerecord = read_len != graph_len_ || !greedy_graph_;
+    if (host_feed || rerecord || !gpu_->support_timeline_semaphore ())
+      {
+        VKLLAMA_STATUS_OK (drain_ ());
+      }
+
+    if (rerecord)
+      {
+        VKLLAMA_STATUS_OK (record_decode_graph_ (read_len, true));
+      }
+
+    // steps still running only read the pages mapped before these
+    VKLLAMA_STATUS_OK (reserve_ (offset + 1));
+
+    if (host_feed)
+      {
+        VKLLAMA_STATUS_OK (
+            feed_ (toks.empty () ? last_tok_ : toks[0], offset));
+      }
+
+    VKLLAMA_STATUS_OK (Command::submit (
+        all_commands_ (), inflight_ () ? output_command_ : nullptr));
+
+    steps_.push_back ({ next_step_++, output_command_->timeline_value (),
+                        offset, false, 0, std::move (cb) });
+    next_offset_ = offset + 1;
+    has_next_ = true;
+    device_fed_ = true;
+    return steps_.back ().id;
+  }
+
+  // Blocks until step has finished and returns its token. Steps queued
+  // before it finish first, with their callbacks run in submission order,
+  // and are retired together with it.
+  absl::StatusOr<uint32_t>
+  wait (const uint64_t step)
+  {
+    auto it = std::find_if (steps_.begin (), steps_.end (),
+                            [step] (auto const &s) { return s.id == step; });
+    if (it == steps_.end ())
+      {
+        return absl::NotFoundError (
+            absl::StrFormat ("Model::wait: step %llu is not pending.",
+                             (unsigned long long)step));
+      }
+
+    const auto end = std::next (it);
+    for (auto s = steps_.begin (); s != end; ++s)
+      {
+        VKLLAMA_STATUS_OK (complete_ (*s));
+      }
+
+    const uint32_t tok = it->tok;
+    steps_.erase (steps_.begin (), end);
+    return tok;
+  }
+
 private:
+  struct Step
+  {
+    uint64_t id;
+    // output_command_ timeline value signaled when the step has finished
+    uint64_t value;
+    size_t offset;
+    bool done;
+    uint32_t tok;
+    StepCallback cb;
+  };
+
+  bool
+  inflight_ () const
+  {
+    return !steps_.empty () && !steps_.back ().done;
+  }
+
+  absl::Status
+  complete_ (Step &step)
+  {
+    if (step.done)
+      {
+        return absl::OkStatus ();
+      }
+
+    // the latest step is waited as a whole so deferred tasks run; earlier
+    // ones only need their own timeline value.
+    if (&step == &steps_.back ())
+      {
+        VKLLAMA_STATUS_OK (Command::wait (all_commands_ ()));
+      }
+    else
+      {
+        VKLLAMA_STATUS_OK (output_command_->wait_timeline (step.value));
+      }
+
+    VKLLAMA_STATUS_OK (vkhistory_.invalid ());
+    step.tok = static_cast<const uint32_t *> (
+        vkhistory_.host ())[step.offset % maxlen_];
+    step.done = true;
+    last_tok_ = step.tok;
+    if (step.cb)
+      {
+        step.cb (step.tok, step.offset);
+      }
+    return absl::OkStatus ();
+  }
+
+  // finishes every queued step but keeps their results for wait ()
+  absl::Status
+  drain_ ()
+  {
+    for (auto &step : steps_)
+      {
+        VKLLAMA_STATUS_OK (complete_ (step));
+      }
+    return absl::OkStatus ();
+  }
+
+  absl::Status
+  feed_ (const uint32_t tok, const size_t offset)
+  {
+    const uint32_t pos = offset;
+    ::memcpy (vktoks_.host (), &tok, sizeof (tok));
+    ::memcpy (vkoffset_.host (), &pos, sizeof (pos));
+    VKLLAMA_STATUS_OK (vktoks_.flush ());
+    return vkoffset_.flush ();
+  }
+
+  // Maps the first rows positions of the selected sequence to pages and
+  // writes the new entries of its block table.
+  absl::Status
+  reserve_ (const size_t rows)
+  {
+    if (!pool_)
+      {
+        return absl::OkStatus ();
+      }
+
+    auto &sequence = *sequences_[sequence_];
+    const size_t mapped = sequence.pages ().size ();
+    VKLLAMA_STATUS_OK (sequence.reserve (rows));
+    return sequence.pages ().size () > mapped ? write_table_ (mapped)
+                                               : absl::OkStatus ();
+  }
+
+  // the entries of the selected sequence from first on, the rest of the
+  // table is left as it is and never read
+  absl::Status
+  write_table_ (const size_t first)
+  {
+    if (!pool_)
+      {
+        return absl::OkStatus ();
+      }
+
+    auto const &pages = sequences_[sequence_]->pages ();
+    if (first < pages.size ())
+      {
+        ::memcpy (static_cast<uint32_t *> (vktable_.host ()) + first,
+                  pages.data () + first,
+                  sizeof (uint32_t) * (pages.size () - first));
+      }
+    return vktable_.flush ();
+  }
+
+  size_t
+  graph_read_len_ (const size_t offset) const
+  {
+    return std::min ((offset / kDecodeGraphBucket + 1) * kDecodeGraphBucket,
+                     maxlen_);
+  }
+
+  // Records the blocks for a single token without submitting them, so that
+  // the activations are planned before the first prompt, which then runs on
+  // the plan whatever its length.
+  absl::Status
+  plan_activations_ (const size_t dim)
+  {
+    Tensor X (1, 1, dim, gpu_, FP16);
+    VKLLAMA_STATUS_OK (X.create ());
+
+    activations_->begin ();
+    for (size_t i = 0; i < blocks_.size (); ++i)
+      {
+        VKLLAMA_STATUS_OK (block_commands_[i]->begin ());
+        auto out = (*blocks_[i]) (X, 0);
+        VKLLAMA_STATUS_OK (out.status ());
+        X = *out;
+        VKLLAMA_STATUS_OK (block_commands_[i]->end ());
+      }
+    return activations_->end ();
+  }
+
+  // Records the blocks from X into their commands without submitting any.
+  // A pass that keeps an activation past the slot the plan gave it fails
+  // end (), which plans again from that pass; the blocks are then recorded
+  // once more on the new plan, so no command runs on overlapping slots.
+  template <typename Forward>
+  absl::StatusOr<Tensor>
+  record_blocks_ (Tensor X, const bool reusable, Forward &&forward)
+  {
+    for (int attempt = 0;; ++attempt)
+      {
+        Tensor out = X;
+        activations_->begin ();
+        for (size_t i = 0; i < blocks_.size (); ++i)
+          {
+            VKLLAMA_STATUS_OK (block_commands_[i]->begin (reusable));
+            auto ret = forward (i, out);
+            VKLLAMA_STATUS_OK (ret.status ());
+            out = *ret;
+            VKLLAMA_STATUS_OK (block_commands_[i]->end ());
+          }
+
+        auto ret = activations_->end ();
+        if (ret.ok ())
+          {
+            return out;
+          }
+
+        if (!absl::IsAborted (ret) || attempt > 0)
+          {
+            return ret;
+          }
+      }
+  }
+
+  // in submission order
+  std::vector<Command *>
+  all_commands_ ()
+  {
+    std::vector<Command *> commands = { input_command_ };
+    commands.insert (commands.end (), block_commands_.cbegin (),
+                     block_commands_.cend ());
+    commands.push_back (output_command_);
+    return commands;
+  }
+
+  // A greedy graph ends with an on-device argmax feeding vktoks_,
+  // vkoffset_ and vkhistory_; otherwise it downloads the logits.
+  absl::Status
+  record_decode_graph_ (const size_t read_len, const bool greedy)
+  {
+    graph_len_ = 0;
+
+    if (greedy)
+      {
+        // the previous replay wrote vktoks_ and vkoffset_ on the device, so
+        // their first readers need a barrier against it.
+        for (auto *t : { &vktoks_, &vkoffset_ })
+          {
+            t->set_access_flags (VK_ACCESS_HOST_WRITE_BIT
+                                 | VK_ACCESS_SHADER_WRITE_BIT);
+            t->set_pipeline_stage (VK_PIPELINE_STAGE_HOST_BIT
+                                   | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+          }
+      }
+
+    VKLLAMA_STATUS_OK (input_command_->begin (true));
+    auto X = (*input_layer_) (vktoks_);
+    VKLLAMA_STATUS_OK (X.status ());
+    VKLLAMA_STATUS_OK (input_command_->end ());
+
+    X = record_blocks_ (*X, true, [this, read_len] (size_t i, Tensor in) {
+      return (*blocks_[i]) (in, vkoffset_, read_len);
+    });
+    VKLLAMA_STATUS_OK (X.status ());
+
+    VKLLAMA_STATUS_OK (output_command_->begin (true));
+    if (greedy)
+      {
+        VKLLAMA_STATUS_OK (
+            output_layer_->greedy (*X, vktoks_, vkoffset_, vkhistory_));
+        VKLLAMA_STATUS_OK (output_command_->host_read_barrier (vkhistory_));
+      }
+    else
+      {
+        auto output = (*output_layer_) (*X);
+        VKLLAMA_STATUS_OK (output.status ());
+
+        logits_.resize (output->size ());
+        VKLLAMA_STATUS_OK (output_command_->download (
+            *output, logits_.data (), logits_.size ()));
+      }
+    VKLLAMA_STATUS_OK (output_command_->end ());
+
+    graph_len_ = read_len;
+    greedy_graph_ = greedy;
+    return absl::OkStatus ();
+  }
+
+  absl::StatusOr<std::vector<float> >
+  decode_ (const uint32_t tok, const size_t offset)
+  {
+    auto t0 = std::chrono::high_resolution_clock::now ();
+
+    const size_t read_len = graph_read_len_ (offset);
+    if (read_len != graph_len_ || greedy_graph_)
+      {
+        VKLLAMA_STATUS_OK (record_decode_graph_ (read_len, false));
+      }
+
+    VKLLAMA_STATUS_OK (feed_ (tok, offset));
+
+    auto t1 = std::chrono::high_resolution_clock::now ();
+    auto commands = all_commands_ ();
+    VKLLAMA_STATUS_OK (Command::submit (commands));
+    VKLLAMA_STATUS_OK (Command::wait (commands));
+
+#if __VKLLAMA_LOG_COST
+    auto t2 = std::chrono::high_resolution_clock::now ();
+    fprintf (stderr,
+             "decode graph record cost = %lldms, replay cost = %lldms\n",
+             (long long)std::chrono::duration_cast<std::chrono::milliseconds> (
+                 t1 - t0)
+                 .count (),
+             (long long)std::chrono::duration_cast<std::chrono::milliseconds> (
+                 t2 - t1)
+                 .count ());
+#endif
+    return logits_;
+  }
+
   int dev_;
+  const bool decode_graph_;
+  bool import_weights_;
+  LoadCallback load_callback_;
   GPUDevice *gpu_;
+  // shared by the block commands
+  ActivationPlanner *activations_;
   Command *input_command_;
   std::vector<Command *> block_commands_;
   Command *output_command_;
   InputLayer *input_layer_;
   OutputLayer *output_layer_;
   std::vector<Llama2Block *> blocks_;
+
+  size_t maxlen_;
+  uint32_t maxlen_limit_;
+  DType kvcache_dtype_;
+  uint32_t kvcache_pages_;
+  uint32_t page_rows_;
+  // with paged kv caches: the pages, the block tables of the sequences and
+  // the device table of the selected one, which the blocks read
+  std::unique_ptr<KVCachePool> pool_;
+  std::map<uint32_t, std::unique_ptr<KVCacheBlockTable> > sequences_;
+  uint32_t sequence_;
+  uint32_t next_sequence_;
+  Tensor vktable_;
+  // kv rows the recorded decode graph attends to, 0 when nothing is recorded
+  size_t graph_len_;
+  bool greedy_graph_;
+  Tensor vktoks_;
+  Tensor vkoffset_;
+  // token picked by the greedy graph, indexed by the position it decoded
+  Tensor vkhistory_;
+  std::vector<float> logits_;
+
+  // steps queued by submit () and not yet retired by wait ()
+  std::deque<Step> steps_;
+  uint64_t next_step_;
+  // position and token an empty submit () continues from
+  size_t next_offset_;
+  uint32_t last_tok_;
+  bool has_next_;
+  // vktoks_ and vkoffset_ already hold the continuation, written there by
+  // the latest greedy step
+  bool device_fed_;
 };
 
 }
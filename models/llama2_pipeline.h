@@ -0,0 +1,464 @@
+#ifndef __VKLLAMA_MODELS_LLAMA2_PIPELINE_H__
+#define __VKLLAMA_MODELS_LLAMA2_PIPELINE_H__
+#include "absl/strings/str_format.h"
+#include "models/llama2.h"
+#include <algorithm>
+#include <array>
+#include <map>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace vkllama
+{
+// Llama2 with its blocks split into runs of consecutive blocks, one run per
+// device, for models whose weights do not fit into the memory of a single
+// one. The first device also embeds the tokens, the last one computes the
+// logits.
+//
+// A prompt is cut into micro-batches of a few tokens that flow through the
+// devices one after the other: while a device runs its blocks for one
+// micro-batch, the device before it already runs the next one, so with n
+// devices up to n of them are busy at once. Activations cross devices
+// through the host: the last block command of a device downloads its
+// output, and the next device uploads it in its first block command.
+class PipelineModel
+{
+public:
+  // devs may repeat an index, which runs several instances of one device
+  PipelineModel (std::vector<int> const &devs, const size_t micro_batch = 32)
+      : devs_ (devs), micro_batch_ (std::max<size_t> (micro_batch, 1)),
+        input_command_ (nullptr), input_layer_ (nullptr),
+        output_command_ (nullptr), output_layer_ (nullptr), maxlen_ (0),
+        maxlen_limit_ (0), kvcache_dtype_ (FP16)
+  {
+  }
+
+  PipelineModel (PipelineModel const &) = delete;
+  PipelineModel &operator= (PipelineModel const &) = delete;
+
+  ~PipelineModel ()
+  {
+    delete input_layer_;
+    delete output_layer_;
+    delete input_command_;
+    delete output_command_;
+    toks_ = Tensor ();
+
+    for (auto &stage : stages_)
+      {
+        for (auto *block : stage.blocks)
+          {
+            delete block;
+          }
+        for (auto *command : stage.commands)
+          {
+            delete command;
+          }
+        delete stage.activations;
+        stage.input = Tensor ();
+        delete stage.gpu;
+      }
+  }
+
+  absl::Status
+  init (std::map<std::string, gguf_key> &kv,
+        std::map<std::string, gguf_tensor> &tensors)
+  {
+    auto config = llama2_config (kv);
+    if (maxlen_limit_ > 0)
+      {
+        config.maxlen = std::min (config.maxlen, maxlen_limit_);
+      }
+    config.kvcache_dtype = kvcache_dtype_;
+    maxlen_ = config.maxlen;
+    if (devs_.empty () || devs_.size () > config.block_count)
+      {
+        return absl::InvalidArgumentError (absl::StrFormat (
+            "PipelineModel::init: %zu devices for %u blocks.", devs_.size (),
+            config.block_count));
+      }
+
+    // an even split unless one was set, the first devices take one block
+    // more when it does not come out even
+    const size_t n = split_.empty () ? devs_.size () : split_.size ();
+    std::vector<uint32_t> counts = split_;
+    for (size_t s = 0; split_.empty () && s < n; ++s)
+      {
+        counts.push_back (config.block_count / n
+                          + (s < config.block_count % n));
+      }
+
+    if (std::accumulate (counts.cbegin (), counts.cend (), size_t (0))
+        != config.block_count)
+      {
+        return absl::InvalidArgumentError (absl::StrFormat (
+            "PipelineModel::init: the split does not cover %u blocks.",
+            config.block_count));
+      }
+
+    size_t first = 0;
+    for (size_t s = 0; s < n; ++s)
+      {
+        Stage stage = {};
+        stage.dev = devs_[s];
+        stage.first = first;
+        stage.count = counts[s];
+        first += stage.count;
+        stages_.push_back (std::move (stage));
+      }
+
+    for (size_t s = 0; s < n; ++s)
+      {
+        VKLLAMA_STATUS_OK (init_stage_ (s, config, tensors));
+      }
+
+    return plan_activations_ (tensors["token_embd.weight"].dim[0]);
+  }
+
+  size_t
+  stages () const
+  {
+    return stages_.size ();
+  }
+
+  // the blocks [first, last) of a stage
+  std::pair<size_t, size_t>
+  blocks (const size_t stage) const
+  {
+    return { stages_[stage].first,
+             stages_[stage].first + stages_[stage].count };
+  }
+
+  GPUDevice *
+  device (const size_t stage)
+  {
+    return stages_[stage].gpu;
+  }
+
+  size_t
+  micro_batch () const
+  {
+    return micro_batch_;
+  }
+
+  void
+  set_micro_batch (const size_t tokens)
+  {
+    micro_batch_ = std::max<size_t> (tokens, 1);
+  }
+
+  // Before init (): the blocks of each stage, as Llama2MemoryPlan has them,
+  // instead of an even split. Only the first blocks.size () devices are
+  // used.
+  absl::Status
+  set_split (std::vector<uint32_t> const &blocks)
+  {
+    if (blocks.empty () || blocks.size () > devs_.size ()
+        || std::count (blocks.cbegin (), blocks.cend (), 0u) > 0)
+      {
+        return absl::InvalidArgumentError (absl::StrFormat (
+            "PipelineModel::set_split: %zu stages for %zu devices, each "
+            "with at least one block.",
+            blocks.size (), devs_.size ()));
+      }
+
+    split_ = blocks;
+    return absl::OkStatus ();
+  }
+
+  // Before init (): kv caches for at most maxlen tokens, 0 for the context
+  // length of the model.
+  void
+  set_maxlen (const uint32_t maxlen)
+  {
+    maxlen_limit_ = maxlen;
+  }
+
+  // Before init (): the dtype of the kv caches, see
+  // Model::set_kvcache_dtype ().
+  void
+  set_kvcache_dtype (const DType dtype)
+  {
+    kvcache_dtype_ = dtype;
+  }
+
+  // logits of the last token of toks, which start at offset
+  absl::StatusOr<std::vector<float> >
+  operator() (std::vector<uint32_t> const &toks, const size_t offset)
+  {
+    if (toks.empty ())
+      {
+        return absl::InvalidArgumentError (
+            "PipelineModel: no tokens to infer.");
+      }
+
+    if (offset + toks.size () > maxlen_)
+      {
+        return absl::OutOfRangeError (absl::StrFormat (
+            "PipelineModel: %zu tokens at offset %zu exceed the context "
+            "length %zu.",
+            toks.size (), offset, maxlen_));
+      }
+
+    const size_t batches = (toks.size () + micro_batch_ - 1) / micro_batch_;
+    const size_t n = stages_.size ();
+
+    // at tick t stage s runs micro-batch t - s
+    for (size_t t = 0; t < batches + n - 1; ++t)
+      {
+        std::vector<size_t> running;
+
+        // from the last stage backwards: a stage consumes the output its
+        // predecessor downloaded in the previous tick before the
+        // predecessor records the download of the next one
+        for (size_t s = n; s-- > 0;)
+          {
+            if (t < s || t - s >= batches)
+              {
+                continue;
+              }
+
+            const size_t j = t - s;
+            const size_t begin = j * micro_batch_;
+            const size_t end = std::min (begin + micro_batch_, toks.size ());
+            VKLLAMA_STATUS_OK (record_stage_ (
+                s, toks.data () + begin, end - begin, offset + begin,
+                j + 1 == batches));
+            VKLLAMA_STATUS_OK (Command::submit (stage_commands_ (s)));
+            running.push_back (s);
+          }
+
+        for (auto s : running)
+          {
+            VKLLAMA_STATUS_OK (Command::wait (stage_commands_ (s)));
+          }
+      }
+
+    return logits_;
+  }
+
+private:
+  struct Stage
+  {
+    int dev;
+    // the blocks [first, first + count) run on the stage
+    size_t first;
+    size_t count;
+    GPUDevice *gpu;
+    // shared by the block commands of the stage
+    ActivationPlanner *activations;
+    std::vector<Command *> commands;
+    std::vector<Llama2Block *> blocks;
+    // the micro-batch the stage takes from its predecessor
+    Tensor input;
+    // the output of the stage's latest micro-batch, for its successor
+    std::vector<__vkllama_fp16_t> output;
+    std::array<size_t, 3> output_shape;
+  };
+
+  absl::Status
+  init_stage_ (const size_t s, Llama2Config const &config,
+               std::map<std::string, gguf_tensor> &tensors)
+  {
+    auto &stage = stages_[s];
+    stage.gpu = new GPUDevice (stage.dev);
+    VKLLAMA_STATUS_OK (stage.gpu->init ());
+    stage.activations = new ActivationPlanner (stage.gpu);
+
+    WeightLoader loader (stage.gpu);
+    VKLLAMA_STATUS_OK (loader.init ());
+
+    // the setup of the input and output layers, waited with the blocks
+    std::vector<Command *> layer_commands;
+
+    if (s == 0)
+      {
+        input_command_ = new Command (stage.gpu);
+        VKLLAMA_STATUS_OK (input_command_->init ());
+        VKLLAMA_STATUS_OK (input_command_->begin ());
+        auto input = create_llama2_input (stage.gpu, input_command_, loader,
+                                          tensors);
+        VKLLAMA_STATUS_OK (input.status ());
+        input_layer_ = *input;
+        VKLLAMA_STATUS_OK (input_command_->end ());
+        VKLLAMA_STATUS_OK (input_command_->submit ());
+        layer_commands.push_back (input_command_);
+      }
+
+    if (s + 1 == stages_.size ())
+      {
+        output_command_ = new Command (stage.gpu);
+        VKLLAMA_STATUS_OK (output_command_->init ());
+        VKLLAMA_STATUS_OK (output_command_->begin ());
+        auto output = create_llama2_output (stage.gpu, output_command_,
+                                            loader, tensors);
+        VKLLAMA_STATUS_OK (output.status ());
+        output_layer_ = *output;
+        VKLLAMA_STATUS_OK (output_command_->end ());
+        VKLLAMA_STATUS_OK (output_command_->submit ());
+        layer_commands.push_back (output_command_);
+      }
+
+    for (size_t b = stage.first; b < stage.first + stage.count; ++b)
+      {
+        auto *command = new Command (stage.gpu);
+        stage.commands.push_back (command);
+        VKLLAMA_STATUS_OK (command->init ());
+        VKLLAMA_STATUS_OK (command->begin ());
+        command->set_activations (stage.activations);
+
+        auto block = create_llama2_block (stage.gpu, command, loader, tensors,
+                                          config, b);
+        VKLLAMA_STATUS_OK (block.status ());
+        stage.blocks.push_back (*block);
+
+        VKLLAMA_STATUS_OK (command->end ());
+        VKLLAMA_STATUS_OK (command->submit ());
+      }
+
+    VKLLAMA_STATUS_OK (loader.finish ());
+    VKLLAMA_STATUS_OK (Command::wait (layer_commands));
+    return Command::wait (stage.commands);
+  }
+
+  // Records the blocks of every stage for a single token, see
+  // Model::plan_activations_ ().
+  absl::Status
+  plan_activations_ (const size_t dim)
+  {
+    for (auto &stage : stages_)
+      {
+        Tensor X (1, 1, dim, stage.gpu, FP16);
+        VKLLAMA_STATUS_OK (X.create ());
+
+        stage.activations->begin ();
+        for (size_t i = 0; i < stage.blocks.size (); ++i)
+          {
+            VKLLAMA_STATUS_OK (stage.commands[i]->begin ());
+            auto out = (*stage.blocks[i]) (X, 0);
+            VKLLAMA_STATUS_OK (out.status ());
+            X = *out;
+            VKLLAMA_STATUS_OK (stage.commands[i]->end ());
+          }
+        VKLLAMA_STATUS_OK (stage.activations->end ());
+      }
+    return absl::OkStatus ();
+  }
+
+  // in submission order
+  std::vector<Command *>
+  stage_commands_ (const size_t s)
+  {
+    std::vector<Command *> commands;
+    if (s == 0)
+      {
+        commands.push_back (input_command_);
+      }
+    commands.insert (commands.end (), stages_[s].commands.cbegin (),
+                     stages_[s].commands.cend ());
+    if (s + 1 == stages_.size ())
+      {
+        commands.push_back (output_command_);
+      }
+    return commands;
+  }
+
+  // Records micro-batch toks at offset on stage s. Only the last
+  // micro-batch goes through the output layer.
+  absl::Status
+  record_stage_ (const size_t s, const uint32_t *toks, const size_t len,
+                 const size_t offset, const bool last)
+  {
+    auto &stage = stages_[s];
+    auto &commands = stage.commands;
+    absl::StatusOr<Tensor> X;
+
+    if (s == 0)
+      {
+        toks_ = Tensor (1, 1, len, stage.gpu, UINT32, true);
+        VKLLAMA_STATUS_OK (toks_.create ());
+        ::memcpy (toks_.host (), toks, sizeof (uint32_t) * len);
+        VKLLAMA_STATUS_OK (toks_.flush ());
+
+        VKLLAMA_STATUS_OK (input_command_->begin ());
+        X = (*input_layer_) (toks_);
+        VKLLAMA_STATUS_OK (X.status ());
+        VKLLAMA_STATUS_OK (input_command_->end ());
+        VKLLAMA_STATUS_OK (commands.front ()->begin ());
+      }
+    else
+      {
+        auto const &prev = stages_[s - 1];
+        stage.input
+            = Tensor (prev.output_shape[0], prev.output_shape[1],
+                      prev.output_shape[2], stage.gpu, FP16);
+        VKLLAMA_STATUS_OK (stage.input.create ());
+        VKLLAMA_STATUS_OK (commands.front ()->begin ());
+        VKLLAMA_STATUS_OK (commands.front ()->upload (
+            prev.output.data (), prev.output.size (), stage.input));
+        X = stage.input;
+      }
+
+    stage.activations->begin ();
+    for (size_t i = 0; i < stage.blocks.size (); ++i)
+      {
+        auto *command = commands[i];
+        if (i > 0)
+          {
+            VKLLAMA_STATUS_OK (command->begin ());
+          }
+
+        X = (*stage.blocks[i]) (*X, offset);
+        VKLLAMA_STATUS_OK (X.status ());
+
+        if (i + 1 == stage.blocks.size () && s + 1 < stages_.size ())
+          {
+            stage.output.resize (X->size ());
+            stage.output_shape = X->shape ();
+            VKLLAMA_STATUS_OK (command->download (*X, stage.output.data (),
+                                                  stage.output.size ()));
+          }
+        VKLLAMA_STATUS_OK (command->end ());
+      }
+    VKLLAMA_STATUS_OK (stage.activations->end ());
+
+    if (s + 1 < stages_.size ())
+      {
+        return absl::OkStatus ();
+      }
+
+    // the output command is submitted with every micro-batch, empty for all
+    // but the last one
+    VKLLAMA_STATUS_OK (output_command_->begin ());
+    if (last)
+      {
+        auto output = (*output_layer_) (*X);
+        VKLLAMA_STATUS_OK (output.status ());
+        logits_.resize (output->size ());
+        VKLLAMA_STATUS_OK (output_command_->download (
+            *output, logits_.data (), logits_.size ()));
+      }
+    return output_command_->end ();
+  }
+
+  std::vector<int> devs_;
+  size_t micro_batch_;
+  std::vector<Stage> stages_;
+  // on the first stage's device
+  Command *input_command_;
+  InputLayer *input_layer_;
+  Tensor toks_;
+  // on the last stage's device
+  Command *output_command_;
+  OutputLayer *output_layer_;
+  std::vector<float> logits_;
+  size_t maxlen_;
+  uint32_t maxlen_limit_;
+  DType kvcache_dtype_;
+  std::vector<uint32_t> split_;
+};
+}
+
+#endif
@@ -0,0 +1,570 @@
+#ifndef __VKLLAMA_MODELS_LLAMA2_TENSOR_PARALLEL_H__
+#define __VKLLAMA_MODELS_LLAMA2_TENSOR_PARALLEL_H__
+#include "absl/strings/str_format.h"
+#include "models/llama2.h"
+#include "src/core/quants.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace vkllama
+{
+// the blocks of a gguf tensor type as they lie in the file. A gguf q8_0
+// block is an fp16 scale and 32 int8 weights, 34 bytes, where the q8_0 the
+// host quantizes to keeps an fp32 scale.
+inline DTypeProperty
+gguf_block (const uint32_t type)
+{
+  const auto dtype = gguf_dtype (type);
+  if (dtype == Q8_0)
+    {
+      return { 32, 34 };
+    }
+  return get_dtype_property (dtype);
+}
+
+// bytes of one row of a gguf matrix, its first dimension
+inline size_t
+gguf_row_bytes (gguf_tensor const &weight)
+{
+  const auto property = gguf_block (weight.type);
+  return weight.dim[0] / property.items_per_block
+         * property.bytes_per_block;
+}
+
+// rows [row, row + rows) of a gguf matrix, uploaded in place
+inline WeightLoader::Upload
+gguf_rows_upload (gguf_tensor const &weight, const size_t row,
+                  const size_t rows, Tensor const &to)
+{
+  const size_t row_bytes = gguf_row_bytes (weight);
+  return { (const uint8_t *)weight.weights_data + row * row_bytes,
+           rows * row_bytes, to };
+}
+
+// A copy of the columns [col, col + cols) of a gguf matrix; both have to be
+// whole quantization blocks.
+inline std::vector<uint8_t>
+gguf_columns (gguf_tensor const &weight, const size_t col, const size_t cols)
+{
+  const auto property = gguf_block (weight.type);
+  const size_t row_bytes = gguf_row_bytes (weight);
+  const size_t from = col / property.items_per_block
+                      * property.bytes_per_block;
+  const size_t bytes = cols / property.items_per_block
+                       * property.bytes_per_block;
+
+  std::vector<uint8_t> out (bytes * weight.dim[1]);
+  for (size_t r = 0; r < weight.dim[1]; ++r)
+    {
+      ::memcpy (out.data () + r * bytes,
+                (const uint8_t *)weight.weights_data + r * row_bytes + from,
+                bytes);
+    }
+  return out;
+}
+
+// The share of one device in a llama2 block under tensor parallelism. The
+// device runs the norms on the whole activations, then the attention of a
+// range of heads and the feed forward of a range of hidden columns. Their
+// outputs are partial sums of the output and down projections, which add
+// up over the devices to the outputs of the whole block; the residual adds
+// are left to whoever sums them.
+class Llama2BlockShard
+{
+public:
+  Llama2BlockShard (GPUDevice *dev, Command *command,
+                    Llama2Block::TransformerParams const &transformer,
+                    Llama2Block::FeedForwardParams const &feed_forward,
+                    Llama2Block::RmsNormParams const &norm)
+      : gpu_ (dev), command_ (command), transformer_params_ (transformer),
+        feedforward_params_ (feed_forward), rmsnorm_params_ (norm)
+  {
+  }
+
+  absl::Status
+  init ()
+  {
+    attn_op_.reset (new MultiHeadAttentionV2 (
+        gpu_, command_, transformer_params_.Wk, transformer_params_.Wq,
+        transformer_params_.Wv, transformer_params_.Wo,
+        transformer_params_.maxlen, transformer_params_.dim, true, FP16, true,
+        transformer_params_.clip_output));
+
+    feedforward_op_.reset (new FeedForward (
+        gpu_, command_, feedforward_params_.w1, feedforward_params_.w2,
+        feedforward_params_.w3, true, feedforward_params_.w1.dtype ()));
+
+    norm_op_.reset (new RMSNorm (gpu_, command_, rmsnorm_params_.weight1,
+                                 rmsnorm_params_.eps, FP16));
+    norm_op2_.reset (new RMSNorm (gpu_, command_, rmsnorm_params_.weight2,
+                                  feedforward_params_.eps, FP16));
+
+    VKLLAMA_STATUS_OK (attn_op_->init ());
+    VKLLAMA_STATUS_OK (feedforward_op_->init ());
+    VKLLAMA_STATUS_OK (norm_op_->init ());
+    return norm_op2_->init ();
+  }
+
+  // the partial attention output of the block input in; only its last row
+  // with clip_output
+  absl::StatusOr<Tensor>
+  attention (Tensor in, const size_t offset)
+  {
+    auto normed = (*norm_op_) (in);
+    VKLLAMA_STATUS_OK (normed.status ());
+    return (*attn_op_) (*normed, offset);
+  }
+
+  // the partial feed forward output of in, the block input plus attention
+  absl::StatusOr<Tensor>
+  feed_forward (Tensor in)
+  {
+    auto normed = (*norm_op2_) (in);
+    VKLLAMA_STATUS_OK (normed.status ());
+    return (*feedforward_op_) (*normed);
+  }
+
+private:
+  GPUDevice *gpu_;
+  Command *command_;
+  std::unique_ptr<MultiHeadAttentionV2> attn_op_;
+  std::unique_ptr<FeedForward> feedforward_op_;
+  std::unique_ptr<RMSNorm> norm_op_;
+  std::unique_ptr<RMSNorm> norm_op2_;
+
+  Llama2Block::TransformerParams transformer_params_;
+  Llama2Block::FeedForwardParams feedforward_params_;
+  Llama2Block::RmsNormParams rmsnorm_params_;
+};
+
+// Llama2 with every block split across devices: each device holds the
+// attention heads and feed forward hidden columns of its share, so every
+// device works on every token and a single decode step gets faster with
+// more devices, which splitting by blocks does not give.
+//
+// The host runs the all-reduce. It keeps the residual stream in fp32, and
+// each half block uploads it to all devices, which return the partial
+// outputs of their shares; the host adds their sum to the residual. The
+// first device also embeds the tokens and computes the logits.
+class TensorParallelModel
+{
+public:
+  // hidden columns are split in multiples of this, the size of a q8_0 block
+  static constexpr size_t kColumnAlign = 32;
+
+  // devs may repeat an index, which runs several instances of one device
+  TensorParallelModel (std::vector<int> const &devs)
+      : devs_ (devs), input_layer_ (nullptr), output_layer_ (nullptr),
+        dim_ (0), maxlen_ (0)
+  {
+  }
+
+  TensorParallelModel (TensorParallelModel const &) = delete;
+  TensorParallelModel &operator= (TensorParallelModel const &) = delete;
+
+  ~TensorParallelModel ()
+  {
+    delete input_layer_;
+    delete output_layer_;
+    for (auto &shard : shards_)
+      {
+        for (auto *block : shard.blocks)
+          {
+            delete block;
+          }
+        delete shard.command;
+        shard.x = Tensor ();
+        delete shard.gpu;
+      }
+  }
+
+  absl::Status
+  init (std::map<std::string, gguf_key> &kv,
+        std::map<std::string, gguf_tensor> &tensors)
+  {
+    const auto config = llama2_config (kv);
+    maxlen_ = config.maxlen;
+    dim_ = tensors["token_embd.weight"].dim[0];
+
+    const size_t n = devs_.size ();
+    const size_t hidden = tensors["blk.0.ffn_gate.weight"].dim[1];
+    const size_t units = hidden / kColumnAlign;
+    if (n == 0 || n > config.head_count || n > units
+        || hidden % kColumnAlign != 0)
+      {
+        return absl::InvalidArgumentError (absl::StrFormat (
+            "TensorParallelModel::init: %zu devices for %u heads and %zu "
+            "hidden columns.",
+            n, config.head_count, hidden));
+      }
+
+    // even splits, the first devices take one more head or column block
+    // when they do not come out even
+    size_t head = 0, column = 0;
+    for (size_t d = 0; d < n; ++d)
+      {
+        Shard shard = {};
+        shard.dev = devs_[d];
+        shard.head = head;
+        shard.heads = config.head_count / n + (d < config.head_count % n);
+        shard.column = column;
+        shard.columns = (units / n + (d < units % n)) * kColumnAlign;
+        head += shard.heads;
+        column += shard.columns;
+        shards_.push_back (std::move (shard));
+      }
+
+    // the heads of a device are columns of wo, whole blocks of them
+    const size_t head_dim
+        = tensors["blk.0.attn_k.weight"].dim[1] / config.head_count;
+    const auto wo_block
+        = gguf_block (tensors["blk.0.attn_output.weight"].type);
+    for (auto const &shard : shards_)
+      {
+        if (shard.heads * head_dim % wo_block.items_per_block != 0)
+          {
+            return absl::InvalidArgumentError (absl::StrFormat (
+                "TensorParallelModel::init: %zu heads of dim %zu are not "
+                "whole blocks of wo columns.",
+                shard.heads, head_dim));
+          }
+      }
+
+    for (size_t d = 0; d < n; ++d)
+      {
+        VKLLAMA_STATUS_OK (init_shard_ (d, config, tensors));
+      }
+    return absl::OkStatus ();
+  }
+
+  size_t
+  shards () const
+  {
+    return shards_.size ();
+  }
+
+  // the heads [first, last) of a device
+  std::pair<size_t, size_t>
+  heads (const size_t shard) const
+  {
+    return { shards_[shard].head,
+             shards_[shard].head + shards_[shard].heads };
+  }
+
+  // the hidden feed forward columns [first, last) of a device
+  std::pair<size_t, size_t>
+  columns (const size_t shard) const
+  {
+    return { shards_[shard].column,
+             shards_[shard].column + shards_[shard].columns };
+  }
+
+  GPUDevice *
+  device (const size_t shard)
+  {
+    return shards_[shard].gpu;
+  }
+
+  // logits of the last token of toks, which start at offset
+  absl::StatusOr<std::vector<float> >
+  operator() (std::vector<uint32_t> const &toks, const size_t offset)
+  {
+    if (toks.empty ())
+      {
+        return absl::InvalidArgumentError (
+            "TensorParallelModel: no tokens to infer.");
+      }
+
+    if (offset + toks.size () > maxlen_)
+      {
+        return absl::OutOfRangeError (absl::StrFormat (
+            "TensorParallelModel: %zu tokens at offset %zu exceed the "
+            "context length %zu.",
+            toks.size (), offset, maxlen_));
+      }
+
+    auto &first = shards_.front ();
+    auto *command = first.command;
+
+    Tensor vktoks (1, 1, toks.size (), first.gpu, UINT32, true);
+    VKLLAMA_STATUS_OK (vktoks.create ());
+    ::memcpy (vktoks.host (), toks.data (), sizeof (uint32_t) * toks.size ());
+    VKLLAMA_STATUS_OK (vktoks.flush ());
+
+    std::vector<__vkllama_fp16_t> embedded;
+    VKLLAMA_STATUS_OK (command->begin ());
+    auto X = (*input_layer_) (vktoks);
+    VKLLAMA_STATUS_OK (X.status ());
+    embedded.resize (X->size ());
+    VKLLAMA_STATUS_OK (
+        command->download (*X, embedded.data (), embedded.size ()));
+    VKLLAMA_STATUS_OK (command->end ());
+    VKLLAMA_STATUS_OK (command->submit_and_wait ());
+
+    residual_.resize (embedded.size ());
+    std::transform (embedded.cbegin (), embedded.cend (), residual_.begin (),
+                    [] (const __vkllama_fp16_t v) {
+                      return __fp16_to_fp32 (v.u16);
+                    });
+
+    for (size_t b = 0; b < first.blocks.size (); ++b)
+      {
+        VKLLAMA_STATUS_OK (all_reduce_ ([b, offset] (Shard &shard, Tensor x) {
+          return shard.blocks[b]->attention (x, offset);
+        }));
+        VKLLAMA_STATUS_OK (all_reduce_ ([b] (Shard &shard, Tensor x) {
+          return shard.blocks[b]->feed_forward (x);
+        }));
+      }
+
+    std::vector<float> logits;
+    round_residual_ ();
+    VKLLAMA_STATUS_OK (command->begin ());
+    VKLLAMA_STATUS_OK (upload_residual_ (first));
+    auto output = (*output_layer_) (first.x);
+    VKLLAMA_STATUS_OK (output.status ());
+    logits.resize (output->size ());
+    VKLLAMA_STATUS_OK (
+        command->download (*output, logits.data (), logits.size ()));
+    VKLLAMA_STATUS_OK (command->end ());
+    VKLLAMA_STATUS_OK (command->submit_and_wait ());
+    return logits;
+  }
+
+private:
+  struct Shard
+  {
+    int dev;
+    // the heads [head, head + heads) and the hidden columns [column, column
+    // + columns) of every block run on the shard
+    size_t head;
+    size_t heads;
+    size_t column;
+    size_t columns;
+    GPUDevice *gpu;
+    // the shard runs one half block at a time
+    Command *command;
+    std::vector<Llama2BlockShard *> blocks;
+    // the residual stream as uploaded for the running half block
+    Tensor x;
+    // the shard's partial output of the running half block
+    std::vector<__vkllama_fp16_t> partial;
+  };
+
+  absl::Status
+  init_shard_ (const size_t d, Llama2Config const &config,
+               std::map<std::string, gguf_tensor> &tensors)
+  {
+    auto &shard = shards_[d];
+    shard.gpu = new GPUDevice (shard.dev);
+    VKLLAMA_STATUS_OK (shard.gpu->init ());
+    shard.command = new Command (shard.gpu);
+    VKLLAMA_STATUS_OK (shard.command->init ());
+    VKLLAMA_STATUS_OK (shard.command->begin ());
+
+    WeightLoader loader (shard.gpu);
+    VKLLAMA_STATUS_OK (loader.init ());
+
+    if (d == 0)
+      {
+        auto input = create_llama2_input (shard.gpu, shard.command, loader,
+                                          tensors);
+        VKLLAMA_STATUS_OK (input.status ());
+        input_layer_ = *input;
+
+        auto output = create_llama2_output (shard.gpu, shard.command, loader,
+                                            tensors);
+        VKLLAMA_STATUS_OK (output.status ());
+        output_layer_ = *output;
+      }
+
+    // column shares are copied out of their rows, and the copies have to
+    // live until the loader has finished
+    std::deque<std::vector<uint8_t> > columns;
+    for (uint32_t b = 0; b < config.block_count; ++b)
+      {
+        auto block = create_block_ (shard, config, b, loader, tensors,
+                                    columns);
+        VKLLAMA_STATUS_OK (block.status ());
+        shard.blocks.push_back (*block);
+      }
+
+    VKLLAMA_STATUS_OK (shard.command->end ());
+    VKLLAMA_STATUS_OK (shard.command->submit ());
+    VKLLAMA_STATUS_OK (loader.finish ());
+    return shard.command->wait ();
+  }
+
+  absl::StatusOr<Llama2BlockShard *>
+  create_block_ (Shard &shard, Llama2Config const &config, const uint32_t b,
+                 WeightLoader &loader,
+                 std::map<std::string, gguf_tensor> &tensors,
+                 std::deque<std::vector<uint8_t> > &columns)
+  {
+    char vname[512];
+    auto weight = [&] (const char *name) {
+      ::snprintf (vname, sizeof (vname), "blk.%u.%s.weight", b, name);
+      return tensors[vname];
+    };
+
+    const auto attn_norm_weight = weight ("attn_norm");
+    const auto attn_k_weight = weight ("attn_k");
+    const auto attn_q_weight = weight ("attn_q");
+    const auto attn_v_weight = weight ("attn_v");
+    const auto attn_output_weight = weight ("attn_output");
+    const auto ffn_norm_weight = weight ("ffn_norm");
+    const auto ffn_up_weight = weight ("ffn_up");
+    const auto ffn_down_weight = weight ("ffn_down");
+    const auto ffn_gate_weight = weight ("ffn_gate");
+
+    auto *gpu = shard.gpu;
+    const size_t head_dim = attn_k_weight.dim[1] / config.head_count;
+    const size_t row = shard.head * head_dim;
+    const size_t rows = shard.heads * head_dim;
+    const size_t input_dim = attn_k_weight.dim[0];
+
+    Tensor vk_attn_norm_weight (1, 1, attn_norm_weight.dim[0], gpu,
+                                gguf_dtype (attn_norm_weight.type));
+    Tensor vk_ffn_norm_weight (1, 1, ffn_norm_weight.dim[0], gpu,
+                               gguf_dtype (ffn_norm_weight.type));
+
+    // the heads of the shard are rows of wk, wq and wv and columns of wo
+    Tensor vkWk (1, rows, input_dim, gpu, gguf_dtype (attn_k_weight.type));
+    Tensor vkWq (1, rows, input_dim, gpu, gguf_dtype (attn_q_weight.type));
+    Tensor vkWv (1, rows, input_dim, gpu, gguf_dtype (attn_v_weight.type));
+    Tensor Wo (1, attn_output_weight.dim[1], rows, gpu,
+               gguf_dtype (attn_output_weight.type));
+
+    // its hidden columns are rows of w1 and w3 and columns of w2
+    Tensor vkw1 (1, shard.columns, ffn_gate_weight.dim[0], gpu,
+                 gguf_dtype (ffn_gate_weight.type));
+    Tensor vkw2 (1, ffn_down_weight.dim[1], shard.columns, gpu,
+                 gguf_dtype (ffn_down_weight.type));
+    Tensor vkw3 (1, shard.columns, ffn_up_weight.dim[0], gpu,
+                 gguf_dtype (ffn_up_weight.type));
+
+    for (auto *t : { &vk_attn_norm_weight, &vk_ffn_norm_weight, &vkWk, &vkWq,
+                     &vkWv, &Wo, &vkw1, &vkw2, &vkw3 })
+      {
+        VKLLAMA_STATUS_OK (t->create (WEIGHT_MEMORY));
+      }
+
+    columns.push_back (gguf_columns (attn_output_weight, row, rows));
+    auto const &wo_columns = columns.back ();
+    columns.push_back (
+        gguf_columns (ffn_down_weight, shard.column, shard.columns));
+    auto const &w2_columns = columns.back ();
+
+    VKLLAMA_STATUS_OK (loader.add (
+        { gguf_weight_upload (attn_norm_weight, vk_attn_norm_weight),
+          gguf_weight_upload (ffn_norm_weight, vk_ffn_norm_weight),
+          gguf_rows_upload (attn_k_weight, row, rows, vkWk),
+          gguf_rows_upload (attn_q_weight, row, rows, vkWq),
+          gguf_rows_upload (attn_v_weight, row, rows, vkWv),
+          { wo_columns.data (), wo_columns.size (), Wo },
+          gguf_rows_upload (ffn_gate_weight, shard.column, shard.columns,
+                            vkw1),
+          { w2_columns.data (), w2_columns.size (), vkw2 },
+          gguf_rows_upload (ffn_up_weight, shard.column, shard.columns,
+                            vkw3) }));
+
+    Llama2Block::RmsNormParams rmsnorm_params
+        = { vk_attn_norm_weight, vk_ffn_norm_weight, config.norm_eps };
+    Llama2Block::TransformerParams transformer_params
+        = { vkWk, vkWq, vkWv, Wo, (int)config.maxlen, (int)head_dim,
+            b == (config.block_count - 1) };
+    Llama2Block::FeedForwardParams feedfward_params
+        = { vkw1, vkw2, vkw3, config.norm_eps };
+
+    std::unique_ptr<Llama2BlockShard> block (
+        new Llama2BlockShard (gpu, shard.command, transformer_params,
+                              feedfward_params, rmsnorm_params));
+    VKLLAMA_STATUS_OK (block->init ());
+    return block.release ();
+  }
+
+  void
+  round_residual_ ()
+  {
+    residual16_.resize (residual_.size ());
+    std::transform (residual_.cbegin (), residual_.cend (),
+                    residual16_.begin (),
+                    [] (const float v) { return __fp32_to_fp16 (v); });
+  }
+
+  // records the upload of the fp16 residual stream into shard.x
+  absl::Status
+  upload_residual_ (Shard &shard)
+  {
+    const size_t rows = residual_.size () / dim_;
+    if (shard.x.height () != rows)
+      {
+        shard.x = Tensor (1, rows, dim_, shard.gpu, FP16);
+        VKLLAMA_STATUS_OK (shard.x.create ());
+      }
+    return shard.command->upload (residual16_.data (), residual16_.size (),
+                                  shard.x);
+  }
+
+  // Runs fn on every shard with the residual stream as input and adds the
+  // sum of their partial outputs to the residual. An output of fewer rows
+  // keeps the last rows of the residual.
+  template <typename Fn>
+  absl::Status
+  all_reduce_ (Fn &&fn)
+  {
+    round_residual_ ();
+    for (auto &shard : shards_)
+      {
+        VKLLAMA_STATUS_OK (shard.command->begin ());
+        VKLLAMA_STATUS_OK (upload_residual_ (shard));
+        auto partial = fn (shard, shard.x);
+        VKLLAMA_STATUS_OK (partial.status ());
+        shard.partial.resize (partial->size ());
+        VKLLAMA_STATUS_OK (shard.command->download (
+            *partial, shard.partial.data (), shard.partial.size ()));
+        VKLLAMA_STATUS_OK (shard.command->end ());
+        VKLLAMA_STATUS_OK (shard.command->submit ());
+      }
+
+    for (auto &shard : shards_)
+      {
+        VKLLAMA_STATUS_OK (shard.command->wait ());
+      }
+
+    const size_t n = shards_.front ().partial.size ();
+    if (n < residual_.size ())
+      {
+        residual_.erase (residual_.begin (), residual_.end () - n);
+      }
+
+    for (auto &shard : shards_)
+      {
+        for (size_t i = 0; i < n; ++i)
+          {
+            residual_[i] += __fp16_to_fp32 (shard.partial[i].u16);
+          }
+      }
+    return absl::OkStatus ();
+  }
+
+  std::vector<int> devs_;
+  std::vector<Shard> shards_;
+  // on the first shard's device
+  InputLayer *input_layer_;
+  OutputLayer *output_layer_;
+  size_t dim_;
+  size_t maxlen_;
+  // the residual stream of the running pass, [rows, dim], and its fp16
+  // copy the shards take
+  std::vector<float> residual_;
+  std::vector<__vkllama_fp16_t> residual16_;
+};
+}
+
+#endif
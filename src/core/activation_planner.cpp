@@ -0,0 +1,277 @@
+#include "activation_planner.h"
+#include "absl/strings/str_format.h"
+#include "gpu_device.h"
+#include "src/core/common.h"
+#include "src/core/quants.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace vkllama
+{
+ActivationPlanner::ActivationPlanner (GPUDevice *dev)
+    : dev_ (dev), active_ (false), following_ (false), step_ (0)
+{
+  stats_ = { 0, 0, 0, 0, 0 };
+}
+
+void
+ActivationPlanner::begin ()
+{
+  active_ = true;
+  following_ = !plan_.empty ();
+  step_ = 0;
+  pass_.clear ();
+  retired_.clear ();
+  owners_.clear ();
+
+  for (size_t s = 0; s < slots_.size (); ++s)
+    {
+      slots_[s].tenant = std::numeric_limits<size_t>::max ();
+      if (slots_[s].storage.data () != VK_NULL_HANDLE)
+        {
+          own_ (slots_[s].storage, true, s);
+        }
+    }
+}
+
+absl::StatusOr<Tensor>
+ActivationPlanner::acquire_slot_ (const int s, size_t c, size_t h, size_t w,
+                                  DType dtype)
+{
+  auto &slot = slots_[s];
+  if (slot.storage.data () != VK_NULL_HANDLE)
+    {
+      auto tensor = slot.storage.alias (c, h, w, dtype);
+      if (tensor.ok ())
+        {
+          return tensor;
+        }
+
+      // earlier tenants of this pass still refer to the old buffer
+      owners_.erase ({ slot.storage.data (), slot.storage.offset () });
+      retired_.push_back (slot.storage);
+    }
+
+  const auto property = get_dtype_property (dtype);
+  const size_t bytes = c * h * property.bytes_per_block
+                       * ((w + property.items_per_block - 1)
+                          / property.items_per_block);
+
+  slot.storage = Tensor (1, 1, bytes, dev_, INT8, false);
+  VKLLAMA_STATUS_OK (slot.storage.create ());
+  own_ (slot.storage, true, s);
+  return slot.storage.alias (c, h, w, dtype);
+}
+
+absl::StatusOr<Tensor>
+ActivationPlanner::acquire (size_t c, size_t h, size_t w, DType dtype)
+{
+  if (!active_)
+    {
+      return absl::FailedPreconditionError (
+          "ActivationPlanner: acquire outside of a pass.");
+    }
+
+  const size_t i = pass_.size ();
+  const uint64_t def = step_++;
+  following_ = following_ && i < plan_.size () && plan_[i].def == def;
+
+  if (following_)
+    {
+      const int s = plan_[i].slot;
+      auto tensor = acquire_slot_ (s, c, h, w, dtype);
+      VKLLAMA_STATUS_OK (tensor);
+      slots_[s].tenant = i;
+      pass_.push_back ({ tensor->bytes (), def, def, s });
+      return tensor;
+    }
+
+  Tensor tensor (c, h, w, dev_, dtype, false);
+  VKLLAMA_STATUS_OK (tensor.create ());
+  own_ (tensor, false, i);
+  retired_.push_back (tensor);
+  pass_.push_back ({ tensor.bytes (), def, def, -1 });
+  return tensor;
+}
+
+void
+ActivationPlanner::own_ (Tensor const &tensor, const bool slot,
+                         const size_t index)
+{
+  owners_[{ tensor.data (), tensor.offset () }]
+      = { slot, index, tensor.range () };
+}
+
+ActivationPlanner::Owner const *
+ActivationPlanner::owner_ (Tensor const &tensor) const
+{
+  auto it = owners_.upper_bound ({ tensor.data (), tensor.offset () });
+  if (it == owners_.cbegin ())
+    {
+      return nullptr;
+    }
+
+  --it;
+  if (it->first.first != tensor.data ()
+      || tensor.offset () >= it->first.second + it->second.bytes)
+    {
+      return nullptr;
+    }
+  return &it->second;
+}
+
+void
+ActivationPlanner::use (absl::Span<const Tensor> tensors)
+{
+  if (!active_)
+    {
+      return;
+    }
+
+  const uint64_t step = step_++;
+  for (auto const &tensor : tensors)
+    {
+      auto const *owner = owner_ (tensor);
+      if (!owner)
+        {
+          continue;
+        }
+
+      const size_t a = owner->slot ? slots_[owner->index].tenant
+                                   : owner->index;
+      if (a < pass_.size ())
+        {
+          pass_[a].last = step;
+        }
+    }
+}
+
+absl::Status
+ActivationPlanner::end ()
+{
+  if (!active_)
+    {
+      return absl::FailedPreconditionError (
+          "ActivationPlanner: end without begin.");
+    }
+  active_ = false;
+
+  std::vector<std::pair<uint64_t, int64_t> > events;
+  events.reserve (pass_.size () * 2);
+  stats_.activations = pass_.size ();
+  stats_.unplanned_bytes = 0;
+  for (auto const &a : pass_)
+    {
+      stats_.unplanned_bytes += a.bytes;
+      events.push_back ({ a.def, (int64_t)a.bytes });
+      events.push_back ({ a.last + 1, -(int64_t)a.bytes });
+    }
+
+  // at equal steps the activations ending there go first
+  std::sort (events.begin (), events.end ());
+  int64_t live = 0, peak = 0;
+  for (auto const &e : events)
+    {
+      live += e.second;
+      peak = std::max (peak, live);
+    }
+  stats_.peak_live_bytes = peak;
+
+  bool overrun = false;
+  bool replan = !following_ || pass_.size () != plan_.size ();
+  for (size_t i = 0; !replan && i < pass_.size (); ++i)
+    {
+      overrun = overrun || pass_[i].last > plan_[i].last;
+    }
+
+  if (replan || overrun)
+    {
+      plan_ = pass_;
+      assign_slots_ ();
+    }
+
+  stats_.slots = slots_.size ();
+  stats_.slot_bytes = 0;
+  for (auto const &slot : slots_)
+    {
+      if (slot.storage.data () != VK_NULL_HANDLE)
+        {
+          stats_.slot_bytes += slot.storage.bytes ();
+        }
+    }
+
+  if (overrun)
+    {
+      return absl::AbortedError (
+          "ActivationPlanner: an activation was used after its slot was "
+          "given to another one; the pass has been planned again and must "
+          "be recorded again.");
+    }
+  return absl::OkStatus ();
+}
+
+// Greedy interval assignment in acquire order: an activation goes to the
+// free slot that holds it most tightly, or grows the largest free slot
+// when none holds it, and opens a new slot when none is free.
+void
+ActivationPlanner::assign_slots_ ()
+{
+  std::vector<uint64_t> busy_until;
+  std::vector<size_t> bytes;
+
+  for (auto &a : plan_)
+    {
+      int best = -1;
+      for (size_t s = 0; s < busy_until.size (); ++s)
+        {
+          if (busy_until[s] >= a.def)
+            {
+              continue;
+            }
+
+          if (best < 0)
+            {
+              best = s;
+              continue;
+            }
+
+          const bool fits = bytes[s] >= a.bytes;
+          const bool best_fits = bytes[best] >= a.bytes;
+          if ((fits && (!best_fits || bytes[s] < bytes[best]))
+              || (!fits && !best_fits && bytes[s] > bytes[best]))
+            {
+              best = s;
+            }
+        }
+
+      if (best < 0)
+        {
+          best = busy_until.size ();
+          busy_until.push_back (0);
+          bytes.push_back (0);
+        }
+
+      a.slot = best;
+      busy_until[best] = a.last;
+      bytes[best] = std::max (bytes[best], a.bytes);
+    }
+
+  // slots that are kept keep their buffers, which grow on demand
+  slots_.resize (busy_until.size ());
+}
+
+bool
+ActivationPlanner::planned () const
+{
+  return !plan_.empty ();
+}
+
+ActivationPlanner::Stats
+ActivationPlanner::stats () const
+{
+  return stats_;
+}
+}
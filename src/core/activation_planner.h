@@ -0,0 +1,118 @@
+#ifndef __VKLLAMA_ACTIVATION_PLANNER_H__
+#define __VKLLAMA_ACTIVATION_PLANNER_H__
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "src/core/common.h"
+#include "tensor.h"
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+namespace vkllama
+{
+class GPUDevice;
+
+// Places the intermediate tensors of a forward pass in a few slot buffers
+// that are reused by activations whose lifetimes do not overlap, so layers
+// running one after another share the same memory.
+//
+// A pass is bracketed by begin () and end (). Ops get their outputs from
+// acquire (), and every dispatch recorded by a Command attached to the
+// planner is reported to use (), which gives each activation the range of
+// steps it is alive in. The first pass allocates each activation on its own
+// and end () plans the slots from the lifetimes it saw. Later passes follow
+// that plan as long as they acquire their activations at the same steps,
+// which holds whenever they run the same ops whatever the sequence length;
+// a slot grows when a pass needs more than it holds. A pass that departs
+// from the plan gets separate allocations from there on and is planned
+// again at end ().
+class ActivationPlanner
+{
+public:
+  struct Stats
+  {
+    size_t slots;
+    // device memory held by the slot buffers
+    size_t slot_bytes;
+    // activations acquired by the last pass
+    size_t activations;
+    // the most bytes of activations alive at one step of the last pass,
+    // which is the least any plan can do with
+    size_t peak_live_bytes;
+    // bytes the last pass needs with every activation in its own buffer
+    size_t unplanned_bytes;
+  };
+
+  ActivationPlanner (GPUDevice *dev);
+
+  void begin ();
+  // Fails with AbortedError when the pass used an activation after the step
+  // the plan let its slot go, in which case its recording must be redone.
+  absl::Status end ();
+
+  absl::StatusOr<Tensor> acquire (size_t c, size_t h, size_t w,
+                                  DType dtype);
+  // one step during which tensors are accessed; tensors that were not
+  // acquired from the planner are ignored
+  void use (absl::Span<const Tensor> tensors);
+
+  bool planned () const;
+  Stats stats () const;
+
+private:
+  struct Activation
+  {
+    size_t bytes;
+    uint64_t def;
+    uint64_t last;
+    // slot of the plan, -1 for a separate allocation
+    int slot;
+  };
+
+  struct Slot
+  {
+    Tensor storage;
+    // activation of the current pass living in the slot
+    size_t tenant;
+  };
+
+  struct Owner
+  {
+    bool slot;
+    // the slot, or the activation of a separate allocation
+    size_t index;
+    VkDeviceSize bytes;
+  };
+
+  // tensors are ranges of pooled buffers, so they are told apart by their
+  // offset as well
+  typedef std::pair<VkBuffer, VkDeviceSize> BufferRange;
+
+  absl::StatusOr<Tensor> acquire_slot_ (const int slot, size_t c, size_t h,
+                                        size_t w, DType dtype);
+  void assign_slots_ ();
+  void own_ (Tensor const &tensor, const bool slot, const size_t index);
+  // the owner of the range tensor starts in, or null
+  Owner const *owner_ (Tensor const &tensor) const;
+
+  GPUDevice *dev_;
+  bool active_;
+  // the current pass has acquired its activations as planned so far
+  bool following_;
+  uint64_t step_;
+  std::vector<Activation> plan_;
+  std::vector<Activation> pass_;
+  std::vector<Slot> slots_;
+  std::map<BufferRange, Owner> owners_;
+  // buffers used in the current pass outside the slots, kept until the
+  // next one so that their ranges cannot be handed out again meanwhile
+  std::vector<Tensor> retired_;
+  Stats stats_;
+};
+}
+
+#endif
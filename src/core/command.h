@@ -2,13 +2,20 @@
 #define __VKLLAMA_COMMAND_H__
 
 #include "absl/status/status.h"
+#include "absl/status/statusor.h"
 #include "absl/strings/str_format.h"
+#include "absl/types/span.h"
+#include "activation_planner.h"
 #include "gpu_device.h"
+#include "host_buffer.h"
 #include "pipeline.h"
+#include "staging_pool.h"
+#include "task_arena.h"
 #include "src/core/common.h"
 #include "src/core/float.h"
 #include "tensor.h"
 #include <algorithm>
+#include <array>
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
@@ -26,22 +33,37 @@ namespace vkllama
 class Command
 {
 public:
-  Command (GPUDevice *dev) : dev_ (dev) {}
+  Command (GPUDevice *dev, const QueueKind kind = COMPUTE_QUEUE)
+      : dev_ (dev), kind_ (kind), family_ (0), fence_ (VK_NULL_HANDLE),
+        timeline_ (VK_NULL_HANDLE),
+        timeline_value_ (0), reusable_ (false), global_barrier_ (false),
+        dispatch_barrier_count_ (0), descriptor_pool_ (0),
+        activations_ (nullptr)
+  {
+  }
 
   ~Command ()
   {
     defer_task_.clear ();
+    for (auto pool : descriptor_pools_)
+      {
+        vkDestroyDescriptorPool (dev_->device (), pool, nullptr);
+      }
     vkFreeCommandBuffers (dev_->device (), commandPool_, 1, &commandBuffer_);
     vkDestroyCommandPool (dev_->device (), commandPool_, nullptr);
     vkDestroyFence (dev_->device (), fence_, nullptr);
+    if (timeline_ != VK_NULL_HANDLE)
+      {
+        vkDestroySemaphore (dev_->device (), timeline_, nullptr);
+      }
   }
 
   absl::Status
   init ()
   {
-    auto queueFamily
-        = dev_->require_queue (VK_QUEUE_TRANSFER_BIT | VK_QUEUE_COMPUTE_BIT);
-    vkGetDeviceQueue (dev_->device (), queueFamily, 0, &queue_);
+    family_ = dev_->queue_family (kind_);
+    vkGetDeviceQueue (dev_->device (), family_, dev_->queue_index (kind_),
+                      &queue_);
     VkFenceCreateInfo fenceCreaeInfo
         = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr, 0 };
     auto ret
@@ -52,9 +74,26 @@ public:
             "Command: failed at create fence, VkResult = %d", int (ret)));
       }
 
+    if (dev_->support_timeline_semaphore ())
+      {
+        VkSemaphoreTypeCreateInfo typeInfo
+            = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO, nullptr,
+                VK_SEMAPHORE_TYPE_TIMELINE, timeline_value_ };
+        VkSemaphoreCreateInfo semaphoreCreateInfo
+            = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, &typeInfo, 0 };
+        ret = vkCreateSemaphore (dev_->device (), &semaphoreCreateInfo,
+                                 nullptr, &timeline_);
+        if (ret != VK_SUCCESS)
+          {
+            return absl::InternalError (absl::StrFormat (
+                "Command: failed at create timeline semaphore, VkResult = %d",
+                int (ret)));
+          }
+      }
+
     VkCommandPoolCreateInfo createInfo
         = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr,
-            VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, queueFamily };
+            VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, family_ };
 
     vkCreateCommandPool (dev_->device (), &createInfo, nullptr, &commandPool_);
 
@@ -73,11 +112,81 @@ public:
     return absl::OkStatus ();
   }
 
+  // A reusable command buffer is recorded once and may be submitted many
+  // times. Its deferred tasks run after every wait and are only dropped when
+  // the command is recorded again.
   absl::Status
-  begin ()
+  begin (const bool reusable = false)
   {
+    defer_task_.clear ();
+    dispatch_barrier_count_ = 0;
+
+    // the sets written by the previous recording are no longer in use once
+    // the command buffer can be recorded again
+    for (auto pool : descriptor_pools_)
+      {
+        vkResetDescriptorPool (dev_->device (), pool, 0);
+      }
+    descriptor_pool_ = 0;
+
+    reusable_ = reusable;
     return begin_ ();
   }
+
+  QueueKind
+  queue_kind () const
+  {
+    return kind_;
+  }
+
+  uint32_t
+  queue_family () const
+  {
+    return family_;
+  }
+
+  bool
+  reusable () const
+  {
+    return reusable_;
+  }
+
+  // With a global barrier, each dispatch waits on the previous ones through
+  // a single VkMemoryBarrier instead of one buffer barrier per binding.
+  // Some drivers handle that better than long lists of buffer barriers.
+  void
+  set_global_barrier (const bool global)
+  {
+    global_barrier_ = global;
+  }
+
+  bool
+  global_barrier () const
+  {
+    return global_barrier_;
+  }
+
+  // Ops recorded into this command get their outputs from activations, and
+  // the tensors of every dispatch and copy are reported to it. Commands of
+  // one forward pass share the planner, which outlives them.
+  void
+  set_activations (ActivationPlanner *activations)
+  {
+    activations_ = activations;
+  }
+
+  ActivationPlanner *
+  activations () const
+  {
+    return activations_;
+  }
+
+  // vkCmdPipelineBarrier calls made by record_pipeline since begin ()
+  size_t
+  dispatch_barrier_count () const
+  {
+    return dispatch_barrier_count_;
+  }
   absl::Status
   end ()
   {
@@ -150,32 +259,56 @@ public:
     if (to.visable ())
       {
         ::memcpy (to.host (), from, bytes);
-        auto ret = to.flush ();
-        if (!ret.ok ())
-          {
-            return ret;
-          }
+        return host_written (to);
+      }
 
-        to.set_access_flags (VK_ACCESS_HOST_WRITE_BIT);
-        to.set_pipeline_stage (VK_PIPELINE_STAGE_HOST_BIT);
+    if (bytes == 0)
+      {
         return absl::OkStatus ();
       }
 
-    auto staging = std::make_shared<Tensor> (
-        to.channels (), to.height (), to.width (), dev_, to.dtype (), true);
-
-    auto ret = staging->create ();
-    if (!ret.ok ())
-      return ret;
+    auto staging = dev_->staging ().acquire (bytes);
+    if (!staging.ok ())
+      {
+        return staging.status ();
+      }
 
-    ::memcpy (staging->host (), reinterpret_cast<const void *> (from), bytes);
+    auto buf = *staging;
+    ::memcpy (buf->host (), reinterpret_cast<const void *> (from), bytes);
+    return upload_staged (buf, bytes, to);
+  }
 
-    ret = staging->flush ();
+  // For a host visible tensor whose memory the host has written: makes the
+  // writes visible to the device and to the next barrier on the tensor.
+  absl::Status
+  host_written (Tensor &to)
+  {
+    auto ret = to.flush ();
     if (!ret.ok ())
       {
         return ret;
       }
 
+    to.set_access_flags (VK_ACCESS_HOST_WRITE_BIT);
+    to.set_pipeline_stage (VK_PIPELINE_STAGE_HOST_BIT);
+    return absl::OkStatus ();
+  }
+
+  // Records the copy of the first bytes of a staging buffer the host has
+  // filled into a tensor. The buffer is kept until the copy has been waited.
+  absl::Status
+  upload_staged (std::shared_ptr<StagingBuffer> buf, const size_t bytes,
+                 Tensor &to)
+  {
+    if (to.bytes () < bytes || buf->bytes () < bytes)
+      {
+        return absl::OutOfRangeError (absl::StrFormat (
+            "to.size() = %zu, staging size = %zu but %zu bytes upload.",
+            to.bytes (), size_t (buf->bytes ()), bytes));
+      }
+
+    VKLLAMA_STATUS_OK (buf->flush ());
+
     // put a barrier for host writing
     {
       VkBufferMemoryBarrier barrier
@@ -185,22 +318,70 @@ public:
               VK_ACCESS_TRANSFER_READ_BIT,
               VK_QUEUE_FAMILY_IGNORED,
               VK_QUEUE_FAMILY_IGNORED,
-              staging->data (),
-              0,
-              staging->bytes () };
+              buf->buffer (),
+              buf->offset (),
+              bytes };
 
       vkCmdPipelineBarrier (commandBuffer_, VK_PIPELINE_STAGE_HOST_BIT,
                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1,
                             &barrier, 0, nullptr);
     }
 
-    VkBufferCopy region = { 0, 0, staging->bytes () };
-    vkCmdCopyBuffer (commandBuffer_, staging->data (), to.data (), 1, &region);
+    VkBufferCopy region = { buf->offset (), to.offset (), bytes };
+    vkCmdCopyBuffer (commandBuffer_, buf->buffer (), to.data (), 1, &region);
+    if (activations_)
+      {
+        activations_->use ({ to });
+      }
     to.set_access_flags (VK_ACCESS_TRANSFER_WRITE_BIT);
     to.set_pipeline_stage (VK_PIPELINE_STAGE_TRANSFER_BIT);
+    to.set_queue_family (family_);
 
-    defer_task_.push_back ([staging] () { return absl::OkStatus (); });
-    return ret;
+    // the range goes back to the pool once the copy has been waited
+    defer_task_.push_back ([buf] () { return absl::OkStatus (); });
+    return absl::OkStatus ();
+  }
+
+  // Uploads host memory that stays mapped and unchanged until this command
+  // has been waited, such as a tensor of a mapped model file. The device
+  // copies it in place when the range can be imported as host memory, and
+  // it goes through staging like upload () otherwise.
+  absl::Status
+  upload_mapped (uint8_t const *from, const size_t bytes, Tensor &to)
+  {
+    if (to.bytes () < bytes)
+      {
+        return absl::OutOfRangeError (absl::StrFormat (
+            "to.size() = %zu but %zu bytes upload.", to.bytes (), bytes));
+      }
+
+    if (to.visable () || bytes == 0 || !dev_->support_external_memory_host ())
+      {
+        return upload_bytes (from, bytes, to);
+      }
+
+    auto imported = HostBuffer::import (dev_, from, bytes);
+    if (!imported.ok ())
+      {
+        return upload_bytes (from, bytes, to);
+      }
+
+    // host writes made before the submission are visible to it, so the
+    // copy needs no barrier on the source
+    auto buf = *imported;
+    VkBufferCopy region = { buf->offset (), to.offset (), bytes };
+    vkCmdCopyBuffer (commandBuffer_, buf->buffer (), to.data (), 1, &region);
+    if (activations_)
+      {
+        activations_->use ({ to });
+      }
+    to.set_access_flags (VK_ACCESS_TRANSFER_WRITE_BIT);
+    to.set_pipeline_stage (VK_PIPELINE_STAGE_TRANSFER_BIT);
+    to.set_queue_family (family_);
+
+    // the import is released once the copy has been waited
+    defer_task_.push_back ([buf] () { return absl::OkStatus (); });
+    return absl::OkStatus ();
   }
 
   template <typename T>
@@ -217,60 +398,55 @@ public:
 
     if (from.visable ())
       {
-        VkBufferMemoryBarrier barrier
-            = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-                nullptr,
-                from.access_flags (),
-                VK_ACCESS_HOST_READ_BIT,
-                VK_QUEUE_FAMILY_IGNORED,
-                VK_QUEUE_FAMILY_IGNORED,
-                from.data (),
-                0,
-                from.bytes () };
-
-        vkCmdPipelineBarrier (commandBuffer_, from.pipeline_stage (),
-                              VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1,
-                              &barrier, 0, nullptr);
-        defer_task_.push_back ([&from, to] () {
+        VKLLAMA_STATUS_OK (host_read_barrier (from));
+        defer_task_.push_back ([from, to, n] () mutable {
           auto ret = from.invalid ();
           if (!ret.ok ())
             {
               return ret;
             }
-          ::memcpy (to, from.host (), from.size () * sizeof (T));
+          // quantized tensors hold more bytes than items
+          ::memcpy (to, from.host (),
+                    std::min (sizeof (T) * n, size_t (from.bytes ())));
           return absl::OkStatus ();
         });
         return absl::OkStatus ();
       }
 
-    Tensor staging (1, 1, from.bytes (), dev_, INT8, true);
-
-    auto ret = staging.create ();
-    if (!ret.ok ())
+    auto staging = dev_->staging ().acquire (from.bytes ());
+    if (!staging.ok ())
       {
-        return ret;
+        return staging.status ();
       }
+    auto buf = *staging;
 
-    {
-      VkBufferMemoryBarrier barrier
-          = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-              nullptr,
-              from.access_flags (),
-              VK_ACCESS_TRANSFER_READ_BIT,
-              VK_QUEUE_FAMILY_IGNORED,
-              VK_QUEUE_FAMILY_IGNORED,
-              from.data (),
-              0,
-              from.bytes () };
+    acquire_ (from, VK_ACCESS_TRANSFER_READ_BIT,
+              VK_PIPELINE_STAGE_TRANSFER_BIT);
+    if (from.access_flags () != 0 && from.pipeline_stage () != 0)
+      {
+        VkBufferMemoryBarrier barrier
+            = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+                nullptr,
+                from.access_flags (),
+                VK_ACCESS_TRANSFER_READ_BIT,
+                VK_QUEUE_FAMILY_IGNORED,
+                VK_QUEUE_FAMILY_IGNORED,
+                from.data (),
+                from.barrier_offset (),
+                from.barrier_bytes () };
 
-      vkCmdPipelineBarrier (commandBuffer_, from.pipeline_stage (),
-                            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1,
-                            &barrier, 0, nullptr);
-    }
+        vkCmdPipelineBarrier (commandBuffer_, from.pipeline_stage (),
+                              VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1,
+                              &barrier, 0, nullptr);
+      }
 
-    VkBufferCopy region = { 0, 0, from.bytes () };
-    vkCmdCopyBuffer (commandBuffer_, from.data (), staging.data (), 1,
+    VkBufferCopy region = { from.offset (), buf->offset (), from.bytes () };
+    vkCmdCopyBuffer (commandBuffer_, from.data (), buf->buffer (), 1,
                      &region);
+    if (activations_)
+      {
+        activations_->use ({ from });
+      }
 
     {
       VkBufferMemoryBarrier barrier
@@ -280,9 +456,9 @@ public:
               VK_ACCESS_HOST_READ_BIT,
               VK_QUEUE_FAMILY_IGNORED,
               VK_QUEUE_FAMILY_IGNORED,
-              staging.data (),
-              0,
-              staging.bytes () };
+              buf->buffer (),
+              buf->offset (),
+              buf->bytes () };
 
       vkCmdPipelineBarrier (commandBuffer_, VK_PIPELINE_STAGE_TRANSFER_BIT,
                             VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1,
@@ -290,51 +466,93 @@ public:
     }
 
     // defer to sumbit and wait then do read from this staging buffer
-    defer_task_.push_back ([staging, to, n] () mutable {
-      auto ret = staging.invalid ();
+    defer_task_.push_back ([buf, to, n] () mutable {
+      auto ret = buf->invalid ();
       if (!ret.ok ())
         return ret;
-      ::memcpy (reinterpret_cast<void *> (to), staging.host (),
-                sizeof (T) * n);
+      ::memcpy (reinterpret_cast<void *> (to), buf->host (),
+                std::min (sizeof (T) * n, size_t (buf->bytes ())));
       return absl::OkStatus ();
     });
     return absl::OkStatus ();
   }
 
+  // Makes device writes to a host visible tensor readable through host ()
+  // once this command has been waited.
   absl::Status
-  record_pipeline (Pipeline &pipeline, std::vector<Tensor> bindings,
-                   std::vector<uint32_t> const &indices,
-                   ShaderConstants const &constants)
+  host_read_barrier (Tensor &from)
   {
-    auto &layout = pipeline.vklayout ();
-    auto &descriptset = pipeline.vkdescriptorset ();
+    if (!from.visable ())
+      {
+        return absl::InvalidArgumentError (
+            "Command::host_read_barrier: tensor is not host visible.");
+      }
 
-    for (auto &tensor : bindings)
+    acquire_ (from, VK_ACCESS_HOST_READ_BIT, VK_PIPELINE_STAGE_HOST_BIT);
+    if (from.access_flags () == 0 || from.pipeline_stage () == 0)
+      {
+        return absl::OkStatus ();
+      }
+
+    VkBufferMemoryBarrier barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+                                      nullptr,
+                                      from.access_flags (),
+                                      VK_ACCESS_HOST_READ_BIT,
+                                      VK_QUEUE_FAMILY_IGNORED,
+                                      VK_QUEUE_FAMILY_IGNORED,
+                                      from.data (),
+                                      from.barrier_offset (),
+                                      from.barrier_bytes () };
+
+    vkCmdPipelineBarrier (commandBuffer_, from.pipeline_stage (),
+                          VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1,
+                          &barrier, 0, nullptr);
+    return absl::OkStatus ();
+  }
+
+  absl::Status
+  fill (Tensor &to, const uint32_t value)
+  {
+    if (to.access_flags () != 0 && to.pipeline_stage () != 0)
       {
-        if (tensor.access_flags () == 0 || tensor.pipeline_stage () == 0)
-          {
-            continue;
-          }
         VkBufferMemoryBarrier barrier
             = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
                 nullptr,
-                tensor.access_flags (),
-                VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+                to.access_flags (),
+                VK_ACCESS_TRANSFER_WRITE_BIT,
                 VK_QUEUE_FAMILY_IGNORED,
                 VK_QUEUE_FAMILY_IGNORED,
-                tensor.data (),
-                0,
-                tensor.bytes () };
+                to.data (),
+                to.barrier_offset (),
+                to.barrier_bytes () };
 
-        vkCmdPipelineBarrier (commandBuffer_, tensor.pipeline_stage (),
-                              VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0,
-                              nullptr, 1, &barrier, 0, nullptr);
+        vkCmdPipelineBarrier (commandBuffer_, to.pipeline_stage (),
+                              VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1,
+                              &barrier, 0, nullptr);
       }
 
-    auto ret = pipeline.update_bindings (bindings, indices);
-    if (!ret.ok ())
+    vkCmdFillBuffer (commandBuffer_, to.data (), to.offset (), to.bytes (),
+                     value);
+    to.set_access_flags (VK_ACCESS_TRANSFER_WRITE_BIT);
+    to.set_pipeline_stage (VK_PIPELINE_STAGE_TRANSFER_BIT);
+    to.set_queue_family (family_);
+    return absl::OkStatus ();
+  }
+
+  // Records a dispatch of pipeline on bindings, which go to the binding
+  // slots in indices, or to slots 0..n-1 when indices is empty. Nothing on
+  // this path allocates once the command has been recorded before.
+  absl::Status
+  record_pipeline (Pipeline &pipeline, absl::Span<const Tensor> bindings,
+                   absl::Span<const uint32_t> indices,
+                   ShaderConstants const &constants)
+  {
+    auto &layout = pipeline.vklayout ();
+
+    VKLLAMA_STATUS_OK (record_dispatch_barrier_ (pipeline, bindings, indices));
+    if (activations_)
       {
-        return ret;
+        activations_->use (bindings);
       }
 
     vkCmdBindPipeline (commandBuffer_, VK_PIPELINE_BIND_POINT_COMPUTE,
@@ -348,8 +566,21 @@ public:
             reinterpret_cast<const void *> (constants.data ()));
       }
 
-    vkCmdBindDescriptorSets (commandBuffer_, VK_PIPELINE_BIND_POINT_COMPUTE,
-                             layout, 0, 1, &descriptset, 0, nullptr);
+    VkDescriptorSet set = VK_NULL_HANDLE;
+    if (!pipeline.push_descriptor ())
+      {
+        auto allocated
+            = allocate_descriptor_set_ (pipeline.vkdescriptorsetlayout ());
+        if (!allocated.ok ())
+          {
+            return allocated.status ();
+          }
+        set = *allocated;
+      }
+
+    VKLLAMA_STATUS_OK (
+        pipeline.record_bindings (commandBuffer_, set, bindings, indices));
+
     if (dev_->support_pipeline_statistics ())
       {
         vkCmdResetQueryPool (commandBuffer_, pipeline.vkquerypool (), 0, 2);
@@ -373,83 +604,344 @@ public:
   }
 
   absl::Status
-  record_pipeline (Pipeline &pipeline, std::vector<Tensor> bindings,
+  record_pipeline (Pipeline &pipeline, absl::Span<const Tensor> bindings,
                    ShaderConstants const &constants)
   {
-    std::vector<uint32_t> indices;
-    std::generate_n (std::back_inserter (indices), bindings.size (),
-                     [i = 0u] () mutable { return i++; });
+    return record_pipeline (pipeline, bindings, {}, constants);
+  }
+
+  // The release half of a queue family ownership transfer: hands a tensor
+  // this command has accessed over to the family of the queue kind. The
+  // first command of that family using the tensor records the acquire
+  // half, or acquire () does ahead of time; it has to run after this one
+  // has finished, chained with submit ({ ... }, this) or after a wait ().
+  // Queues of one family need no transfer and nothing is recorded.
+  absl::Status
+  release (Tensor &t, const QueueKind to)
+  {
+    const auto family = dev_->queue_family (to);
+    if (family == family_)
+      {
+        return absl::OkStatus ();
+      }
 
-    return record_pipeline (pipeline, bindings, indices, constants);
+    const auto stage = t.pipeline_stage ();
+    VkBufferMemoryBarrier barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+                                      nullptr,
+                                      t.access_flags (),
+                                      0,
+                                      family_,
+                                      family,
+                                      t.data (),
+                                      t.barrier_offset (),
+                                      t.barrier_bytes () };
+
+    vkCmdPipelineBarrier (
+        commandBuffer_, stage ? stage : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &barrier, 0,
+        nullptr);
+
+    t.set_queue_family (family_, family);
+    t.set_access_flags (0);
+    t.set_pipeline_stage (0);
+    return absl::OkStatus ();
+  }
+
+  // Records the acquire half of the transfer of a tensor released to this
+  // command's family, for any later access; nothing when none is pending.
+  absl::Status
+  acquire (Tensor &t)
+  {
+    acquire_ (t, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT,
+              VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    return absl::OkStatus ();
   }
 
   absl::Status
   wait ()
   {
-    uint64_t timeout = 60ul * 1000000000ul; // 60s
-    auto ret = vkWaitForFences (dev_->device (), 1, &fence_, true, timeout);
-    if (ret != VK_SUCCESS)
+    return wait ({ this });
+  }
+
+  absl::Status
+  submit ()
+  {
+    return submit ({ this });
+  }
+
+  // Submits all commands with a single vkQueueSubmit when timeline
+  // semaphores are available. Commands run in the given order on one queue,
+  // so the barriers recorded in later commands cover the earlier ones.
+  // With after, the batch does not start before the latest submission of
+  // after has finished, so it may be queued while after is still running.
+  // after may be on another queue, a transfer feeding compute for one.
+  static absl::Status
+  submit (std::vector<Command *> const &commands, Command *after = nullptr)
+  {
+    if (commands.empty ())
       {
-        return absl::InternalError (
-            absl::StrFormat ("failed at waiting fence: %d", int (ret)));
+        return absl::OkStatus ();
       }
-    ret = vkResetFences (dev_->device (), 1, &fence_);
+
+    auto *queue = commands.front ()->queue_;
+    bool use_timeline = true;
+    for (auto *c : commands)
+      {
+        if (c->queue_ != queue)
+          {
+            return absl::InvalidArgumentError (
+                "Command::submit: all commands must share one queue.");
+          }
+        use_timeline = use_timeline && c->timeline_ != VK_NULL_HANDLE;
+      }
+
+    if (after && (!use_timeline || after->timeline_ == VK_NULL_HANDLE))
+      {
+        return absl::InvalidArgumentError (
+            "Command::submit: chaining requires timeline semaphores.");
+      }
+
+    if (!use_timeline)
+      {
+        for (auto *c : commands)
+          {
+            VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                                        nullptr,
+                                        0,
+                                        nullptr,
+                                        nullptr,
+                                        1,
+                                        &c->commandBuffer_,
+                                        0,
+                                        nullptr };
+
+            auto ret = vkQueueSubmit (queue, 1, &submitInfo, c->fence_);
+            if (ret != VK_SUCCESS)
+              {
+                return absl::InternalError (absl::StrFormat (
+                    "failed at submiting commands: %d\n", int (ret)));
+              }
+          }
+        return absl::OkStatus ();
+      }
+
+    std::vector<uint64_t> values (commands.size ());
+    std::vector<VkTimelineSemaphoreSubmitInfo> timelineInfos (
+        commands.size ());
+    std::vector<VkSubmitInfo> submitInfos (commands.size ());
+
+    const uint64_t after_value = after ? after->timeline_value_ : 0;
+    const VkPipelineStageFlags after_stage
+        = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+    for (size_t i = 0; i < commands.size (); ++i)
+      {
+        auto *c = commands[i];
+        const bool wait_after = i == 0 && after;
+        values[i] = c->timeline_value_ + 1;
+        timelineInfos[i]
+            = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+                nullptr,
+                wait_after ? 1u : 0u,
+                wait_after ? &after_value : nullptr,
+                1,
+                &values[i] };
+        submitInfos[i] = { VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                           &timelineInfos[i],
+                           wait_after ? 1u : 0u,
+                           wait_after ? &after->timeline_ : nullptr,
+                           wait_after ? &after_stage : nullptr,
+                           1,
+                           &c->commandBuffer_,
+                           1,
+                           &c->timeline_ };
+      }
+
+    auto ret = vkQueueSubmit (queue, (uint32_t)submitInfos.size (),
+                              submitInfos.data (), VK_NULL_HANDLE);
     if (ret != VK_SUCCESS)
       {
         return absl::InternalError (
-            absl::StrFormat ("failed at reseting fence: %d", int (ret)));
+            absl::StrFormat ("failed at submiting commands: %d\n", int (ret)));
       }
 
-    absl::Status defer_result = absl::OkStatus ();
+    for (size_t i = 0; i < commands.size (); ++i)
+      {
+        commands[i]->timeline_value_ = values[i];
+      }
+
+    return absl::OkStatus ();
+  }
+
+  // Blocks once for all commands, then runs their deferred tasks in order.
+  static absl::Status
+  wait (std::vector<Command *> const &commands)
+  {
+    if (commands.empty ())
+      {
+        return absl::OkStatus ();
+      }
+
+    uint64_t timeout = 60ul * 1000000000ul; // 60s
+    auto device = commands.front ()->dev_->device ();
+
+    std::vector<VkSemaphore> semaphores;
+    std::vector<uint64_t> values;
+    std::vector<VkFence> fences;
+    for (auto *c : commands)
+      {
+        if (c->timeline_ != VK_NULL_HANDLE)
+          {
+            semaphores.push_back (c->timeline_);
+            values.push_back (c->timeline_value_);
+          }
+        else
+          {
+            fences.push_back (c->fence_);
+          }
+      }
+
+    if (!semaphores.empty ())
+      {
+        VkSemaphoreWaitInfo waitInfo
+            = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+                nullptr,
+                0,
+                (uint32_t)semaphores.size (),
+                semaphores.data (),
+                values.data () };
+        auto ret = vkWaitSemaphores (device, &waitInfo, timeout);
+        if (ret != VK_SUCCESS)
+          {
+            return absl::InternalError (absl::StrFormat (
+                "failed at waiting timeline semaphore: %d", int (ret)));
+          }
+      }
 
-    for (auto &fn : defer_task_)
+    if (!fences.empty ())
       {
-        if (auto ret = fn (); !ret.ok ())
+        auto ret = vkWaitForFences (device, (uint32_t)fences.size (),
+                                    fences.data (), true, timeout);
+        if (ret != VK_SUCCESS)
+          {
+            return absl::InternalError (
+                absl::StrFormat ("failed at waiting fence: %d", int (ret)));
+          }
+        ret = vkResetFences (device, (uint32_t)fences.size (),
+                             fences.data ());
+        if (ret != VK_SUCCESS)
+          {
+            return absl::InternalError (
+                absl::StrFormat ("failed at reseting fence: %d", int (ret)));
+          }
+      }
+
+    absl::Status defer_result = absl::OkStatus ();
+    for (auto *c : commands)
+      {
+        if (auto ret = c->run_defer_tasks_ (); !ret.ok ())
           {
             defer_result = ret;
           }
       }
 
-    defer_task_.clear ();
     return defer_result;
   }
 
+  // value the latest submit signals on the timeline semaphore, 0 when
+  // timeline semaphores are unavailable.
+  uint64_t
+  timeline_value () const
+  {
+    return timeline_value_;
+  }
+
+  // Blocks until the timeline semaphore reaches value. Unlike wait (), the
+  // deferred tasks are left for the next wait ().
   absl::Status
-  submit ()
+  wait_timeline (const uint64_t value)
   {
-    VkSubmitInfo sumbitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                                nullptr,
-                                0,
-                                nullptr,
-                                nullptr,
-                                1,
-                                &commandBuffer_,
-                                0,
-                                nullptr };
-
-    auto ret = vkQueueSubmit (queue_, 1, &sumbitInfo, fence_);
-    if (ret != VK_SUCCESS)
+    if (timeline_ == VK_NULL_HANDLE)
       {
-        return absl::InternalError (
-            absl::StrFormat ("failed at submiting commands: %d\n", int (ret)));
+        return absl::FailedPreconditionError (
+            "Command::wait_timeline: timeline semaphore is unavailable.");
       }
 
+    uint64_t timeout = 60ul * 1000000000ul; // 60s
+    VkSemaphoreWaitInfo waitInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+                                     nullptr,
+                                     0,
+                                     1,
+                                     &timeline_,
+                                     &value };
+    auto ret = vkWaitSemaphores (dev_->device (), &waitInfo, timeout);
+    if (ret != VK_SUCCESS)
+      {
+        return absl::InternalError (absl::StrFormat (
+            "failed at waiting timeline semaphore: %d", int (ret)));
+      }
     return absl::OkStatus ();
   }
 
+  template <typename Fn>
   void
-  defer (std::function<absl::Status (void)> &&fn)
+  defer (Fn &&fn)
   {
-    defer_task_.push_back (std::move (fn));
+    defer_task_.push_back (std::forward<Fn> (fn));
   }
 
 private:
+  // Records the acquire of a tensor released to this command's family,
+  // making it visible to access at stage. The tensor is then left with no
+  // access to wait for.
+  void
+  acquire_ (Tensor const &t, const VkAccessFlags access,
+            const VkPipelineStageFlags stage)
+  {
+    if (t.pending_queue_family () != family_)
+      {
+        return;
+      }
+
+    VkBufferMemoryBarrier barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+                                      nullptr,
+                                      0,
+                                      access,
+                                      t.queue_family (),
+                                      family_,
+                                      t.data (),
+                                      t.barrier_offset (),
+                                      t.barrier_bytes () };
+
+    vkCmdPipelineBarrier (commandBuffer_, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                          stage, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+    t.set_queue_family (family_);
+    t.set_access_flags (0);
+    t.set_pipeline_stage (0);
+  }
+
+  absl::Status
+  run_defer_tasks_ ()
+  {
+    auto defer_result = defer_task_.run ();
+    if (!reusable_)
+      {
+        defer_task_.clear ();
+      }
+    return defer_result;
+  }
+
   absl::Status
   begin_ ()
   {
+    // a reusable command may be queued again, chained behind its previous
+    // submission, before that one has finished.
+    VkCommandBufferUsageFlags flags
+        = reusable_ ? VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT
+                    : VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     VkCommandBufferBeginInfo info
-        = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
-            VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr };
+        = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr, flags,
+            nullptr };
 
     auto ret = vkBeginCommandBuffer (commandBuffer_, &info);
     if (ret != VK_SUCCESS)
@@ -461,6 +953,175 @@ private:
     return absl::OkStatus ();
   }
 
+  // Makes the previous accesses of the bound tensors visible to a dispatch
+  // of pipeline with one barrier call. The reads and writes of each binding
+  // come from the shader's buffer qualifiers; a binding that is only read
+  // and was last accessed by compute shader reads needs no barrier.
+  absl::Status
+  record_dispatch_barrier_ (Pipeline &pipeline,
+                            absl::Span<const Tensor> bindings,
+                            absl::Span<const uint32_t> indices)
+  {
+    if (!indices.empty () && indices.size () != bindings.size ())
+      {
+        return absl::InvalidArgumentError (
+            "Command::record_pipeline: bindings and indices mismatch.");
+      }
+
+    if (bindings.size () > Pipeline::kMaxBindings)
+      {
+        return absl::InvalidArgumentError (absl::StrFormat (
+            "Command::record_pipeline: more than %zu bindings.",
+            Pipeline::kMaxBindings));
+      }
+
+    std::array<VkBufferMemoryBarrier, Pipeline::kMaxBindings> barriers;
+    size_t nbarriers = 0;
+    VkPipelineStageFlags src_stages = 0;
+    VkAccessFlags src_access = 0;
+    VkAccessFlags dst_access = 0;
+
+    for (size_t i = 0; i < bindings.size (); ++i)
+      {
+        auto &tensor = bindings[i];
+        bool bound = false;
+        VkAccessFlags access = 0;
+        for (size_t k = 0; k < bindings.size (); ++k)
+          {
+            if (bindings[k].data () != tensor.data ()
+                || bindings[k].barrier_offset ()
+                   != tensor.barrier_offset ())
+              continue;
+            bound = bound || k < i;
+            access |= pipeline.binding_access (indices.empty () ? k
+                                                                : indices[k]);
+          }
+
+        // tensors sharing access state get one barrier for all their roles
+        if (bound)
+          {
+            continue;
+          }
+
+        acquire_ (tensor, access, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+        const auto from = tensor.access_flags ();
+        const auto stage = tensor.pipeline_stage ();
+        const bool writes = access & VK_ACCESS_SHADER_WRITE_BIT;
+
+        tensor.set_access_flags (writes ? VK_ACCESS_SHADER_WRITE_BIT
+                                        : VK_ACCESS_SHADER_READ_BIT);
+        tensor.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+        if (from == 0 || stage == 0)
+          {
+            continue;
+          }
+
+        if (!writes && (from & ~VK_ACCESS_SHADER_READ_BIT) == 0
+            && stage == VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT)
+          {
+            continue;
+          }
+
+        src_stages |= stage;
+        src_access |= from;
+        dst_access |= access;
+        barriers[nbarriers++]
+            = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+                nullptr,
+                from,
+                access,
+                VK_QUEUE_FAMILY_IGNORED,
+                VK_QUEUE_FAMILY_IGNORED,
+                tensor.data (),
+                tensor.barrier_offset (),
+                tensor.barrier_bytes () };
+      }
+
+    if (nbarriers == 0)
+      {
+        return absl::OkStatus ();
+      }
+
+    if (global_barrier_)
+      {
+        VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr,
+                                    src_access, dst_access };
+        vkCmdPipelineBarrier (commandBuffer_, src_stages,
+                              VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                              &barrier, 0, nullptr, 0, nullptr);
+      }
+    else
+      {
+        vkCmdPipelineBarrier (commandBuffer_, src_stages,
+                              VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0,
+                              nullptr, (uint32_t)nbarriers, barriers.data (),
+                              0, nullptr);
+      }
+
+    ++dispatch_barrier_count_;
+    return absl::OkStatus ();
+  }
+
+  // Descriptor sets for devices without VK_KHR_push_descriptor. Every
+  // dispatch gets its own set from pools owned by this command, which are
+  // reset as a whole when it is recorded again.
+  absl::StatusOr<VkDescriptorSet>
+  allocate_descriptor_set_ (VkDescriptorSetLayout layout)
+  {
+    constexpr uint32_t kSetsPerPool = 256;
+    constexpr uint32_t kDescriptorsPerSet = 8;
+
+    while (true)
+      {
+        const bool fresh = descriptor_pool_ == descriptor_pools_.size ();
+        if (fresh)
+          {
+            VkDescriptorPoolSize size = { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                          kSetsPerPool * kDescriptorsPerSet };
+            VkDescriptorPoolCreateInfo createInfo
+                = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+                    nullptr,
+                    0,
+                    kSetsPerPool,
+                    1,
+                    &size };
+
+            VkDescriptorPool pool = VK_NULL_HANDLE;
+            auto ret = vkCreateDescriptorPool (dev_->device (), &createInfo,
+                                               nullptr, &pool);
+            if (ret != VK_SUCCESS)
+              {
+                return absl::InternalError (absl::StrFormat (
+                    "failed at creating descriptor pool: %d", int (ret)));
+              }
+            descriptor_pools_.push_back (pool);
+          }
+
+        VkDescriptorSetAllocateInfo allocInfo
+            = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr,
+                descriptor_pools_[descriptor_pool_], 1, &layout };
+
+        VkDescriptorSet set = VK_NULL_HANDLE;
+        auto ret
+            = vkAllocateDescriptorSets (dev_->device (), &allocInfo, &set);
+        if (ret == VK_SUCCESS)
+          {
+            return set;
+          }
+
+        if (fresh
+            || (ret != VK_ERROR_OUT_OF_POOL_MEMORY
+                && ret != VK_ERROR_FRAGMENTED_POOL))
+          {
+            return absl::InternalError (absl::StrFormat (
+                "failed at allocating descriptor set: %d", int (ret)));
+          }
+
+        ++descriptor_pool_;
+      }
+  }
+
   absl::Status
   end_ ()
   {
@@ -475,11 +1136,23 @@ private:
   }
 
   GPUDevice *dev_;
+  const QueueKind kind_;
+  uint32_t family_;
   VkQueue queue_;
   VkCommandBuffer commandBuffer_;
   VkFence fence_;
+  VkSemaphore timeline_;
+  // last value signaled on timeline_ by a submit
+  uint64_t timeline_value_;
   VkCommandPool commandPool_;
-  std::vector<std::function<absl::Status (void)> > defer_task_;
+  bool reusable_;
+  bool global_barrier_;
+  size_t dispatch_barrier_count_;
+  std::vector<VkDescriptorPool> descriptor_pools_;
+  // index of the pool sets are allocated from
+  size_t descriptor_pool_;
+  ActivationPlanner *activations_;
+  TaskArena defer_task_;
 };
 
 class CommandScope
@@ -0,0 +1,279 @@
+#include "device_probe.h"
+#include "absl/strings/str_format.h"
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace vkllama
+{
+static int
+type_rank (const VkPhysicalDeviceType type)
+{
+  switch (type)
+    {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+      return 4;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+      return 3;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+      return 2;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+      return 0;
+    default:
+      return 1;
+    }
+}
+
+static DeviceInfo
+describe (const int index, VkPhysicalDevice phy, const uint32_t version)
+{
+  DeviceInfo info = {};
+  info.index = index;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties (phy, &properties);
+  info.name = properties.deviceName;
+  info.type = properties.deviceType;
+  info.api_version = properties.apiVersion;
+
+  // the *2 queries are Vulkan 1.1 on both the instance and the device; a
+  // 1.0 device is described by the 1.0 queries, without the features the
+  // kernels need
+  const uint32_t api = std::min (version, properties.apiVersion);
+  const bool query2 = api >= VK_API_VERSION_1_1;
+
+  uint32_t n = 0;
+  vkEnumerateDeviceExtensionProperties (phy, nullptr, &n, nullptr);
+  std::vector<VkExtensionProperties> exts (n);
+  vkEnumerateDeviceExtensionProperties (phy, nullptr, &n, exts.data ());
+  std::set<std::string> supported_exts;
+  for (auto const &ext : exts)
+    {
+      supported_exts.insert (ext.extensionName);
+    }
+
+  if (query2)
+    {
+      // the 8-bit storage and float16 int8 structs are core in 1.2 and
+      // may only be chained below it when the device has the extensions
+      const bool has_8bit
+          = supported_exts.count (VK_KHR_8BIT_STORAGE_EXTENSION_NAME);
+      const bool fp16_int8
+          = supported_exts.count (VK_KHR_SHADER_FLOAT16_INT8_EXTENSION_NAME);
+      VkPhysicalDeviceShaderFloat16Int8Features feat_fp16_int8 = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_FLOAT16_INT8_FEATURES,
+        nullptr
+      };
+      VkPhysicalDevice16BitStorageFeatures feat_16bit
+          = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES,
+              nullptr };
+      VkPhysicalDevice8BitStorageFeatures feat_8bit
+          = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_8BIT_STORAGE_FEATURES,
+              nullptr };
+      VkPhysicalDeviceFeatures2 feats
+          = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, &feat_16bit };
+      if (api >= VK_API_VERSION_1_2 || fp16_int8)
+        {
+          feat_fp16_int8.pNext = feats.pNext;
+          feats.pNext = &feat_fp16_int8;
+        }
+      if (api >= VK_API_VERSION_1_2 || has_8bit)
+        {
+          feat_8bit.pNext = feats.pNext;
+          feats.pNext = &feat_8bit;
+        }
+      vkGetPhysicalDeviceFeatures2 (phy, &feats);
+
+      // the same checks as GPUDevice::init ()
+      info.storage_16bit
+          = supported_exts.count (VK_KHR_16BIT_STORAGE_EXTENSION_NAME)
+            && feat_16bit.storageBuffer16BitAccess
+            && feat_16bit.storagePushConstant16;
+      info.storage_8bit = has_8bit && feat_8bit.storageBuffer8BitAccess
+                          && feat_8bit.storagePushConstant8;
+      info.fp16_arithmetic = fp16_int8 && feat_fp16_int8.shaderFloat16;
+      info.int8_arithmetic = fp16_int8 && feat_fp16_int8.shaderInt8;
+
+      VkPhysicalDeviceSubgroupProperties subgroup
+          = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES,
+              nullptr };
+      VkPhysicalDeviceProperties2 properties2
+          = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, &subgroup };
+      vkGetPhysicalDeviceProperties2 (phy, &properties2);
+      info.subgroup_size = subgroup.subgroupSize;
+    }
+
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budget
+      = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT,
+          nullptr };
+  const bool has_budget
+      = query2 && supported_exts.count (VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+  VkPhysicalDeviceMemoryProperties2 memory2
+      = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2,
+          has_budget ? &budget : nullptr };
+  if (query2)
+    {
+      vkGetPhysicalDeviceMemoryProperties2 (phy, &memory2);
+    }
+  else
+    {
+      vkGetPhysicalDeviceMemoryProperties (phy, &memory2.memoryProperties);
+    }
+
+  info.memory_budget = has_budget;
+  const auto &memory = memory2.memoryProperties;
+  for (uint32_t h = 0; h < memory.memoryHeapCount; ++h)
+    {
+      const auto bytes = memory.memoryHeaps[h].size;
+      const bool device_local
+          = memory.memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+      const auto heap_budget = has_budget ? budget.heapBudget[h] : bytes;
+      const auto heap_usage = has_budget ? budget.heapUsage[h] : 0;
+      info.heaps.push_back ({ bytes, device_local, heap_budget, heap_usage });
+      if (device_local)
+        {
+          info.device_local_bytes += bytes;
+          info.device_local_available = std::max (
+              info.device_local_available,
+              heap_budget > heap_usage ? heap_budget - heap_usage : 0);
+        }
+    }
+
+  return info;
+}
+
+absl::StatusOr<std::vector<DeviceInfo> >
+enumerate_devices ()
+{
+  uint32_t version = 0;
+  auto ret = vkEnumerateInstanceVersion (&version);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::InternalError (absl::StrFormat (
+          "failed at enumerate vulkan instance: %d", int (ret)));
+    }
+
+  VkApplicationInfo appInfo
+      = { VK_STRUCTURE_TYPE_APPLICATION_INFO, nullptr, "vkllama.cpp", 1,
+          "vkllama.cpp", 1, version };
+  const char *exts[] = {
+#if __APPLE__
+    VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME,
+#endif
+  };
+  VkInstanceCreateInfo instanceCreateInfo
+      = { VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+          nullptr,
+#if __APPLE__
+          VK_KHR_portability_enumeration,
+#else
+          0,
+#endif
+          &appInfo,
+          0,
+          nullptr,
+          sizeof (exts) / sizeof (const char *),
+          exts };
+
+  VkInstance instance;
+  ret = vkCreateInstance (&instanceCreateInfo, nullptr, &instance);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::InternalError (
+          absl::StrFormat ("create vulkan instance failed: %d", int (ret)));
+    }
+
+  uint32_t ndev = 0;
+  std::vector<VkPhysicalDevice> vkdev;
+  ret = vkEnumeratePhysicalDevices (instance, &ndev, nullptr);
+  if (ret == VK_SUCCESS)
+    {
+      vkdev.resize (ndev);
+      ret = vkEnumeratePhysicalDevices (instance, &ndev, vkdev.data ());
+    }
+
+  if (ret != VK_SUCCESS)
+    {
+      vkDestroyInstance (instance, nullptr);
+      return absl::InternalError (absl::StrFormat (
+          "enumerate physical devices failed: %d", int (ret)));
+    }
+
+  std::vector<DeviceInfo> devices;
+  for (uint32_t i = 0; i < ndev; ++i)
+    {
+      devices.push_back (describe ((int)i, vkdev[i], version));
+    }
+
+  vkDestroyInstance (instance, nullptr);
+  return devices;
+}
+
+VkDeviceSize
+usable_bytes (DeviceInfo const &device)
+{
+  return device.memory_budget ? device.device_local_available
+                              : device.device_local_bytes;
+}
+
+absl::StatusOr<int>
+pick_device (std::vector<DeviceInfo> const &devices, const size_t model_bytes)
+{
+  std::vector<DeviceInfo const *> candidates;
+  for (auto const &device : devices)
+    {
+      if (device.storage_16bit && usable_bytes (device) >= model_bytes)
+        {
+          candidates.push_back (&device);
+        }
+    }
+
+  if (candidates.empty ())
+    {
+      return absl::ResourceExhaustedError (absl::StrFormat (
+          "pick_device: none of %zu devices has 16-bit storage and %zu bytes "
+          "of device local memory.",
+          devices.size (), model_bytes));
+    }
+
+  const bool measured
+      = std::all_of (candidates.cbegin (), candidates.cend (),
+                     [] (auto *d) { return d->gemv_bytes_per_second > 0; });
+
+  auto better = [measured] (DeviceInfo const *a, DeviceInfo const *b) {
+    if (measured && a->gemv_bytes_per_second != b->gemv_bytes_per_second)
+      {
+        return a->gemv_bytes_per_second > b->gemv_bytes_per_second;
+      }
+    if (type_rank (a->type) != type_rank (b->type))
+      {
+        return type_rank (a->type) > type_rank (b->type);
+      }
+    return usable_bytes (*a) > usable_bytes (*b);
+  };
+
+  return (*std::min_element (candidates.cbegin (), candidates.cend (),
+                             better))
+      ->index;
+}
+
+const char *
+device_type_name (const VkPhysicalDeviceType type)
+{
+  switch (type)
+    {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+      return "discrete";
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+      return "integrated";
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+      return "virtual";
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+      return "cpu";
+    default:
+      return "other";
+    }
+}
+}
@@ -0,0 +1,72 @@
+#ifndef __VKLLAMA_DEVICE_PROBE_H__
+#define __VKLLAMA_DEVICE_PROBE_H__
+
+#include "absl/status/statusor.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+namespace vkllama
+{
+// What a physical device offers, as far as running a model on it goes.
+// index is the one GPUDevice takes.
+struct DeviceInfo
+{
+  struct Heap
+  {
+    VkDeviceSize bytes;
+    bool device_local;
+    // with VK_EXT_memory_budget what the driver lets the process have and
+    // what all processes use; the heap size and 0 otherwise
+    VkDeviceSize budget;
+    VkDeviceSize usage;
+  };
+
+  int index;
+  std::string name;
+  VkPhysicalDeviceType type;
+  uint32_t api_version;
+  // the features GPUDevice enables when it finds them
+  bool storage_16bit;
+  bool storage_8bit;
+  bool fp16_arithmetic;
+  bool int8_arithmetic;
+  uint32_t subgroup_size;
+  std::vector<Heap> heaps;
+  // the sum of the device local heaps, where weights and kv caches go
+  VkDeviceSize device_local_bytes;
+  // whether the heaps came with VK_EXT_memory_budget
+  bool memory_budget;
+  // what the budget of the largest device local heap has left, as
+  // GPUDevice::device_local_available () has it
+  VkDeviceSize device_local_available;
+
+  // measured by benchmark_device (), 0 until then: weight bytes a matrix
+  // vector product streams per second, the bound of a decode step, and the
+  // fp16 flops of a matrix product, the bound of a prompt
+  double gemv_bytes_per_second;
+  double gemm_flops;
+};
+
+// Every physical device, from a Vulkan instance of its own; no device is
+// created.
+absl::StatusOr<std::vector<DeviceInfo> > enumerate_devices ();
+
+// Device local memory a model can still have on the device: what the
+// budget has left when the driver reports one, the heaps otherwise.
+VkDeviceSize usable_bytes (DeviceInfo const &device);
+
+// The index of the device to run a model of model_bytes on. Devices
+// without 16-bit storage, which the kernels need, or with less than
+// model_bytes of usable_bytes () are passed over. Among the rest, measured
+// decode throughput decides when all of them were benchmarked; otherwise
+// discrete GPUs come before integrated ones, those before virtual and CPU
+// devices, and more usable memory before less.
+absl::StatusOr<int> pick_device (std::vector<DeviceInfo> const &devices,
+                                 const size_t model_bytes);
+
+const char *device_type_name (const VkPhysicalDeviceType type);
+}
+
+#endif
@@ -1,23 +1,39 @@
 #include "gpu_device.h"
 #include "absl/strings/str_format.h"
+#include "pipeline.h"
+#include "staging_pool.h"
 #include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iterator>
 #include <memory>
 #include <set>
 #include <string>
 #include <vector>
+#include <unistd.h>
 #include <vulkan/vulkan_core.h>
 
 namespace vkllama
 {
 GPUDevice::GPUDevice (int dev)
     : physicalDev_ (VK_NULL_HANDLE), device_ (VK_NULL_HANDLE), dev_ (dev),
-      version_ (0), support_descriptor_templ_update_ (false),
+      pipeline_cache_ (VK_NULL_HANDLE), pipeline_cache_loaded_bytes_ (0),
+      pipeline_cache_saved_bytes_ (0), version_ (0),
+      support_descriptor_templ_update_ (false),
       support_16bit_storage_ (false), support_8bit_storage_ (false),
       support_shader_fp16_arithmetic_ (false),
-      support_shader_int8_arithmetic_ (false)
+      support_shader_int8_arithmetic_ (false),
+      support_timeline_semaphore_ (false), support_push_descriptor_ (false),
+      unified_memory_ (false), support_external_memory_host_ (false),
+      support_memory_budget_ (false), host_pointer_alignment_ (0),
+      host_pointer_properties_ (nullptr), push_descriptor_set_ (nullptr),
+      push_descriptor_set_with_template_ (nullptr)
 {
+  queue_families_.fill (0);
+  queue_indices_.fill (0);
 }
 
 absl::Status
@@ -31,8 +47,11 @@ GPUDevice::init ()
   if (!ret.ok ())
     return ret;
 
+  const VmaAllocatorCreateFlags flags
+      = support_memory_budget_ ? VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT
+                               : 0;
   VmaAllocatorCreateInfo createInfo
-      = { 0,       physicalDev_, device_,   0,        nullptr, nullptr,
+      = { flags,   physicalDev_, device_,   0,        nullptr, nullptr,
           nullptr, nullptr,      instance_, version_, nullptr };
   auto vkret = vmaCreateAllocator (&createInfo, &allocator_);
   if (vkret != VK_SUCCESS)
@@ -40,11 +59,35 @@ GPUDevice::init ()
       return absl::InternalError (
           absl::StrFormat ("failed at vmaCreateAllocator: %d", int (vkret)));
     }
-  return absl::OkStatus ();
+
+  staging_.reset (new StagingPool (this));
+  pools_[WEIGHT_MEMORY].reset (
+      new MemoryPool (this, WEIGHT_MEMORY, 256ul << 20));
+  pools_[KVCACHE_MEMORY].reset (
+      new MemoryPool (this, KVCACHE_MEMORY, 256ul << 20));
+  pools_[ACTIVATION_MEMORY].reset (
+      new MemoryPool (this, ACTIVATION_MEMORY, 64ul << 20));
+  pipelines_.reset (new PipelineRegistry ());
+  return create_pipeline_cache_ ();
 }
 
 GPUDevice::~GPUDevice ()
 {
+  pipelines_.reset ();
+  if (pipeline_cache_ != VK_NULL_HANDLE)
+    {
+      auto ret = save_pipeline_cache ();
+      if (!ret.ok ())
+        {
+          fprintf (stderr, "%s\n", ret.ToString ().c_str ());
+        }
+      vkDestroyPipelineCache (device_, pipeline_cache_, nullptr);
+    }
+  for (auto &pool : pools_)
+    {
+      pool.reset ();
+    }
+  staging_.reset ();
   vmaDestroyAllocator (allocator_);
   vkDestroyDevice (device_, nullptr);
   vkDestroyInstance (instance_, nullptr);
@@ -182,10 +225,10 @@ GPUDevice::init_device_ ()
           "enumerate physical devices failed: %d", int (ret)));
     }
 
-  if (vkdev.size () < (size_t)dev_)
+  if (dev_ < 0 || (size_t)dev_ >= vkdev.size ())
     {
-      return absl::InternalError (
-          absl::StrFormat ("target device %d not found.", dev_));
+      return absl::NotFoundError (absl::StrFormat (
+          "target device %d not found, %zu devices.", dev_, vkdev.size ()));
     }
 
   physicalDev_ = vkdev[dev_];
@@ -216,6 +259,60 @@ GPUDevice::init_device_ ()
     vkGetPhysicalDeviceProperties (physicalDev_, &physicalDevProperties_);
   }
 
+  {
+    const auto &families = physicalDevQueueProperties_;
+    const auto compute
+        = require_queue (VK_QUEUE_TRANSFER_BIT | VK_QUEUE_COMPUTE_BIT);
+    queue_families_[COMPUTE_QUEUE] = compute;
+    queue_indices_[COMPUTE_QUEUE] = 0;
+    queue_families_[TRANSFER_QUEUE] = compute;
+    const bool second
+        = !families.empty () && families[compute].queueCount > 1;
+    queue_indices_[TRANSFER_QUEUE] = second ? 1 : 0;
+
+    for (size_t i = 0; i < families.size (); ++i)
+      {
+        const auto flags = families[i].queueFlags;
+        if ((flags & VK_QUEUE_TRANSFER_BIT)
+            && !(flags & (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_GRAPHICS_BIT)))
+          {
+            queue_families_[TRANSFER_QUEUE] = i;
+            queue_indices_[TRANSFER_QUEUE] = 0;
+            break;
+          }
+      }
+  }
+
+  {
+    // a discrete GPU may map some or all of its memory through the BAR, but
+    // host access to it is slow and sharing it with host memory types
+    // could place tensors in system memory, so only integrated and CPU
+    // devices whose every device local heap is mappable count as unified.
+    const auto type = physicalDevProperties_.deviceType;
+    unified_memory_ = type == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU
+                      || type == VK_PHYSICAL_DEVICE_TYPE_CPU;
+
+    const auto &mem = physicalDevMemProperties_;
+    for (uint32_t h = 0; unified_memory_ && h < mem.memoryHeapCount; ++h)
+      {
+        if (!(mem.memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT))
+          {
+            continue;
+          }
+
+        bool mappable = false;
+        for (uint32_t t = 0; t < mem.memoryTypeCount; ++t)
+          {
+            const auto flags = mem.memoryTypes[t].propertyFlags;
+            mappable = mappable
+                       || (mem.memoryTypes[t].heapIndex == h
+                           && (flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+                           && (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT));
+          }
+        unified_memory_ = mappable;
+      }
+  }
+
   {
     subgroupProperties_.sType
         = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
@@ -269,6 +366,12 @@ GPUDevice::init_device_ ()
         support_descriptor_templ_update_ = true;
       }
 
+    if (supported_exts.count (VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME) > 0)
+      {
+        devExts.push_back (VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+        support_push_descriptor_ = true;
+      }
+
     if (supported_exts.count (VK_KHR_16BIT_STORAGE_EXTENSION_NAME) > 0)
       {
         devExts.push_back (VK_KHR_16BIT_STORAGE_EXTENSION_NAME);
@@ -287,12 +390,50 @@ GPUDevice::init_device_ ()
         support_shader_fp16_arithmetic_ = true;
         support_shader_int8_arithmetic_ = true;
       }
+
+    if (supported_exts.count (VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME) > 0)
+      {
+        VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProperties
+            = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT,
+                nullptr, 0 };
+        VkPhysicalDeviceProperties2 properties
+            = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+                &hostProperties,
+                {} };
+        vkGetPhysicalDeviceProperties2 (physicalDev_, &properties);
+
+        devExts.push_back (VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+        host_pointer_alignment_
+            = hostProperties.minImportedHostPointerAlignment;
+        support_external_memory_host_ = host_pointer_alignment_ > 0;
+      }
+
+    // VMA queries the budget through vkGetPhysicalDeviceMemoryProperties2,
+    // core since 1.1
+    if (supported_exts.count (VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) > 0
+        && version_ >= VK_API_VERSION_1_1
+        && physicalDevProperties_.apiVersion >= VK_API_VERSION_1_1)
+      {
+        devExts.push_back (VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+        support_memory_budget_ = true;
+      }
   }
 
+  // timeline semaphores are used through the core 1.2 entry points
+  support_timeline_semaphore_
+      = version_ >= VK_API_VERSION_1_2
+        && physicalDevProperties_.apiVersion >= VK_API_VERSION_1_2;
+
+  static VkPhysicalDeviceTimelineSemaphoreFeatures feat_timeline_semaphore
+      = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+          nullptr };
+
   static VkPhysicalDeviceShaderFloat16Int8Features feat_fp16_int8
       = { .sType
           = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_FLOAT16_INT8_FEATURES,
           .pNext = nullptr };
+  feat_fp16_int8.pNext
+      = support_timeline_semaphore_ ? &feat_timeline_semaphore : nullptr;
 
   static VkPhysicalDevice16BitStorageFeatures feat_16bit
       = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES,
@@ -328,6 +469,12 @@ GPUDevice::init_device_ ()
       {
         support_shader_int8_arithmetic_ = feat_fp16_int8.shaderInt8;
       }
+
+    if (support_timeline_semaphore_)
+      {
+        support_timeline_semaphore_
+            = feat_timeline_semaphore.timelineSemaphore;
+      }
   }
 
   VkDeviceCreateInfo devCreateInfo = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
@@ -348,9 +495,52 @@ GPUDevice::init_device_ ()
           absl::StrFormat ("create device failed: %d", int (ret)));
     }
 
+  // extension entry points are not exported by the loader
+  if (support_push_descriptor_)
+    {
+      push_descriptor_set_ = reinterpret_cast<PFN_vkCmdPushDescriptorSetKHR> (
+          vkGetDeviceProcAddr (device_, "vkCmdPushDescriptorSetKHR"));
+      push_descriptor_set_with_template_
+          = reinterpret_cast<PFN_vkCmdPushDescriptorSetWithTemplateKHR> (
+              vkGetDeviceProcAddr (device_,
+                                   "vkCmdPushDescriptorSetWithTemplateKHR"));
+      support_push_descriptor_
+          = push_descriptor_set_
+            && (!support_descriptor_templ_update_
+                || push_descriptor_set_with_template_);
+    }
+
+  if (support_external_memory_host_)
+    {
+      host_pointer_properties_
+          = reinterpret_cast<PFN_vkGetMemoryHostPointerPropertiesEXT> (
+              vkGetDeviceProcAddr (device_,
+                                   "vkGetMemoryHostPointerPropertiesEXT"));
+      support_external_memory_host_ = host_pointer_properties_ != nullptr;
+    }
+
   return absl::OkStatus ();
 }
 
+uint32_t
+GPUDevice::queue_family (const QueueKind kind) const
+{
+  return queue_families_[kind];
+}
+
+uint32_t
+GPUDevice::queue_index (const QueueKind kind) const
+{
+  return queue_indices_[kind];
+}
+
+bool
+GPUDevice::separate_transfer_queue () const
+{
+  return queue_families_[TRANSFER_QUEUE] != queue_families_[COMPUTE_QUEUE]
+         || queue_indices_[TRANSFER_QUEUE] != queue_indices_[COMPUTE_QUEUE];
+}
+
 uint32_t
 GPUDevice::require_queue (VkQueueFlags flags) const
 {
@@ -403,6 +593,12 @@ GPUDevice::support_pipeline_statistics () const
   return physicalFeats_.pipelineStatisticsQuery;
 }
 
+bool
+GPUDevice::support_timeline_semaphore () const
+{
+  return support_timeline_semaphore_;
+}
+
 VkPhysicalDeviceLimits const &
 GPUDevice::limits () const
 {
@@ -420,5 +616,330 @@ GPUDevice::subgroup_size () const
 {
   return subgroupProperties_.subgroupSize;
 }
+
+namespace
+{
+// header of the cache file in front of the driver's cache data, so that a
+// truncated or foreign file is never handed to the driver.
+struct PipelineCacheFileHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t bytes;
+  uint64_t hash;
+};
+
+constexpr uint32_t kPipelineCacheMagic = 0x504b4c56; // "VLKP"
+constexpr uint32_t kPipelineCacheVersion = 1;
+
+uint64_t
+fnv1a (const uint8_t *data, const size_t n)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < n; ++i)
+    {
+      h = (h ^ data[i]) * 0x100000001b3ull;
+    }
+  return h;
+}
+
+std::string
+pipeline_cache_dir ()
+{
+  if (const char *dir = ::getenv ("VKLLAMA_PIPELINE_CACHE_DIR"))
+    {
+      return dir;
+    }
+
+  if (const char *dir = ::getenv ("XDG_CACHE_HOME"); dir && *dir)
+    {
+      return std::string (dir) + "/vkllama";
+    }
+
+  if (const char *dir = ::getenv ("HOME"); dir && *dir)
+    {
+      return std::string (dir) + "/.cache/vkllama";
+    }
+
+  return "";
+}
+}
+
+absl::Status
+GPUDevice::create_pipeline_cache_ ()
+{
+  std::vector<uint8_t> data;
+
+  // an empty directory turns the disk cache off
+  const auto dir = pipeline_cache_dir ();
+  if (!dir.empty ())
+    {
+      std::string uuid;
+      for (auto b : physicalDevProperties_.pipelineCacheUUID)
+        {
+          uuid += absl::StrFormat ("%02x", int (b));
+        }
+
+      pipeline_cache_path_ = absl::StrFormat (
+          "%s/pipeline_%s_%08x.bin", dir, uuid,
+          physicalDevProperties_.driverVersion);
+
+      std::ifstream in (pipeline_cache_path_, std::ios::binary);
+      PipelineCacheFileHeader header = { 0, 0, 0, 0 };
+      if (in.read (reinterpret_cast<char *> (&header), sizeof (header))
+          && header.magic == kPipelineCacheMagic
+          && header.version == kPipelineCacheVersion
+          && header.bytes < (1ull << 30))
+        {
+          data.resize (header.bytes);
+          if (!in.read (reinterpret_cast<char *> (data.data ()), data.size ())
+              || fnv1a (data.data (), data.size ()) != header.hash)
+            {
+              data.clear ();
+            }
+        }
+    }
+
+  VkPipelineCacheCreateInfo createInfo
+      = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO, nullptr, 0,
+          data.size (), data.data () };
+  auto ret = vkCreatePipelineCache (device_, &createInfo, nullptr,
+                                    &pipeline_cache_);
+  if (ret != VK_SUCCESS && !data.empty ())
+    {
+      // the driver refused the stored data, start over with an empty cache
+      data.clear ();
+      createInfo.initialDataSize = 0;
+      createInfo.pInitialData = nullptr;
+      ret = vkCreatePipelineCache (device_, &createInfo, nullptr,
+                                   &pipeline_cache_);
+    }
+
+  if (ret != VK_SUCCESS)
+    {
+      return absl::InternalError (absl::StrFormat (
+          "failed at creating pipeline cache: %d", int (ret)));
+    }
+
+  pipeline_cache_loaded_bytes_ = data.size ();
+  pipeline_cache_saved_bytes_ = data.size ();
+  return absl::OkStatus ();
+}
+
+absl::Status
+GPUDevice::save_pipeline_cache ()
+{
+  if (pipeline_cache_ == VK_NULL_HANDLE || pipeline_cache_path_.empty ())
+    {
+      return absl::OkStatus ();
+    }
+
+  size_t n = 0;
+  auto ret = vkGetPipelineCacheData (device_, pipeline_cache_, &n, nullptr);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::InternalError (absl::StrFormat (
+          "failed at getting pipeline cache size: %d", int (ret)));
+    }
+
+  // nothing was compiled since the cache was loaded or saved
+  if (n == pipeline_cache_saved_bytes_)
+    {
+      return absl::OkStatus ();
+    }
+
+  std::vector<uint8_t> data (n);
+  ret = vkGetPipelineCacheData (device_, pipeline_cache_, &n, data.data ());
+  if (ret != VK_SUCCESS && ret != VK_INCOMPLETE)
+    {
+      return absl::InternalError (absl::StrFormat (
+          "failed at getting pipeline cache data: %d", int (ret)));
+    }
+  data.resize (n);
+
+  std::error_code ec;
+  const std::filesystem::path path (pipeline_cache_path_);
+  std::filesystem::create_directories (path.parent_path (), ec);
+  if (ec)
+    {
+      return absl::InternalError (absl::StrFormat (
+          "failed at creating pipeline cache directory %s: %s",
+          path.parent_path ().string (), ec.message ()));
+    }
+
+  // write a temporary file and rename it, so that concurrent processes
+  // never see a partially written cache
+  const auto tmp
+      = absl::StrFormat ("%s.%d.tmp", pipeline_cache_path_, int (::getpid ()));
+  {
+    std::ofstream out (tmp, std::ios::binary | std::ios::trunc);
+    PipelineCacheFileHeader header
+        = { kPipelineCacheMagic, kPipelineCacheVersion, data.size (),
+            fnv1a (data.data (), data.size ()) };
+    out.write (reinterpret_cast<const char *> (&header), sizeof (header));
+    out.write (reinterpret_cast<const char *> (data.data ()), data.size ());
+    if (!out.flush ())
+      {
+        out.close ();
+        std::filesystem::remove (tmp, ec);
+        return absl::InternalError (
+            absl::StrFormat ("failed at writing pipeline cache %s", tmp));
+      }
+  }
+
+  std::filesystem::rename (tmp, path, ec);
+  if (ec)
+    {
+      const auto msg = ec.message ();
+      std::filesystem::remove (tmp, ec);
+      return absl::InternalError (
+          absl::StrFormat ("failed at saving pipeline cache %s: %s",
+                           pipeline_cache_path_, msg));
+    }
+
+  pipeline_cache_saved_bytes_ = data.size ();
+  return absl::OkStatus ();
+}
+
+VkPipelineCache &
+GPUDevice::pipeline_cache ()
+{
+  return pipeline_cache_;
+}
+
+size_t
+GPUDevice::pipeline_cache_loaded_bytes () const
+{
+  return pipeline_cache_loaded_bytes_;
+}
+
+bool
+GPUDevice::support_push_descriptor () const
+{
+  return support_push_descriptor_;
+}
+
+bool
+GPUDevice::unified_memory () const
+{
+  return unified_memory_;
+}
+
+bool
+GPUDevice::support_external_memory_host () const
+{
+  return support_external_memory_host_;
+}
+
+VkDeviceSize
+GPUDevice::host_pointer_alignment () const
+{
+  return host_pointer_alignment_;
+}
+
+VkResult
+GPUDevice::host_pointer_properties (const void *host,
+                                    VkMemoryHostPointerPropertiesEXT *props)
+{
+  return host_pointer_properties_ (
+      device_, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, host,
+      props);
+}
+
+void
+GPUDevice::cmd_push_descriptor_set (VkCommandBuffer cmd,
+                                    VkPipelineLayout layout,
+                                    const uint32_t n,
+                                    const VkWriteDescriptorSet *writes)
+{
+  push_descriptor_set_ (cmd, VK_PIPELINE_BIND_POINT_COMPUTE, layout, 0, n,
+                        writes);
+}
+
+void
+GPUDevice::cmd_push_descriptor_set_with_template (
+    VkCommandBuffer cmd, VkDescriptorUpdateTemplate templ,
+    VkPipelineLayout layout, const void *data)
+{
+  push_descriptor_set_with_template_ (cmd, templ, layout, 0, data);
+}
+
+bool
+GPUDevice::support_memory_budget () const
+{
+  return support_memory_budget_;
+}
+
+std::vector<HeapBudget>
+GPUDevice::heap_budgets ()
+{
+  VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+  vmaGetHeapBudgets (allocator_, budgets);
+
+  std::vector<HeapBudget> heaps;
+  const auto &mem = physicalDevMemProperties_;
+  for (uint32_t h = 0; h < mem.memoryHeapCount; ++h)
+    {
+      heaps.push_back (
+          { mem.memoryHeaps[h].size, budgets[h].budget, budgets[h].usage,
+            (mem.memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+                != 0 });
+    }
+  return heaps;
+}
+
+VkDeviceSize
+GPUDevice::device_local_available ()
+{
+  // a device without device local heaps, if there is one, allocates from
+  // whatever heap it has
+  const auto heaps = heap_budgets ();
+  const bool any_device_local
+      = std::any_of (heaps.cbegin (), heaps.cend (),
+                     [] (HeapBudget const &h) { return h.device_local; });
+
+  VkDeviceSize available = 0;
+  for (auto const &heap : heaps)
+    {
+      if (heap.device_local || !any_device_local)
+        {
+          available = std::max (available, heap.budget > heap.usage
+                                               ? heap.budget - heap.usage
+                                               : VkDeviceSize (0));
+        }
+    }
+  return available;
+}
+
+MemoryUsage
+GPUDevice::memory_usage ()
+{
+  MemoryUsage usage = {};
+  for (int k = 0; k < MEMORY_KIND_COUNT; ++k)
+    {
+      usage.pool_bytes[k] = pools_[k]->stats ().allocated_bytes;
+    }
+  usage.staging_bytes = staging_->stats ().allocated_bytes;
+  usage.heaps = heap_budgets ();
+  return usage;
+}
+
+StagingPool &
+GPUDevice::staging ()
+{
+  return *staging_;
+}
+
+MemoryPool &
+GPUDevice::memory_pool (const MemoryKind kind)
+{
+  return *pools_[kind];
+}
+
+PipelineRegistry &
+GPUDevice::pipelines ()
+{
+  return *pipelines_;
+}
 }
 
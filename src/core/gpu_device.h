@@ -1,8 +1,11 @@
 #ifndef __VKLLAMA_CPP_GPU_DEVICE_H__
 #define __VKLLAMA_CPP_GPU_DEVICE_H__
 #include "absl/status/status.h"
+#include "memory_pool.h"
 #include "vk_mem_alloc.h"
+#include <array>
 #include <memory>
+#include <string>
 #include <vector>
 #include <vulkan/vulkan.h>
 
@@ -10,6 +13,41 @@
 
 namespace vkllama
 {
+class StagingPool;
+class PipelineRegistry;
+
+// The queues Command records for. Compute takes the first family with
+// compute and transfer; transfer prefers a family with neither compute nor
+// graphics, the copy engine of discrete GPUs, then a second queue of the
+// compute family, and shares the compute queue when there is neither.
+typedef enum : int
+{
+  COMPUTE_QUEUE = 0,
+  TRANSFER_QUEUE,
+  QUEUE_KIND_COUNT
+} QueueKind;
+
+// A memory heap as VMA accounts for it. With VK_EXT_memory_budget budget
+// and usage are what the driver reports for the process, other processes
+// included; otherwise VMA estimates the budget from the heap size and
+// counts only its own allocations.
+struct HeapBudget
+{
+  VkDeviceSize size;
+  VkDeviceSize budget;
+  VkDeviceSize usage;
+  bool device_local;
+};
+
+// Device memory held by the pools of each kind of tensor and by staging,
+// with the heaps it comes out of.
+struct MemoryUsage
+{
+  std::array<size_t, MEMORY_KIND_COUNT> pool_bytes;
+  size_t staging_bytes;
+  std::vector<HeapBudget> heaps;
+};
+
 class GPUDevice
 {
 public:
@@ -22,6 +60,10 @@ public:
   uint32_t find_mem (uint32_t typeBits,
                      VkMemoryPropertyFlags properties) const;
   uint32_t require_queue (VkQueueFlags flags) const;
+  uint32_t queue_family (const QueueKind kind) const;
+  uint32_t queue_index (const QueueKind kind) const;
+  // transfers run on a queue of their own, so they may overlap compute
+  bool separate_transfer_queue () const;
   const VkPhysicalDeviceLimits &limits () const;
   const float timestamp_period () const;
   absl::Status init ();
@@ -31,14 +73,58 @@ public:
   bool support_fp16_arithmetic () const;
   bool support_int8_arithmetic () const;
   bool support_pipeline_statistics () const;
+  bool support_timeline_semaphore () const;
+  bool support_push_descriptor () const;
+  // Device local memory is host visible, as on integrated GPUs and CPU
+  // implementations. Weights and kv caches are then created mapped and
+  // uploaded with a memcpy instead of going through staging.
+  bool unified_memory () const;
+  // VK_EXT_external_memory_host, with which host allocations aligned to
+  // host_pointer_alignment () are imported as device memory
+  bool support_external_memory_host () const;
+  VkDeviceSize host_pointer_alignment () const;
+  VkResult host_pointer_properties (const void *host,
+                                    VkMemoryHostPointerPropertiesEXT *props);
+  // VK_EXT_memory_budget, which VMA then tracks budgets with
+  bool support_memory_budget () const;
+  std::vector<HeapBudget> heap_budgets ();
+  // The most a single allocation of device local memory can take without
+  // going over the budget of its heap. Memory pools refuse new chunks
+  // beyond it.
+  VkDeviceSize device_local_available ();
+  MemoryUsage memory_usage ();
+
+  // VK_KHR_push_descriptor entry points, set 0 of a compute pipeline
+  void cmd_push_descriptor_set (VkCommandBuffer cmd, VkPipelineLayout layout,
+                                const uint32_t n,
+                                const VkWriteDescriptorSet *writes);
+  void cmd_push_descriptor_set_with_template (
+      VkCommandBuffer cmd, VkDescriptorUpdateTemplate templ,
+      VkPipelineLayout layout, const void *data);
 
   size_t subgroup_size () const;
+  StagingPool &staging ();
+  // the pool tensors of a kind are sub-allocated from
+  MemoryPool &memory_pool (const MemoryKind kind);
+  PipelineRegistry &pipelines ();
+
+  // Pipelines are created through this cache. It is loaded from and saved
+  // to a file under $VKLLAMA_PIPELINE_CACHE_DIR, falling back to
+  // $XDG_CACHE_HOME/vkllama and ~/.cache/vkllama; the file is named after
+  // the pipeline cache UUID and driver version of the device.
+  VkPipelineCache &pipeline_cache ();
+  // bytes of cache data loaded from disk by init ()
+  size_t pipeline_cache_loaded_bytes () const;
+  // writes the cache back when pipelines were added to it, which also
+  // happens on destruction
+  absl::Status save_pipeline_cache ();
 
   ~GPUDevice ();
 
 private:
   absl::Status create_instance_ ();
   absl::Status init_device_ ();
+  absl::Status create_pipeline_cache_ ();
   VkInstance instance_;
   VkPhysicalDevice physicalDev_;
   VkDevice device_;
@@ -50,15 +136,33 @@ private:
   VkPhysicalDeviceProperties physicalDevProperties_;
   VkPhysicalDeviceProperties2 physicalDevProperties2_;
   VkPhysicalDeviceSubgroupProperties subgroupProperties_;
+  std::array<uint32_t, QUEUE_KIND_COUNT> queue_families_;
+  std::array<uint32_t, QUEUE_KIND_COUNT> queue_indices_;
 
   const int dev_;
   VmaAllocator allocator_;
+  std::unique_ptr<StagingPool> staging_;
+  std::array<std::unique_ptr<MemoryPool>, MEMORY_KIND_COUNT> pools_;
+  std::unique_ptr<PipelineRegistry> pipelines_;
+  VkPipelineCache pipeline_cache_;
+  std::string pipeline_cache_path_;
+  size_t pipeline_cache_loaded_bytes_;
+  size_t pipeline_cache_saved_bytes_;
   uint32_t version_;
   bool support_descriptor_templ_update_;
   bool support_16bit_storage_;
   bool support_8bit_storage_;
   bool support_shader_fp16_arithmetic_;
   bool support_shader_int8_arithmetic_;
+  bool support_timeline_semaphore_;
+  bool support_push_descriptor_;
+  bool unified_memory_;
+  bool support_external_memory_host_;
+  bool support_memory_budget_;
+  VkDeviceSize host_pointer_alignment_;
+  PFN_vkGetMemoryHostPointerPropertiesEXT host_pointer_properties_;
+  PFN_vkCmdPushDescriptorSetKHR push_descriptor_set_;
+  PFN_vkCmdPushDescriptorSetWithTemplateKHR push_descriptor_set_with_template_;
 };
 }
 
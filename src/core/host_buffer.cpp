@@ -0,0 +1,136 @@
+#include "host_buffer.h"
+#include "absl/strings/str_format.h"
+#include "gpu_device.h"
+#include <cstdint>
+#include <memory>
+#include <vulkan/vulkan_core.h>
+
+namespace vkllama
+{
+HostBuffer::HostBuffer (GPUDevice *dev)
+    : dev_ (dev), buffer_ (VK_NULL_HANDLE), memory_ (VK_NULL_HANDLE),
+      offset_ (0), bytes_ (0)
+{
+}
+
+HostBuffer::~HostBuffer ()
+{
+  if (buffer_ != VK_NULL_HANDLE)
+    {
+      vkDestroyBuffer (dev_->device (), buffer_, nullptr);
+    }
+  if (memory_ != VK_NULL_HANDLE)
+    {
+      vkFreeMemory (dev_->device (), memory_, nullptr);
+    }
+}
+
+absl::StatusOr<std::shared_ptr<HostBuffer> >
+HostBuffer::import (GPUDevice *dev, const void *data, const size_t bytes)
+{
+  if (!dev->support_external_memory_host ())
+    {
+      return absl::UnimplementedError (
+          "HostBuffer: VK_EXT_external_memory_host is unsupported.");
+    }
+
+  if (bytes == 0)
+    {
+      return absl::InvalidArgumentError (
+          "HostBuffer: cannot import an empty range.");
+    }
+
+  const auto align = dev->host_pointer_alignment ();
+  const auto start = reinterpret_cast<uintptr_t> (data);
+  const uintptr_t base = start / align * align;
+  const VkDeviceSize size = (start + bytes - base + align - 1) / align * align;
+
+  std::shared_ptr<HostBuffer> host (new HostBuffer (dev));
+  host->offset_ = start - base;
+  host->bytes_ = bytes;
+
+  VkMemoryHostPointerPropertiesEXT pointerProperties
+      = { VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT, nullptr, 0 };
+  auto ret = dev->host_pointer_properties (reinterpret_cast<void *> (base),
+                                           &pointerProperties);
+  if (ret != VK_SUCCESS || pointerProperties.memoryTypeBits == 0)
+    {
+      return absl::UnavailableError (absl::StrFormat (
+          "HostBuffer: host pointer cannot be imported: %d", int (ret)));
+    }
+
+  VkExternalMemoryBufferCreateInfo externalInfo
+      = { VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO, nullptr,
+          VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT };
+  VkBufferCreateInfo createInfo
+      = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+          &externalInfo,
+          0,
+          size,
+          VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+          VK_SHARING_MODE_EXCLUSIVE,
+          0,
+          nullptr };
+
+  ret = vkCreateBuffer (dev->device (), &createInfo, nullptr, &host->buffer_);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::InternalError (absl::StrFormat (
+          "HostBuffer: failed at creating buffer: %d", int (ret)));
+    }
+
+  VkMemoryRequirements requirements;
+  vkGetBufferMemoryRequirements (dev->device (), host->buffer_,
+                                 &requirements);
+  const uint32_t types
+      = requirements.memoryTypeBits & pointerProperties.memoryTypeBits;
+  if (types == 0 || requirements.size > size)
+    {
+      return absl::UnavailableError (
+          "HostBuffer: no memory type can hold the imported range.");
+    }
+
+  VkImportMemoryHostPointerInfoEXT importInfo
+      = { VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT, nullptr,
+          VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+          reinterpret_cast<void *> (base) };
+  VkMemoryAllocateInfo allocInfo
+      = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, &importInfo, size,
+          dev->find_mem (types, 0) };
+
+  ret = vkAllocateMemory (dev->device (), &allocInfo, nullptr,
+                          &host->memory_);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::UnavailableError (absl::StrFormat (
+          "HostBuffer: failed at importing host memory: %d", int (ret)));
+    }
+
+  ret = vkBindBufferMemory (dev->device (), host->buffer_, host->memory_, 0);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::InternalError (absl::StrFormat (
+          "HostBuffer: failed at binding imported memory: %d", int (ret)));
+    }
+
+  return host;
+}
+
+VkBuffer
+HostBuffer::buffer () const
+{
+  return buffer_;
+}
+
+VkDeviceSize
+HostBuffer::offset () const
+{
+  return offset_;
+}
+
+VkDeviceSize
+HostBuffer::bytes () const
+{
+  return bytes_;
+}
+}
@@ -0,0 +1,45 @@
+#ifndef __VKLLAMA_HOST_BUFFER_H__
+#define __VKLLAMA_HOST_BUFFER_H__
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include <memory>
+#include <vulkan/vulkan.h>
+
+namespace vkllama
+{
+class GPUDevice;
+
+// Host memory the device reads in place, imported with
+// VK_EXT_external_memory_host. The pages around the range, rounded out to
+// the device's host pointer alignment, are bound to a transfer source
+// buffer, so a copy from it reads straight from the host, which for a
+// mapped file is the page cache. The memory has to stay mapped and
+// unchanged until the buffer is destroyed.
+class HostBuffer
+{
+public:
+  static absl::StatusOr<std::shared_ptr<HostBuffer> >
+  import (GPUDevice *dev, const void *data, const size_t bytes);
+
+  HostBuffer (HostBuffer const &) = delete;
+  HostBuffer &operator= (HostBuffer const &) = delete;
+  ~HostBuffer ();
+
+  VkBuffer buffer () const;
+  // where the imported data starts in buffer ()
+  VkDeviceSize offset () const;
+  VkDeviceSize bytes () const;
+
+private:
+  HostBuffer (GPUDevice *dev);
+
+  GPUDevice *dev_;
+  VkBuffer buffer_;
+  VkDeviceMemory memory_;
+  VkDeviceSize offset_;
+  VkDeviceSize bytes_;
+};
+}
+
+#endif
@@ -0,0 +1,153 @@
+#include "kvcache_pool.h"
+#include "absl/strings/str_format.h"
+#include "command.h"
+#include "gpu_device.h"
+#include "src/core/common.h"
+#include <algorithm>
+#include <vector>
+
+namespace vkllama
+{
+KVCachePool::KVCachePool (GPUDevice *dev, const size_t layers,
+                          const size_t heads, const size_t dim,
+                          const uint32_t pages, const uint32_t page_rows)
+    : dev_ (dev), layers_ (layers), heads_ (heads), dim_ (dim),
+      pages_ (pages), page_rows_ (page_rows)
+{
+}
+
+absl::Status
+KVCachePool::init (Command *command)
+{
+  if (pages_ == 0 || page_rows_ == 0)
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "KVCachePool: %u pages of %u rows.", pages_, page_rows_));
+    }
+
+  for (size_t l = 0; l < layers_; ++l)
+    {
+      for (auto *tensors : { &keys_, &values_ })
+        {
+          Tensor pages (pages_ * heads_, page_rows_, dim_, dev_, FP16, false);
+          VKLLAMA_STATUS_OK (pages.create (KVCACHE_MEMORY));
+
+          // zeroed once so no page holds what the memory had before; a page
+          // given back keeps its rows for the next sequence, which reads
+          // only the positions it wrote
+          VKLLAMA_STATUS_OK (command->fill (pages, 0));
+          tensors->push_back (pages);
+        }
+    }
+
+  free_.resize (pages_);
+  for (uint32_t p = 0; p < pages_; ++p)
+    {
+      free_[p] = pages_ - 1 - p;
+    }
+  return absl::OkStatus ();
+}
+
+PagedKVCache
+KVCachePool::layer (const size_t layer, Tensor table) const
+{
+  return { keys_[layer], values_[layer], table };
+}
+
+absl::StatusOr<uint32_t>
+KVCachePool::acquire ()
+{
+  if (free_.empty ())
+    {
+      return absl::ResourceExhaustedError (absl::StrFormat (
+          "KVCachePool: all %u pages are in use.", pages_));
+    }
+
+  const uint32_t page = free_.back ();
+  free_.pop_back ();
+  return page;
+}
+
+void
+KVCachePool::release (const uint32_t page)
+{
+  free_.push_back (page);
+}
+
+uint32_t
+KVCachePool::pages () const
+{
+  return pages_;
+}
+
+uint32_t
+KVCachePool::page_rows () const
+{
+  return page_rows_;
+}
+
+uint32_t
+KVCachePool::free_pages () const
+{
+  return free_.size ();
+}
+
+size_t
+KVCachePool::bytes (const size_t layers, const size_t heads, const size_t dim,
+                    const uint32_t pages, const uint32_t page_rows)
+{
+  return 2ul * layers * pages * heads * page_rows * dim
+         * sizeof (__vkllama_fp16_t);
+}
+
+KVCacheBlockTable::KVCacheBlockTable (KVCachePool *pool,
+                                      const uint32_t max_pages)
+    : pool_ (pool), max_pages_ (max_pages)
+{
+}
+
+KVCacheBlockTable::~KVCacheBlockTable () { clear (); }
+
+absl::Status
+KVCacheBlockTable::reserve (const size_t rows)
+{
+  const size_t page_rows = pool_->page_rows ();
+  const size_t needed = std::min<size_t> (
+      (rows + page_rows - 1) / page_rows, max_pages_);
+  while (pages_.size () < needed)
+    {
+      auto page = pool_->acquire ();
+      VKLLAMA_STATUS_OK (page.status ());
+      pages_.push_back (*page);
+    }
+  return absl::OkStatus ();
+}
+
+void
+KVCacheBlockTable::clear ()
+{
+  for (auto page : pages_)
+    {
+      pool_->release (page);
+    }
+  pages_.clear ();
+}
+
+std::vector<uint32_t> const &
+KVCacheBlockTable::pages () const
+{
+  return pages_;
+}
+
+uint32_t
+KVCacheBlockTable::max_pages () const
+{
+  return max_pages_;
+}
+
+size_t
+KVCacheBlockTable::rows () const
+{
+  return pages_.size () * pool_->page_rows ();
+}
+}
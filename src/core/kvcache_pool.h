@@ -0,0 +1,107 @@
+#ifndef __VKLLAMA_KVCACHE_POOL_H__
+#define __VKLLAMA_KVCACHE_POOL_H__
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "src/core/tensor.h"
+#include <cstdint>
+#include <vector>
+
+namespace vkllama
+{
+class GPUDevice;
+class Command;
+
+// What an attention layer reads a paged kv cache through: the k and v
+// pages of a pool, [pages * heads, page_rows, dim] with the heads of a page
+// side by side, and the block table of a sequence, a UINT32 tensor whose
+// entry i is the page holding positions [i * page_rows, (i + 1) *
+// page_rows). The table is read when the commands run, so its owner may
+// map more pages between submissions without recording them again.
+struct PagedKVCache
+{
+  Tensor keys;
+  Tensor values;
+  Tensor table;
+};
+
+// Fixed size pages of kv cache rows shared by the sequences of a model.
+// A page is the same slot of page_rows positions in the caches of every
+// layer, so one block table serves all layers of a sequence. Sequences
+// take pages as they grow instead of a whole context up front and give
+// them back when they end, so many short sequences fit where a few
+// contiguous caches of the context length would.
+class KVCachePool
+{
+public:
+  static constexpr uint32_t kPageRows = 64;
+
+  KVCachePool (GPUDevice *dev, const size_t layers, const size_t heads,
+               const size_t dim, const uint32_t pages,
+               const uint32_t page_rows = kPageRows);
+
+  // Creates the pages in KVCACHE_MEMORY and records zeroing them into
+  // command, which has to be recording.
+  absl::Status init (Command *command);
+
+  // the pages of layer, read through table
+  PagedKVCache layer (const size_t layer, Tensor table) const;
+
+  // A free page, ResourceExhaustedError when there is none.
+  absl::StatusOr<uint32_t> acquire ();
+  void release (const uint32_t page);
+
+  uint32_t pages () const;
+  uint32_t page_rows () const;
+  uint32_t free_pages () const;
+
+  // bytes of pages pages of page_rows fp16 k and v rows for all layers
+  static size_t bytes (const size_t layers, const size_t heads,
+                       const size_t dim, const uint32_t pages,
+                       const uint32_t page_rows = kPageRows);
+
+private:
+  GPUDevice *dev_;
+  const size_t layers_;
+  const size_t heads_;
+  const size_t dim_;
+  const uint32_t pages_;
+  const uint32_t page_rows_;
+  std::vector<Tensor> keys_;
+  std::vector<Tensor> values_;
+  // taken from the back, the lowest pages first
+  std::vector<uint32_t> free_;
+};
+
+// The pages of one sequence, taken from a pool as the sequence grows and
+// given back when it is cleared or destroyed. pages () is what the block
+// table of the sequence holds.
+class KVCacheBlockTable
+{
+public:
+  // max_pages bounds the positions the sequence maps, its context length
+  KVCacheBlockTable (KVCachePool *pool, const uint32_t max_pages);
+  ~KVCacheBlockTable ();
+
+  KVCacheBlockTable (KVCacheBlockTable const &) = delete;
+  KVCacheBlockTable &operator= (KVCacheBlockTable const &) = delete;
+
+  // Takes pages until the first rows positions are mapped, at most
+  // max_pages. When the pool runs out the pages taken so far are kept and
+  // ResourceExhaustedError is returned.
+  absl::Status reserve (const size_t rows);
+  void clear ();
+
+  std::vector<uint32_t> const &pages () const;
+  uint32_t max_pages () const;
+  // positions the pages hold
+  size_t rows () const;
+
+private:
+  KVCachePool *pool_;
+  const uint32_t max_pages_;
+  std::vector<uint32_t> pages_;
+};
+}
+
+#endif
@@ -0,0 +1,303 @@
+#include "memory_pool.h"
+#include "absl/strings/str_format.h"
+#include "gpu_device.h"
+#include "src/core/common.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+namespace vkllama
+{
+const char *
+memory_kind_name (const MemoryKind kind)
+{
+  switch (kind)
+    {
+    case WEIGHT_MEMORY:
+      return "weights";
+    case KVCACHE_MEMORY:
+      return "kv cache";
+    case ACTIVATION_MEMORY:
+      return "activations";
+    default:
+      return "unknown";
+    }
+}
+
+MemoryPool::MemoryPool (GPUDevice *dev, const MemoryKind kind,
+                        const VkDeviceSize chunk_bytes)
+    : dev_ (dev), kind_ (kind), chunk_bytes_ (chunk_bytes), budget_ (0)
+{
+  // ranges bind as storage buffers at their offset, and neighbouring ranges
+  // of host visible chunks must not share a non-coherent atom
+  const auto &limits = dev_->limits ();
+  align_ = std::max<VkDeviceSize> (
+      std::max (limits.minStorageBufferOffsetAlignment,
+                limits.nonCoherentAtomSize),
+      1);
+  stats_ = { 0, 0, 0, 0, 0 };
+}
+
+MemoryPool::~MemoryPool ()
+{
+  for (auto &chunk : chunks_)
+    {
+      vmaClearVirtualBlock (chunk->block);
+      vmaDestroyVirtualBlock (chunk->block);
+      vmaDestroyBuffer (dev_->allocator (), chunk->buffer, chunk->allocation);
+    }
+}
+
+absl::StatusOr<MemoryPool::Chunk *>
+MemoryPool::add_chunk_ (const VkDeviceSize bytes, const bool visable)
+{
+  const auto headroom = headroom_ ();
+  if (bytes > headroom)
+    {
+      return absl::ResourceExhaustedError (absl::StrFormat (
+          "a %zu bytes chunk for %s is over the memory budget: %zu bytes "
+          "left, %zu bytes held for %s.",
+          size_t (bytes), memory_kind_name (kind_), size_t (headroom),
+          stats_.allocated_bytes, memory_kind_name (kind_)));
+    }
+
+  std::unique_ptr<Chunk> chunk (new Chunk{ VK_NULL_HANDLE, VK_NULL_HANDLE,
+                                           VK_NULL_HANDLE, bytes, visable,
+                                           nullptr, 0 });
+
+  VkBufferCreateInfo createInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                                    nullptr,
+                                    0,
+                                    bytes,
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                                        | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+                                        | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                    VK_SHARING_MODE_EXCLUSIVE,
+                                    0,
+                                    nullptr };
+
+  VmaAllocationCreateFlags flags = 0;
+  if (visable)
+    {
+      flags = VMA_ALLOCATION_CREATE_MAPPED_BIT
+              | VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT;
+    }
+
+  VmaAllocationCreateInfo allocInfo
+      = { flags,   VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+          0,       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+          0,       VK_NULL_HANDLE,
+          nullptr, 0 };
+
+  VmaAllocationInfo info;
+  auto ret = vmaCreateBuffer (dev_->allocator (), &createInfo, &allocInfo,
+                              &chunk->buffer, &chunk->allocation, &info);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::ResourceExhaustedError (absl::StrFormat (
+          "failed at creating a %zu bytes chunk for %s: %d", size_t (bytes),
+          memory_kind_name (kind_), int (ret)));
+    }
+  chunk->host = info.pMappedData;
+
+  VmaVirtualBlockCreateInfo blockInfo = { bytes, 0, nullptr };
+  ret = vmaCreateVirtualBlock (&blockInfo, &chunk->block);
+  if (ret != VK_SUCCESS)
+    {
+      vmaDestroyBuffer (dev_->allocator (), chunk->buffer, chunk->allocation);
+      return absl::InternalError (absl::StrFormat (
+          "failed at creating virtual block for %s: %d",
+          memory_kind_name (kind_), int (ret)));
+    }
+
+  stats_.allocated_bytes += bytes;
+  chunks_.push_back (std::move (chunk));
+  stats_.chunk_count = chunks_.size ();
+  return chunks_.back ().get ();
+}
+
+void
+MemoryPool::destroy_chunk_ (Chunk *chunk)
+{
+  auto it = std::find_if (
+      chunks_.begin (), chunks_.end (),
+      [chunk] (std::unique_ptr<Chunk> const &c) { return c.get () == chunk; });
+  if (it == chunks_.end ())
+    {
+      return;
+    }
+
+  vmaDestroyVirtualBlock (chunk->block);
+  vmaDestroyBuffer (dev_->allocator (), chunk->buffer, chunk->allocation);
+  stats_.allocated_bytes -= chunk->bytes;
+  chunks_.erase (it);
+  stats_.chunk_count = chunks_.size ();
+}
+
+VkDeviceSize
+MemoryPool::usual_chunk_bytes_ (const bool visable) const
+{
+  if (!visable || dev_->unified_memory ())
+    {
+      return chunk_bytes_;
+    }
+  return std::min (chunk_bytes_, kVisableChunkBytes);
+}
+
+VkDeviceSize
+MemoryPool::headroom_ () const
+{
+  auto headroom = dev_->device_local_available ();
+  if (budget_ > 0)
+    {
+      headroom = std::min<VkDeviceSize> (
+          headroom, budget_ > stats_.allocated_bytes
+                        ? budget_ - stats_.allocated_bytes
+                        : 0);
+    }
+  return headroom;
+}
+
+absl::StatusOr<MemoryPool::Range>
+MemoryPool::acquire (const VkDeviceSize bytes, const bool visable)
+{
+  if (bytes == 0)
+    {
+      return absl::InvalidArgumentError (
+          "MemoryPool: cannot acquire an empty range.");
+    }
+
+  std::lock_guard<std::mutex> lock (mutex_);
+
+  const VkDeviceSize aligned = (bytes + align_ - 1) / align_ * align_;
+  VmaVirtualAllocationCreateInfo rangeInfo = { aligned, align_, 0, nullptr };
+
+  auto make_range = [&] (Chunk *chunk, VmaVirtualAllocation allocation,
+                         VkDeviceSize offset) {
+    chunk->ranges += 1;
+    stats_.allocations += 1;
+    stats_.in_use_bytes += aligned;
+    stats_.peak_in_use_bytes
+        = std::max (stats_.peak_in_use_bytes, stats_.in_use_bytes);
+
+    Range range;
+    range.buffer = chunk->buffer;
+    range.allocation = chunk->allocation;
+    range.offset = offset;
+    range.bytes = aligned;
+    range.host = chunk->host
+                     ? static_cast<uint8_t *> (chunk->host) + offset
+                     : nullptr;
+    range.chunk = chunk;
+    range.range = allocation;
+    return range;
+  };
+
+  for (auto &chunk : chunks_)
+    {
+      if (chunk->visable != visable || chunk->bytes < aligned)
+        {
+          continue;
+        }
+
+      VmaVirtualAllocation allocation;
+      VkDeviceSize offset = 0;
+      if (vmaVirtualAllocate (chunk->block, &rangeInfo, &allocation, &offset)
+          == VK_SUCCESS)
+        {
+          return make_range (chunk.get (), allocation, offset);
+        }
+    }
+
+  auto chunk = add_chunk_ (
+      std::max (std::min (usual_chunk_bytes_ (visable), headroom_ ()),
+                aligned),
+      visable);
+  VKLLAMA_STATUS_OK (chunk.status ());
+
+  VmaVirtualAllocation allocation;
+  VkDeviceSize offset = 0;
+  auto ret = vmaVirtualAllocate ((*chunk)->block, &rangeInfo, &allocation,
+                                 &offset);
+  if (ret != VK_SUCCESS)
+    {
+      destroy_chunk_ (*chunk);
+      return absl::InternalError (absl::StrFormat (
+          "failed at allocating from a new %s chunk: %d",
+          memory_kind_name (kind_), int (ret)));
+    }
+  return make_range (*chunk, allocation, offset);
+}
+
+void
+MemoryPool::release (Range const &range)
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  auto *chunk = static_cast<Chunk *> (range.chunk);
+
+  vmaVirtualFree (chunk->block, range.range);
+  chunk->ranges -= 1;
+  stats_.allocations -= 1;
+  stats_.in_use_bytes -= range.bytes;
+
+  if (chunk->ranges > 0)
+    {
+      return;
+    }
+
+  // one empty chunk of the usual size is kept for the next tensors
+  const auto usual = usual_chunk_bytes_ (chunk->visable);
+  auto other_spare = [chunk, usual] (std::unique_ptr<Chunk> const &c) {
+    return c.get () != chunk && c->ranges == 0
+           && c->visable == chunk->visable && c->bytes == usual;
+  };
+  const bool spare
+      = chunk->bytes == usual
+        && std::none_of (chunks_.cbegin (), chunks_.cend (), other_spare);
+  if (!spare)
+    {
+      destroy_chunk_ (chunk);
+    }
+}
+
+MemoryKind
+MemoryPool::kind () const
+{
+  return kind_;
+}
+
+VkDeviceSize
+MemoryPool::chunk_bytes () const
+{
+  return chunk_bytes_;
+}
+
+void
+MemoryPool::set_budget (const VkDeviceSize budget)
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  budget_ = budget;
+}
+
+VkDeviceSize
+MemoryPool::budget () const
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  return budget_;
+}
+
+VkDeviceSize
+MemoryPool::alignment () const
+{
+  return align_;
+}
+
+MemoryPool::Stats
+MemoryPool::stats () const
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  return stats_;
+}
+}
@@ -0,0 +1,120 @@
+#ifndef __VKLLAMA_MEMORY_POOL_H__
+#define __VKLLAMA_MEMORY_POOL_H__
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "vk_mem_alloc.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+namespace vkllama
+{
+class GPUDevice;
+
+// what the memory of a tensor holds, which picks the pool it comes from.
+// Staging memory has its own pool, StagingPool.
+typedef enum : int
+{
+  WEIGHT_MEMORY = 0,
+  KVCACHE_MEMORY,
+  ACTIVATION_MEMORY,
+  MEMORY_KIND_COUNT
+} MemoryKind;
+
+const char *memory_kind_name (const MemoryKind kind);
+
+// Device memory for tensors of one kind. Tensors are sub-allocated from
+// large storage buffers, so they are ranges of a shared VkBuffer and bind
+// with their offset. A tensor that does not fit in the chunk size gets a
+// chunk of its own. Chunks are created on demand; a chunk left empty is
+// destroyed unless it is the only spare one of its size.
+//
+// A chunk is only created when it fits into the budget of the pool, if one
+// is set, and into what the device memory budget has left; otherwise
+// acquire () fails with ResourceExhaustedError before Vulkan is asked.
+// Near the limits chunks shrink down to the range they are created for.
+class MemoryPool
+{
+public:
+  struct Stats
+  {
+    // device memory held by the chunks
+    size_t allocated_bytes;
+    // bytes of the ranges handed out, alignment included
+    size_t in_use_bytes;
+    size_t peak_in_use_bytes;
+    size_t allocations;
+    size_t chunk_count;
+  };
+
+  // A range handed out by acquire (), to be given back to release ().
+  struct Range
+  {
+    VkBuffer buffer;
+    VmaAllocation allocation;
+    VkDeviceSize offset;
+    VkDeviceSize bytes;
+    // null for memory the host cannot see
+    void *host;
+
+  private:
+    friend class MemoryPool;
+    void *chunk;
+    VmaVirtualAllocation range;
+  };
+
+  // host visible chunks stay small unless memory is unified, as device
+  // local memory the host can map is scarce without resizable BAR
+  static constexpr VkDeviceSize kVisableChunkBytes = 4ul << 20;
+
+  MemoryPool (GPUDevice *dev, const MemoryKind kind,
+              const VkDeviceSize chunk_bytes);
+  ~MemoryPool ();
+
+  absl::StatusOr<Range> acquire (const VkDeviceSize bytes,
+                                 const bool visable = false);
+  void release (Range const &range);
+
+  MemoryKind kind () const;
+  VkDeviceSize chunk_bytes () const;
+  // bytes of device memory the chunks may hold together, 0 for no limit
+  // but the device's; chunks already created are kept
+  void set_budget (const VkDeviceSize budget);
+  VkDeviceSize budget () const;
+  // every range starts at a multiple of it
+  VkDeviceSize alignment () const;
+  Stats stats () const;
+
+private:
+  struct Chunk
+  {
+    VkBuffer buffer;
+    VmaAllocation allocation;
+    VmaVirtualBlock block;
+    VkDeviceSize bytes;
+    bool visable;
+    void *host;
+    size_t ranges;
+  };
+
+  absl::StatusOr<Chunk *> add_chunk_ (const VkDeviceSize bytes,
+                                      const bool visable);
+  void destroy_chunk_ (Chunk *chunk);
+  VkDeviceSize usual_chunk_bytes_ (const bool visable) const;
+  // bytes a new chunk may take under both budgets
+  VkDeviceSize headroom_ () const;
+
+  GPUDevice *dev_;
+  const MemoryKind kind_;
+  const VkDeviceSize chunk_bytes_;
+  VkDeviceSize align_;
+  VkDeviceSize budget_;
+  std::vector<std::unique_ptr<Chunk> > chunks_;
+  Stats stats_;
+  mutable std::mutex mutex_;
+};
+}
+
+#endif
@@ -1,11 +1,17 @@
 #include "pipeline.h"
 #include "absl/strings/str_format.h"
+#include "src/core/common.h"
 #include "tensor.h"
 #include <array>
+#include <cstring>
 #include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iterator>
+#include <memory>
+#include <map>
+#include <numeric>
+#include <mutex>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
@@ -13,31 +19,67 @@
 
 namespace vkllama
 {
+PipelineProgram::PipelineProgram (GPUDevice *dev)
+    : device (dev), push_descriptor (false), module (VK_NULL_HANDLE),
+      descriptor_set_layout (VK_NULL_HANDLE), layout (VK_NULL_HANDLE),
+      pipeline (VK_NULL_HANDLE), descriptor_update_template (VK_NULL_HANDLE)
+{
+}
+
+PipelineProgram::~PipelineProgram ()
+{
+  vkDestroyPipeline (device->device (), pipeline, nullptr);
+  vkDestroyShaderModule (device->device (), module, nullptr);
+  vkDestroyPipelineLayout (device->device (), layout, nullptr);
+  vkDestroyDescriptorSetLayout (device->device (), descriptor_set_layout,
+                                nullptr);
+  vkDestroyDescriptorUpdateTemplate (device->device (),
+                                     descriptor_update_template, nullptr);
+}
+
+absl::StatusOr<std::shared_ptr<PipelineProgram> >
+PipelineRegistry::get (std::string const &key, Factory const &create)
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  auto pos = programs_.find (key);
+  if (pos != programs_.cend ())
+    {
+      stats_.hits += 1;
+      return pos->second;
+    }
+
+  auto program = create ();
+  if (!program.ok ())
+    {
+      return program.status ();
+    }
+
+  stats_.misses += 1;
+  programs_[key] = *program;
+  stats_.programs = programs_.size ();
+  return program;
+}
+
+PipelineRegistry::Stats
+PipelineRegistry::stats () const
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  return stats_;
+}
+
 Pipeline::Pipeline (GPUDevice *device, const uint8_t *spv,
                     const size_t spv_size,
                     ShaderConstants const &specialization,
                     ShaderInfo const &info)
-    : init_ (false), module_ (VK_NULL_HANDLE), spv_ (spv),
-      spv_size_ (spv_size), shaderInfo_ (info),
-      specialization_ (specialization), device_ (device),
-      descriptorSetLayout_ (VK_NULL_HANDLE), descriptorPool_ (VK_NULL_HANDLE),
-      descriptorSet_ (VK_NULL_HANDLE), pipelineLayout_ (VK_NULL_HANDLE),
-      pipeline_ (VK_NULL_HANDLE), x_ (0), y_ (0), z_ (0),
-      queryPool_ (VK_NULL_HANDLE), descriptor_update_template_ (VK_NULL_HANDLE)
+    : init_ (false), spv_ (spv), spv_size_ (spv_size), shaderInfo_ (info),
+      specialization_ (specialization), device_ (device), x_ (0), y_ (0),
+      z_ (0), queryPool_ (VK_NULL_HANDLE)
 {
 }
 
 Pipeline::~Pipeline ()
 {
-  vkDestroyPipeline (device_->device (), pipeline_, nullptr);
-  vkDestroyShaderModule (device_->device (), module_, nullptr);
-  vkDestroyPipelineLayout (device_->device (), pipelineLayout_, nullptr);
-  vkDestroyDescriptorSetLayout (device_->device (), descriptorSetLayout_,
-                                nullptr);
-  vkDestroyDescriptorPool (device_->device (), descriptorPool_, nullptr);
   vkDestroyQueryPool (device_->device (), queryPool_, nullptr);
-  vkDestroyDescriptorUpdateTemplate (device_->device (),
-                                     descriptor_update_template_, nullptr);
 }
 
 absl::Status
@@ -47,34 +89,51 @@ Pipeline::init ()
   if (!ret.ok ())
     return ret;
 
-  ret = create_shader_module_ ();
-  if (!ret.ok ())
-    return ret;
-
-  ret = create_pipeline_layout_ ();
-  if (!ret.ok ())
-    return ret;
-
-  ret = create_descriptor_set_ ();
-  if (!ret.ok ())
+  if (shaderInfo_.binding_count < 0
+      || (size_t)shaderInfo_.binding_count > kMaxBindings)
     {
-      return ret;
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "pipeline has %d bindings, at most %zu are supported.",
+          shaderInfo_.binding_count, kMaxBindings));
     }
 
-  ret = create_query_pool_ ();
-  if (!ret.ok () && !absl::IsUnimplemented (ret))
+  // everything but the bound tensors and query pool only depends on the
+  // shader, its specialization and ShaderInfo, so it is built once per
+  // device and shared by all op instances using the same shader.
+  std::string key (reinterpret_cast<const char *> (&spv_), sizeof (spv_));
+  key.append (reinterpret_cast<const char *> (&spv_size_),
+              sizeof (spv_size_));
+  key.append (reinterpret_cast<const char *> (&shaderInfo_),
+              sizeof (shaderInfo_));
+  for (auto size : specialization_.sizes ())
     {
-      return ret;
+      key.append (reinterpret_cast<const char *> (&size), sizeof (size));
     }
-
-  ret = create_pipeline_ (specialization_);
-  if (!ret.ok ())
+  key.append (reinterpret_cast<const char *> (specialization_.data ()),
+              specialization_.bytes ());
+
+  auto program = device_->pipelines ().get (
+      key, [this] () -> absl::StatusOr<std::shared_ptr<PipelineProgram> > {
+        auto program = std::make_shared<PipelineProgram> (device_);
+        program->push_descriptor = device_->support_push_descriptor ();
+        VKLLAMA_STATUS_OK (create_shader_module_ (*program));
+        VKLLAMA_STATUS_OK (reflect_binding_access_ (*program));
+        VKLLAMA_STATUS_OK (create_pipeline_layout_ (*program));
+        VKLLAMA_STATUS_OK (create_pipeline_ (*program, specialization_));
+        VKLLAMA_STATUS_OK (create_descriptor_update_template_ (*program));
+        return program;
+      });
+
+  if (!program.ok ())
     {
-      return ret;
+      return program.status ();
     }
+  program_ = *program;
 
-  ret = create_descriptor_update_template_ ();
-  if (!ret.ok ())
+  bindings_.assign (shaderInfo_.binding_count, Tensor ());
+
+  ret = create_query_pool_ ();
+  if (!ret.ok () && !absl::IsUnimplemented (ret))
     {
       return ret;
     }
@@ -84,7 +143,7 @@ Pipeline::init ()
 }
 
 absl::Status
-Pipeline::create_shader_module_ ()
+Pipeline::create_shader_module_ (PipelineProgram &program)
 {
 
   VkShaderModuleCreateInfo createInfo
@@ -92,7 +151,7 @@ Pipeline::create_shader_module_ ()
           reinterpret_cast<const uint32_t *> (spv_) };
 
   auto ret = vkCreateShaderModule (device_->device (), &createInfo, nullptr,
-                                   &module_);
+                                   &program.module);
   if (ret != VK_SUCCESS)
     {
       return absl::InternalError (
@@ -103,7 +162,117 @@ Pipeline::create_shader_module_ ()
 }
 
 absl::Status
-Pipeline::create_pipeline_layout_ ()
+Pipeline::reflect_binding_access_ (PipelineProgram &program)
+{
+  auto &binding_access = program.binding_access;
+  binding_access.assign (shaderInfo_.binding_count,
+                          VK_ACCESS_SHADER_READ_BIT
+                              | VK_ACCESS_SHADER_WRITE_BIT);
+
+  const size_t n = spv_size_ / sizeof (uint32_t);
+  if (n < 5)
+    {
+      return absl::InvalidArgumentError ("spirv code is too short.");
+    }
+
+  std::vector<uint32_t> code (n);
+  ::memcpy (code.data (), spv_, n * sizeof (uint32_t));
+
+  // SPIR-V opcodes and decorations used below
+  constexpr uint32_t kOpTypeStruct = 30, kOpTypePointer = 32,
+                     kOpVariable = 59, kOpDecorate = 71,
+                     kOpMemberDecorate = 72;
+  constexpr uint32_t kNonWritable = 24, kNonReadable = 25, kBinding = 33;
+
+  std::map<uint32_t, uint32_t> bindings, pointees, var_types, members;
+  std::map<uint32_t, uint32_t> non_writable, non_readable;
+
+  for (size_t i = 5; i < n;)
+    {
+      const uint32_t count = code[i] >> 16;
+      const uint32_t op = code[i] & 0xffff;
+      if (count == 0 || i + count > n)
+        {
+          return absl::InvalidArgumentError ("malformed spirv code.");
+        }
+
+      const uint32_t *args = code.data () + i + 1;
+      if (op == kOpDecorate && count >= 3)
+        {
+          if (args[1] == kBinding && count >= 4)
+            bindings[args[0]] = args[2];
+          else if (args[1] == kNonWritable)
+            non_writable[args[0]] = UINT32_MAX;
+          else if (args[1] == kNonReadable)
+            non_readable[args[0]] = UINT32_MAX;
+        }
+      else if (op == kOpMemberDecorate && count >= 4)
+        {
+          if (args[2] == kNonWritable)
+            non_writable[args[0]] += 1;
+          else if (args[2] == kNonReadable)
+            non_readable[args[0]] += 1;
+        }
+      else if (op == kOpTypeStruct)
+        {
+          members[args[0]] = count - 2;
+        }
+      else if (op == kOpTypePointer && count >= 4)
+        {
+          pointees[args[0]] = args[2];
+        }
+      else if (op == kOpVariable && count >= 4)
+        {
+          var_types[args[1]] = args[0];
+        }
+
+      i += count;
+    }
+
+  // a qualifier on the variable or on every member of its block applies
+  // to the whole binding
+  auto all = [&] (std::map<uint32_t, uint32_t> const &decorated,
+                  const uint32_t var) {
+    auto it = decorated.find (var);
+    if (it != decorated.cend () && it->second == UINT32_MAX)
+      return true;
+
+    auto ptr = var_types.find (var);
+    if (ptr == var_types.cend ())
+      return false;
+    auto type = pointees.find (ptr->second);
+    if (type == pointees.cend ())
+      return false;
+    auto m = members.find (type->second);
+    auto d = decorated.find (type->second);
+    return m != members.cend () && d != decorated.cend () && m->second > 0
+           && d->second == m->second;
+  };
+
+  for (auto const &[var, binding] : bindings)
+    {
+      if (binding >= binding_access.size ())
+        {
+          continue;
+        }
+
+      VkAccessFlags access = 0;
+      if (!all (non_readable, var))
+        access |= VK_ACCESS_SHADER_READ_BIT;
+      if (!all (non_writable, var))
+        access |= VK_ACCESS_SHADER_WRITE_BIT;
+
+      if (access != 0)
+        {
+          binding_access[binding] = access;
+        }
+    }
+
+  return absl::OkStatus ();
+}
+
+absl::Status
+Pipeline::create_pipeline_layout_ (PipelineProgram &program)
 {
   std::vector<VkDescriptorSetLayoutBinding> bindings;
   for (int i = 0; i < shaderInfo_.binding_count; ++i)
@@ -117,12 +286,17 @@ Pipeline::create_pipeline_layout_ ()
     }
 
   {
+    VkDescriptorSetLayoutCreateFlags flags
+        = program.push_descriptor
+              ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR
+              : 0;
     VkDescriptorSetLayoutCreateInfo createInfo
-        = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr, 0,
-            (uint32_t)bindings.size (), bindings.data () };
+        = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr,
+            flags, (uint32_t)bindings.size (), bindings.data () };
 
     auto ret = vkCreateDescriptorSetLayout (device_->device (), &createInfo,
-                                            nullptr, &descriptorSetLayout_);
+                                            nullptr,
+                                            &program.descriptor_set_layout);
     if (ret != VK_SUCCESS)
       return absl::InternalError (absl::StrFormat (
           "create descriptors set layout failed: %d", int (ret)));
@@ -137,11 +311,11 @@ Pipeline::create_pipeline_layout_ ()
             nullptr,
             0,
             1,
-            &descriptorSetLayout_,
+            &program.descriptor_set_layout,
             shaderInfo_.push_constant_bytes > 0 ? 1u : 0u,
             &range };
     auto ret = vkCreatePipelineLayout (device_->device (), &createInfo,
-                                       nullptr, &pipelineLayout_);
+                                       nullptr, &program.layout);
     if (ret != VK_SUCCESS)
       {
         return absl::InternalError (
@@ -153,7 +327,8 @@ Pipeline::create_pipeline_layout_ ()
 }
 
 absl::Status
-Pipeline::create_pipeline_ (ShaderConstants const &constants)
+Pipeline::create_pipeline_ (PipelineProgram &program,
+                            ShaderConstants const &constants)
 {
   const int n = constants.elem_num ();
   std::vector<VkSpecializationMapEntry> mapEntries;
@@ -183,7 +358,7 @@ Pipeline::create_pipeline_ (ShaderConstants const &constants)
           nullptr,
           0,
           VK_SHADER_STAGE_COMPUTE_BIT,
-          module_,
+          program.module,
           "main",
           &specializationInfo };
 
@@ -192,13 +367,13 @@ Pipeline::create_pipeline_ (ShaderConstants const &constants)
           nullptr,
           0,
           shaderCreateInfo,
-          pipelineLayout_,
+          program.layout,
           VK_NULL_HANDLE,
           0 };
 
-  auto ret = vkCreateComputePipelines (device_->device (), 0, 1,
-                                       &computePipelineCreateInfo, nullptr,
-                                       &pipeline_);
+  auto ret = vkCreateComputePipelines (
+      device_->device (), device_->pipeline_cache (), 1,
+      &computePipelineCreateInfo, nullptr, &program.pipeline);
   if (ret != VK_SUCCESS)
     {
       return absl::InternalError (
@@ -209,45 +384,7 @@ Pipeline::create_pipeline_ (ShaderConstants const &constants)
 }
 
 absl::Status
-Pipeline::create_descriptor_set_ ()
-{
-  VkDescriptorPoolSize size;
-  size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-  size.descriptorCount = 1024; // large enough?
-
-  VkDescriptorPoolCreateInfo createInfo
-      = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-          nullptr,
-          VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
-          1,
-          1,
-          &size };
-
-  auto ret = vkCreateDescriptorPool (device_->device (), &createInfo, nullptr,
-                                     &descriptorPool_);
-  if (ret != VK_SUCCESS)
-    {
-      return absl::InternalError (
-          absl::StrFormat ("failed at create descriptors pool %d", int (ret)));
-    }
-
-  VkDescriptorSetAllocateInfo allocInfo
-      = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr,
-          descriptorPool_, 1, &descriptorSetLayout_ };
-
-  ret = vkAllocateDescriptorSets (device_->device (), &allocInfo,
-                                  &descriptorSet_);
-  if (ret != VK_SUCCESS)
-    {
-      return absl::InternalError (
-          absl::StrFormat ("allocate descriptors set failed: %d", int (ret)));
-    }
-
-  return absl::OkStatus ();
-}
-
-absl::Status
-Pipeline::create_descriptor_update_template_ ()
+Pipeline::create_descriptor_update_template_ (PipelineProgram &program)
 {
   if (!device_->support_descriptor_templ_update ())
     {
@@ -272,14 +409,16 @@ Pipeline::create_descriptor_update_template_ ()
           0,
           (uint32_t)shaderInfo_.binding_count,
           entries.data (),
-          VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET,
-          descriptorSetLayout_,
+          program.push_descriptor
+              ? VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_PUSH_DESCRIPTORS_KHR
+              : VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET,
+          program.descriptor_set_layout,
           VK_PIPELINE_BIND_POINT_COMPUTE,
-          pipelineLayout_,
+          program.layout,
           0 };
 
   auto ret = vkCreateDescriptorUpdateTemplate (
-      device_->device (), &info, nullptr, &descriptor_update_template_);
+      device_->device (), &info, nullptr, &program.descriptor_update_template);
   if (ret != VK_SUCCESS)
     {
       return absl::InternalError (absl::StrFormat (
@@ -318,41 +457,107 @@ Pipeline::create_query_pool_ ()
 absl::Status
 Pipeline::update_bindings (std::vector<Tensor> bindings)
 {
-  return set_bindings_ (bindings);
+  std::vector<uint32_t> indices (bindings.size ());
+  std::iota (indices.begin (), indices.end (), 0u);
+  return update_bindings (bindings, indices);
 }
 
 absl::Status
 Pipeline::update_bindings (std::vector<Tensor> bindings,
                            const std::vector<uint32_t> &indices)
 {
-  return set_bindings_ (bindings, indices);
+  if (bindings.size () != indices.size ())
+    {
+      return absl::InvalidArgumentError (
+          "Pipeline::update_bindings: bindings and indices mismatch.");
+    }
+
+  for (size_t i = 0; i < indices.size (); ++i)
+    {
+      if (indices[i] >= bindings_.size ())
+        {
+          return absl::OutOfRangeError (absl::StrFormat (
+              "binding %u is out of range, the shader has %zu bindings.",
+              indices[i], bindings_.size ()));
+        }
+      bindings_[indices[i]] = bindings[i];
+    }
+
+  return absl::OkStatus ();
 }
 
 absl::Status
-Pipeline::set_bindings_ (std::vector<Tensor> bindings)
+Pipeline::record_bindings (VkCommandBuffer cmd, VkDescriptorSet set,
+                           absl::Span<const Tensor> bindings,
+                           absl::Span<const uint32_t> indices)
 {
-  std::vector<VkDescriptorBufferInfo> descriptors;
-  descriptors.resize (bindings.size ());
+  if (!indices.empty () && indices.size () != bindings.size ())
+    {
+      return absl::InvalidArgumentError (
+          "Pipeline::record_bindings: bindings and indices mismatch.");
+    }
+
+  const size_t n = bindings_.size ();
+  std::array<VkDescriptorBufferInfo, kMaxBindings> descriptors;
+  std::array<bool, kMaxBindings> bound = {};
   for (size_t i = 0; i < bindings.size (); ++i)
     {
-      descriptors[i] = { bindings[i].data (), 0, VK_WHOLE_SIZE };
+      const uint32_t slot = indices.empty () ? i : indices[i];
+      if (slot >= n)
+        {
+          return absl::OutOfRangeError (absl::StrFormat (
+              "binding %u is out of range, the shader has %zu bindings.",
+              slot, n));
+        }
+      descriptors[slot] = { bindings[i].data (), bindings[i].offset (),
+                            bindings[i].range () };
+      bound[slot] = true;
+    }
+
+  for (size_t i = 0; i < n; ++i)
+    {
+      if (bound[i])
+        {
+          continue;
+        }
+      if (bindings_[i].data () == VK_NULL_HANDLE)
+        {
+          return absl::FailedPreconditionError (
+              absl::StrFormat ("binding %zu of pipeline is not bound.", i));
+        }
+      descriptors[i] = { bindings_[i].data (), bindings_[i].offset (),
+                         bindings_[i].range () };
+    }
+
+  if (!program_->push_descriptor && set == VK_NULL_HANDLE)
+    {
+      return absl::InvalidArgumentError (
+          "Pipeline::record_bindings: a descriptor set is required.");
     }
 
   if (device_->support_descriptor_templ_update ())
     {
-      vkUpdateDescriptorSetWithTemplate (device_->device (), descriptorSet_,
-                                         descriptor_update_template_,
-                                         descriptors.data ());
+      if (program_->push_descriptor)
+        {
+          device_->cmd_push_descriptor_set_with_template (
+              cmd, program_->descriptor_update_template, program_->layout,
+              descriptors.data ());
+        }
+      else
+        {
+          vkUpdateDescriptorSetWithTemplate (
+              device_->device (), set, program_->descriptor_update_template,
+              descriptors.data ());
+        }
     }
   else
     {
-      std::vector<VkWriteDescriptorSet> writes;
-      writes.resize (bindings.size ());
-      for (size_t i = 0; i < bindings.size (); ++i)
+      std::array<VkWriteDescriptorSet, kMaxBindings> writes;
+      for (size_t i = 0; i < n; ++i)
         {
           writes[i] = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
                         nullptr,
-                        descriptorSet_,
+                        set,
                         (uint32_t)i,
                         0,
                         1,
@@ -361,59 +566,50 @@ Pipeline::set_bindings_ (std::vector<Tensor> bindings)
                         &descriptors[i],
                         nullptr };
         }
-      vkUpdateDescriptorSets (device_->device (), writes.size (),
-                              writes.data (), 0, nullptr);
-    }
-
-  return absl::OkStatus ();
-}
 
-absl::Status
-Pipeline::set_bindings_ (std::vector<Tensor> bindings,
-                         const std::vector<uint32_t> &indices)
-{
-  std::vector<VkDescriptorBufferInfo> descriptors (indices.size ());
-  descriptors.resize (indices.size ());
+      if (program_->push_descriptor)
+        {
+          device_->cmd_push_descriptor_set (cmd, program_->layout, n,
+                                            writes.data ());
+        }
+      else
+        {
+          vkUpdateDescriptorSets (device_->device (), n, writes.data (), 0,
+                                  nullptr);
+        }
+    }
 
-  std::vector<VkWriteDescriptorSet> writes;
-  writes.resize (bindings.size ());
-  for (size_t i = 0; i < indices.size (); ++i)
+  if (!program_->push_descriptor)
     {
-      descriptors[i] = { bindings[i].data (), 0, VK_WHOLE_SIZE };
-      writes[i] = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-                    nullptr,
-                    descriptorSet_,
-                    indices[i],
-                    0,
-                    1,
-                    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-                    nullptr,
-                    &descriptors[i],
-                    nullptr };
+      vkCmdBindDescriptorSets (cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                               program_->layout, 0, 1, &set, 0, nullptr);
     }
 
-  vkUpdateDescriptorSets (device_->device (), writes.size (), writes.data (),
-                          0, nullptr);
-
   return absl::OkStatus ();
 }
 
 VkPipeline &
 Pipeline::vkpileine ()
 {
-  return pipeline_;
+  return program_->pipeline;
 }
 
-VkDescriptorSet &
-Pipeline::vkdescriptorset ()
+bool
+Pipeline::push_descriptor () const
 {
-  return descriptorSet_;
+  return program_ && program_->push_descriptor;
 }
 
 VkPipelineLayout &
 Pipeline::vklayout ()
 {
-  return pipelineLayout_;
+  return program_->layout;
+}
+
+VkDescriptorSetLayout &
+Pipeline::vkdescriptorsetlayout ()
+{
+  return program_->descriptor_set_layout;
 }
 
 VkQueryPool &
@@ -518,5 +714,15 @@ Pipeline::shader_info () const
 {
   return shaderInfo_;
 }
+
+VkAccessFlags
+Pipeline::binding_access (const uint32_t binding) const
+{
+  if (!program_ || binding >= program_->binding_access.size ())
+    {
+      return VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    }
+  return program_->binding_access[binding];
+}
 }
 
@@ -1,9 +1,15 @@
 #ifndef __VKLLAMA_CPP_PIPELINE_H__
 #define __VKLLAMA_CPP_PIPELINE_H__
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
 #include "gpu_device.h"
 #include "shader_constants.h"
 #include <array>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
@@ -11,6 +17,54 @@
 namespace vkllama
 {
 class Tensor;
+
+// Device objects of a pipeline that only depend on its shader,
+// specialization constants and ShaderInfo.
+struct PipelineProgram
+{
+  PipelineProgram (GPUDevice *dev);
+  ~PipelineProgram ();
+
+  GPUDevice *device;
+  // descriptors are pushed with VK_KHR_push_descriptor instead of being
+  // written to sets
+  bool push_descriptor;
+  VkShaderModule module;
+  VkDescriptorSetLayout descriptor_set_layout;
+  VkPipelineLayout layout;
+  VkPipeline pipeline;
+  VkDescriptorUpdateTemplate descriptor_update_template;
+  std::vector<VkAccessFlags> binding_access;
+};
+
+// Per-device table of PipelineProgram, so that op instances built from the
+// same shader and constants compile it once. Programs live as long as the
+// device.
+class PipelineRegistry
+{
+public:
+  struct Stats
+  {
+    size_t programs;
+    size_t hits;
+    size_t misses;
+  };
+
+  using Factory
+      = std::function<absl::StatusOr<std::shared_ptr<PipelineProgram> > ()>;
+
+  // returns the program stored under key, or stores the one made by create
+  absl::StatusOr<std::shared_ptr<PipelineProgram> >
+  get (std::string const &key, Factory const &create);
+  Stats stats () const;
+
+private:
+  std::unordered_map<std::string, std::shared_ptr<PipelineProgram> >
+      programs_;
+  Stats stats_ = { 0, 0, 0 };
+  mutable std::mutex mutex_;
+};
+
 class Pipeline
 {
 public:
@@ -27,10 +81,15 @@ public:
 
   ~Pipeline ();
 
+  // upper bound of binding_count, which keeps record_bindings on the stack.
+  // It is also the smallest maxPushDescriptors allowed by the spec.
+  static constexpr size_t kMaxBindings = 32;
+
   absl::Status init ();
   VkPipeline &vkpileine ();
-  VkDescriptorSet &vkdescriptorset ();
   VkPipelineLayout &vklayout ();
+  VkDescriptorSetLayout &vkdescriptorsetlayout ();
+  bool push_descriptor () const;
   VkQueryPool &vkquerypool ();
   uint64_t time ();
 
@@ -38,43 +97,49 @@ public:
   uint32_t group_y () const;
   uint32_t group_z () const;
   absl::Status set_group (uint32_t x, uint32_t y, uint32_t z);
+  // Binds tensors that stay the same for every dispatch, such as weights.
   absl::Status update_bindings (std::vector<Tensor> bindings);
   absl::Status update_bindings (std::vector<Tensor> bindings,
                                 std::vector<uint32_t> const &indices);
 
+  // Records the descriptors of one dispatch into cmd: bindings at indices
+  // plus whatever update_bindings bound to the other slots. They are pushed
+  // when the device supports VK_KHR_push_descriptor, otherwise written to
+  // set, which the caller allocates from vkdescriptorsetlayout () for every
+  // dispatch. Empty indices bind bindings[i] to slot i.
+  absl::Status record_bindings (VkCommandBuffer cmd, VkDescriptorSet set,
+                                absl::Span<const Tensor> bindings,
+                                absl::Span<const uint32_t> indices);
+
   ShaderInfo const &shader_info () const;
+  // SHADER_READ and/or SHADER_WRITE, as declared by the shader's readonly
+  // and writeonly qualifiers on the buffer bound at binding
+  VkAccessFlags binding_access (const uint32_t binding) const;
   void query_exec_timestamp ();
 
 private:
   bool init_;
-  VkShaderModule module_;
   const uint8_t *spv_;
   const size_t spv_size_;
   ShaderInfo shaderInfo_;
   ShaderConstants specialization_;
 
   GPUDevice *device_;
-  VkDescriptorSetLayout descriptorSetLayout_;
-  VkDescriptorPool descriptorPool_;
-  VkDescriptorSet descriptorSet_;
-  VkPipelineLayout pipelineLayout_;
-  VkPipeline pipeline_;
+  std::shared_ptr<PipelineProgram> program_;
+  std::vector<Tensor> bindings_;
   int x_;
   int y_;
   int z_;
   VkQueryPool queryPool_;
-  VkDescriptorUpdateTemplate descriptor_update_template_;
   std::array<uint64_t, 2> time_stamps_;
 
-  absl::Status create_shader_module_ ();
-  absl::Status create_pipeline_layout_ ();
-  absl::Status create_descriptor_set_ ();
-  absl::Status create_pipeline_ (ShaderConstants const &);
+  absl::Status create_shader_module_ (PipelineProgram &program);
+  absl::Status create_pipeline_layout_ (PipelineProgram &program);
+  absl::Status create_pipeline_ (PipelineProgram &program,
+                                 ShaderConstants const &);
   absl::Status create_query_pool_ ();
-  absl::Status create_descriptor_update_template_ ();
-  absl::Status set_bindings_ (std::vector<Tensor> bindings);
-  absl::Status set_bindings_ (std::vector<Tensor> bindings,
-                              std::vector<uint32_t> const &indices);
+  absl::Status create_descriptor_update_template_ (PipelineProgram &program);
+  absl::Status reflect_binding_access_ (PipelineProgram &program);
   absl::Status limits_ ();
 };
 }
@@ -1,22 +1,30 @@
 #ifndef __VKLLAMA_SHADER_CONSTANTS_H__
 #define __VKLLAMA_SHADER_CONSTANTS_H__
 
+#include "absl/types/span.h"
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <initializer_list>
 #include <iterator>
 #include <tuple>
 #include <utility>
-#include <vector>
 
 namespace vkllama
 {
+// Specialization and push constants, stored inline so that building them
+// for a dispatch does not touch the heap. Push constants are limited to 128
+// bytes on many devices, specializations are a few scalars.
 class ShaderConstants
 {
 public:
+  static constexpr size_t kMaxBytes = 256;
+  static constexpr size_t kMaxElems = 32;
+
   ShaderConstants () = default;
-  ShaderConstants (ShaderConstants const &other)
-      : data_ (other.data_), offset_ (other.offset_), sizes_ (other.sizes_)
-  {
-  }
+  ShaderConstants (ShaderConstants const &other) = default;
 
   template <typename... Args> ShaderConstants (Args const &...args)
   {
@@ -36,9 +44,7 @@ public:
   operator+= (ShaderConstants const &rhs)
   {
     const auto *p = rhs.data ();
-    const auto &sizes = rhs.sizes ();
-
-    for (auto const size : sizes)
+    for (auto const size : rhs.sizes ())
       {
         push_back (p, size);
         p += size;
@@ -46,14 +52,7 @@ public:
     return *this;
   }
 
-  ShaderConstants &
-  operator= (ShaderConstants const &rhs)
-  {
-    data_ = rhs.data_;
-    offset_ = rhs.offset_;
-    sizes_ = rhs.sizes_;
-    return *this;
-  }
+  ShaderConstants &operator= (ShaderConstants const &rhs) = default;
 
   ShaderConstants
   operator+ (const ShaderConstants &rhs)
@@ -73,26 +72,31 @@ public:
   void
   push_back (uint8_t const *v, size_t len)
   {
-    const auto offset = data_.size ();
-    for (size_t i = 0; i < len; ++i)
+    if (bytes_ + len > kMaxBytes || elems_ == kMaxElems)
       {
-        data_.push_back (v[i]);
+        fprintf (stderr,
+                 "ShaderConstants: more than %zu bytes or %zu constants.\n",
+                 kMaxBytes, kMaxElems);
+        abort ();
       }
 
-    offset_.push_back (offset);
-    sizes_.push_back (len);
+    ::memcpy (data_.data () + bytes_, v, len);
+    offset_[elems_] = bytes_;
+    sizes_[elems_] = len;
+    bytes_ += len;
+    elems_ += 1;
   }
 
   size_t
   elem_num () const
   {
-    return offset_.size ();
+    return elems_;
   }
 
   size_t
   bytes () const
   {
-    return data_.size ();
+    return bytes_;
   }
 
   const uint8_t *
@@ -101,22 +105,24 @@ public:
     return data_.data ();
   }
 
-  std::vector<size_t> const &
+  absl::Span<const uint32_t>
   offsets () const
   {
-    return offset_;
+    return absl::MakeConstSpan (offset_.data (), elems_);
   }
 
-  std::vector<size_t> const &
+  absl::Span<const uint32_t>
   sizes () const
   {
-    return sizes_;
+    return absl::MakeConstSpan (sizes_.data (), elems_);
   }
 
 private:
-  std::vector<uint8_t> data_;
-  std::vector<size_t> offset_;
-  std::vector<size_t> sizes_;
+  std::array<uint8_t, kMaxBytes> data_;
+  std::array<uint32_t, kMaxElems> offset_;
+  std::array<uint32_t, kMaxElems> sizes_;
+  size_t bytes_ = 0;
+  size_t elems_ = 0;
 };
 
 }
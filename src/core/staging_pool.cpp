@@ -0,0 +1,276 @@
+#include "staging_pool.h"
+#include "absl/strings/str_format.h"
+#include "gpu_device.h"
+#include "src/core/common.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+namespace vkllama
+{
+StagingBuffer::StagingBuffer (StagingPool *pool, const int chunk,
+                              VmaVirtualAllocation range, VkBuffer buffer,
+                              VmaAllocation allocation, VkDeviceSize offset,
+                              VkDeviceSize bytes, void *host)
+    : pool_ (pool), chunk_ (chunk), range_ (range), buffer_ (buffer),
+      allocation_ (allocation), offset_ (offset), bytes_ (bytes), host_ (host)
+{
+}
+
+StagingBuffer::~StagingBuffer () { pool_->release_ (this); }
+
+VkBuffer
+StagingBuffer::buffer () const
+{
+  return buffer_;
+}
+
+VkDeviceSize
+StagingBuffer::offset () const
+{
+  return offset_;
+}
+
+VkDeviceSize
+StagingBuffer::bytes () const
+{
+  return bytes_;
+}
+
+void *
+StagingBuffer::host () const
+{
+  return host_;
+}
+
+absl::Status
+StagingBuffer::flush ()
+{
+  auto ret = vmaFlushAllocation (pool_->dev_->allocator (), allocation_,
+                                 offset_, bytes_);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::InternalError (
+          absl::StrFormat ("failed at flushing staging buffer %d", int (ret)));
+    }
+  return absl::OkStatus ();
+}
+
+absl::Status
+StagingBuffer::invalid ()
+{
+  auto ret = vmaInvalidateAllocation (pool_->dev_->allocator (), allocation_,
+                                      offset_, bytes_);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::InternalError (absl::StrFormat (
+          "failed at invaliding staging buffer, ret = %d", int (ret)));
+    }
+  return absl::OkStatus ();
+}
+
+StagingPool::StagingPool (GPUDevice *dev, const VkDeviceSize budget)
+    : dev_ (dev), budget_ (budget)
+{
+  stats_ = { 0, 0, 0, 0 };
+}
+
+StagingPool::~StagingPool ()
+{
+  for (auto &chunk : chunks_)
+    {
+      vmaClearVirtualBlock (chunk.block);
+      vmaDestroyVirtualBlock (chunk.block);
+      vmaDestroyBuffer (dev_->allocator (), chunk.buffer, chunk.allocation);
+    }
+}
+
+absl::Status
+StagingPool::create_buffer_ (const VkDeviceSize bytes, VkBuffer &buffer,
+                             VmaAllocation &allocation, void *&host)
+{
+  VkBufferCreateInfo createInfo
+      = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+          nullptr,
+          0,
+          bytes,
+          VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+          VK_SHARING_MODE_EXCLUSIVE,
+          0,
+          nullptr };
+
+  // staging serves downloads as well as uploads, so it is read by the host
+  VmaAllocationCreateInfo allocInfo
+      = { VMA_ALLOCATION_CREATE_MAPPED_BIT
+              | VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+          VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+          0,
+          0,
+          0,
+          VK_NULL_HANDLE,
+          nullptr,
+          0 };
+
+  VmaAllocationInfo info;
+  auto ret = vmaCreateBuffer (dev_->allocator (), &createInfo, &allocInfo,
+                              &buffer, &allocation, &info);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::InternalError (absl::StrFormat (
+          "failed at creating staging buffer: %d", int (ret)));
+    }
+
+  host = info.pMappedData;
+  stats_.allocated_bytes += bytes;
+  return absl::OkStatus ();
+}
+
+absl::Status
+StagingPool::add_chunk_ (const VkDeviceSize bytes)
+{
+  Chunk chunk = { VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE, bytes,
+                  nullptr };
+
+  VmaVirtualBlockCreateInfo blockInfo = { bytes, 0, nullptr };
+  auto ret = vmaCreateVirtualBlock (&blockInfo, &chunk.block);
+  if (ret != VK_SUCCESS)
+    {
+      return absl::InternalError (absl::StrFormat (
+          "failed at creating staging virtual block: %d", int (ret)));
+    }
+
+  auto s = create_buffer_ (bytes, chunk.buffer, chunk.allocation, chunk.host);
+  if (!s.ok ())
+    {
+      vmaDestroyVirtualBlock (chunk.block);
+      return s;
+    }
+
+  chunks_.push_back (chunk);
+  stats_.chunk_count = chunks_.size ();
+  return absl::OkStatus ();
+}
+
+absl::StatusOr<std::shared_ptr<StagingBuffer> >
+StagingPool::acquire (const VkDeviceSize bytes)
+{
+  if (bytes == 0)
+    {
+      return absl::InvalidArgumentError (
+          "StagingPool: cannot acquire an empty staging buffer.");
+    }
+
+  std::lock_guard<std::mutex> lock (mutex_);
+
+  // neighbouring ranges must not share a non-coherent atom, or flushing one
+  // would clobber the other.
+  const VkDeviceSize align = std::max<VkDeviceSize> (
+      dev_->limits ().nonCoherentAtomSize, 1);
+  const VkDeviceSize aligned = (bytes + align - 1) / align * align;
+  VmaVirtualAllocationCreateInfo rangeInfo = { aligned, align, 0, nullptr };
+
+  auto make_buffer = [&] (const int i, VmaVirtualAllocation range,
+                          VkDeviceSize offset) {
+    auto const &chunk = chunks_[i];
+    stats_.in_use_bytes += aligned;
+    return std::shared_ptr<StagingBuffer> (new StagingBuffer (
+        this, i, range, chunk.buffer, chunk.allocation, offset, bytes,
+        static_cast<uint8_t *> (chunk.host) + offset));
+  };
+
+  for (size_t i = 0; i < chunks_.size (); ++i)
+    {
+      VmaVirtualAllocation range;
+      VkDeviceSize offset = 0;
+      if (vmaVirtualAllocate (chunks_[i].block, &rangeInfo, &range, &offset)
+          == VK_SUCCESS)
+        {
+          stats_.recycled_bytes += bytes;
+          return make_buffer (i, range, offset);
+        }
+    }
+
+  VkDeviceSize pooled = 0;
+  for (auto const &chunk : chunks_)
+    {
+      pooled += chunk.bytes;
+    }
+
+  const auto chunk_bytes = std::max (kChunkBytes, aligned);
+  if (pooled + chunk_bytes <= budget_)
+    {
+      VKLLAMA_STATUS_OK (add_chunk_ (chunk_bytes));
+
+      const int i = chunks_.size () - 1;
+      VmaVirtualAllocation range;
+      VkDeviceSize offset = 0;
+      auto ret = vmaVirtualAllocate (chunks_[i].block, &rangeInfo, &range,
+                                     &offset);
+      if (ret != VK_SUCCESS)
+        {
+          return absl::InternalError (absl::StrFormat (
+              "failed at allocating from a new staging chunk: %d",
+              int (ret)));
+        }
+      return make_buffer (i, range, offset);
+    }
+
+  // over budget: a dedicated buffer that is freed on release
+  VkBuffer buffer = VK_NULL_HANDLE;
+  VmaAllocation allocation = VK_NULL_HANDLE;
+  void *host = nullptr;
+  auto s = create_buffer_ (aligned, buffer, allocation, host);
+  if (!s.ok ())
+    {
+      return s;
+    }
+
+  stats_.in_use_bytes += aligned;
+  return std::shared_ptr<StagingBuffer> (new StagingBuffer (
+      this, -1, VK_NULL_HANDLE, buffer, allocation, 0, bytes, host));
+}
+
+void
+StagingPool::release_ (StagingBuffer *buffer)
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  const VkDeviceSize align = std::max<VkDeviceSize> (
+      dev_->limits ().nonCoherentAtomSize, 1);
+  const VkDeviceSize aligned = (buffer->bytes_ + align - 1) / align * align;
+  stats_.in_use_bytes -= aligned;
+
+  // a dedicated buffer was allocated with its aligned size
+  if (buffer->chunk_ < 0)
+    {
+      vmaDestroyBuffer (dev_->allocator (), buffer->buffer_,
+                        buffer->allocation_);
+      stats_.allocated_bytes -= aligned;
+      return;
+    }
+
+  vmaVirtualFree (chunks_[buffer->chunk_].block, buffer->range_);
+}
+
+void
+StagingPool::set_budget (const VkDeviceSize budget)
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  budget_ = budget;
+}
+
+VkDeviceSize
+StagingPool::budget () const
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  return budget_;
+}
+
+StagingPool::Stats
+StagingPool::stats () const
+{
+  std::lock_guard<std::mutex> lock (mutex_);
+  return stats_;
+}
+}
@@ -0,0 +1,108 @@
+#ifndef __VKLLAMA_STAGING_POOL_H__
+#define __VKLLAMA_STAGING_POOL_H__
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "vk_mem_alloc.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+namespace vkllama
+{
+class GPUDevice;
+class StagingPool;
+
+// A persistently mapped range handed out by StagingPool. The range goes
+// back to the pool when the buffer is destroyed, so a Command keeps it alive
+// in a deferred task until the copy reading or writing it has been waited.
+class StagingBuffer
+{
+public:
+  ~StagingBuffer ();
+
+  VkBuffer buffer () const;
+  VkDeviceSize offset () const;
+  VkDeviceSize bytes () const;
+  void *host () const;
+  absl::Status flush ();
+  absl::Status invalid ();
+
+private:
+  friend class StagingPool;
+  StagingBuffer (StagingPool *pool, const int chunk,
+                 VmaVirtualAllocation range, VkBuffer buffer,
+                 VmaAllocation allocation, VkDeviceSize offset,
+                 VkDeviceSize bytes, void *host);
+
+  StagingPool *pool_;
+  // index of the pool chunk, -1 for a dedicated allocation
+  const int chunk_;
+  VmaVirtualAllocation range_;
+  VkBuffer buffer_;
+  VmaAllocation allocation_;
+  const VkDeviceSize offset_;
+  const VkDeviceSize bytes_;
+  void *host_;
+};
+
+// Per-device staging memory for uploads and downloads. Requests are
+// sub-allocated from host visible chunks that stay mapped for the lifetime
+// of the pool; chunks are created lazily until their total reaches the
+// budget, and requests that do not fit after that get a dedicated buffer
+// which is freed on release.
+class StagingPool
+{
+public:
+  struct Stats
+  {
+    // bytes of device memory allocated for staging, chunks and dedicated
+    // buffers alike
+    size_t allocated_bytes;
+    // bytes of requests served from pool memory without a new allocation
+    size_t recycled_bytes;
+    size_t in_use_bytes;
+    size_t chunk_count;
+  };
+
+  static constexpr VkDeviceSize kDefaultBudget = 256ul << 20;
+  static constexpr VkDeviceSize kChunkBytes = 64ul << 20;
+
+  StagingPool (GPUDevice *dev, const VkDeviceSize budget = kDefaultBudget);
+  ~StagingPool ();
+
+  absl::StatusOr<std::shared_ptr<StagingBuffer> >
+  acquire (const VkDeviceSize bytes);
+
+  // takes effect for chunks created afterwards
+  void set_budget (const VkDeviceSize budget);
+  VkDeviceSize budget () const;
+  Stats stats () const;
+
+private:
+  friend class StagingBuffer;
+
+  struct Chunk
+  {
+    VkBuffer buffer;
+    VmaAllocation allocation;
+    VmaVirtualBlock block;
+    VkDeviceSize bytes;
+    void *host;
+  };
+
+  absl::Status create_buffer_ (const VkDeviceSize bytes, VkBuffer &buffer,
+                               VmaAllocation &allocation, void *&host);
+  absl::Status add_chunk_ (const VkDeviceSize bytes);
+  void release_ (StagingBuffer *buffer);
+
+  GPUDevice *dev_;
+  VkDeviceSize budget_;
+  std::vector<Chunk> chunks_;
+  Stats stats_;
+  mutable std::mutex mutex_;
+};
+}
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef __VKLLAMA_TASK_ARENA_H__
+#define __VKLLAMA_TASK_ARENA_H__
+
+#include "absl/status/status.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace vkllama
+{
+// Deferred tasks of a Command. The callables are placed in blocks that are
+// kept across clear (), so a command recorded over and over stops
+// allocating once its blocks and task list have grown large enough.
+class TaskArena
+{
+public:
+  TaskArena () : block_ (0) {}
+  TaskArena (TaskArena const &) = delete;
+  TaskArena &operator= (TaskArena const &) = delete;
+  ~TaskArena () { clear (); }
+
+  template <typename Fn>
+  void
+  push_back (Fn &&fn)
+  {
+    using T = typename std::decay<Fn>::type;
+    void *p = allocate_ (sizeof (T), alignof (T));
+    auto *task = new (p) T (std::forward<Fn> (fn));
+    tasks_.push_back (
+        { task,
+          [] (void *t) -> absl::Status { return (*static_cast<T *> (t)) (); },
+          [] (void *t) { static_cast<T *> (t)->~T (); } });
+  }
+
+  // runs every task in order and returns the last failure
+  absl::Status
+  run ()
+  {
+    absl::Status result = absl::OkStatus ();
+    for (auto &task : tasks_)
+      {
+        if (auto ret = task.invoke (task.object); !ret.ok ())
+          {
+            result = ret;
+          }
+      }
+    return result;
+  }
+
+  void
+  clear ()
+  {
+    for (auto &task : tasks_)
+      {
+        task.destroy (task.object);
+      }
+    tasks_.clear ();
+
+    for (auto &block : blocks_)
+      {
+        block.used = 0;
+      }
+    block_ = 0;
+  }
+
+  size_t
+  size () const
+  {
+    return tasks_.size ();
+  }
+
+  bool
+  empty () const
+  {
+    return tasks_.empty ();
+  }
+
+private:
+  static constexpr size_t kBlockBytes = 4096;
+
+  struct Task
+  {
+    void *object;
+    absl::Status (*invoke) (void *);
+    void (*destroy) (void *);
+  };
+
+  struct Block
+  {
+    std::unique_ptr<uint8_t[]> data;
+    size_t bytes;
+    size_t used;
+  };
+
+  void *
+  allocate_ (const size_t bytes, const size_t align)
+  {
+    for (; block_ < blocks_.size (); ++block_)
+      {
+        auto &block = blocks_[block_];
+        const auto base = reinterpret_cast<uintptr_t> (block.data.get ());
+        const auto start = (base + block.used + align - 1) / align * align;
+        if (start + bytes <= base + block.bytes)
+          {
+            block.used = start + bytes - base;
+            return reinterpret_cast<void *> (start);
+          }
+      }
+
+    const auto n = std::max (kBlockBytes, bytes + align);
+    blocks_.push_back ({ std::unique_ptr<uint8_t[]> (new uint8_t[n]), n, 0 });
+    block_ = blocks_.size () - 1;
+    return allocate_ (bytes, align);
+  }
+
+  std::vector<Task> tasks_;
+  std::vector<Block> blocks_;
+  // first block with room left
+  size_t block_;
+};
+}
+
+#endif
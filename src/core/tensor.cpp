@@ -3,6 +3,7 @@
 #include "gpu_device.h"
 #include "src/core/quants.h"
 #include "vk_mem_alloc.h"
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cstddef>
@@ -13,10 +14,9 @@ namespace vkllama
 {
 Tensor::Tensor ()
     : c_ (0), h_ (0), w_ (0), cs_ (0), hs_ (0), ws_ (0), dev_ (nullptr),
-      visable_ (false), dtype_ (FP32), data_ (VK_NULL_HANDLE),
+      visable_ (false), dtype_ (FP32), data_ (VK_NULL_HANDLE), offset_ (0),
       status_ (nullptr)
 {
-  mem_ = { 0, 0, 0, 0, 0, 0, 0 };
 }
 
 Tensor::Tensor (const int c, const int h, const int w, GPUDevice *dev,
@@ -29,17 +29,16 @@ Tensor::Tensor (const int c, const int h, const int w, const int cs,
                 const int hs, const int ws, GPUDevice *dev, const DType dtype,
                 const bool visable)
     : c_ (c), h_ (h), w_ (w), cs_ (cs), hs_ (hs), ws_ (ws), dev_ (dev),
-      visable_ (visable), dtype_ (dtype), data_ (VK_NULL_HANDLE),
+      visable_ (visable), dtype_ (dtype), data_ (VK_NULL_HANDLE), offset_ (0),
       status_ (nullptr)
 {
-  mem_ = { 0, 0, 0, 0, 0, 0, 0 };
 }
 
 Tensor::Tensor (const Tensor &rhs)
     : c_ (rhs.channels ()), h_ (rhs.height ()), w_ (rhs.width ()),
       cs_ (rhs.cs ()), hs_ (rhs.hs ()), ws_ (rhs.ws ()), dev_ (rhs.dev_),
       visable_ (rhs.visable ()), dtype_ (rhs.dtype_), data_ (rhs.data_),
-      mem_ (rhs.mem_), allocation_ (rhs.allocation_), status_ (rhs.status_)
+      offset_ (rhs.offset_), status_ (rhs.status_)
 {
   if (status_)
     {
@@ -51,7 +50,7 @@ Tensor::Tensor (Tensor &&rhs)
     : c_ (rhs.channels ()), h_ (rhs.height ()), w_ (rhs.width ()),
       cs_ (rhs.cs ()), hs_ (rhs.hs ()), ws_ (rhs.ws ()), dev_ (rhs.dev_),
       visable_ (rhs.visable_), dtype_ (rhs.dtype_), data_ (rhs.data_),
-      mem_ (rhs.mem_), allocation_ (rhs.allocation_), status_ (rhs.status_)
+      offset_ (rhs.offset_), status_ (rhs.status_)
 {
   rhs.status_ = nullptr;
 }
@@ -76,8 +75,7 @@ Tensor::operator= (Tensor const &rhs)
   visable_ = rhs.visable_;
   dtype_ = rhs.dtype_;
   data_ = rhs.data_;
-  mem_ = rhs.mem_;
-  allocation_ = rhs.allocation_;
+  offset_ = rhs.offset_;
   status_ = rhs.status_;
 
   return *this;
@@ -109,49 +107,35 @@ Tensor::elem_bytes () const
 }
 
 absl::Status
-Tensor::create ()
+Tensor::create (const MemoryKind kind)
 {
   update_strides_ ();
-  auto bytes = this->bytes ();
-
-  {
-    VkBufferCreateInfo createInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-                                      nullptr,
-                                      0,
-                                      bytes,
-                                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
-                                          | VK_BUFFER_USAGE_TRANSFER_DST_BIT
-                                          | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                      VK_SHARING_MODE_EXCLUSIVE,
-                                      0,
-                                      nullptr };
-
-    VmaAllocationCreateFlags flags = 0;
-    if (visable_)
-      {
-        flags = VMA_ALLOCATION_CREATE_MAPPED_BIT
-                | VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT;
-      }
-
-    VmaAllocationCreateInfo allocInfo
-        = { flags,   VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-            0,       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            0,       VK_NULL_HANDLE,
-            nullptr, 0 };
-
-    auto ret = vmaCreateBuffer (dev_->allocator (), &createInfo, &allocInfo,
-                                &data_, &allocation_, &mem_);
-    if (ret != VK_SUCCESS)
-      {
-        return absl::InternalError (
-            absl::StrFormat ("failed at creating vma buffer: %d", int (ret)));
-      }
-  }
+
+  // weights and kv caches written by the host are mapped when device
+  // memory is, so uploads skip staging
+  if (dev_->unified_memory () && kind != ACTIVATION_MEMORY)
+    {
+      visable_ = true;
+    }
+
+  auto &pool = dev_->memory_pool (kind);
+  auto range = pool.acquire (bytes (), visable_);
+  if (!range.ok ())
+    {
+      return range.status ();
+    }
+
+  data_ = range->buffer;
+  offset_ = range->offset;
 
   status_ = new __TensorStatus ();
   status_->access_flags_ = (0);
   status_->pipeline_stage_ = (0);
+  status_->queue_family_ = VK_QUEUE_FAMILY_IGNORED;
+  status_->pending_queue_family_ = VK_QUEUE_FAMILY_IGNORED;
   status_->ref_.store (1);
+  status_->pool_ = &pool;
+  status_->range_ = *range;
   return absl::OkStatus ();
 }
 
@@ -165,7 +149,13 @@ Tensor::bytes () const
 void *
 Tensor::host ()
 {
-  return mem_.pMappedData;
+  if (!status_ || !status_->range_.host)
+    {
+      return nullptr;
+    }
+
+  return static_cast<uint8_t *> (status_->range_.host)
+         + (offset_ - status_->range_.offset);
 }
 
 VkAccessFlags
@@ -181,7 +171,7 @@ Tensor::pipeline_stage () const
 }
 
 void
-Tensor::set_access_flags (VkAccessFlags flags)
+Tensor::set_access_flags (VkAccessFlags flags) const
 {
   if (!status_)
     return;
@@ -189,13 +179,34 @@ Tensor::set_access_flags (VkAccessFlags flags)
 }
 
 void
-Tensor::set_pipeline_stage (VkPipelineStageFlags stage)
+Tensor::set_pipeline_stage (VkPipelineStageFlags stage) const
 {
   if (!status_)
     return;
   status_->pipeline_stage_ = stage;
 }
 
+uint32_t
+Tensor::queue_family () const
+{
+  return status_ ? status_->queue_family_ : VK_QUEUE_FAMILY_IGNORED;
+}
+
+uint32_t
+Tensor::pending_queue_family () const
+{
+  return status_ ? status_->pending_queue_family_ : VK_QUEUE_FAMILY_IGNORED;
+}
+
+void
+Tensor::set_queue_family (const uint32_t family, const uint32_t pending) const
+{
+  if (!status_)
+    return;
+  status_->queue_family_ = family;
+  status_->pending_queue_family_ = pending;
+}
+
 bool
 Tensor::visable () const
 {
@@ -301,12 +312,139 @@ Tensor::view (size_t c, size_t h, size_t w)
   return v;
 }
 
+absl::StatusOr<Tensor>
+Tensor::alias (size_t c, size_t h, size_t w, DType dtype) const
+{
+  Tensor v = *this;
+  v.c_ = c;
+  v.h_ = h;
+  v.w_ = w;
+  v.dtype_ = dtype;
+  v.update_strides_ ();
+
+  if (v.bytes () > bytes ())
+    {
+      return absl::OutOfRangeError (absl::StrFormat (
+          "alias of %zu bytes does not fit in a tensor of %zu bytes.",
+          v.bytes (), bytes ()));
+    }
+
+  return v;
+}
+
+absl::StatusOr<Tensor>
+Tensor::view_at (VkDeviceSize offset, size_t c, size_t h, size_t w) const
+{
+  Tensor v = *this;
+  v.c_ = c;
+  v.h_ = h;
+  v.w_ = w;
+  v.update_strides_ ();
+  v.offset_ += offset;
+
+  const auto align = std::max<VkDeviceSize> (
+      dev_->limits ().minStorageBufferOffsetAlignment, 1);
+  if (v.offset_ % align != 0)
+    {
+      return absl::FailedPreconditionError (absl::StrFormat (
+          "view at offset %zu is not aligned to %zu bytes.",
+          size_t (v.offset_), size_t (align)));
+    }
+
+  // bytes () of the view is what barriers and copies cover
+  const VkDeviceSize bytes = v.bytes ();
+  if (offset > range () || bytes > range () - offset)
+    {
+      return absl::OutOfRangeError (absl::StrFormat (
+          "view of %zu bytes at offset %zu is past the end of a %zu bytes "
+          "range.",
+          size_t (bytes), size_t (offset), size_t (range ())));
+    }
+
+  return v;
+}
+
+absl::StatusOr<Tensor>
+Tensor::slice (std::array<size_t, 3> const &starts,
+               std::array<size_t, 3> const &extents) const
+{
+  const auto shape = this->shape ();
+  for (int i = 0; i < 3; ++i)
+    {
+      if (starts[i] + extents[i] > shape[i])
+        {
+          return absl::OutOfRangeError (absl::StrFormat (
+              "slice starts = (%zu, %zu, %zu) extents = (%zu, %zu, %zu) "
+              "from (%zu, %zu, %zu) shape tensor",
+              starts[0], starts[1], starts[2], extents[0], extents[1],
+              extents[2], shape[0], shape[1], shape[2]));
+        }
+    }
+
+  // whole rows of one channel, or whole channels
+  const bool rows = starts[2] == 0 && extents[2] == shape[2]
+                    && (extents[0] == 1
+                        || (starts[1] == 0 && extents[1] == shape[1]));
+  if (!contiguous () || !rows)
+    {
+      return absl::FailedPreconditionError (
+          "slice is not a contiguous range of the tensor.");
+    }
+
+  return view_at (starts[0] * cs_ + starts[1] * hs_, extents[0], extents[1],
+                  extents[2]);
+}
+
+bool
+Tensor::contiguous () const
+{
+  const auto property = get_dtype_property (dtype_);
+  const size_t hs = (w_ + property.items_per_block - 1)
+                    / property.items_per_block * property.bytes_per_block;
+  return (size_t)hs_ == hs && (size_t)cs_ == h_ * hs;
+}
+
 VkBuffer &
 Tensor::data ()
 {
   return data_;
 }
 
+VkBuffer
+Tensor::data () const
+{
+  return data_;
+}
+
+VkDeviceSize
+Tensor::offset () const
+{
+  return offset_;
+}
+
+VkDeviceSize
+Tensor::range () const
+{
+  if (!status_)
+    {
+      return 0;
+    }
+
+  return status_->range_.offset + status_->range_.bytes - offset_;
+}
+
+VkDeviceSize
+Tensor::barrier_offset () const
+{
+  return status_ ? status_->range_.offset : offset_;
+}
+
+VkDeviceSize
+Tensor::barrier_bytes () const
+{
+  return status_ ? status_->range_.bytes : bytes ();
+}
+
 absl::Status
 Tensor::flush ()
 {
@@ -316,10 +454,9 @@ Tensor::flush ()
           absl::StrFormat ("cannot flush to invisable tensor"));
     }
 
-  VkMappedMemoryRange range = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr,
-                                mem_.deviceMemory, mem_.offset, mem_.size };
-
-  auto ret = vkFlushMappedMemoryRanges (dev_->device (), 1, &range);
+  auto ret = vmaFlushAllocation (dev_->allocator (),
+                                 status_->range_.allocation, offset_,
+                                 std::min<VkDeviceSize> (bytes (), range ()));
   if (ret != VK_SUCCESS)
     {
       return absl::InternalError (
@@ -338,10 +475,9 @@ Tensor::invalid ()
           absl::StrFormat ("cannot invalid an invisable tensor"));
     }
 
-  VkMappedMemoryRange range = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr,
-                                mem_.deviceMemory, mem_.offset, mem_.size };
-
-  auto ret = vkInvalidateMappedMemoryRanges (dev_->device (), 1, &range);
+  auto ret = vmaInvalidateAllocation (
+      dev_->allocator (), status_->range_.allocation, offset_,
+      std::min<VkDeviceSize> (bytes (), range ()));
   if (ret != VK_SUCCESS)
     {
       return absl::InternalError (absl::StrFormat (
@@ -356,9 +492,9 @@ Tensor::release_ ()
 {
   if (status_ && (status_->ref_.fetch_sub (1)) == 1)
     {
-      if (data_ != VK_NULL_HANDLE)
+      if (status_->pool_)
         {
-          vmaDestroyBuffer (dev_->allocator (), data_, allocation_);
+          status_->pool_->release (status_->range_);
         }
 
       delete status_;
@@ -2,7 +2,9 @@
 #define __VKLLAMA_TENSOR__
 
 #include "absl/status/status.h"
+#include "absl/status/statusor.h"
 #include "gpu_device.h"
+#include "memory_pool.h"
 #include "src/core/common.h"
 #include "src/core/shader_constants.h"
 #include <array>
@@ -30,6 +32,24 @@ public:
   Tensor (Tensor &&rhs);
 
   Tensor view (size_t c, size_t h, size_t w);
+  // A tensor of another shape and dtype at the start of the same buffer,
+  // sharing its access state and lifetime. It must fit in bytes ().
+  absl::StatusOr<Tensor> alias (size_t c, size_t h, size_t w,
+                                DType dtype) const;
+  // A dense tensor of the shape starting offset bytes into this one, which
+  // binds at its own descriptor offset and shares the access state and
+  // lifetime of the tensor, so its barriers cover the whole allocation. Its
+  // start must meet the storage buffer offset alignment of the device and
+  // its end must lie within the allocation.
+  absl::StatusOr<Tensor> view_at (VkDeviceSize offset, size_t c, size_t h,
+                                  size_t w) const;
+  // The part of a contiguous tensor at starts of extents, as a view when it
+  // is a single range of whole rows view_at () can bind, an error otherwise
+  // in which case the caller has to copy it.
+  absl::StatusOr<Tensor> slice (std::array<size_t, 3> const &starts,
+                                std::array<size_t, 3> const &extents) const;
+  // the strides are the dense ones of the shape
+  bool contiguous () const;
 
   ~Tensor ();
 
@@ -47,12 +67,32 @@ public:
   absl::Status reshape (size_t const c, size_t const h, size_t const w);
   VkAccessFlags access_flags () const;
   VkPipelineStageFlags pipeline_stage () const;
-  void set_access_flags (VkAccessFlags access_flags);
-  void set_pipeline_stage (VkPipelineStageFlags stage_flags);
+  // the access state is shared by all copies of a tensor
+  void set_access_flags (VkAccessFlags access_flags) const;
+  void set_pipeline_stage (VkPipelineStageFlags stage_flags) const;
+  // The queue family owning the tensor, shared like the access state, and
+  // the family it has been released to until that family acquires it.
+  // VK_QUEUE_FAMILY_IGNORED for a tensor no queue has used yet.
+  uint32_t queue_family () const;
+  uint32_t pending_queue_family () const;
+  void set_queue_family (const uint32_t family,
+                         const uint32_t pending
+                         = VK_QUEUE_FAMILY_IGNORED) const;
 
   VkBuffer &data ();
-
-  absl::Status create ();
+  VkBuffer data () const;
+  // where the tensor starts in data (), which it may share with others
+  VkDeviceSize offset () const;
+  // bytes of data () from offset () a descriptor of the tensor may cover
+  VkDeviceSize range () const;
+  // the part of data () the access state covers, shared by the views and
+  // aliases of the tensor, which its barriers must cover as a whole
+  VkDeviceSize barrier_offset () const;
+  VkDeviceSize barrier_bytes () const;
+
+  // Takes memory for the tensor from the device's pool of the kind. Weights
+  // and kv caches become host visible on unified memory devices.
+  absl::Status create (const MemoryKind kind = ACTIVATION_MEMORY);
   size_t bytes () const;
   bool visable () const;
   DType dtype () const;
@@ -76,15 +116,18 @@ private:
   bool visable_;
   DType dtype_;
   VkBuffer data_;
+  VkDeviceSize offset_;
   struct __TensorStatus
   {
     VkAccessFlags access_flags_;
     VkPipelineStageFlags pipeline_stage_;
+    uint32_t queue_family_;
+    uint32_t pending_queue_family_;
     std::atomic<int> ref_;
+    MemoryPool *pool_;
+    MemoryPool::Range range_;
   };
 
-  VmaAllocationInfo mem_;
-  VmaAllocation allocation_;
   __TensorStatus *status_;
   void release_ ();
 };
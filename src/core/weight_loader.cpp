@@ -0,0 +1,284 @@
+#include "weight_loader.h"
+#include "absl/strings/str_format.h"
+#include "command.h"
+#include "gpu_device.h"
+#include "src/core/common.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vkllama
+{
+WeightLoader::WeightLoader (GPUDevice *dev, const bool import_weights,
+                            const size_t inflight, const size_t threads)
+    : dev_ (dev), import_weights_ (import_weights),
+      thread_count_ (
+          threads ? threads
+                  : std::min<size_t> (
+                      std::max (std::thread::hardware_concurrency (), 1u), 8)),
+      slots_ (std::max<size_t> (inflight, 1)), next_ (0), running_ (0),
+      stop_ (false)
+{
+}
+
+WeightLoader::~WeightLoader ()
+{
+  // groups still in flight keep staging memory until they are waited
+  for (auto &slot : slots_)
+    {
+      if (slot.pending)
+        {
+          (void)slot.command->wait ();
+        }
+    }
+
+  {
+    std::lock_guard<std::mutex> lock (mutex_);
+    stop_ = true;
+  }
+  job_cond_.notify_all ();
+  for (auto &worker : workers_)
+    {
+      worker.join ();
+    }
+}
+
+absl::Status
+WeightLoader::init ()
+{
+  for (auto &slot : slots_)
+    {
+      slot.command.reset (new Command (dev_, TRANSFER_QUEUE));
+      slot.pending = false;
+      slot.group = 0;
+      slot.bytes = 0;
+      VKLLAMA_STATUS_OK (slot.command->init ());
+    }
+
+  if (dev_->queue_family (TRANSFER_QUEUE)
+      != dev_->queue_family (COMPUTE_QUEUE))
+    {
+      acquire_command_.reset (new Command (dev_, COMPUTE_QUEUE));
+      VKLLAMA_STATUS_OK (acquire_command_->init ());
+    }
+
+  for (size_t i = 0; i < thread_count_; ++i)
+    {
+      workers_.emplace_back ([this] () { work_ (); });
+    }
+  return absl::OkStatus ();
+}
+
+void
+WeightLoader::set_callback (Callback callback)
+{
+  callback_ = std::move (callback);
+}
+
+size_t
+WeightLoader::threads () const
+{
+  return thread_count_;
+}
+
+void
+WeightLoader::work_ ()
+{
+  while (true)
+    {
+      std::function<void ()> job;
+      {
+        std::unique_lock<std::mutex> lock (mutex_);
+        job_cond_.wait (lock, [this] () { return stop_ || !jobs_.empty (); });
+        if (jobs_.empty ())
+          {
+            return;
+          }
+        job = std::move (jobs_.front ());
+        jobs_.pop_front ();
+      }
+
+      job ();
+
+      std::lock_guard<std::mutex> lock (mutex_);
+      if (--running_ == 0)
+        {
+          done_cond_.notify_all ();
+        }
+    }
+}
+
+void
+WeightLoader::run_ (std::vector<std::function<void ()> > &jobs)
+{
+  if (jobs.empty ())
+    {
+      return;
+    }
+
+  std::unique_lock<std::mutex> lock (mutex_);
+  running_ += jobs.size ();
+  for (auto &job : jobs)
+    {
+      jobs_.push_back (std::move (job));
+    }
+  job_cond_.notify_all ();
+  done_cond_.wait (lock, [this] () { return running_ == 0; });
+}
+
+absl::Status
+WeightLoader::complete_ (Slot &slot)
+{
+  slot.pending = false;
+  VKLLAMA_STATUS_OK (slot.command->wait ());
+  if (callback_)
+    {
+      callback_ (slot.group, slot.bytes);
+    }
+  return absl::OkStatus ();
+}
+
+absl::Status
+WeightLoader::add (std::vector<Upload> const &uploads)
+{
+  // nothing is recorded for a batch that cannot be uploaded whole
+  for (auto const &u : uploads)
+    {
+      if (u.to.bytes () < u.bytes)
+        {
+          return absl::OutOfRangeError (absl::StrFormat (
+              "to.size() = %zu but %zu bytes upload.", u.to.bytes (),
+              u.bytes));
+        }
+    }
+
+  auto &slot = slots_[next_ % slots_.size ()];
+  if (slot.pending)
+    {
+      VKLLAMA_STATUS_OK (complete_ (slot));
+    }
+
+  auto *command = slot.command.get ();
+  VKLLAMA_STATUS_OK (command->begin ());
+
+  // where each upload lands on the host: the tensor itself when the host
+  // can see it, staging memory otherwise
+  std::vector<std::shared_ptr<StagingBuffer> > staged (uploads.size ());
+  std::vector<std::function<void ()> > jobs;
+  size_t bytes = 0;
+  for (size_t i = 0; i < uploads.size (); ++i)
+    {
+      auto const &u = uploads[i];
+      bytes += u.bytes;
+      if (u.bytes == 0)
+        {
+          continue;
+        }
+
+      uint8_t *host = nullptr;
+      if (u.to.visable ())
+        {
+          host = static_cast<uint8_t *> (u.to.host ());
+        }
+      else if (import_weights_ && dev_->support_external_memory_host ())
+        {
+          auto to = u.to;
+          VKLLAMA_STATUS_OK (command->upload_mapped (u.from, u.bytes, to));
+          continue;
+        }
+      else
+        {
+          auto buf = dev_->staging ().acquire (u.bytes);
+          VKLLAMA_STATUS_OK (buf.status ());
+          staged[i] = *buf;
+          host = static_cast<uint8_t *> (staged[i]->host ());
+        }
+
+      for (size_t o = 0; o < u.bytes; o += kPieceBytes)
+        {
+          const size_t n = std::min (kPieceBytes, u.bytes - o);
+          jobs.push_back ([host, from = u.from, o, n] () {
+            ::memcpy (host + o, from + o, n);
+          });
+        }
+    }
+
+  // the reads of the source pages, from the page cache or the disk, happen
+  // here on the workers
+  run_ (jobs);
+
+  for (size_t i = 0; i < uploads.size (); ++i)
+    {
+      auto to = uploads[i].to;
+      if (uploads[i].bytes == 0)
+        {
+          continue;
+        }
+
+      if (to.visable ())
+        {
+          VKLLAMA_STATUS_OK (command->host_written (to));
+        }
+      else if (staged[i])
+        {
+          VKLLAMA_STATUS_OK (
+              command->upload_staged (staged[i], uploads[i].bytes, to));
+        }
+    }
+
+  // weights written on a transfer queue of its own family are handed over
+  // to compute, which acquires them once the load is done
+  if (acquire_command_)
+    {
+      for (auto const &u : uploads)
+        {
+          auto to = u.to;
+          if (u.bytes > 0 && !to.visable ())
+            {
+              VKLLAMA_STATUS_OK (command->release (to, COMPUTE_QUEUE));
+              released_.push_back (to);
+            }
+        }
+    }
+
+  VKLLAMA_STATUS_OK (command->end ());
+  VKLLAMA_STATUS_OK (command->submit ());
+
+  slot.pending = true;
+  slot.group = next_++;
+  slot.bytes = bytes;
+  return absl::OkStatus ();
+}
+
+absl::Status
+WeightLoader::finish ()
+{
+  // oldest group first, so the callback sees them in order
+  const size_t n = slots_.size ();
+  for (size_t i = 0; i < n; ++i)
+    {
+      auto &slot = slots_[(next_ + i) % n];
+      if (slot.pending)
+        {
+          VKLLAMA_STATUS_OK (complete_ (slot));
+        }
+    }
+
+  if (released_.empty ())
+    {
+      return absl::OkStatus ();
+    }
+
+  VKLLAMA_STATUS_OK (acquire_command_->begin ());
+  for (auto &t : released_)
+    {
+      VKLLAMA_STATUS_OK (acquire_command_->acquire (t));
+    }
+  released_.clear ();
+  VKLLAMA_STATUS_OK (acquire_command_->end ());
+  return acquire_command_->submit_and_wait ();
+}
+}
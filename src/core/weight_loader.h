@@ -0,0 +1,99 @@
+#ifndef __VKLLAMA_WEIGHT_LOADER_H__
+#define __VKLLAMA_WEIGHT_LOADER_H__
+
+#include "absl/status/status.h"
+#include "tensor.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vkllama
+{
+class GPUDevice;
+class Command;
+
+// Uploads model weights with the host side and the device side of the load
+// overlapping. Weights are added in groups, such as the tensors of one
+// block. The copies of a group into staging memory are split over worker
+// threads, then the group is recorded and submitted on one of a few
+// commands, so it moves to the device while the next group is prepared. A
+// group is done once its command has been waited; a command is waited when
+// it is needed for a new group, or by finish (). The commands run on the
+// transfer queue, so a load may go on next to inference.
+class WeightLoader
+{
+public:
+  struct Upload
+  {
+    const uint8_t *from;
+    size_t bytes;
+    Tensor to;
+  };
+
+  // called in the order the groups were added, with the group's index and
+  // the bytes it uploaded
+  using Callback = std::function<void (size_t group, size_t bytes)>;
+
+  // host copies are split into pieces of this size for the workers
+  static constexpr size_t kPieceBytes = 4ul << 20;
+
+  // with import_weights, the device copies ranges it can import as host
+  // memory in place, see Command::upload_mapped ()
+  WeightLoader (GPUDevice *dev, const bool import_weights = false,
+                const size_t inflight = 2, const size_t threads = 0);
+  WeightLoader (WeightLoader const &) = delete;
+  WeightLoader &operator= (WeightLoader const &) = delete;
+  ~WeightLoader ();
+
+  absl::Status init ();
+  void set_callback (Callback callback);
+
+  // the host memory of the uploads has to stay unchanged until the group
+  // is done
+  absl::Status add (std::vector<Upload> const &uploads);
+  // waits for every group added so far, then hands the weights over to the
+  // compute queue family when the transfer queue is of another one
+  absl::Status finish ();
+
+  size_t threads () const;
+
+private:
+  struct Slot
+  {
+    std::unique_ptr<Command> command;
+    bool pending;
+    size_t group;
+    size_t bytes;
+  };
+
+  absl::Status complete_ (Slot &slot);
+  // runs the jobs on the workers and returns when all of them are done
+  void run_ (std::vector<std::function<void ()> > &jobs);
+  void work_ ();
+
+  GPUDevice *dev_;
+  const bool import_weights_;
+  const size_t thread_count_;
+  std::vector<Slot> slots_;
+  size_t next_;
+  Callback callback_;
+  // records the acquire of weights released by the transfer queue family
+  std::unique_ptr<Command> acquire_command_;
+  std::vector<Tensor> released_;
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void ()> > jobs_;
+  size_t running_;
+  bool stop_;
+  std::mutex mutex_;
+  std::condition_variable job_cond_;
+  std::condition_variable done_cond_;
+};
+}
+
+#endif
@@ -113,7 +113,7 @@ public:
       }
 
     stage0_output_.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
-    stage0_output_.set_pipeline_stage (VK_SHADER_STAGE_COMPUTE_BIT);
+    stage0_output_.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 
     group_y = (in.height () + 127) / 128;
     ret = pipeline1_->set_group (1, group_y, group_z);
@@ -134,7 +134,7 @@ public:
       }
 
     out.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
-    out.set_pipeline_stage (VK_SHADER_STAGE_COMPUTE_BIT);
+    out.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 
     return out;
   }
@@ -129,12 +129,13 @@ Concat::operator() (const std::vector<Tensor> &inputs) noexcept
         }
     }
 
-  if (out_.channels () != c || out_.height () != h || out_.width () != w)
+  if (auto view = adjacent_view_ (inputs, c, h, w); view.ok ())
     {
-      out_ = Tensor (c, h, w, dev_, dtype_);
-      VKLLAMA_STATUS_OK (out_.create ());
+      return view;
     }
 
+  VKLLAMA_STATUS_OK (output_ (out_, c, h, w, dtype_));
+
   std::vector<uint32_t> offsets;
   uint32_t offset = 0;
   for (size_t i = 0; i < num_; ++i)
@@ -184,6 +185,42 @@ Concat::operator() (const std::vector<Tensor> &inputs) noexcept
   return out_;
 }
 
+absl::StatusOr<Tensor>
+Concat::adjacent_view_ (std::vector<Tensor> const &inputs, size_t c, size_t h,
+                        size_t w)
+{
+  // joining along an axis keeps rows in memory order only when the axes
+  // before it are 1
+  if ((axis_ > 0 && c != 1) || (axis_ > 1 && h != 1))
+    {
+      return absl::FailedPreconditionError ("concat is not contiguous.");
+    }
+
+  for (size_t i = 0; i < inputs.size (); ++i)
+    {
+      auto const &inp = inputs[i];
+      if (!inp.contiguous ())
+        {
+          return absl::FailedPreconditionError ("input is not contiguous.");
+        }
+
+      if (i == 0)
+        {
+          continue;
+        }
+
+      auto const &prev = inputs[i - 1];
+      if (inp.data () != prev.data ()
+          || inp.offset () != prev.offset () + prev.channels () * prev.cs ())
+        {
+          return absl::FailedPreconditionError (
+              "inputs are not adjacent ranges of one buffer.");
+        }
+    }
+
+  return inputs.front ().view_at (0, c, h, w);
+}
+
 uint64_t
 Concat::time () noexcept
 {
@@ -13,11 +13,17 @@ public:
   Concat (GPUDevice *gpu, Command *command, const int num, const int axis,
           Tensor::DType const dtype = FP16);
   absl::Status init () noexcept override;
+  // Inputs that already lie back to back in one buffer, such as slices
+  // taken in order from one tensor, are joined into a view of them without
+  // a dispatch.
   absl::StatusOr<Tensor>
   operator() (std::vector<Tensor> const &inputs) noexcept;
   uint64_t time () noexcept override;
 
 private:
+  absl::StatusOr<Tensor> adjacent_view_ (std::vector<Tensor> const &inputs,
+                                         size_t c, size_t h, size_t w);
+
   const int num_;
   std::vector<std::unique_ptr<Pipeline> > pipelines_;
   int axis_;
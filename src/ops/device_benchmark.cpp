@@ -0,0 +1,111 @@
+#include "src/ops/device_benchmark.h"
+#include "src/core/command.h"
+#include "src/core/common.h"
+#include "src/core/gpu_device.h"
+#include "src/ops/mat_mul.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+namespace vkllama
+{
+absl::Status
+benchmark_device (DeviceInfo &info, const size_t rows, const size_t cols,
+                  const size_t tokens, const int repeats)
+{
+  if (rows == 0 || cols == 0 || tokens == 0 || repeats <= 0)
+    {
+      return absl::InvalidArgumentError (
+          "benchmark_device: empty benchmark.");
+    }
+
+  GPUDevice gpu (info.index);
+  VKLLAMA_STATUS_OK (gpu.init ());
+  Command command (&gpu);
+  VKLLAMA_STATUS_OK (command.init ());
+
+  Tensor weight (1, rows, cols, &gpu, FP16);
+  Tensor gemv_in (1, 1, cols, &gpu, FP16);
+  Tensor gemm_in (1, tokens, cols, &gpu, FP16);
+  VKLLAMA_STATUS_OK (weight.create (WEIGHT_MEMORY));
+  VKLLAMA_STATUS_OK (gemv_in.create ());
+  VKLLAMA_STATUS_OK (gemm_in.create ());
+
+  MatMul gemv (&gpu, &command, weight, 1.0f, .0f, 0, 0, true, FP16, FP16);
+  MatMul gemm (&gpu, &command, weight, 1.0f, .0f, 0, 0, true, FP16, FP16);
+  VKLLAMA_STATUS_OK (gemv.init ());
+  VKLLAMA_STATUS_OK (gemm.init ());
+
+  // zeros keep denormals and nans out of the timing; the first run also
+  // takes the one-off costs of the pipelines
+  VKLLAMA_STATUS_OK (command.begin ());
+  for (auto *t : { &weight, &gemv_in, &gemm_in })
+    {
+      VKLLAMA_STATUS_OK (command.fill (*t, 0));
+    }
+  VKLLAMA_STATUS_OK (gemv (gemv_in).status ());
+  VKLLAMA_STATUS_OK (gemm (gemm_in).status ());
+  VKLLAMA_STATUS_OK (command.end ());
+  VKLLAMA_STATUS_OK (command.submit_and_wait ());
+
+  auto seconds = [&] (MatMul &op, Tensor in) -> absl::StatusOr<double> {
+    VKLLAMA_STATUS_OK (command.begin ());
+    for (int r = 0; r < repeats; ++r)
+      {
+        VKLLAMA_STATUS_OK (op (in).status ());
+      }
+    VKLLAMA_STATUS_OK (command.end ());
+
+    auto t0 = std::chrono::high_resolution_clock::now ();
+    VKLLAMA_STATUS_OK (command.submit_and_wait ());
+    auto t1 = std::chrono::high_resolution_clock::now ();
+    return std::chrono::duration<double> (t1 - t0).count () / repeats;
+  };
+
+  auto gemv_seconds = seconds (gemv, gemv_in);
+  VKLLAMA_STATUS_OK (gemv_seconds.status ());
+  auto gemm_seconds = seconds (gemm, gemm_in);
+  VKLLAMA_STATUS_OK (gemm_seconds.status ());
+
+  info.gemv_bytes_per_second
+      = weight.bytes () / std::max (*gemv_seconds, 1e-9);
+  info.gemm_flops
+      = 2.0 * tokens * rows * cols / std::max (*gemm_seconds, 1e-9);
+  return absl::OkStatus ();
+}
+
+absl::StatusOr<int>
+select_device (const size_t model_bytes, const bool benchmark)
+{
+  auto devices = enumerate_devices ();
+  VKLLAMA_STATUS_OK (devices.status ());
+
+  for (auto &device : *devices)
+    {
+      if (!benchmark || !device.storage_16bit
+          || usable_bytes (device) < model_bytes)
+        {
+          continue;
+        }
+
+      auto ret = benchmark_device (device);
+      if (!ret.ok ())
+        {
+          fprintf (stderr, "failed at benchmarking device %d (%s): %s\n",
+                   device.index, device.name.c_str (),
+                   ret.ToString ().c_str ());
+          device.gemv_bytes_per_second = 0;
+          device.gemm_flops = 0;
+          continue;
+        }
+
+      fprintf (stderr,
+               "device %d %s (%s): gemv %.1f GB/s, gemm %.1f GFLOPS\n",
+               device.index, device.name.c_str (),
+               device_type_name (device.type),
+               device.gemv_bytes_per_second / 1e9, device.gemm_flops / 1e9);
+    }
+
+  return pick_device (*devices, model_bytes);
+}
+}
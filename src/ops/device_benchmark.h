@@ -0,0 +1,27 @@
+#ifndef __VKLLAMA_DEVICE_BENCHMARK_H__
+#define __VKLLAMA_DEVICE_BENCHMARK_H__
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "src/core/device_probe.h"
+
+namespace vkllama
+{
+// Times the fp16 MatMul kernels the models run on device info.index: a
+// matrix vector product over a rows x cols weight, which streams the
+// weight as a decode step does, and the product of tokens rows with it, as
+// a prompt does. Fills in info.gemv_bytes_per_second and info.gemm_flops.
+absl::Status benchmark_device (DeviceInfo &info, const size_t rows = 4096,
+                               const size_t cols = 4096,
+                               const size_t tokens = 32,
+                               const int repeats = 4);
+
+// The device to run a model of model_bytes on, see pick_device (). With
+// benchmark, every device the model fits on is benchmarked first; a device
+// that fails to is left unmeasured, and the choice then falls back to the
+// device types.
+absl::StatusOr<int> select_device (const size_t model_bytes,
+                                   const bool benchmark = true);
+}
+
+#endif
@@ -72,14 +72,8 @@ Embedding::operator() (Tensor indices) noexcept
           "only indices.dtype = UINT32 is supported");
     }
 
-  if (out_.channels () != indices.height ()
-      || out_.height () != indices.width ()
-      || out_.width () != vocab_.width ())
-    {
-      out_ = Tensor (indices.height (), indices.width (), vocab_.width (),
-                     dev_, FP16);
-      VKLLAMA_STATUS_OK (out_.create ());
-    }
+  VKLLAMA_STATUS_OK (output_ (out_, indices.height (), indices.width (),
+                              vocab_.width (), FP16));
 
   auto constants = vocab_.shape_constant () + indices.shape_constant ();
 
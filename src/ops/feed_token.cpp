@@ -0,0 +1,64 @@
+#include "src/ops/feed_token.h"
+#include "src/core/command.h"
+#include "src/shaders/vkllama_comp_shaders.h"
+#include <memory>
+
+namespace vkllama
+{
+FeedToken::FeedToken (GPUDevice *gpu, Command *command) : Op (gpu, command)
+{
+}
+
+absl::Status
+FeedToken::init () noexcept
+{
+  Pipeline::ShaderInfo info = { 0, 4, sizeof (uint32_t), 1, 1, 1 };
+  ShaderConstants specs;
+  pipeline_ = std::make_unique<Pipeline> (
+      dev_, __get_feed_token_comp_spv_code (),
+      __get_feed_token_comp_spv_size (), specs, info);
+  return pipeline_->init ();
+}
+
+absl::Status
+FeedToken::operator() (Tensor sampled, Tensor toks, Tensor offset,
+                       Tensor history) noexcept
+{
+  for (auto const *t : { &sampled, &toks, &offset, &history })
+    {
+      if (t->dtype () != UINT32 || t->size () < 1)
+        {
+          return absl::InvalidArgumentError (
+              "FeedToken: all tensors must be uint32 with at least 1 "
+              "element.");
+        }
+    }
+
+  auto ret = pipeline_->set_group (1, 1, 1);
+  if (!ret.ok ())
+    {
+      return ret;
+    }
+
+  ShaderConstants constants = { (uint32_t)history.size () };
+  ret = command_->record_pipeline (
+      *pipeline_, { sampled, toks, offset, history }, constants);
+  if (!ret.ok ())
+    {
+      return ret;
+    }
+
+  for (auto *t : { &toks, &offset, &history })
+    {
+      t->set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
+      t->set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    }
+  return absl::OkStatus ();
+}
+
+uint64_t
+FeedToken::time () noexcept
+{
+  return pipeline_->time ();
+}
+}
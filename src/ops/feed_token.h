@@ -0,0 +1,28 @@
+#ifndef __VKLLAMA_FEED_TOKEN_H__
+#define __VKLLAMA_FEED_TOKEN_H__
+
+#include "src/core/pipeline.h"
+#include "src/ops/op.h"
+#include <memory>
+
+namespace vkllama
+{
+// Closes a decode step on the device: the sampled token is written to the
+// token buffer the next step reads and to history[offset], then offset is
+// advanced by one. All tensors are UINT32.
+class FeedToken : public Op
+{
+public:
+  FeedToken (GPUDevice *gpu, Command *command);
+
+  absl::Status init () noexcept override;
+  uint64_t time () noexcept override;
+  absl::Status operator() (Tensor sampled, Tensor toks, Tensor offset,
+                           Tensor history) noexcept;
+
+private:
+  std::unique_ptr<Pipeline> pipeline_;
+};
+}
+
+#endif
@@ -0,0 +1,370 @@
+#include "src/ops/flash_attention.h"
+#include "absl/strings/str_format.h"
+#include "src/core/command.h"
+#include "src/core/common.h"
+#include "src/core/gpu_device.h"
+#include "src/shaders/vkllama_comp_shaders.h"
+#include <array>
+#include <memory>
+
+namespace vkllama
+{
+FlashAttention::FlashAttention (GPUDevice *dev, Command *command,
+                                const int dim, const float scale,
+                                const Tensor::DType dtype,
+                                const Tensor::DType kv_dtype,
+                                const bool paged)
+    : Op (dev, command), dim_ (dim), scale_ (scale), dtype_ (dtype),
+      kv_dtype_ (kv_dtype), paged_ (paged)
+{
+}
+
+absl::StatusOr<int>
+FlashAttention::key_tile_ (const int rows)
+{
+  // the largest tile of keys whose k and v rows fit into shared memory
+  // next to the query rows, their outputs and their scores
+  for (int bc : { 32, 16, 8 })
+    {
+      const size_t bytes
+          = sizeof (float)
+            * (bc * (dim_ + 1) + bc * dim_ + 2 * rows * dim_ + rows * bc);
+      if (bytes <= dev_->limits ().maxComputeSharedMemorySize)
+        {
+          return bc;
+        }
+    }
+
+  return absl::InvalidArgumentError (absl::StrFormat (
+      "FlashAttention: head dim %d does not fit into %u bytes of shared "
+      "memory.",
+      dim_, dev_->limits ().maxComputeSharedMemorySize));
+}
+
+absl::StatusOr<std::unique_ptr<Pipeline> >
+FlashAttention::create_pipeline_ (const int rows)
+{
+  auto key_tile = key_tile_ (rows);
+  VKLLAMA_STATUS_OK (key_tile.status ());
+
+  // the offset bias follows the shapes, then a paged pipeline takes the
+  // keys' count and binds the block table
+  Pipeline::ShaderInfo info
+      = { 4,
+          paged_ ? 6 : 5,
+          sizeof (ShapeConstant) * 3 + sizeof (uint32_t) * (paged_ ? 2 : 1),
+          (uint32_t)dev_->subgroup_size (),
+          (uint32_t)rows,
+          1 };
+
+  const uint8_t *spv_code = __get_flash_attention_fp16_comp_spv_code ();
+  size_t spv_size = __get_flash_attention_fp16_comp_spv_size ();
+  if (kv_dtype_ == Q8_0)
+    {
+      spv_code = __get_flash_attention_q8_0_comp_spv_code ();
+      spv_size = __get_flash_attention_q8_0_comp_spv_size ();
+    }
+  else if (paged_)
+    {
+      spv_code = __get_flash_attention_paged_fp16_comp_spv_code ();
+      spv_size = __get_flash_attention_paged_fp16_comp_spv_size ();
+    }
+
+  std::unique_ptr<Pipeline> pipeline (new Pipeline (
+      dev_, spv_code, spv_size, { dim_, *key_tile, rows, scale_ }, info));
+  VKLLAMA_STATUS_OK (pipeline->init ());
+  return pipeline;
+}
+
+absl::Status
+FlashAttention::init () noexcept
+{
+  if (dtype_ != FP16)
+    {
+      return absl::InvalidArgumentError (
+          "FlashAttention op: only fp16 dtype is supported.");
+    }
+
+  if (kv_dtype_ != FP16 && kv_dtype_ != Q8_0)
+    {
+      return absl::InvalidArgumentError (
+          "FlashAttention op: k and v must be fp16 or q8_0.");
+    }
+
+  if (paged_ && kv_dtype_ != FP16)
+    {
+      return absl::InvalidArgumentError (
+          "FlashAttention op: only fp16 k and v can be paged.");
+    }
+
+  if (kv_dtype_ == Q8_0 && dim_ % 32 != 0)
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "FlashAttention op: q8_0 k and v need a head dim that is a "
+          "multiple of 32, got %d.",
+          dim_));
+    }
+
+  // bound as the device offset of calls with a numeric one, which goes
+  // into the push constants instead; written once, so recordings in
+  // flight never see it change
+  zero_ = Tensor (1, 1, 1, dev_, UINT32, true);
+  VKLLAMA_STATUS_OK (zero_.create ());
+  const uint32_t zero = 0;
+  VKLLAMA_STATUS_OK (command_->upload (&zero, 1, zero_));
+
+  auto decode = create_pipeline_ (1);
+  VKLLAMA_STATUS_OK (decode.status ());
+  decode_ = std::move (*decode);
+
+  auto prefill = create_pipeline_ (kPrefillRows);
+  VKLLAMA_STATUS_OK (prefill.status ());
+  prefill_ = std::move (*prefill);
+
+  // a split holds one query row, as the decode pipeline does
+  auto key_tile = key_tile_ (1);
+  VKLLAMA_STATUS_OK (key_tile.status ());
+
+  Pipeline::ShaderInfo split_info
+      = { 4,
+          paged_ ? 6 : 5,
+          sizeof (ShapeConstant) * 4 + sizeof (uint32_t) * (paged_ ? 2 : 1),
+          (uint32_t)dev_->subgroup_size (),
+          1,
+          1 };
+  const uint8_t *split_code = __get_flash_decoding_fp16_comp_spv_code ();
+  size_t split_size = __get_flash_decoding_fp16_comp_spv_size ();
+  if (kv_dtype_ == Q8_0)
+    {
+      split_code = __get_flash_decoding_q8_0_comp_spv_code ();
+      split_size = __get_flash_decoding_q8_0_comp_spv_size ();
+    }
+  else if (paged_)
+    {
+      split_code = __get_flash_decoding_paged_fp16_comp_spv_code ();
+      split_size = __get_flash_decoding_paged_fp16_comp_spv_size ();
+    }
+  split_.reset (new Pipeline (dev_, split_code, split_size,
+                              { dim_, *key_tile, kSplitKeys, scale_ },
+                              split_info));
+  VKLLAMA_STATUS_OK (split_->init ());
+
+  Pipeline::ShaderInfo reduce_info = {
+    1, 2, sizeof (ShapeConstant), (uint32_t)dev_->subgroup_size (), 1, 1
+  };
+  reduce_.reset (new Pipeline (
+      dev_, __get_flash_decoding_reduce_fp16_comp_spv_code (),
+      __get_flash_decoding_reduce_fp16_comp_spv_size (), { dim_ },
+      reduce_info));
+  return reduce_->init ();
+}
+
+uint64_t
+FlashAttention::time () noexcept
+{
+  return decode_->time () + prefill_->time () + split_->time ()
+         + reduce_->time ();
+}
+
+absl::StatusOr<Tensor>
+FlashAttention::operator() (Tensor q, Tensor k, Tensor v,
+                            const size_t offset) noexcept
+{
+  return attend_contiguous_ (q, k, v, zero_, offset);
+}
+
+absl::StatusOr<Tensor>
+FlashAttention::operator() (Tensor q, Tensor k, Tensor v, Tensor offset,
+                            const uint32_t bias) noexcept
+{
+  return attend_contiguous_ (q, k, v, offset, bias);
+}
+
+absl::StatusOr<Tensor>
+FlashAttention::attend_contiguous_ (Tensor q, Tensor k, Tensor v,
+                                    Tensor offset, const uint32_t bias)
+{
+  if (paged_)
+    {
+      return absl::FailedPreconditionError (
+          "FlashAttention: a paged op reads k and v through a block table.");
+    }
+
+  VKLLAMA_STATUS_OK (check_inputs_ (q, k, v, offset));
+  if (k.channels () != q.channels () || v.channels () != q.channels ()
+      || k.height () != v.height () || q.height () == 0 || k.height () == 0)
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "FlashAttention shape error. q.shape = (%zu, %zu, %zu), k.shape = "
+          "(%zu, %zu, %zu), v.shape = (%zu, %zu, %zu), dim = %d",
+          q.channels (), q.height (), q.width (), k.channels (), k.height (),
+          k.width (), v.channels (), v.height (), v.width (), dim_));
+    }
+
+  return attend_ (q, k, v, Tensor (), offset, bias, k.height ());
+}
+
+absl::StatusOr<Tensor>
+FlashAttention::operator() (Tensor q, Tensor k, Tensor v, Tensor table,
+                            const size_t offset, const size_t kvlen) noexcept
+{
+  return attend_paged_ (q, k, v, table, zero_, offset, kvlen);
+}
+
+absl::StatusOr<Tensor>
+FlashAttention::operator() (Tensor q, Tensor k, Tensor v, Tensor table,
+                            Tensor offset, const size_t kvlen,
+                            const uint32_t bias) noexcept
+{
+  return attend_paged_ (q, k, v, table, offset, bias, kvlen);
+}
+
+absl::StatusOr<Tensor>
+FlashAttention::attend_paged_ (Tensor q, Tensor k, Tensor v, Tensor table,
+                               Tensor offset, const uint32_t bias,
+                               const size_t kvlen)
+{
+  if (!paged_)
+    {
+      return absl::FailedPreconditionError (
+          "FlashAttention: the op was not created paged.");
+    }
+
+  VKLLAMA_STATUS_OK (check_inputs_ (q, k, v, offset));
+  if (table.dtype () != UINT32)
+    {
+      return absl::InvalidArgumentError (
+          "FlashAttention: the block table must be a uint32 tensor.");
+    }
+
+  // a page holds the rows of every head side by side
+  if (q.channels () == 0 || k.channels () % q.channels () != 0
+      || v.channels () != k.channels () || k.height () != v.height ()
+      || q.height () == 0 || kvlen == 0
+      || kvlen > table.size () * k.height ())
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "FlashAttention paged shape error. q.shape = (%zu, %zu, %zu), "
+          "k.shape = (%zu, %zu, %zu), v.shape = (%zu, %zu, %zu), %zu table "
+          "entries, kvlen = %zu",
+          q.channels (), q.height (), q.width (), k.channels (), k.height (),
+          k.width (), v.channels (), v.height (), v.width (), table.size (),
+          kvlen));
+    }
+
+  return attend_ (q, k, v, table, offset, bias, kvlen);
+}
+
+absl::Status
+FlashAttention::check_inputs_ (Tensor const &q, Tensor const &k,
+                               Tensor const &v, Tensor const &offset)
+{
+  if (offset.dtype () != UINT32 || offset.size () < 1)
+    {
+      return absl::InvalidArgumentError (
+          "FlashAttention: offset must be a uint32 tensor with at least 1 "
+          "element.");
+    }
+
+  if (q.dtype () != dtype_ || k.dtype () != kv_dtype_
+      || v.dtype () != kv_dtype_)
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "FlashAttention op defined with %d and %d dtypes but the inputs' "
+          "dtypes are %d, %d and %d",
+          int (dtype_), int (kv_dtype_), int (q.dtype ()), int (k.dtype ()),
+          int (v.dtype ())));
+    }
+
+  if (q.width () != (size_t)dim_ || k.width () != (size_t)dim_
+      || v.width () != (size_t)dim_)
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "FlashAttention: q, k and v are %zu, %zu and %zu wide but dim = %d",
+          q.width (), k.width (), v.width (), dim_));
+    }
+  return absl::OkStatus ();
+}
+
+absl::StatusOr<Tensor>
+FlashAttention::attend_ (Tensor q, Tensor k, Tensor v, Tensor table,
+                         Tensor offset, const uint32_t bias,
+                         const size_t kvlen)
+{
+  if (q.height () == 1 && kvlen > (size_t)kSplitKeys)
+    {
+      return split_decode_ (q, k, v, table, offset, bias, kvlen);
+    }
+
+  const size_t heads = q.channels (), qlen = q.height ();
+  VKLLAMA_STATUS_OK (output_ (out_, qlen, heads, dim_, dtype_));
+
+  auto &pipeline = qlen == 1 ? *decode_ : *prefill_;
+  const int rows = qlen == 1 ? 1 : kPrefillRows;
+  VKLLAMA_STATUS_OK (
+      pipeline.set_group (1, (qlen + rows - 1) / rows, heads));
+
+  // the table and the keys' count follow for a paged pipeline
+  const std::array<Tensor, 6> bindings = { q, k, v, out_, offset, table };
+  auto constants
+      = q.shape_constant () + k.shape_constant () + v.shape_constant ();
+  constants.push_back (bias);
+  if (paged_)
+    {
+      constants.push_back ((uint32_t)kvlen);
+    }
+
+  VKLLAMA_STATUS_OK (command_->record_pipeline (
+      pipeline, absl::MakeConstSpan (bindings.data (), paged_ ? 6 : 5),
+      constants));
+
+  out_.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
+  out_.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+  return out_;
+}
+
+absl::StatusOr<Tensor>
+FlashAttention::split_decode_ (Tensor q, Tensor k, Tensor v, Tensor table,
+                               Tensor offset, const uint32_t bias,
+                               const size_t kvlen)
+{
+  const size_t heads = q.channels ();
+  const size_t splits = (kvlen + kSplitKeys - 1) / kSplitKeys;
+
+  // the splits are written and merged within the op, so their buffer is
+  // kept here rather than taken from the activations, and a shorter
+  // cache uses a view of it
+  if (partial_.channels () != heads || partial_.height () < splits)
+    {
+      partial_ = Tensor (heads, splits, dim_ + 2, dev_, FP32, false);
+      VKLLAMA_STATUS_OK (partial_.create ());
+    }
+  Tensor partial = partial_.view (heads, splits, dim_ + 2);
+
+  const std::array<Tensor, 6> bindings = { q, k, v, partial, offset, table };
+  auto constants = q.shape_constant () + k.shape_constant ()
+                   + v.shape_constant () + partial.shape_constant ();
+  constants.push_back (bias);
+  if (paged_)
+    {
+      constants.push_back ((uint32_t)kvlen);
+    }
+
+  VKLLAMA_STATUS_OK (split_->set_group (splits, 1, heads));
+  VKLLAMA_STATUS_OK (command_->record_pipeline (
+      *split_, absl::MakeConstSpan (bindings.data (), paged_ ? 6 : 5),
+      constants));
+
+  partial.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
+  partial.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+  VKLLAMA_STATUS_OK (output_ (out_, 1, heads, dim_, dtype_));
+  VKLLAMA_STATUS_OK (reduce_->set_group (1, 1, heads));
+  VKLLAMA_STATUS_OK (command_->record_pipeline (*reduce_, { partial, out_ },
+                                                partial.shape_constant ()));
+
+  out_.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
+  out_.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+  return out_;
+}
+}
@@ -0,0 +1,102 @@
+#ifndef __VKLLAMA_FLASH_ATTENTION_H__
+#define __VKLLAMA_FLASH_ATTENTION_H__
+
+#include "src/core/pipeline.h"
+#include "src/core/tensor.h"
+#include "src/ops/op.h"
+#include <memory>
+
+namespace vkllama
+{
+class GPUDevice;
+class Command;
+
+// softmax (q k^T * scale) v with a causal mask in one dispatch: the scores
+// of a tile of keys live in shared memory only, and the softmax is carried
+// along the keys with a running max and sum.
+class FlashAttention : public Op
+{
+public:
+  // query rows a workgroup of a prompt takes; a decoded token, a single
+  // query row, has a pipeline with workgroups of one row
+  static constexpr int kPrefillRows = 4;
+  // keys a workgroup takes when a decoded token is split along a cache
+  // longer than this; the splits are merged in a second dispatch
+  static constexpr int kSplitKeys = 256;
+
+  // kv_dtype is FP16 or Q8_0; q8_0 k and v rows are dim / 32 blocks,
+  // dequantized as they are staged. A paged op reads fp16 k and v pages
+  // through a block table, see PagedKVCache, and only takes the paged
+  // operator ().
+  FlashAttention (GPUDevice *dev, Command *command, const int dim,
+                  const float scale, const Tensor::DType dtype = FP16,
+                  const Tensor::DType kv_dtype = FP16,
+                  const bool paged = false);
+
+  absl::Status init () noexcept override;
+  uint64_t time () noexcept override;
+
+  // q: [heads, qlen, dim], k and v: [heads, kvlen, dim], which may be views
+  // of kv caches. Returns [qlen, heads, dim], the heads of a row side by
+  // side. Query row i attends to the keys up to i + offset, which is
+  // pushed as a constant of the recorded dispatch.
+  absl::StatusOr<Tensor> operator() (Tensor q, Tensor k, Tensor v,
+                                     const size_t offset = 0) noexcept;
+  // offset is read from a UINT32 device tensor at dispatch time, and bias
+  // is added to it
+  absl::StatusOr<Tensor> operator() (Tensor q, Tensor k, Tensor v,
+                                     Tensor offset,
+                                     const uint32_t bias = 0) noexcept;
+
+  // k and v: pages of [pages * heads, page_rows, dim], table: the UINT32
+  // block table of the sequence. The first kvlen positions the table maps
+  // are the keys, the rest of it may be unset.
+  absl::StatusOr<Tensor> operator() (Tensor q, Tensor k, Tensor v,
+                                     Tensor table, const size_t offset,
+                                     const size_t kvlen) noexcept;
+  absl::StatusOr<Tensor> operator() (Tensor q, Tensor k, Tensor v,
+                                     Tensor table, Tensor offset,
+                                     const size_t kvlen,
+                                     const uint32_t bias = 0) noexcept;
+
+private:
+  absl::StatusOr<int> key_tile_ (const int rows);
+  absl::StatusOr<std::unique_ptr<Pipeline> >
+  create_pipeline_ (const int rows);
+  absl::Status check_inputs_ (Tensor const &q, Tensor const &k,
+                              Tensor const &v, Tensor const &offset);
+  // the position of query row 0 is offset[0] + bias
+  absl::StatusOr<Tensor> attend_contiguous_ (Tensor q, Tensor k, Tensor v,
+                                             Tensor offset,
+                                             const uint32_t bias);
+  absl::StatusOr<Tensor> attend_paged_ (Tensor q, Tensor k, Tensor v,
+                                        Tensor table, Tensor offset,
+                                        const uint32_t bias,
+                                        const size_t kvlen);
+  absl::StatusOr<Tensor> attend_ (Tensor q, Tensor k, Tensor v,
+                                  Tensor table, Tensor offset,
+                                  const uint32_t bias, const size_t kvlen);
+  absl::StatusOr<Tensor> split_decode_ (Tensor q, Tensor k, Tensor v,
+                                        Tensor table, Tensor offset,
+                                        const uint32_t bias,
+                                        const size_t kvlen);
+
+  const int dim_;
+  const float scale_;
+  const Tensor::DType dtype_;
+  const Tensor::DType kv_dtype_;
+  const bool paged_;
+
+  std::unique_ptr<Pipeline> decode_;
+  std::unique_ptr<Pipeline> prefill_;
+  std::unique_ptr<Pipeline> split_;
+  std::unique_ptr<Pipeline> reduce_;
+  Tensor out_;
+  // outputs, maxes and sums of the splits, grown to the most splits seen
+  Tensor partial_;
+  // a device offset of 0 for the calls with a numeric offset
+  Tensor zero_;
+};
+}
+
+#endif
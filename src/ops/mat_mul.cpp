@@ -186,12 +186,7 @@ MatMul::operator() (Tensor a) noexcept
          out_h = a.height (),
          out_w = transpose_b_ ? weight_.height () : weight_.width ();
 
-  if (out_.channels () != out_c || out_.height () != out_h
-      || out_.width () != out_w)
-    {
-      out_ = Tensor (out_c, out_h, out_w, dev_, FP16, false);
-      VKLLAMA_STATUS_OK (out_.create ());
-    }
+  VKLLAMA_STATUS_OK (output_ (out_, out_c, out_h, out_w, FP16));
 
   int channels = std::max (a.channels (), weight_.channels ());
 
@@ -250,12 +245,7 @@ MatMul::operator() (Tensor a, Tensor b) noexcept
   size_t out_h = a.height (), out_w = transpose_b_ ? b.height () : b.width ();
   size_t out_c = std::max (a.channels (), b.channels ());
 
-  if (out_.channels () != out_c || out_.height () != out_h
-      || out_.width () != out_w)
-    {
-      out_ = Tensor (out_c, out_h, out_w, dev_, FP16, false);
-      VKLLAMA_STATUS_OK (out_.create ());
-    }
+  VKLLAMA_STATUS_OK (output_ (out_, out_c, out_h, out_w, FP16));
 
   int channels = std::max (a.channels (), b.channels ());
 
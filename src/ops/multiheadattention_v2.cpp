@@ -22,10 +22,13 @@ namespace vkllama
 MultiHeadAttentionV2::MultiHeadAttentionV2 (
     GPUDevice *dev, Command *command, Tensor wk, Tensor wq, Tensor wv,
     Tensor wo, const int maxlen, const int dim, const bool transposed_weight,
-    Tensor::DType dtype, const bool use_kvcache, const bool clip_output)
+    Tensor::DType dtype, const bool use_kvcache, const bool clip_output,
+    const Tensor::DType kvcache_dtype, PagedKVCache const &paged)
     : Op (dev, command), wk_ (wk), wq_ (wq), wv_ (wv), wo_ (wo),
       maxlen_ (maxlen), dim_ (dim), transposed_weight_ (transposed_weight),
-      dtype_ (dtype), use_kvcache_ (use_kvcache), clip_output_ (clip_output)
+      dtype_ (dtype), use_kvcache_ (use_kvcache), clip_output_ (clip_output),
+      kvcache_dtype_ (kvcache_dtype), paged_ (paged),
+      use_pages_ (paged.table.size () > 0)
 {
 }
 
@@ -38,6 +41,26 @@ MultiHeadAttentionV2::init () noexcept
           "MultiHeadAttentionV2: only fp16 dtype is supported.");
     }
 
+  if (kvcache_dtype_ != FP16 && kvcache_dtype_ != Q8_0)
+    {
+      return absl::InvalidArgumentError (
+          "MultiHeadAttentionV2: only fp16 and q8_0 kv caches are "
+          "supported.");
+    }
+
+  if (use_pages_ && (!use_kvcache_ || kvcache_dtype_ != FP16))
+    {
+      return absl::InvalidArgumentError (
+          "MultiHeadAttentionV2: a paged kv cache is an fp16 kv cache.");
+    }
+
+  // the kqv shader reads the weights as gguf q8_0 blocks only
+  if (wk_.dtype () != Q8_0 || wq_.dtype () != Q8_0 || wv_.dtype () != Q8_0)
+    {
+      return absl::InvalidArgumentError (
+          "MultiHeadAttentionV2: wk, wq and wv must be q8_0 weights.");
+    }
+
   if (wk_.channels () != wq_.channels () || wk_.height () != wq_.height ()
       || wk_.width () != wq_.width () || wq_.channels () != wv_.channels ()
       || wq_.width () != wv_.width () || wq_.height () != wv_.height ())
@@ -51,14 +74,28 @@ MultiHeadAttentionV2::init () noexcept
           wv_.width (), wo_.channels (), wo_.height (), wo_.width ()));
     }
 
+  if (dim_ % 2 != 0
+      || (transposed_weight_ ? wk_.height () : wk_.width ()) % dim_ != 0)
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "multiheadattention: %zu output features are not heads of an even "
+          "dim %d.",
+          transposed_weight_ ? wk_.height () : wk_.width (), dim_));
+    }
+
   {
     Pipeline::ShaderInfo info
-        = { 0, 7, sizeof (ShapeConstant) * 3, (uint32_t)dev_->subgroup_size (),
-            1, 1 };
-
-    const auto *kqv_code = __get_kqv_fp16_x_q8_0_comp_spv_code ();
-    const auto kqv_size = __get_kqv_fp16_x_q8_0_comp_spv_size ();
-    kqv_pipeline_.reset (new Pipeline (dev_, kqv_code, kqv_size, {}, info));
+        = { 2, 10, sizeof (ShapeConstant) * 4 + sizeof (uint32_t),
+            (uint32_t)dev_->subgroup_size (), 1, 1 };
+
+    const auto *kqv_code = __get_kqv_rope_fp16_x_q8_0_comp_spv_code ();
+    const auto kqv_size = __get_kqv_rope_fp16_x_q8_0_comp_spv_size ();
+    // the shader writes fp16 caches itself, q8_0 and paged ones are filled
+    // from its k and v afterwards
+    const int cached
+        = use_kvcache_ && kvcache_dtype_ == FP16 && !use_pages_ ? 1 : 0;
+    kqv_pipeline_.reset (new Pipeline (dev_, kqv_code, kqv_size,
+                                       { dim_, cached }, info));
   }
 
   absl::Status ret;
@@ -67,54 +104,48 @@ MultiHeadAttentionV2::init () noexcept
                                   transposed_weight_, FP16, wo_.dtype ());
 
   float attn_score_scale = 1.0f / std::sqrt (static_cast<float> (dim_));
-  matmul_qk_ = std::make_unique<MatMul> (dev_, command_, attn_score_scale, 0,
-                                         0, 0, 1, FP16, FP16);
-
-  rope_q_ = std::make_unique<Rope> (dev_, command_, maxlen_, dim_, dtype_);
-  rope_k_ = std::make_unique<Rope> (dev_, command_, maxlen_, dim_, dtype_);
-  matmul_weighted_
-      = std::make_unique<MatMul> (dev_, command_, 1.0, 0, 0, 0, 0, FP16, FP16);
-
-  matmul_attn_score_ = std::make_unique<MatMul> (dev_, command_, 1.0, .0, 0, 0,
-                                                 true, FP16, FP16);
-
-  softmax_ = std::make_unique<Softmax> (dev_, command_, true, 1.0, dtype_);
-  transpose_k_ = std::make_unique<Transpose> (dev_, command_, 0, dtype_);
-  transpose_q_ = std::make_unique<Transpose> (dev_, command_, 0, dtype_);
-  transpose_v_ = std::make_unique<Transpose> (dev_, command_, 0, dtype_);
-  transpose_heads_ = std::make_unique<Transpose> (dev_, command_, 0, dtype_);
+  attention_ = std::make_unique<FlashAttention> (
+      dev_, command_, dim_, attn_score_scale, dtype_,
+      use_kvcache_ ? kvcache_dtype_ : FP16, use_pages_);
 
   if (!(ret = kqv_pipeline_->init ()).ok ()
       || !(ret = matmul_o_->init ()).ok ()
-      || !(ret = matmul_qk_->init ()).ok ()
-      || !(ret = matmul_weighted_->init ()).ok ()
-      || !(ret = rope_q_->init ()).ok () || !(ret = rope_k_->init ()).ok ()
-      || !(ret = matmul_attn_score_->init ()).ok ()
-      || !(ret = transpose_k_->init ()).ok ()
-      || !(ret = transpose_q_->init ()).ok ()
-      || !(ret = transpose_v_->init ()).ok ()
-      || !(ret = transpose_heads_->init ()).ok ()
-      || !(ret = softmax_->init ()).ok ())
+      || !(ret = attention_->init ()).ok ())
     {
       return ret;
     }
 
-  if (use_kvcache_)
-    {
-      kcache_
-          = Tensor (wk_.width () / dim_, maxlen_, dim_, dev_, dtype_, false);
-      vcache_
-          = Tensor (wv_.width () / dim_, maxlen_, dim_, dev_, dtype_, false);
+  // rope is applied by the kqv shader as it writes q and k out
+  {
+    std::vector<float> freqc, freqs;
+    rope_frequencies (dim_, 2 * maxlen_, freqc, freqs);
+
+    freqc_ = Tensor (1, 2 * maxlen_, dim_ / 2, dev_, FP32, false);
+    freqs_ = Tensor (1, 2 * maxlen_, dim_ / 2, dev_, FP32, false);
+    VKLLAMA_STATUS_OK (freqc_.create ());
+    VKLLAMA_STATUS_OK (freqs_.create ());
+    VKLLAMA_STATUS_OK (
+        command_->upload (freqc.data (), freqc.size (), freqc_));
+    VKLLAMA_STATUS_OK (
+        command_->upload (freqs.data (), freqs.size (), freqs_));
+    VKLLAMA_STATUS_OK (
+        kqv_pipeline_->update_bindings ({ freqc_, freqs_ }, { 7, 8 }));
+  }
 
-      if (!(ret = kcache_.create ()).ok () || !(ret = vcache_.create ()).ok ())
-        {
-          return ret;
-        }
+  // bound as the device offset of calls with a numeric one, which goes
+  // into the push constants instead; written once, so recordings in
+  // flight never see it change
+  zero_ = Tensor (1, 1, 1, dev_, UINT32, true);
+  VKLLAMA_STATUS_OK (zero_.create ());
+  const uint32_t zero = 0;
+  VKLLAMA_STATUS_OK (command_->upload (&zero, 1, zero_));
 
+  if (use_pages_)
+    {
       update_kcache_op_
-          = std::make_unique<UpdateKVCache> (dev_, command_, dtype_);
+          = std::make_unique<UpdateKVCache> (dev_, command_, FP16);
       update_vcache_op_
-          = std::make_unique<UpdateKVCache> (dev_, command_, dtype_);
+          = std::make_unique<UpdateKVCache> (dev_, command_, FP16);
 
       if (!(ret = update_kcache_op_->init ()).ok ()
           || !(ret = update_vcache_op_->init ()).ok ())
@@ -122,6 +153,42 @@ MultiHeadAttentionV2::init () noexcept
           return ret;
         }
     }
+  else if (use_kvcache_)
+    {
+      // one cache channel per head, the output features of wk and wv
+      const size_t heads
+          = (transposed_weight_ ? wk_.height () : wk_.width ()) / dim_;
+      kcache_ = Tensor (heads, maxlen_, dim_, dev_, kvcache_dtype_, false);
+      vcache_ = Tensor (heads, maxlen_, dim_, dev_, kvcache_dtype_, false);
+
+      if (!(ret = kcache_.create (KVCACHE_MEMORY)).ok ()
+          || !(ret = vcache_.create (KVCACHE_MEMORY)).ok ())
+        {
+          return ret;
+        }
+
+      // masked rows past the current position are still multiplied by zero
+      // weights, so the caches must not hold garbage.
+      if (!(ret = command_->fill (kcache_, 0)).ok ()
+          || !(ret = command_->fill (vcache_, 0)).ok ())
+        {
+          return ret;
+        }
+
+      if (kvcache_dtype_ == Q8_0)
+        {
+          update_kcache_op_ = std::make_unique<UpdateKVCache> (
+              dev_, command_, kvcache_dtype_);
+          update_vcache_op_ = std::make_unique<UpdateKVCache> (
+              dev_, command_, kvcache_dtype_);
+
+          if (!(ret = update_kcache_op_->init ()).ok ()
+              || !(ret = update_vcache_op_->init ()).ok ())
+            {
+              return ret;
+            }
+        }
+    }
 
   if (clip_output_)
     {
@@ -139,6 +206,30 @@ static bool __enable_debug_log = false;
 
 absl::StatusOr<Tensor>
 MultiHeadAttentionV2::operator() (Tensor X, const size_t offset) noexcept
+{
+  // the rope angles cover positions up to 2 * maxlen
+  if (offset + X.height () > 2 * (size_t)maxlen_)
+    {
+      return absl::OutOfRangeError (absl::StrFormat (
+          "multiheadattention: positions up to %zu past the %d positions "
+          "with rope angles.",
+          offset + X.height (), 2 * maxlen_));
+    }
+
+  const size_t read_len = std::min (offset + X.height (), (size_t)maxlen_);
+  return forward_ (X, zero_, offset, read_len);
+}
+
+absl::StatusOr<Tensor>
+MultiHeadAttentionV2::operator() (Tensor X, Tensor offset,
+                                  const size_t read_len) noexcept
+{
+  return forward_ (X, offset, 0, read_len);
+}
+
+absl::StatusOr<Tensor>
+MultiHeadAttentionV2::forward_ (Tensor X, Tensor offset, const uint32_t bias,
+                                const size_t read_len) noexcept
 {
   absl::Status ret;
 
@@ -159,7 +250,8 @@ MultiHeadAttentionV2::operator() (Tensor X, const size_t offset) noexcept
     }
 
   if ((!transposed_weight_ && wv_.height () != X.width ())
-      || (transposed_weight_ && wv_.width () != X.width ()))
+      || (transposed_weight_ && wv_.width () != X.width ())
+      || X.channels () != 1)
     {
       return absl::InvalidArgumentError (
           absl::StrFormat ("shape error. wv.shape = (%zu, %zu, %zu), "
@@ -168,145 +260,110 @@ MultiHeadAttentionV2::operator() (Tensor X, const size_t offset) noexcept
                            X.channels (), X.height (), X.width ()));
     }
 
-  {
-    size_t c = X.channels (), h = X.height (),
-           w = transposed_weight_ ? wk_.height () : wk_.width ();
-    if (!(k_.channels () == c && k_.height () == h && k_.width () == w))
-      {
-        k_ = Tensor (X.channels (), X.height (),
-                     transposed_weight_ ? wk_.height () : wk_.width (), dev_,
-                     X.dtype (), false);
-
-        q_ = Tensor::like (k_);
-        v_ = Tensor::like (k_);
-
-        VKLLAMA_STATUS_OK (k_.create ());
-        VKLLAMA_STATUS_OK (q_.create ());
-        VKLLAMA_STATUS_OK (v_.create ());
-      }
-  }
+  const size_t seqlen = X.height ();
+  const size_t heads
+      = (transposed_weight_ ? wk_.height () : wk_.width ()) / dim_;
+
+  if (use_kvcache_ && (read_len < seqlen || read_len > (size_t)maxlen_))
+    {
+      return absl::OutOfRangeError (absl::StrFormat (
+          "multiheadattention: read_len = %zu out of range [%zu, %d]",
+          read_len, seqlen, maxlen_));
+    }
+
+  // [heads, seqlen, dim]. k and v go straight into fp16 caches at offset
+  // when there are such caches.
+  VKLLAMA_STATUS_OK (output_ (q_, heads, seqlen, dim_, X.dtype ()));
+  const bool quantized = use_kvcache_ && kvcache_dtype_ == Q8_0;
+  Tensor k = kcache_, v = vcache_;
+  if (!use_kvcache_ || quantized || use_pages_)
+    {
+      VKLLAMA_STATUS_OK (output_ (k_, heads, seqlen, dim_, X.dtype ()));
+      VKLLAMA_STATUS_OK (output_ (v_, heads, seqlen, dim_, X.dtype ()));
+      k = k_;
+      v = v_;
+    }
 
-  Tensor q = q_;
   {
-    uint32_t groupx
-        = (k_.width () + Q8_0_KQV_TILE_X_SIZE - 1) / Q8_0_KQV_TILE_X_SIZE,
-        groupy = k_.height (), groupz = k_.channels ();
+    uint32_t groupx = (heads * dim_ + Q8_0_KQV_TILE_X_SIZE - 1)
+                      / Q8_0_KQV_TILE_X_SIZE,
+             groupy = seqlen, groupz = X.channels ();
 
     VKLLAMA_STATUS_OK (kqv_pipeline_->set_group (groupx, groupy, groupz));
 
-    auto constants
-        = X.shape_constant () + wk_.shape_constant () + k_.shape_constant ();
+    auto constants = X.shape_constant () + wk_.shape_constant ()
+                     + k.shape_constant () + q_.shape_constant ();
+    constants.push_back (bias);
 
     VKLLAMA_STATUS_OK (command_->record_pipeline (
-        *kqv_pipeline_, { X, wk_, wq_, wv_, k_, q, v_ }, constants));
+        *kqv_pipeline_, { X, wk_, wq_, wv_, k, q_, v, offset },
+        { 0, 1, 2, 3, 4, 5, 6, 9 }, constants));
+
+    k.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
+    k.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    q_.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
+    q_.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    v.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
+    v.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
   }
 
-  // [seqlen, heads, dim]
-  if (auto ret = k_.reshape (k_.height (), k_.width () / dim_, dim_);
-      !ret.ok ())
+  if (quantized)
     {
-      return ret;
+      VKLLAMA_STATUS_OK ((*update_kcache_op_) (kcache_, k, offset, bias));
+      VKLLAMA_STATUS_OK ((*update_vcache_op_) (vcache_, v, offset, bias));
     }
-
-  if (auto ret = q.reshape (q.height (), q.width () / dim_, dim_); !ret.ok ())
+  else if (use_pages_)
     {
-      return ret;
+      VKLLAMA_STATUS_OK ((*update_kcache_op_) (paged_.keys, k, paged_.table,
+                                               offset, maxlen_, bias));
+      VKLLAMA_STATUS_OK ((*update_vcache_op_) (paged_.values, v, paged_.table,
+                                               offset, maxlen_, bias));
     }
 
-  if (auto ret = v_.reshape (v_.height (), v_.width () / dim_, dim_);
-      !ret.ok ())
-    {
-      return ret;
-    }
+  Tensor q = q_;
+  VKLLAMA_STATUS_OK (print_fn ("multiheadattention roped q mean: ", q));
 
   // clip to last token
   if (clip_output_)
     {
       std::array<uint32_t, 3> starts
-          = { uint32_t (q.channels () - 1), uint32_t (0), uint32_t (0) };
+          = { uint32_t (0), uint32_t (seqlen - 1), uint32_t (0) };
       std::array<uint32_t, 3> sizes
-          = { uint32_t (1), uint32_t (q.height ()), uint32_t (q.width ()) };
+          = { uint32_t (heads), uint32_t (1), uint32_t (dim_) };
 
       auto ret = (*clip_output_op_) (q, starts, sizes);
       VKLLAMA_STATUS_OK (ret);
       q = *ret;
     }
 
-  //[heads, seqlen, dim]
-  auto transposed_k = (*transpose_k_) (k_);
-  auto transposed_q = (*transpose_q_) (q);
-  auto transposed_v = (*transpose_v_) (v_);
-
-  VKLLAMA_STATUS_OK (transposed_k);
-  VKLLAMA_STATUS_OK (transposed_q);
-  VKLLAMA_STATUS_OK (transposed_v);
-
-  VKLLAMA_STATUS_OK (
-      print_fn ("multiheadattention transposed k mean: ", *transposed_k));
-  VKLLAMA_STATUS_OK (
-      print_fn ("multiheadattention transposed q mean: ", *transposed_q));
-  VKLLAMA_STATUS_OK (
-      print_fn ("multiheadattention transposed v mean: ", *transposed_v));
-
-  auto roped_q = (*rope_q_) (*transposed_q, offset);
-
-  auto roped_k = (*rope_k_) (*transposed_k, offset);
-
-  VKLLAMA_STATUS_OK (roped_k);
-  VKLLAMA_STATUS_OK (roped_q);
-
-  VKLLAMA_STATUS_OK (print_fn ("multiheadattention roped q mean: ", *roped_q));
-  VKLLAMA_STATUS_OK (print_fn ("multiheadattention roped k mean: ", *roped_k));
-
-  if (use_kvcache_)
+  // [seqlen, heads, dim], the scores stay in the shader. The device offset
+  // is only the mask offset when every query row is kept; a clipped query
+  // is the last row and expects read_len == offset + seqlen.
+  absl::StatusOr<Tensor> concated;
+  if (use_pages_)
     {
-      auto &update_kcache_op = *update_kcache_op_;
-      auto &update_vcache_op = *update_vcache_op_;
-
-      auto ret = update_kcache_op (kcache_, *roped_k, (uint32_t)offset);
-      VKLLAMA_STATUS_OK (ret);
-
-      ret = update_vcache_op (vcache_, *transposed_v, (uint32_t)offset);
-      VKLLAMA_STATUS_OK (ret);
-
-      uint32_t read_len = std::min (
-          (uint32_t)(offset + transposed_k->height ()), (uint32_t)maxlen_);
-
-      roped_k = kcache_.view (kcache_.channels (), read_len, kcache_.width ());
-
-      VKLLAMA_STATUS_OK (roped_k);
-
-      transposed_v
-          = vcache_.view (vcache_.channels (), read_len, vcache_.width ());
-      VKLLAMA_STATUS_OK (transposed_v);
+      concated = q.height () == seqlen
+                     ? (*attention_) (q, paged_.keys, paged_.values,
+                                      paged_.table, offset, read_len, bias)
+                     : (*attention_) (q, paged_.keys, paged_.values,
+                                      paged_.table, read_len - q.height (),
+                                      read_len);
     }
+  else
+    {
+      if (use_kvcache_)
+        {
+          k = kcache_.view (kcache_.channels (), read_len, kcache_.width ());
+          v = vcache_.view (vcache_.channels (), read_len, vcache_.width ());
+        }
 
-  VKLLAMA_STATUS_OK (
-      print_fn ("multiheadattention cached k mean: ", *transposed_k));
-  VKLLAMA_STATUS_OK (
-      print_fn ("multiheadattention cached v mean: ", *transposed_v));
-
-  // [heads, seqlen, seqlen]
-  auto attn_scores = (*matmul_qk_) (*roped_q, *roped_k);
-  VKLLAMA_STATUS_OK (attn_scores);
-  VKLLAMA_STATUS_OK (
-      print_fn ("multiheadattention attn_scores mean: ", *attn_scores));
-
-  // TODO: could be funsed
-  auto softmax_offset = attn_scores->width () - attn_scores->height ();
-  auto softmax_attn_scores = (*softmax_) (*attn_scores, softmax_offset);
-
-  VKLLAMA_STATUS_OK (softmax_attn_scores);
-  VKLLAMA_STATUS_OK (print_fn ("multiheadattention softmax_attn_scores mean: ",
-                               *softmax_attn_scores));
-
-  // [heads, seqlen, dim]
-  auto heads = (*matmul_weighted_) (*softmax_attn_scores, *transposed_v);
-  VKLLAMA_STATUS_OK (heads);
-  VKLLAMA_STATUS_OK (print_fn ("multiheadattention heads mean: ", *heads));
+      VKLLAMA_STATUS_OK (print_fn ("multiheadattention cached k mean: ", k));
+      VKLLAMA_STATUS_OK (print_fn ("multiheadattention cached v mean: ", v));
 
-  //[seqlen, heads, dim]
-  auto concated = (*transpose_heads_) (*heads);
+      concated = use_kvcache_ && q.height () == seqlen
+                     ? (*attention_) (q, k, v, offset, bias)
+                     : (*attention_) (q, k, v, k.height () - q.height ());
+    }
   VKLLAMA_STATUS_OK (concated);
   VKLLAMA_STATUS_OK (
       print_fn ("multiheadattention concated heads mean: ", *concated));
@@ -328,36 +385,20 @@ uint64_t
 MultiHeadAttentionV2::time () noexcept
 {
   auto kqv_cost = kqv_pipeline_->time ();
-  auto transposed_cost = std::max (
-      { transpose_k_->time (), transpose_q_->time (), transpose_v_->time () });
-  uint64_t kvcache_cost = 0;
-
-  if (use_kvcache_)
+  auto attention_cost = attention_->time ();
+  auto output_cost = matmul_o_->time ();
+  if (update_kcache_op_)
     {
-      auto update_cost
-          = std::max (update_kcache_op_->time (), update_vcache_op_->time ());
-      kvcache_cost = update_cost;
+      kqv_cost += update_kcache_op_->time () + update_vcache_op_->time ();
     }
 
-  auto rope_cost = rope_k_->time ();
-  auto attn_score_cost = matmul_qk_->time ();
-  auto softmax_cost = softmax_->time ();
-  auto weighted_cost = matmul_weighted_->time ();
-  auto transpose_head_cost = transpose_heads_->time ();
-  auto output_cost = matmul_o_->time ();
-
 #if __VKLLAMA_LOG_COST
-  fprintf (
-      stderr,
-      "attn time: kqv_cost = %llu, transposed_cost = %llu, kvcache_cost = "
-      "%llu, rope_cost = %llu, attn_score_cost = %llu, softmax cost = %llu, "
-      "weighted_cost = %llu, transpose head cost = %llu, output cost = %llu\n",
-      kqv_cost, transposed_cost, kvcache_cost, rope_cost, attn_score_cost,
-      softmax_cost, weighted_cost, transpose_head_cost, output_cost);
+  fprintf (stderr,
+           "attn time: kqv_cost = %llu, attention_cost = %llu, output cost = "
+           "%llu\n",
+           kqv_cost, attention_cost, output_cost);
 #endif
 
-  return kqv_cost + transposed_cost + kvcache_cost + rope_cost
-         + attn_score_cost + softmax_cost + weighted_cost + transpose_head_cost
-         + output_cost;
+  return kqv_cost + attention_cost + output_cost;
 }
 }
@@ -1,14 +1,15 @@
 #ifndef __VKLLAMA_MULTIHEADATTENTIONV2_H__
 #define __VKLLAMA_MULTIHEADATTENTIONV2_H__
+#include "src/core/kvcache_pool.h"
 #include "src/core/tensor.h"
 #include "src/ops/elementwise.h"
 #include "src/ops/feed_forward.h"
+#include "src/ops/flash_attention.h"
 #include "src/ops/mat_mul.h"
 #include "src/ops/op.h"
 #include "src/ops/rope.h"
 #include "src/ops/slice.h"
 #include "src/ops/softmax.h"
-#include "src/ops/transpose.h"
 #include "src/ops/update_kv_cache.h"
 #include <memory>
 #include <unordered_map>
@@ -22,25 +23,47 @@ class Command;
 class MultiHeadAttentionV2 : public Op
 {
 public:
+  // kvcache_dtype is FP16 or Q8_0. Q8_0 caches take about half the memory;
+  // k and v are then written out in fp16 and quantized into the caches.
+  // With paged set, the kv cache is the pages of a KVCachePool instead of
+  // caches of maxlen rows of the op's own; it is fp16, and the owner of the
+  // table maps the positions a pass reads and writes before it runs.
   MultiHeadAttentionV2 (GPUDevice *dev, Command *command, Tensor wk, Tensor wq,
                         Tensor wv, Tensor wo, const int maxlen, const int dim,
                         const bool transposed_weight = false,
                         Tensor::DType dtype = FP16,
                         const bool use_kvcache = false,
-                        const bool clip_output = false);
+                        const bool clip_output = false,
+                        const Tensor::DType kvcache_dtype = FP16,
+                        PagedKVCache const &paged = {});
 
   absl::StatusOr<Tensor> operator() (Tensor X,
                                      const size_t offset = 0) noexcept;
+
+  // offset is a UINT32 device tensor read at dispatch time, so the recorded
+  // commands can be replayed for any position. read_len is the number of
+  // cached rows attended to; rows past the current position are masked.
+  absl::StatusOr<Tensor> operator() (Tensor X, Tensor offset,
+                                     const size_t read_len) noexcept;
   absl::Status init () noexcept override;
   uint64_t time () noexcept override;
 
 private:
+  // a numeric offset goes into the push constants as bias, added to that
+  // of the offset tensor, which is then zero_
+  absl::StatusOr<Tensor> forward_ (Tensor X, Tensor offset,
+                                   const uint32_t bias,
+                                   const size_t read_len) noexcept;
+
   Tensor wk_;
   Tensor wq_;
   Tensor wv_;
   Tensor wo_;
   Tensor kcache_;
   Tensor vcache_;
+  // rope angles of the kqv shader
+  Tensor freqc_;
+  Tensor freqs_;
 
   const int maxlen_;
   const int dim_;
@@ -48,27 +71,23 @@ private:
   Tensor::DType dtype_;
   const bool use_kvcache_;
   const bool clip_output_;
+  const Tensor::DType kvcache_dtype_;
+  PagedKVCache paged_;
+  const bool use_pages_;
 
   std::unique_ptr<MatMul> matmul_o_;
-  std::unique_ptr<MatMul> matmul_qk_;
-  std::unique_ptr<MatMul> matmul_weighted_;
+  std::unique_ptr<FlashAttention> attention_;
   std::unique_ptr<ElementWise> scaled_;
-  std::unique_ptr<Softmax> softmax_;
-  std::unique_ptr<Rope> rope_q_;
-  std::unique_ptr<Rope> rope_k_;
-  std::unique_ptr<Transpose> transpose_k_;
-  std::unique_ptr<Transpose> transpose_q_;
-  std::unique_ptr<Transpose> transpose_v_;
-  std::unique_ptr<Transpose> transpose_heads_;
-  std::unique_ptr<MatMul> matmul_attn_score_;
-  std::unique_ptr<UpdateKVCache> update_kcache_op_;
-  std::unique_ptr<UpdateKVCache> update_vcache_op_;
   std::unique_ptr<Slice> clip_output_op_;
   std::unique_ptr<Pipeline> kqv_pipeline_;
+  // q8_0 and paged caches only, fp16 caches are written by the kqv shader
+  std::unique_ptr<UpdateKVCache> update_kcache_op_;
+  std::unique_ptr<UpdateKVCache> update_vcache_op_;
 
   // temp tensors
   std::vector<Tensor> tmp_tensors_;
   Tensor k_, q_, v_;
+  Tensor zero_;
 };
 }
 
@@ -1,4 +1,6 @@
 #include "op.h"
+#include "src/core/activation_planner.h"
+#include "src/core/command.h"
 #include "src/core/pipeline.h"
 
 namespace vkllama
@@ -7,5 +9,25 @@ Op::Op (GPUDevice *dev, Command *command) noexcept : dev_ (dev),
                                                      command_ (command)
 {
 }
-}
 
+absl::Status
+Op::output_ (Tensor &out, size_t c, size_t h, size_t w, DType dtype)
+{
+  if (auto *activations = command_->activations ())
+    {
+      auto tensor = activations->acquire (c, h, w, dtype);
+      VKLLAMA_STATUS_OK (tensor.status ());
+      out = *tensor;
+      return absl::OkStatus ();
+    }
+
+  if (out.channels () != c || out.height () != h || out.width () != w
+      || out.dtype () != dtype)
+    {
+      out = Tensor (c, h, w, dev_, dtype, false);
+      VKLLAMA_STATUS_OK (out.create ());
+    }
+
+  return absl::OkStatus ();
+}
+}
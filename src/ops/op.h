@@ -20,6 +20,12 @@ public:
   virtual ~Op (){};
 
 protected:
+  // Makes out an output of the given shape. With an ActivationPlanner on
+  // the command it comes from the planner on every call, otherwise out is
+  // created anew only when its shape or dtype changes.
+  absl::Status output_ (Tensor &out, size_t c, size_t h, size_t w,
+                        DType dtype);
+
   GPUDevice *dev_;
   Command *command_;
 };
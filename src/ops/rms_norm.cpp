@@ -67,13 +67,8 @@ RMSNorm::operator() (Tensor x) noexcept
           int (dtype_), int (x.dtype ())));
     }
 
-  if (out_.channels () != x.channels () || out_.height () != x.height ()
-      || out_.width () != x.width ())
-    {
-      out_ = Tensor (x.channels (), x.height (), x.width (), dev_, dtype_,
-                     false);
-      VKLLAMA_STATUS_OK (out_.create ());
-    }
+  VKLLAMA_STATUS_OK (
+      output_ (out_, x.channels (), x.height (), x.width (), dtype_));
 
   auto ret = pipeline_->set_group (1, x.height (), x.channels ());
   VKLLAMA_STATUS_OK (ret);
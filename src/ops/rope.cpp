@@ -16,9 +16,9 @@ Rope::Rope (GPUDevice *dev, Command *command, const int maxlen, const int dim,
 {
 }
 
-static void
-compute_freq (size_t dim, size_t maxlen, std::vector<float> &freqc,
-              std::vector<float> &freqs)
+void
+rope_frequencies (size_t dim, size_t maxlen, std::vector<float> &freqc,
+                  std::vector<float> &freqs)
 {
   std::vector<float> freq;
   std::generate_n (std::back_inserter (freq), dim / 2,
@@ -56,7 +56,7 @@ Rope::init () noexcept
     }
 
   Pipeline::ShaderInfo shader_info_q
-      = { 0, 3, sizeof (ShapeConstant) + sizeof (uint32_t), 16, 2, 1 };
+      = { 0, 4, sizeof (ShapeConstant), 16, 2, 1 };
 
   const auto *spv_code = __get_rope_fp16_comp_spv_code ();
   const auto spv_size = __get_rope_fp16_comp_spv_size ();
@@ -79,7 +79,7 @@ Rope::init () noexcept
     }
 
   std::vector<float> freqc, freqs;
-  compute_freq (dim_, 2 * maxlen_, freqc, freqs);
+  rope_frequencies (dim_, 2 * maxlen_, freqc, freqs);
 
   ret = command_->upload ((const uint8_t *)freqc.data (),
                           freqc.size () * sizeof (__vkllama_fp16_t), freqc_);
@@ -112,6 +112,26 @@ Rope::time () noexcept
 absl::StatusOr<Tensor>
 Rope::operator() (Tensor query, const size_t offset) noexcept
 {
+  if (offset_.size () == 0)
+    {
+      offset_ = Tensor (1, 1, 1, dev_, UINT32, true);
+      VKLLAMA_STATUS_OK (offset_.create ());
+    }
+
+  const uint32_t value = offset;
+  VKLLAMA_STATUS_OK (command_->upload (&value, 1, offset_));
+  return operator() (query, offset_);
+}
+
+absl::StatusOr<Tensor>
+Rope::operator() (Tensor query, Tensor offset) noexcept
+{
+  if (offset.dtype () != UINT32 || offset.size () < 1)
+    {
+      return absl::InvalidArgumentError (
+          "rope: offset must be a uint32 tensor with at least 1 element.");
+    }
+
   if (query.width () != dim_ || query.height () > maxlen_)
     {
       return absl::InvalidArgumentError (absl::StrFormat (
@@ -136,9 +156,8 @@ Rope::operator() (Tensor query, const size_t offset) noexcept
       return ret;
     }
 
-  auto shape = query.shape_constant ();
-  shape.push_back ((uint32_t)offset);
-  ret = command_->record_pipeline (*pipeline_q_, { query }, { 0 }, shape);
+  ret = command_->record_pipeline (*pipeline_q_, { query, offset }, { 0, 3 },
+                                   query.shape_constant ());
   if (!ret.ok ())
     {
       return ret;
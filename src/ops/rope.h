@@ -9,6 +9,11 @@
 
 namespace vkllama
 {
+// cos and sin of the angles rope rotates the pairs of a head of dim by, for
+// positions [0, maxlen): [maxlen, dim / 2] each
+void rope_frequencies (size_t dim, size_t maxlen, std::vector<float> &freqc,
+                       std::vector<float> &freqs);
+
 class Rope : public Op
 {
 public:
@@ -17,6 +22,8 @@ public:
 
   absl::StatusOr<Tensor> operator() (Tensor query,
                                      const size_t offset = 0) noexcept;
+  // offset is read from a UINT32 device tensor at dispatch time
+  absl::StatusOr<Tensor> operator() (Tensor query, Tensor offset) noexcept;
   absl::Status init () noexcept override;
   uint64_t time () noexcept override;
 
@@ -28,6 +35,7 @@ private:
   std::unique_ptr<Pipeline> pipeline_q_;
   Tensor freqc_;
   Tensor freqs_;
+  Tensor offset_;
 };
 
 }
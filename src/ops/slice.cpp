@@ -44,16 +44,20 @@ Slice::operator() (Tensor in, const std::array<uint32_t, 3> &starts,
           in.channels (), in.height (), in.width ()));
     }
 
+  // whole rows at a bindable offset are viewed in place
+  auto view = in.slice ({ starts[0], starts[1], starts[2] },
+                        { extents[0], extents[1], extents[2] });
+  if (view.ok ())
+    {
+      return view;
+    }
+
   ShaderConstants constants = in.shape_constant ();
   constants += { starts[0],  starts[1],  starts[2],
                  extents[0], extents[1], extents[2] };
 
-  if (out_.channels () != extents[0] || out_.height () != extents[1]
-      || out_.width () != extents[2])
-    {
-      out_ = Tensor (extents[0], extents[1], extents[2], dev_, dtype_);
-      VKLLAMA_STATUS_OK (out_.create ());
-    }
+  VKLLAMA_STATUS_OK (
+      output_ (out_, extents[0], extents[1], extents[2], dtype_));
 
   uint32_t groupz = (extents[0] + 3) / 4, groupy = (extents[1] + 7) / 8,
            groupx = (extents[2] + 7) / 8;
@@ -13,6 +13,8 @@ public:
   Slice (GPUDevice *gpu_, Command *command_, Tensor::DType dtype);
   absl::Status init () noexcept override;
   uint64_t time () noexcept override;
+  // A slice of whole rows at an offset the device can bind is a view of in
+  // and records nothing, so writes to it land in in; others are copied.
   absl::StatusOr<Tensor>
   operator() (Tensor in, std::array<uint32_t, 3> const &starts,
               std::array<uint32_t, 3> const &extents) noexcept;
@@ -28,8 +28,8 @@ Softmax::init () noexcept
     }
 
   Pipeline::ShaderInfo info0 = { 1,
-                                 2,
-                                 sizeof (ShapeConstant) + sizeof (uint32_t),
+                                 3,
+                                 sizeof (ShapeConstant),
                                  (uint32_t)dev_->subgroup_size (),
                                  2,
                                  1 };
@@ -52,6 +52,26 @@ Softmax::time () noexcept
 absl::StatusOr<Tensor>
 Softmax::operator() (Tensor a, size_t offset) noexcept
 {
+  if (offset_.size () == 0)
+    {
+      offset_ = Tensor (1, 1, 1, dev_, UINT32, true);
+      VKLLAMA_STATUS_OK (offset_.create ());
+    }
+
+  const uint32_t value = offset;
+  VKLLAMA_STATUS_OK (command_->upload (&value, 1, offset_));
+  return operator() (a, offset_);
+}
+
+absl::StatusOr<Tensor>
+Softmax::operator() (Tensor a, Tensor offset) noexcept
+{
+  if (offset.dtype () != UINT32 || offset.size () < 1)
+    {
+      return absl::InvalidArgumentError (
+          "softmax: offset must be a uint32 tensor with at least 1 element.");
+    }
+
   if (a.dtype () != dtype_)
     {
       return absl::InvalidArgumentError (absl::StrFormat (
@@ -59,12 +79,8 @@ Softmax::operator() (Tensor a, size_t offset) noexcept
           int (dtype_), int (a.dtype ())));
     }
 
-  if (out_.channels () != a.channels () || out_.height () != a.height ()
-      || out_.width () != a.width ())
-    {
-      out_ = Tensor::like (a);
-      VKLLAMA_STATUS_OK (out_.create ());
-    }
+  VKLLAMA_STATUS_OK (output_ (out_, a.channels (), a.height (), a.width (),
+                              a.dtype ()));
 
   uint32_t group_x = 1, group_y = (a.height () + 1) / 2,
            group_z = a.channels ();
@@ -75,10 +91,8 @@ Softmax::operator() (Tensor a, size_t offset) noexcept
       return ret;
     }
 
-  auto constants = a.shape_constant ();
-  constants.push_back ((uint32_t)offset);
-
-  ret = command_->record_pipeline (*softmax0_, { a, out_ }, constants);
+  ret = command_->record_pipeline (*softmax0_, { a, out_, offset },
+                                   a.shape_constant ());
 
   if (!ret.ok ())
     {
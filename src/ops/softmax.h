@@ -16,6 +16,8 @@ public:
   absl::Status init () noexcept override;
   uint64_t time () noexcept override;
   absl::StatusOr<Tensor> operator() (Tensor a, size_t offset = 0) noexcept;
+  // mask offset is read from a UINT32 device tensor at dispatch time
+  absl::StatusOr<Tensor> operator() (Tensor a, Tensor offset) noexcept;
 
 private:
   std::unique_ptr<Pipeline> softmax0_;
@@ -25,6 +27,7 @@ private:
 
   float temp_;
   Tensor out_;
+  Tensor offset_;
 };
 
 }
@@ -46,14 +46,8 @@ Transpose::operator() (Tensor in) noexcept
           "only transpose type 0 is supported now.");
     }
 
-  if (out_.channels () != in.height () || out_.height () != in.channels ()
-      || out_.width () != in.width ())
-    {
-
-      out_ = Tensor (in.height (), in.channels (), in.width (), dev_,
-                     in.dtype ());
-      VKLLAMA_STATUS_OK (out_.create ());
-    }
+  VKLLAMA_STATUS_OK (output_ (out_, in.height (), in.channels (),
+                              in.width (), in.dtype ()));
 
   uint32_t group_x = (out_.width () + 7) / 8,
            group_y = (out_.height () + 1) / 2,
@@ -1,5 +1,6 @@
 #include "src/ops/update_kv_cache.h"
 #include "src/core/command.h"
+#include "src/core/common.h"
 #include "src/shaders/vkllama_comp_shaders.h"
 #include <array>
 #include <memory>
@@ -15,28 +16,73 @@ UpdateKVCache::UpdateKVCache (GPUDevice *gpu, Command *command,
 absl::Status
 UpdateKVCache::init () noexcept
 {
-  if (dtype_ != FP16)
+  if (dtype_ != FP16 && dtype_ != Q8_0)
     {
       return absl::InvalidArgumentError (
-          "UpdateKVCache op: only fp16 is supported.");
+          "UpdateKVCache op: only fp16 and q8_0 caches are supported.");
     }
-  const auto *spv_code
-      = dtype_ == FP32 ? nullptr : __get_update_kvcache_fp16_comp_spv_code ();
 
-  size_t spv_size
-      = dtype_ == FP32 ? 0 : __get_update_kvcache_fp16_comp_spv_size ();
+  // bound as the device offset of calls with a numeric one, which goes
+  // into the push constants instead; written once, so recordings in
+  // flight never see it change
+  zero_ = Tensor (1, 1, 1, dev_, UINT32, true);
+  VKLLAMA_STATUS_OK (zero_.create ());
+  const uint32_t zero = 0;
+  VKLLAMA_STATUS_OK (command_->upload (&zero, 1, zero_));
 
-  Pipeline::ShaderInfo info = { 0, 2, sizeof (uint32_t) * 6, 16, 2, 1 };
+  if (dtype_ == Q8_0)
+    {
+      Pipeline::ShaderInfo info = {
+        0, 3, sizeof (ShapeConstant) * 2 + sizeof (uint32_t), 4, 16, 1
+      };
+      pipeline_ = std::make_unique<Pipeline> (
+          dev_, __get_update_kvcache_q8_0_comp_spv_code (),
+          __get_update_kvcache_q8_0_comp_spv_size (), ShaderConstants (),
+          info);
+      return pipeline_->init ();
+    }
+
+  const auto *spv_code = __get_update_kvcache_fp16_comp_spv_code ();
+  size_t spv_size = __get_update_kvcache_fp16_comp_spv_size ();
+
+  Pipeline::ShaderInfo info = { 0, 3, sizeof (uint32_t) * 6, 16, 2, 1 };
   ShaderConstants specs;
   pipeline_
       = std::make_unique<Pipeline> (dev_, spv_code, spv_size, specs, info);
-  return pipeline_->init ();
+
+  Pipeline::ShaderInfo paged_info
+      = { 0, 4, sizeof (ShapeConstant) * 3 + sizeof (uint32_t) * 2, 16, 2, 1 };
+  paged_ = std::make_unique<Pipeline> (
+      dev_, __get_update_kvcache_paged_fp16_comp_spv_code (),
+      __get_update_kvcache_paged_fp16_comp_spv_size (), ShaderConstants (),
+      paged_info);
+
+  auto ret = pipeline_->init ();
+  if (!ret.ok ())
+    {
+      return ret;
+    }
+  return paged_->init ();
 }
 
 absl::Status
 UpdateKVCache::operator() (Tensor cache, Tensor key_or_value,
                            const uint32_t offset) noexcept
 {
+  return operator() (cache, key_or_value, zero_, offset);
+}
+
+absl::Status
+UpdateKVCache::operator() (Tensor cache, Tensor key_or_value,
+                           Tensor offset, const uint32_t bias) noexcept
+{
+  if (offset.dtype () != UINT32 || offset.size () < 1)
+    {
+      return absl::InvalidArgumentError (
+          "UpdateKVCache: offset must be a uint32 tensor with at least 1 "
+          "element.");
+    }
+
   if (cache.height () < key_or_value.height ()
       || cache.channels () < key_or_value.channels ()
       || cache.width () != key_or_value.width ())
@@ -49,35 +95,141 @@ UpdateKVCache::operator() (Tensor cache, Tensor key_or_value,
                            cache.height (), cache.width ()));
     }
 
-  ShaderConstants constants
-      = { (uint32_t)key_or_value.channels (), (uint32_t)key_or_value.height (),
-          (uint32_t)key_or_value.width (),    (uint32_t)cache.height (),
-          (uint32_t)cache.width (),           offset };
+  if (key_or_value.dtype () != FP16 || cache.dtype () != dtype_)
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "UpdateKVCache: fp16 rows into a cache of dtype %d expected, got "
+          "dtypes %d and %d.",
+          int (dtype_), int (key_or_value.dtype ()), int (cache.dtype ())));
+    }
+
+  absl::Status ret;
+  if (dtype_ == Q8_0)
+    {
+      // a block of 32 items per invocation
+      const uint32_t blocks = (key_or_value.width () + 31) / 32;
+      ret = pipeline_->set_group ((blocks + 3) / 4,
+                                  (key_or_value.height () + 15) / 16,
+                                  key_or_value.channels ());
+      if (!ret.ok ())
+        {
+          return ret;
+        }
+
+      auto constants
+          = key_or_value.shape_constant () + cache.shape_constant ();
+      constants.push_back (bias);
+      ret = command_->record_pipeline (
+          *pipeline_, { key_or_value, cache, offset }, constants);
+    }
+  else
+    {
+      ShaderConstants constants
+          = { (uint32_t)key_or_value.channels (),
+              (uint32_t)key_or_value.height (),
+              (uint32_t)key_or_value.width (), (uint32_t)cache.height (),
+              (uint32_t)cache.width (),        bias };
+
+      const uint32_t group_x = (key_or_value.width () + 15) / 16,
+                     group_y = (key_or_value.height () + 1) / 2,
+                     group_z = key_or_value.channels ();
+      ret = pipeline_->set_group (group_x, group_y, group_z);
+      if (!ret.ok ())
+        {
+          return ret;
+        }
+
+      ret = command_->record_pipeline (
+          *pipeline_, { key_or_value, cache, offset }, constants);
+    }
+
+  if (!ret.ok ())
+    {
+      return ret;
+    }
+
+  cache.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
+  cache.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+  return absl::OkStatus ();
+}
+
+absl::Status
+UpdateKVCache::operator() (Tensor pages, Tensor key_or_value, Tensor table,
+                           Tensor offset, const uint32_t maxlen,
+                           const uint32_t bias) noexcept
+{
+  if (!paged_)
+    {
+      return absl::FailedPreconditionError (
+          "UpdateKVCache: only fp16 caches can be paged.");
+    }
+
+  if (offset.dtype () != UINT32 || offset.size () < 1
+      || table.dtype () != UINT32 || table.size () < 1)
+    {
+      return absl::InvalidArgumentError (
+          "UpdateKVCache: offset and table must be uint32 tensors with at "
+          "least 1 element.");
+    }
+
+  if (key_or_value.dtype () != FP16 || pages.dtype () != FP16)
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "UpdateKVCache: fp16 rows into fp16 pages expected, got dtypes %d "
+          "and %d.",
+          int (key_or_value.dtype ()), int (pages.dtype ())));
+    }
+
+  // a page holds the rows of every head side by side
+  if (key_or_value.channels () == 0
+      || pages.channels () % key_or_value.channels () != 0
+      || pages.width () != key_or_value.width ())
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "UpdateKVCache: pages of shape (%zu, %zu, %zu) do not hold rows "
+          "of shape (%zu, %zu, %zu).",
+          pages.channels (), pages.height (), pages.width (),
+          key_or_value.channels (), key_or_value.height (),
+          key_or_value.width ()));
+    }
+
+  // positions past the table would land in pages it does not map
+  if (maxlen == 0 || maxlen > table.size () * pages.height ())
+    {
+      return absl::InvalidArgumentError (absl::StrFormat (
+          "UpdateKVCache: %u positions through a table of %zu pages of %zu "
+          "rows.",
+          maxlen, table.size (), pages.height ()));
+    }
 
   const uint32_t group_x = (key_or_value.width () + 15) / 16,
                  group_y = (key_or_value.height () + 1) / 2,
                  group_z = key_or_value.channels ();
-  auto ret = pipeline_->set_group (group_x, group_y, group_z);
+  auto ret = paged_->set_group (group_x, group_y, group_z);
   if (!ret.ok ())
     {
       return ret;
     }
 
-  ret = command_->record_pipeline (*pipeline_, { key_or_value, cache },
-                                   constants);
+  auto constants = key_or_value.shape_constant () + pages.shape_constant ()
+                   + table.shape_constant ();
+  constants.push_back (maxlen);
+  constants.push_back (bias);
+  ret = command_->record_pipeline (
+      *paged_, { key_or_value, pages, table, offset }, constants);
   if (!ret.ok ())
     {
       return ret;
     }
 
-  cache.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
-  cache.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+  pages.set_access_flags (VK_ACCESS_SHADER_WRITE_BIT);
+  pages.set_pipeline_stage (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
   return absl::OkStatus ();
 }
 
 uint64_t
 UpdateKVCache::time () noexcept
 {
-  return pipeline_->time ();
+  return pipeline_->time () + (paged_ ? paged_->time () : 0);
 }
 }
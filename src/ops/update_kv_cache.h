@@ -7,6 +7,10 @@
 #include <memory>
 namespace vkllama
 {
+// Writes rows of keys or values into a cache at an offset, wrapping around
+// past its last row. dtype is the dtype of the cache; a Q8_0 cache gets its
+// rows quantized, and its rows are packed blocks of the device layout
+// (fp16 scale, 32 int8 items).
 class UpdateKVCache : public Op
 {
 public:
@@ -14,12 +18,26 @@ public:
 
   absl::Status init () noexcept override;
   uint64_t time () noexcept override;
+  // offset is pushed as a constant of the recorded dispatch
   absl::Status operator() (Tensor cache, Tensor key_or_value,
                            uint32_t offset) noexcept;
+  // offset is read from a UINT32 device tensor at dispatch time, and bias
+  // is added to it
+  absl::Status operator() (Tensor cache, Tensor key_or_value, Tensor offset,
+                           const uint32_t bias = 0) noexcept;
+  // Writes into the pages of a pool, [pages * heads, page_rows, width],
+  // through the block table of a sequence, see PagedKVCache; the rows
+  // wrap around past maxlen, which the table has to map. fp16 only.
+  absl::Status operator() (Tensor pages, Tensor key_or_value, Tensor table,
+                           Tensor offset, const uint32_t maxlen,
+                           const uint32_t bias = 0) noexcept;
 
 private:
   std::unique_ptr<Pipeline> pipeline_;
+  std::unique_ptr<Pipeline> paged_;
   Tensor::DType dtype_;
+  // bound as the device offset of calls with a numeric one
+  Tensor zero_;
 };
 }
 
@@ -0,0 +1,131 @@
+// Startup cost of Model::init with weights staged through host memory and
+// with weights imported from the mapped gguf file. Each mode loads the
+// model in a child process, so the wall time and peak RSS of one do not
+// leak into the other. Usage: bench_model_load <path to gguf> [rounds]
+#include "models/llama2.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int
+load (const char *path, const bool import_weights)
+{
+  auto *gguf = gguf_open (path);
+  if (!gguf)
+    {
+      fprintf (stderr, "failed at opening %s.\n", path);
+      return -1;
+    }
+
+  std::map<std::string, gguf_key> kv;
+  gguf_key key;
+  while (gguf_get_key (gguf, &key))
+    {
+      kv[std::string (key.name, key.namelen)] = key;
+    }
+
+  std::map<std::string, gguf_tensor> tensors;
+  gguf_tensor tensor;
+  while (gguf_get_tensor (gguf, &tensor))
+    {
+      tensors[std::string (tensor.name, tensor.namelen)] = tensor;
+    }
+
+  int ret = 0;
+  {
+    vkllama::Model model (0);
+    model.set_import_weights (import_weights);
+    auto s = model.init (kv, tensors);
+    if (!s.ok ())
+      {
+        fprintf (stderr, "failed at init model: %s\n", s.ToString ().c_str ());
+        ret = -1;
+      }
+  }
+
+  gguf_close (gguf);
+  return ret;
+}
+
+static int
+bench (const char *path, const bool import_weights, double *millis,
+       long *peak_rss_kb)
+{
+  auto start = std::chrono::high_resolution_clock::now ();
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      perror ("fork");
+      return -1;
+    }
+  if (pid == 0)
+    {
+      _exit (load (path, import_weights) == 0 ? 0 : 1);
+    }
+
+  int status = 0;
+  struct rusage usage;
+  if (wait4 (pid, &status, 0, &usage) != pid || !WIFEXITED (status)
+      || WEXITSTATUS (status) != 0)
+    {
+      return -1;
+    }
+
+  auto end = std::chrono::high_resolution_clock::now ();
+  *millis = std::chrono::duration<double, std::milli> (end - start).count ();
+  *peak_rss_kb = usage.ru_maxrss;
+  return 0;
+}
+
+int
+main (int argc, const char *argv[])
+{
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: %s <path to gguf> [rounds]\n", argv[0]);
+      return -1;
+    }
+
+  const int rounds = argc > 2 ? std::max (::atoi (argv[2]), 1) : 3;
+  const char *modes[] = { "staged", "imported" };
+
+  // the first load warms the page cache, so neither mode pays for the disk
+  double millis = .0;
+  long rss = 0;
+  if (bench (argv[1], false, &millis, &rss) != 0)
+    {
+      fprintf (stderr, "failed at loading %s.\n", argv[1]);
+      return -1;
+    }
+
+  fprintf (stderr, "%-10s %12s %12s %16s\n", "mode", "best ms", "mean ms",
+           "peak rss MiB");
+  for (int m = 0; m < 2; ++m)
+    {
+      double best = .0, total = .0;
+      long peak = 0;
+      for (int r = 0; r < rounds; ++r)
+        {
+          if (bench (argv[1], m == 1, &millis, &rss) != 0)
+            {
+              fprintf (stderr, "failed at loading %s in %s mode.\n", argv[1],
+                       modes[m]);
+              return -1;
+            }
+          best = r == 0 ? millis : std::min (best, millis);
+          total += millis;
+          peak = std::max (peak, rss);
+        }
+
+      fprintf (stderr, "%-10s %12.1f %12.1f %16.1f\n", modes[m], best,
+               total / rounds, peak / 1024.0);
+    }
+
+  return 0;
+}
@@ -0,0 +1,120 @@
+// Host-side cost of Command::record_pipeline: wall time and heap
+// allocations per recorded dispatch. Nothing is submitted, so the numbers
+// only cover recording. Usage: bench_record_pipeline [dispatches] [rounds]
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "core/pipeline.h"
+#include "core/shader_constants.h"
+#include "core/tensor.h"
+#include "src/shaders/vkllama_comp_shaders.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+static std::atomic<size_t> heap_allocations (0);
+
+void *
+operator new (size_t bytes)
+{
+  heap_allocations.fetch_add (1, std::memory_order_relaxed);
+  if (void *p = std::malloc (bytes ? bytes : 1))
+    {
+      return p;
+    }
+  throw std::bad_alloc ();
+}
+
+void
+operator delete (void *p) noexcept
+{
+  std::free (p);
+}
+
+void
+operator delete (void *p, size_t) noexcept
+{
+  std::free (p);
+}
+
+namespace vkllama
+{
+static int
+bench (const int dispatches, const int rounds)
+{
+  GPUDevice gpu;
+  Command command (&gpu);
+  if (!gpu.init ().ok () || !command.init ().ok ())
+    {
+      fprintf (stderr, "failed at initializing device.\n");
+      return -1;
+    }
+
+  Pipeline::ShaderInfo info = { 0, 2, sizeof (uint32_t), 128, 1, 1 };
+  Pipeline pipeline (&gpu, __get_cast_fp16_to_fp32_comp_spv_code (),
+                     __get_cast_fp16_to_fp32_comp_spv_size (), {}, info);
+
+  Tensor from (1, 1, 1024, &gpu, FP16);
+  Tensor to (1, 1, 1024, &gpu, FP32);
+  if (!pipeline.init ().ok () || !from.create ().ok () || !to.create ().ok ()
+      || !pipeline.set_group (8, 1, 1).ok ())
+    {
+      fprintf (stderr, "failed at creating pipeline or tensors.\n");
+      return -1;
+    }
+
+  ShaderConstants N = { static_cast<uint32_t> (from.size ()) };
+
+  // round 0 warms up the command's descriptor pools and task storage
+  for (int round = 0; round <= rounds; ++round)
+    {
+      if (!command.begin ().ok ())
+        {
+          return -1;
+        }
+
+      const size_t allocations = heap_allocations.load ();
+      const auto start = std::chrono::steady_clock::now ();
+      for (int i = 0; i < dispatches; ++i)
+        {
+          if (!command.record_pipeline (pipeline, { from, to }, N).ok ())
+            {
+              fprintf (stderr, "failed at recording dispatch %d.\n", i);
+              return -1;
+            }
+        }
+      const auto stop = std::chrono::steady_clock::now ();
+      const size_t allocated = heap_allocations.load () - allocations;
+
+      if (!command.end ().ok ())
+        {
+          return -1;
+        }
+
+      if (round == 0)
+        {
+          continue;
+        }
+
+      const double ns
+          = std::chrono::duration<double, std::nano> (stop - start).count ();
+      fprintf (stderr,
+               "round %d: %d dispatches, %.1f ns/dispatch, %.2f heap "
+               "allocations/dispatch\n",
+               round, dispatches, ns / dispatches,
+               double (allocated) / dispatches);
+    }
+
+  return 0;
+}
+}
+
+int
+main (int argc, char **argv)
+{
+  const int dispatches = argc > 1 ? atoi (argv[1]) : 4096;
+  const int rounds = argc > 2 ? atoi (argv[2]) : 5;
+  return vkllama::bench (dispatches, rounds);
+}
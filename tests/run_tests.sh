@@ -12,3 +12,20 @@ bazel run //tests:test_embedding
 bazel run //tests:test_update_kv_cache
 bazel run //tests:test_slice
 bazel run //tests:test_transpose
+bazel run //tests:test_feed_token
+bazel run //tests:test_staging_pool
+bazel run //tests:test_barrier
+bazel run //tests:test_pipeline_cache
+bazel run //tests:test_pipeline_registry
+bazel run //tests:test_multi_dispatch
+bazel run //tests:test_activation_planner
+bazel run //tests:test_memory_pool
+bazel run //tests:test_weight_loader
+bazel run //tests:test_transfer_queue
+bazel run //tests:test_llama2_pipeline
+bazel run //tests:test_llama2_tensor_parallel
+bazel run //tests:test_device_probe
+bazel run //tests:test_memory_budget
+bazel run //tests:test_flash_attention
+bazel run //tests:test_multiheadattention_v2
+bazel run //tests:test_kvcache_pool
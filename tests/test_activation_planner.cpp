@@ -0,0 +1,122 @@
+#include "core/activation_planner.h"
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "ops/transpose.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace vkllama
+{
+struct TestActivationPlannerParams
+{
+  const int C;
+  const int H;
+  const int W;
+};
+
+class TestActivationPlanner
+    : public ::testing::TestWithParam<TestActivationPlannerParams>
+{
+public:
+  GPUDevice *gpu_;
+  Command *command_;
+  ActivationPlanner *planner_;
+
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    command_ = new Command (gpu_);
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    ASSERT_EQ (command_->init (), absl::OkStatus ());
+    planner_ = new ActivationPlanner (gpu_);
+    command_->set_activations (planner_);
+  }
+
+  void
+  TearDown () override
+  {
+    delete command_;
+    delete planner_;
+    delete gpu_;
+  }
+};
+
+TEST_P (TestActivationPlanner, test_activation_planner)
+{
+  auto params = GetParam ();
+
+  std::vector<std::unique_ptr<Transpose> > ops;
+  for (int i = 0; i < 4; ++i)
+    {
+      ops.emplace_back (new Transpose (gpu_, command_, 0));
+      ASSERT_EQ (ops.back ()->init (), absl::OkStatus ());
+    }
+
+  // the first pass allocates every activation on its own, the second one
+  // follows the plan and the third one grows its slots
+  for (int pass = 0; pass < 3; ++pass)
+    {
+      const int scale = pass == 2 ? 2 : 1;
+      const int C = params.C * scale, H = params.H * scale, W = params.W;
+
+      ASSERT_EQ (command_->begin (), absl::OkStatus ());
+      auto input = random_tensor<Eigen::half> (gpu_, command_, C, H, W);
+      ASSERT_TRUE (input);
+
+      planner_->begin ();
+      std::vector<Tensor> outputs;
+      Tensor x = input->first;
+      for (auto &op : ops)
+        {
+          auto out = (*op) (x);
+          ASSERT_TRUE (out.ok ()) << out.status ();
+          outputs.push_back (*out);
+          x = *out;
+        }
+
+      std::vector<Eigen::half> output (x.size ());
+      ASSERT_EQ (command_->download (x, output.data (), output.size ()),
+                 absl::OkStatus ());
+      ASSERT_EQ (planner_->end (), absl::OkStatus ());
+      ASSERT_EQ (command_->end (), absl::OkStatus ());
+      ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+
+      auto stats = planner_->stats ();
+      const size_t bytes = outputs[0].bytes ();
+      ASSERT_TRUE (planner_->planned ());
+      ASSERT_EQ (stats.activations, 4);
+      ASSERT_EQ (stats.slots, 2);
+      ASSERT_EQ (stats.unplanned_bytes, 4 * bytes);
+      ASSERT_EQ (stats.peak_live_bytes, 2 * bytes);
+
+      if (pass > 0)
+        {
+          // slots may be ranges of one pooled buffer
+          auto at = [] (Tensor const &t) {
+            return std::make_pair (t.data (), t.offset ());
+          };
+          ASSERT_EQ (at (outputs[2]), at (outputs[0]));
+          ASSERT_EQ (at (outputs[3]), at (outputs[1]));
+          ASSERT_NE (at (outputs[1]), at (outputs[0]));
+          ASSERT_GE (stats.slot_bytes, 2 * bytes);
+        }
+
+      // four transposes give the input back
+      for (size_t i = 0; i < output.size (); ++i)
+        {
+          ASSERT_EQ (float (output[i]), float (input->second[i]))
+              << "pass " << pass << " at " << i;
+        }
+    }
+}
+
+std::vector<TestActivationPlannerParams> params
+    = { { 1, 1, 31 }, { 3, 17, 64 }, { 32, 64, 128 } };
+
+INSTANTIATE_TEST_SUITE_P (test_activation_planner, TestActivationPlanner,
+                          ::testing::ValuesIn (params));
+}
@@ -0,0 +1,109 @@
+#include "core/command.h"
+#include "core/float.h"
+#include "core/gpu_device.h"
+#include "ops/cast.h"
+#include "ops/elementwise.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <cmath>
+#include <vector>
+
+namespace vkllama
+{
+struct TestBarrierParams
+{
+  const int C;
+  const int H;
+  const int W;
+  const bool global_barrier;
+};
+
+class TestBarrier : public ::testing::TestWithParam<TestBarrierParams>
+{
+public:
+  GPUDevice *gpu_;
+  Command *command_;
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    command_ = new Command (gpu_);
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    ASSERT_EQ (command_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete command_;
+    delete gpu_;
+  }
+};
+
+TEST_P (TestBarrier, test_barrier)
+{
+  auto params = GetParam ();
+  command_->set_global_barrier (params.global_barrier);
+  ASSERT_EQ (command_->begin (), absl::OkStatus ());
+
+  auto input0 = random_tensor<__vkllama_fp16_t> (
+      gpu_, command_, params.C, params.H, params.W, __fp32_to_fp16 (-1.0),
+      __fp32_to_fp16 (1.0));
+  auto input1 = random_tensor<__vkllama_fp16_t> (
+      gpu_, command_, params.C, params.H, params.W, __fp32_to_fp16 (-1.0),
+      __fp32_to_fp16 (1.0));
+  ASSERT_TRUE (input0 && input1);
+
+  Cast cast0_op (gpu_, command_, FP16, FP32);
+  Cast cast1_op (gpu_, command_, FP16, FP32);
+  Cast cast2_op (gpu_, command_, FP16, FP32);
+  ElementWise add_op (gpu_, command_, 0);
+  ASSERT_EQ (cast0_op.init (), absl::OkStatus ());
+  ASSERT_EQ (cast1_op.init (), absl::OkStatus ());
+  ASSERT_EQ (cast2_op.init (), absl::OkStatus ());
+  ASSERT_EQ (add_op.init (), absl::OkStatus ());
+
+  // the uploaded input needs a barrier before its first read
+  auto out0 = cast0_op (input0->first);
+  ASSERT_TRUE (out0.ok ());
+  ASSERT_EQ (command_->dispatch_barrier_count (), 1);
+
+  // reading it again after a read needs none
+  auto out1 = cast1_op (input0->first);
+  ASSERT_TRUE (out1.ok ());
+  ASSERT_EQ (command_->dispatch_barrier_count (), 1);
+
+  // input1 is written in place after its upload
+  auto sum = add_op (input0->first, input1->first);
+  ASSERT_TRUE (sum.ok ());
+  ASSERT_EQ (command_->dispatch_barrier_count (), 2);
+
+  auto out2 = cast2_op (*sum);
+  ASSERT_TRUE (out2.ok ());
+  ASSERT_EQ (command_->dispatch_barrier_count (), 3);
+
+  std::vector<float> output1 (out1->size ());
+  std::vector<float> output2 (out2->size ());
+  ASSERT_EQ (command_->download (*out1, output1.data (), output1.size ()),
+             absl::OkStatus ());
+  ASSERT_EQ (command_->download (*out2, output2.data (), output2.size ()),
+             absl::OkStatus ());
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+  ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+
+  for (size_t i = 0; i < output1.size (); ++i)
+    {
+      const float a = __fp16_to_fp32 (input0->second[i].u16);
+      const float b = __fp16_to_fp32 (input1->second[i].u16);
+      ASSERT_NEAR (output1[i], a, 1e-3) << "at " << i;
+      ASSERT_NEAR (output2[i], a + b, 1e-2) << "at " << i;
+    }
+}
+
+std::vector<TestBarrierParams> params
+    = { { 1, 1, 31, false }, { 3, 64, 1024, false }, { 1, 1, 31, true },
+        { 3, 64, 1024, true } };
+
+INSTANTIATE_TEST_SUITE_P (test_barrier, TestBarrier,
+                          ::testing::ValuesIn (params));
+}
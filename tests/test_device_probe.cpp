@@ -0,0 +1,108 @@
+#include "core/device_probe.h"
+#include "core/gpu_device.h"
+#include "ops/device_benchmark.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <vector>
+
+namespace vkllama
+{
+static DeviceInfo
+fake_device (const int index, const VkPhysicalDeviceType type,
+             const VkDeviceSize bytes, const double gemv = 0)
+{
+  DeviceInfo info = {};
+  info.index = index;
+  info.type = type;
+  info.storage_16bit = true;
+  info.device_local_bytes = bytes;
+  info.heaps.push_back ({ bytes, true });
+  info.gemv_bytes_per_second = gemv;
+  return info;
+}
+
+TEST (TestDeviceProbe, test_enumerate)
+{
+  auto devices = enumerate_devices ();
+  ASSERT_TRUE (devices.ok ()) << devices.status ();
+  ASSERT_FALSE (devices->empty ());
+
+  for (size_t i = 0; i < devices->size (); ++i)
+    {
+      auto const &device = (*devices)[i];
+      ASSERT_EQ (device.index, (int)i);
+      ASSERT_FALSE (device.name.empty ());
+      ASSERT_GT (device.subgroup_size, 0u);
+      ASSERT_FALSE (device.heaps.empty ());
+      ASSERT_GT (device.device_local_bytes, 0u);
+      ASSERT_EQ (device.gemv_bytes_per_second, 0);
+    }
+
+  // indices past the last device are not devices
+  GPUDevice past ((int)devices->size ());
+  ASSERT_FALSE (past.init ().ok ());
+  GPUDevice negative (-1);
+  ASSERT_FALSE (negative.init ().ok ());
+}
+
+TEST (TestDeviceProbe, test_benchmark)
+{
+  auto devices = enumerate_devices ();
+  ASSERT_TRUE (devices.ok ()) << devices.status ();
+
+  auto &device = devices->front ();
+  ASSERT_EQ (benchmark_device (device, 256, 256, 8, 2), absl::OkStatus ());
+  ASSERT_GT (device.gemv_bytes_per_second, 0);
+  ASSERT_GT (device.gemm_flops, 0);
+
+  ASSERT_FALSE (benchmark_device (device, 0, 256, 8, 2).ok ());
+}
+
+TEST (TestDeviceProbe, test_pick)
+{
+  const VkDeviceSize GiB = 1ul << 30;
+
+  // without measurements the device types decide, then the memory
+  std::vector<DeviceInfo> devices
+      = { fake_device (0, VK_PHYSICAL_DEVICE_TYPE_CPU, 16 * GiB),
+          fake_device (1, VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU, 8 * GiB),
+          fake_device (2, VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU, 4 * GiB),
+          fake_device (3, VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU, 8 * GiB) };
+  auto picked = pick_device (devices, GiB);
+  ASSERT_TRUE (picked.ok ()) << picked.status ();
+  ASSERT_EQ (*picked, 3);
+
+  // models only go where they fit
+  picked = pick_device (devices, 6 * GiB);
+  ASSERT_TRUE (picked.ok ()) << picked.status ();
+  ASSERT_EQ (*picked, 3);
+  picked = pick_device (devices, 10 * GiB);
+  ASSERT_TRUE (picked.ok ()) << picked.status ();
+  ASSERT_EQ (*picked, 0);
+  ASSERT_FALSE (pick_device (devices, 32 * GiB).ok ());
+
+  // devices without 16-bit storage cannot run the kernels
+  devices[3].storage_16bit = false;
+  picked = pick_device (devices, GiB);
+  ASSERT_TRUE (picked.ok ()) << picked.status ();
+  ASSERT_EQ (*picked, 2);
+
+  // measured throughput goes before the types, once every candidate has it
+  devices[0].gemv_bytes_per_second = 400e9;
+  devices[1].gemv_bytes_per_second = 100e9;
+  picked = pick_device (devices, GiB);
+  ASSERT_TRUE (picked.ok ()) << picked.status ();
+  ASSERT_EQ (*picked, 2);
+  devices[2].gemv_bytes_per_second = 200e9;
+  picked = pick_device (devices, GiB);
+  ASSERT_TRUE (picked.ok ()) << picked.status ();
+  ASSERT_EQ (*picked, 0);
+
+  // a reported budget goes before the size of the heaps
+  devices[0].memory_budget = true;
+  devices[0].device_local_available = 2 * GiB;
+  picked = pick_device (devices, 4 * GiB);
+  ASSERT_TRUE (picked.ok ()) << picked.status ();
+  ASSERT_EQ (*picked, 2);
+}
+}
@@ -0,0 +1,93 @@
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "ops/feed_token.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <memory>
+#include <vector>
+
+namespace vkllama
+{
+struct TestFeedTokenParams
+{
+  const uint32_t tok;
+  const uint32_t offset;
+  const int maxlen;
+  const int replays;
+};
+
+class TestFeedToken : public ::testing::TestWithParam<TestFeedTokenParams>
+{
+public:
+  GPUDevice *gpu_;
+  Command *command_;
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    command_ = new Command (gpu_);
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    ASSERT_EQ (command_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete command_;
+    delete gpu_;
+  }
+};
+
+TEST_P (TestFeedToken, test_feed_token)
+{
+  auto params = GetParam ();
+
+  Tensor sampled (1, 1, 1, gpu_, UINT32, true);
+  Tensor toks (1, 1, 1, gpu_, UINT32, true);
+  Tensor offset (1, 1, 1, gpu_, UINT32, true);
+  Tensor history (1, 1, params.maxlen, gpu_, UINT32, true);
+
+  ASSERT_EQ (sampled.create (), absl::OkStatus ());
+  ASSERT_EQ (toks.create (), absl::OkStatus ());
+  ASSERT_EQ (offset.create (), absl::OkStatus ());
+  ASSERT_EQ (history.create (), absl::OkStatus ());
+
+  const uint32_t zero = 0;
+  ASSERT_EQ (command_->upload (&params.tok, 1, sampled), absl::OkStatus ());
+  ASSERT_EQ (command_->upload (&zero, 1, toks), absl::OkStatus ());
+  ASSERT_EQ (command_->upload (&params.offset, 1, offset), absl::OkStatus ());
+
+  // recorded once and replayed, as the decode graph does
+  ASSERT_EQ (command_->begin (true), absl::OkStatus ());
+  FeedToken feed_op (gpu_, command_);
+  ASSERT_EQ (feed_op.init (), absl::OkStatus ());
+  ASSERT_EQ (feed_op (sampled, toks, offset, history), absl::OkStatus ());
+  ASSERT_EQ (command_->host_read_barrier (history), absl::OkStatus ());
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+
+  for (int i = 0; i < params.replays; ++i)
+    {
+      ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+    }
+
+  ASSERT_EQ (history.invalid (), absl::OkStatus ());
+  ASSERT_EQ (toks.invalid (), absl::OkStatus ());
+  ASSERT_EQ (offset.invalid (), absl::OkStatus ());
+
+  const auto *h = static_cast<const uint32_t *> (history.host ());
+  for (int i = 0; i < params.replays; ++i)
+    {
+      ASSERT_EQ (h[(params.offset + i) % params.maxlen], params.tok);
+    }
+
+  ASSERT_EQ (*static_cast<const uint32_t *> (toks.host ()), params.tok);
+  ASSERT_EQ (*static_cast<const uint32_t *> (offset.host ()),
+             params.offset + params.replays);
+}
+
+std::vector<TestFeedTokenParams> params
+    = { { 42, 0, 1024, 1 }, { 31999, 100, 1024, 3 }, { 7, 1022, 1024, 4 } };
+
+INSTANTIATE_TEST_SUITE_P (test_feed_token, TestFeedToken,
+                          ::testing::ValuesIn (params));
+}
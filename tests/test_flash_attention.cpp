@@ -0,0 +1,197 @@
+#include "Eigen/Eigen"
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "ops/flash_attention.h"
+#include "ops/update_kv_cache.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace vkllama
+{
+struct TestFlashAttentionParams
+{
+  const int heads;
+  const int qlen;
+  const int kvlen;
+  const int dim;
+  // rows of the caches k and v are views of, 0 for tensors of their own
+  const int maxlen;
+  // keys past the query, as a graph replayed over the whole cache has them
+  const int masked;
+  // k and v quantized into q8_0 caches
+  const bool q8_0;
+};
+
+class TestFlashAttention
+    : public ::testing::TestWithParam<TestFlashAttentionParams>
+{
+public:
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    command_ = new Command (gpu_);
+
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    ASSERT_EQ (command_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete command_;
+    delete gpu_;
+  }
+
+  GPUDevice *gpu_;
+  Command *command_;
+};
+
+// items rounded as UpdateKVCache stores them in a q8_0 cache, in blocks
+// of 32 as the rows are a multiple of 32 long
+static std::vector<Eigen::half>
+round_q8_0 (std::vector<Eigen::half> const &rows)
+{
+  std::vector<Eigen::half> rounded (rows.size ());
+  for (size_t start = 0; start < rows.size (); start += 32)
+    {
+      const size_t end = start + 32;
+      float amax = .0f;
+      for (size_t i = start; i < end; ++i)
+        {
+          amax = std::max (amax, std::fabs (float (rows[i])));
+        }
+
+      const float d = float (Eigen::half (amax / 127.0f));
+      for (size_t i = start; i < end; ++i)
+        {
+          const float q = d > 0 ? std::round (float (rows[i]) / d) : .0f;
+          rounded[i] = Eigen::half (std::clamp (q, -127.0f, 127.0f) * d);
+        }
+    }
+  return rounded;
+}
+
+TEST_P (TestFlashAttention, test_flash_attention)
+{
+  auto params = GetParam ();
+  const int rows = params.maxlen > 0 ? params.maxlen : params.kvlen;
+  const size_t offset = params.kvlen - params.qlen - params.masked;
+  const float scale = 1.0f / std::sqrt (float (params.dim));
+
+  ASSERT_EQ (command_->begin (), absl::OkStatus ());
+  auto q = random_tensor<Eigen::half> (gpu_, command_, params.heads,
+                                       params.qlen, params.dim);
+  auto k = random_tensor<Eigen::half> (gpu_, command_, params.heads, rows,
+                                       params.dim);
+  auto v = random_tensor<Eigen::half> (gpu_, command_, params.heads, rows,
+                                       params.dim);
+  ASSERT_TRUE (q && k && v);
+
+  Tensor kcache = k->first, vcache = v->first;
+  UpdateKVCache update_k (gpu_, command_, Q8_0);
+  UpdateKVCache update_v (gpu_, command_, Q8_0);
+  if (params.q8_0)
+    {
+      kcache = Tensor (params.heads, rows, params.dim, gpu_, Q8_0, false);
+      vcache = Tensor (params.heads, rows, params.dim, gpu_, Q8_0, false);
+      ASSERT_EQ (kcache.create (), absl::OkStatus ());
+      ASSERT_EQ (vcache.create (), absl::OkStatus ());
+      ASSERT_EQ (update_k.init (), absl::OkStatus ());
+      ASSERT_EQ (update_v.init (), absl::OkStatus ());
+      ASSERT_EQ (update_k (kcache, k->first, 0), absl::OkStatus ());
+      ASSERT_EQ (update_v (vcache, v->first, 0), absl::OkStatus ());
+      k->second = round_q8_0 (k->second);
+      v->second = round_q8_0 (v->second);
+    }
+
+  Tensor kview = kcache.view (params.heads, params.kvlen, params.dim);
+  Tensor vview = vcache.view (params.heads, params.kvlen, params.dim);
+
+  FlashAttention attention (gpu_, command_, params.dim, scale, FP16,
+                            params.q8_0 ? Q8_0 : FP16);
+  ASSERT_EQ (attention.init (), absl::OkStatus ());
+
+  auto out = attention (q->first, kview, vview, offset);
+  ASSERT_TRUE (out.ok ()) << out.status ();
+  ASSERT_EQ (out->channels (), (size_t)params.qlen);
+  ASSERT_EQ (out->height (), (size_t)params.heads);
+  ASSERT_EQ (out->width (), (size_t)params.dim);
+
+  std::vector<Eigen::half> out_buf (out->size ());
+  ASSERT_EQ (command_->download (*out, out_buf.data (), out_buf.size ()),
+             absl::OkStatus ());
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+  ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+
+  const int D = params.dim;
+  auto at = [&] (std::vector<Eigen::half> const &buf, int h, int r, int d,
+                 int n) { return float (buf[(h * n + r) * D + d]); };
+
+  for (int h = 0; h < params.heads; ++h)
+    {
+      for (int i = 0; i < params.qlen; ++i)
+        {
+          const int last = std::min<int> (params.kvlen - 1, i + offset);
+          std::vector<float> scores (last + 1);
+          for (int j = 0; j <= last; ++j)
+            {
+              float s = .0f;
+              for (int d = 0; d < D; ++d)
+                {
+                  s += at (q->second, h, i, d, params.qlen)
+                       * at (k->second, h, j, d, rows);
+                }
+              scores[j] = s * scale;
+            }
+
+          const float m = *std::max_element (scores.cbegin (), scores.cend ());
+          float sum = .0f;
+          for (auto &s : scores)
+            {
+              s = std::exp (s - m);
+              sum += s;
+            }
+
+          for (int d = 0; d < D; ++d)
+            {
+              float expected = .0f;
+              for (int j = 0; j <= last; ++j)
+                {
+                  expected += scores[j] / sum * at (v->second, h, j, d, rows);
+                }
+              const float actual
+                  = float (out_buf[(i * params.heads + h) * D + d]);
+              ASSERT_NEAR (actual, expected, 1e-2)
+                  << "head " << h << " row " << i << " dim " << d;
+            }
+        }
+    }
+}
+
+std::vector<TestFlashAttentionParams> params = {
+  // prompts
+  { 4, 37, 37, 64, 0 },
+  { 2, 13, 40, 64, 64 },
+  { 8, 70, 70, 128, 128 },
+  // decoded tokens against a cache
+  { 4, 1, 1, 64, 64 },
+  { 4, 1, 50, 64, 64 },
+  { 2, 1, 200, 128, 256 },
+  // decoded tokens split along a long cache
+  { 4, 1, FlashAttention::kSplitKeys + 1, 64, 1024 },
+  { 8, 1, 1000, 128, 1024 },
+  { 2, 1, 3000, 64, 4096 },
+  { 4, 1, 1024, 64, 1024, 700 },
+  // q8_0 caches
+  { 2, 13, 40, 64, 64, 0, true },
+  { 4, 1, 50, 128, 64, 0, true },
+  { 4, 1, 1000, 64, 1024, 0, true },
+};
+
+INSTANTIATE_TEST_SUITE_P (test_flash_attention, TestFlashAttention,
+                          ::testing::ValuesIn (params));
+}
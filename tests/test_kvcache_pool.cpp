@@ -0,0 +1,278 @@
+#include "Eigen/Eigen"
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "core/kvcache_pool.h"
+#include "ops/flash_attention.h"
+#include "ops/update_kv_cache.h"
+#include "test_common.h"
+#include "test_llama2_model.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace vkllama
+{
+struct TestKVCachePoolParams
+{
+  const int heads;
+  const int qlen;
+  const int kvlen;
+  const int dim;
+  const uint32_t page_rows;
+};
+
+class TestKVCachePool : public ::testing::TestWithParam<TestKVCachePoolParams>
+{
+public:
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    command_ = new Command (gpu_);
+
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    ASSERT_EQ (command_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete command_;
+    delete gpu_;
+  }
+
+  GPUDevice *gpu_;
+  Command *command_;
+};
+
+TEST_F (TestKVCachePool, test_pages)
+{
+  KVCachePool pool (gpu_, 2, 2, 64, 4, 16);
+  ASSERT_EQ (command_->begin (), absl::OkStatus ());
+  ASSERT_EQ (pool.init (command_), absl::OkStatus ());
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+  ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+  ASSERT_EQ (pool.free_pages (), 4u);
+
+  {
+    // three pages hold 33 rows, and the table never maps more than three
+    KVCacheBlockTable table (&pool, 3);
+    ASSERT_EQ (table.reserve (33), absl::OkStatus ());
+    ASSERT_EQ (table.pages (), (std::vector<uint32_t>{ 0, 1, 2 }));
+    ASSERT_EQ (table.rows (), 48u);
+    ASSERT_EQ (table.reserve (1000), absl::OkStatus ());
+    ASSERT_EQ (table.pages ().size (), 3u);
+    ASSERT_EQ (pool.free_pages (), 1u);
+
+    KVCacheBlockTable other (&pool, 3);
+    ASSERT_EQ (other.reserve (16), absl::OkStatus ());
+    ASSERT_EQ (other.pages (), (std::vector<uint32_t>{ 3 }));
+    ASSERT_EQ (other.reserve (17).code (),
+               absl::StatusCode::kResourceExhausted);
+    ASSERT_EQ (other.pages ().size (), 1u);
+
+    table.clear ();
+    ASSERT_EQ (pool.free_pages (), 3u);
+    ASSERT_EQ (other.reserve (17), absl::OkStatus ());
+    ASSERT_EQ (pool.free_pages (), 2u);
+  }
+
+  // the tables gave their pages back when they went away
+  ASSERT_EQ (pool.free_pages (), 4u);
+}
+
+TEST_P (TestKVCachePool, test_paged_attention)
+{
+  auto params = GetParam ();
+  const int D = params.dim;
+  const uint32_t table_pages
+      = (params.kvlen + params.page_rows - 1) / params.page_rows;
+  const size_t offset = params.kvlen - params.qlen;
+  const float scale = 1.0f / std::sqrt (float (D));
+
+  // a page more than the sequence needs, and the table maps them in the
+  // reverse order of the pool
+  KVCachePool pool (gpu_, 1, params.heads, D, table_pages + 1,
+                    params.page_rows);
+  ASSERT_EQ (command_->begin (), absl::OkStatus ());
+  ASSERT_EQ (pool.init (command_), absl::OkStatus ());
+
+  KVCacheBlockTable blocks (&pool, table_pages + 1);
+  ASSERT_EQ (blocks.reserve ((table_pages + 1) * params.page_rows),
+             absl::OkStatus ());
+  std::vector<uint32_t> entries (blocks.pages ().crbegin (),
+                                 blocks.pages ().crend ());
+
+  Tensor table (1, 1, table_pages, gpu_, UINT32, true);
+  Tensor zero (1, 1, 1, gpu_, UINT32, true);
+  ASSERT_EQ (table.create (), absl::OkStatus ());
+  ASSERT_EQ (zero.create (), absl::OkStatus ());
+  ::memcpy (table.host (), entries.data (), sizeof (uint32_t) * table_pages);
+  ::memset (zero.host (), 0, sizeof (uint32_t));
+  ASSERT_EQ (table.flush (), absl::OkStatus ());
+  ASSERT_EQ (zero.flush (), absl::OkStatus ());
+
+  auto q = random_tensor<Eigen::half> (gpu_, command_, params.heads,
+                                       params.qlen, D);
+  auto k = random_tensor<Eigen::half> (gpu_, command_, params.heads,
+                                       params.kvlen, D);
+  auto v = random_tensor<Eigen::half> (gpu_, command_, params.heads,
+                                       params.kvlen, D);
+  ASSERT_TRUE (q && k && v);
+
+  auto paged = pool.layer (0, table);
+  UpdateKVCache update_k (gpu_, command_, FP16);
+  UpdateKVCache update_v (gpu_, command_, FP16);
+  ASSERT_EQ (update_k.init (), absl::OkStatus ());
+  ASSERT_EQ (update_v.init (), absl::OkStatus ());
+  ASSERT_EQ (update_k (paged.keys, k->first, table, zero, params.kvlen),
+             absl::OkStatus ());
+  ASSERT_EQ (update_v (paged.values, v->first, table, zero, params.kvlen),
+             absl::OkStatus ());
+
+  // positions past those the table maps are refused
+  ASSERT_EQ (update_k (paged.keys, k->first, table, zero,
+                       table_pages * params.page_rows + 1)
+                 .code (),
+             absl::StatusCode::kInvalidArgument);
+
+  FlashAttention attention (gpu_, command_, D, scale, FP16, FP16, true);
+  ASSERT_EQ (attention.init (), absl::OkStatus ());
+
+  auto out = attention (q->first, paged.keys, paged.values, table, offset,
+                        params.kvlen);
+  ASSERT_TRUE (out.ok ()) << out.status ();
+  ASSERT_EQ (out->channels (), (size_t)params.qlen);
+  ASSERT_EQ (out->height (), (size_t)params.heads);
+
+  std::vector<Eigen::half> out_buf (out->size ());
+  ASSERT_EQ (command_->download (*out, out_buf.data (), out_buf.size ()),
+             absl::OkStatus ());
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+  ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+
+  auto at = [&] (std::vector<Eigen::half> const &buf, int h, int r, int d,
+                 int n) { return float (buf[(h * n + r) * D + d]); };
+
+  for (int h = 0; h < params.heads; ++h)
+    {
+      for (int i = 0; i < params.qlen; ++i)
+        {
+          const int last = i + offset;
+          std::vector<float> scores (last + 1);
+          for (int j = 0; j <= last; ++j)
+            {
+              float s = .0f;
+              for (int d = 0; d < D; ++d)
+                {
+                  s += at (q->second, h, i, d, params.qlen)
+                       * at (k->second, h, j, d, params.kvlen);
+                }
+              scores[j] = s * scale;
+            }
+
+          const float m = *std::max_element (scores.cbegin (), scores.cend ());
+          float sum = .0f;
+          for (auto &s : scores)
+            {
+              s = std::exp (s - m);
+              sum += s;
+            }
+
+          for (int d = 0; d < D; ++d)
+            {
+              float expected = .0f;
+              for (int j = 0; j <= last; ++j)
+                {
+                  expected += scores[j] / sum
+                              * at (v->second, h, j, d, params.kvlen);
+                }
+              const float actual
+                  = float (out_buf[(i * params.heads + h) * D + d]);
+              ASSERT_NEAR (actual, expected, 1e-2)
+                  << "head " << h << " row " << i << " dim " << d;
+            }
+        }
+    }
+}
+
+TEST (TestKVCachePoolModel, test_sequences)
+{
+  TestLlama2Model weights;
+  auto prompt_a = weights.prompt (13);
+  auto prompt_b = weights.prompt (21);
+  const std::vector<uint32_t> tok = { 5 };
+
+  // enough pages for two whole sequences
+  constexpr uint32_t kPageRows = 16;
+  constexpr uint32_t kPages = 2 * TestLlama2Model::kMaxlen / kPageRows;
+  Model contiguous (0);
+  Model paged (0);
+  paged.set_kvcache_pages (kPages, kPageRows);
+  ASSERT_EQ (contiguous.init (weights.kv, weights.tensors), absl::OkStatus ());
+  ASSERT_EQ (paged.init (weights.kv, weights.tensors), absl::OkStatus ());
+  ASSERT_EQ (paged.free_kvcache_pages (), kPages);
+
+  auto expected = contiguous (prompt_a, 0);
+  auto actual = paged (prompt_a, 0);
+  ASSERT_TRUE (expected.ok () && actual.ok ()) << actual.status ();
+  expect_logits_near (*expected, *actual);
+  ASSERT_EQ (paged.free_kvcache_pages (), kPages - 1);
+
+  // a second sequence takes pages of its own and leaves the first intact
+  auto b = paged.create_sequence ();
+  ASSERT_TRUE (b.ok ()) << b.status ();
+  ASSERT_EQ (paged.select_sequence (*b), absl::OkStatus ());
+  expected = contiguous (prompt_b, 0);
+  actual = paged (prompt_b, 0);
+  ASSERT_TRUE (expected.ok () && actual.ok ()) << actual.status ();
+  expect_logits_near (*expected, *actual);
+  ASSERT_EQ (paged.free_kvcache_pages (), kPages - 3);
+
+  ASSERT_EQ (paged.select_sequence (0), absl::OkStatus ());
+  ASSERT_TRUE (contiguous (prompt_a, 0).ok ());
+  for (size_t i = 0; i < 4; ++i)
+    {
+      expected = contiguous (tok, prompt_a.size () + i);
+      actual = paged (tok, prompt_a.size () + i);
+      ASSERT_TRUE (expected.ok () && actual.ok ()) << actual.status ();
+      expect_logits_near (*expected, *actual);
+    }
+  ASSERT_EQ (paged.free_kvcache_pages (), kPages - 4);
+
+  // only a sequence that is not selected gives its pages back
+  ASSERT_EQ (paged.release_sequence (0).code (),
+             absl::StatusCode::kFailedPrecondition);
+  ASSERT_EQ (paged.release_sequence (*b), absl::OkStatus ());
+  ASSERT_EQ (paged.free_kvcache_pages (), kPages - 2);
+  ASSERT_EQ (paged.select_sequence (*b).code (),
+             absl::StatusCode::kNotFound);
+}
+
+TEST (TestKVCachePoolModel, test_exhausted)
+{
+  TestLlama2Model weights;
+  Model paged (0);
+  paged.set_kvcache_pages (1, 16);
+  ASSERT_EQ (paged.init (weights.kv, weights.tensors), absl::OkStatus ());
+
+  ASSERT_TRUE (paged (weights.prompt (16), 0).ok ());
+  auto logits = paged (weights.prompt (1), 16);
+  ASSERT_EQ (logits.status ().code (), absl::StatusCode::kResourceExhausted);
+}
+
+std::vector<TestKVCachePoolParams> params = {
+  // prompts over pages
+  { 4, 37, 37, 64, 16 },
+  { 2, 40, 40, 128, 64 },
+  // decoded tokens, split along the keys past FlashAttention::kSplitKeys
+  { 4, 1, 50, 64, 16 },
+  { 4, 1, FlashAttention::kSplitKeys + 1, 64, 32 },
+  { 8, 1, 1000, 128, 64 },
+};
+
+INSTANTIATE_TEST_SUITE_P (test_kvcache_pool, TestKVCachePool,
+                          ::testing::ValuesIn (params));
+}
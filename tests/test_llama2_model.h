@@ -0,0 +1,194 @@
+#ifndef __VKLLAMA_TEST_LLAMA2_MODEL_H__
+#define __VKLLAMA_TEST_LLAMA2_MODEL_H__
+
+#include "models/llama2.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace vkllama
+{
+// A small random llama2 model held in memory the way gguf-tools hands out
+// a mapped file: the k, q and v projections in q8_0, which the attention
+// reads them as, the other matrices in fp16, or in q8_0 too when quantized,
+// and norm weights in fp32.
+class TestLlama2Model
+{
+public:
+  static constexpr uint32_t kDim = 64;
+  static constexpr uint32_t kHeads = 4;
+  static constexpr uint32_t kHidden = 128;
+  static constexpr uint32_t kVocab = 96;
+  static constexpr uint32_t kBlocks = 4;
+  static constexpr uint32_t kMaxlen = 64;
+
+  std::map<std::string, gguf_key> kv;
+  std::map<std::string, gguf_tensor> tensors;
+
+  explicit TestLlama2Model (const bool quantized = false)
+  {
+    values_[0].uint32 = kHeads;
+    values_[1].uint32 = kBlocks;
+    values_[2].float32 = 1e-5f;
+    values_[3].uint32 = kMaxlen;
+    const char *keys[] = { "llama.attention.head_count", "llama.block_count",
+                           "llama.attention.layer_norm_rms_epsilon",
+                           "llama.context_length" };
+    for (int i = 0; i < 4; ++i)
+      {
+        gguf_key key = {};
+        key.val = &values_[i];
+        kv[keys[i]] = key;
+      }
+
+    add_matrix_ ("token_embd.weight", kDim, kVocab);
+    add_matrix_ ("output.weight", kDim, kVocab);
+    add_norm_ ("output_norm.weight");
+
+    char name[64];
+    for (uint32_t b = 0; b < kBlocks; ++b)
+      {
+        auto block_weight = [&] (const char *weight) {
+          ::snprintf (name, sizeof (name), "blk.%u.%s.weight", b, weight);
+          return std::string (name);
+        };
+
+        add_norm_ (block_weight ("attn_norm"));
+        add_norm_ (block_weight ("ffn_norm"));
+        for (auto *w : { "attn_k", "attn_q", "attn_v" })
+          {
+            add_q8_0_ (block_weight (w), kDim, kDim);
+          }
+        auto add = [&] (const char *weight, const uint32_t cols,
+                        const uint32_t rows) {
+          if (quantized)
+            {
+              add_q8_0_ (block_weight (weight), cols, rows);
+            }
+          else
+            {
+              add_matrix_ (block_weight (weight), cols, rows);
+            }
+        };
+        add ("attn_output", kDim, kDim);
+        add ("ffn_gate", kDim, kHidden);
+        add ("ffn_up", kDim, kHidden);
+        add ("ffn_down", kHidden, kDim);
+      }
+  }
+
+  // kv and tensors point into the model
+  TestLlama2Model (TestLlama2Model const &) = delete;
+  TestLlama2Model &operator= (TestLlama2Model const &) = delete;
+
+  std::vector<uint32_t>
+  prompt (const size_t n) const
+  {
+    std::vector<uint32_t> toks (n);
+    for (size_t i = 0; i < n; ++i)
+      {
+        toks[i] = (i * 37 + 11) % kVocab;
+      }
+    return toks;
+  }
+
+private:
+  // cols is gguf's first dimension, the one that is contiguous
+  void
+  add_matrix_ (std::string const &name, const uint32_t cols,
+               const uint32_t rows)
+  {
+    std::vector<uint8_t> buf (sizeof (__vkllama_fp16_t) * cols * rows);
+    auto *p = reinterpret_cast<__vkllama_fp16_t *> (buf.data ());
+    random_vec (p, cols * rows, __fp32_to_fp16 (-0.1f),
+                __fp32_to_fp16 (0.1f));
+    add_ (name, 1, cols, rows, std::move (buf));
+  }
+
+  // gguf's q8_0: blocks of 32 weights of a row, each an fp16 scale and the
+  // 32 int8 weights it scales, 34 bytes
+  void
+  add_q8_0_ (std::string const &name, const uint32_t cols,
+             const uint32_t rows)
+  {
+    const uint32_t blocks = (cols + 31) / 32;
+    std::vector<float> w (cols * rows);
+    random_vec (w.data (), w.size (), -0.1f, 0.1f);
+
+    std::vector<uint8_t> buf (rows * blocks * 34, 0);
+    for (uint32_t r = 0; r < rows; ++r)
+      {
+        for (uint32_t b = 0; b < blocks; ++b)
+          {
+            const uint32_t start = b * 32, end = std::min (start + 32, cols);
+            float amax = .0f;
+            for (uint32_t j = start; j < end; ++j)
+              {
+                amax = std::max (amax, std::fabs (w[r * cols + j]));
+              }
+
+            const auto d = __fp32_to_fp16 (amax / 127.0f);
+            const float scale = __fp16_to_fp32 (d.u16);
+            auto *block = buf.data () + (r * blocks + b) * 34;
+            ::memcpy (block, &d, 2);
+            for (uint32_t j = start; j < end; ++j)
+              {
+                block[2 + j - start] = (uint8_t)(
+                    scale > 0 ? (int8_t)std::round (w[r * cols + j] / scale)
+                              : 0);
+              }
+          }
+      }
+    add_ (name, 8, cols, rows, std::move (buf));
+  }
+
+  void
+  add_norm_ (std::string const &name)
+  {
+    std::vector<uint8_t> buf (sizeof (float) * kDim);
+    auto *p = reinterpret_cast<float *> (buf.data ());
+    random_vec (p, kDim, 0.5f, 1.5f);
+    add_ (name, 0, kDim, 1, std::move (buf));
+  }
+
+  void
+  add_ (std::string const &name, const uint32_t type, const uint32_t cols,
+        const uint32_t rows, std::vector<uint8_t> buf)
+  {
+    data_.push_back (std::move (buf));
+    gguf_tensor tensor = {};
+    tensor.type = type;
+    tensor.ndim = 2;
+    tensor.dim[0] = cols;
+    tensor.dim[1] = rows;
+    tensor.num_weights = cols * rows;
+    tensor.bsize = data_.back ().size ();
+    tensor.weights_data = data_.back ().data ();
+    tensors[name] = tensor;
+  }
+
+  union gguf_value values_[4];
+  std::vector<std::vector<uint8_t> > data_;
+};
+
+inline void
+expect_logits_near (std::vector<float> const &expected,
+                    std::vector<float> const &actual)
+{
+  ASSERT_EQ (expected.size (), actual.size ());
+  for (size_t i = 0; i < expected.size (); ++i)
+    {
+      ASSERT_NEAR (expected[i], actual[i],
+                   2e-2f * std::max (1.0f, std::fabs (expected[i])))
+          << "at " << i;
+    }
+}
+}
+
+#endif
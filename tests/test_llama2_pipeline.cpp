@@ -0,0 +1,81 @@
+#include "models/llama2_pipeline.h"
+#include "test_common.h"
+#include "test_llama2_model.h"
+#include "gtest/gtest.h"
+#include <vector>
+
+namespace vkllama
+{
+struct TestLlama2PipelineParams
+{
+  const std::vector<int> devs;
+  const size_t micro_batch;
+  const size_t prompt;
+};
+
+class TestLlama2Pipeline
+    : public ::testing::TestWithParam<TestLlama2PipelineParams>
+{
+public:
+  TestLlama2Model model_;
+};
+
+TEST_P (TestLlama2Pipeline, test_pipeline_matches_model)
+{
+  auto params = GetParam ();
+  auto toks = model_.prompt (params.prompt);
+
+  Model model (0);
+  ASSERT_EQ (model.init (model_.kv, model_.tensors), absl::OkStatus ());
+  PipelineModel pipeline (params.devs, params.micro_batch);
+  ASSERT_EQ (pipeline.init (model_.kv, model_.tensors), absl::OkStatus ());
+
+  // consecutive runs of blocks, covering all of them
+  ASSERT_EQ (pipeline.stages (), params.devs.size ());
+  size_t next = 0;
+  for (size_t s = 0; s < pipeline.stages (); ++s)
+    {
+      auto blocks = pipeline.blocks (s);
+      ASSERT_EQ (blocks.first, next);
+      ASSERT_GT (blocks.second, blocks.first);
+      next = blocks.second;
+    }
+  ASSERT_EQ (next, TestLlama2Model::kBlocks);
+
+  auto expected = model (toks, 0);
+  ASSERT_TRUE (expected.ok ()) << expected.status ();
+  auto actual = pipeline (toks, 0);
+  ASSERT_TRUE (actual.ok ()) << actual.status ();
+  expect_logits_near (*expected, *actual);
+
+  // decoding goes on from the kv caches the prompt filled on every device
+  for (size_t i = 0; i < 3; ++i)
+    {
+      const std::vector<uint32_t> tok
+          = { uint32_t ((i * 5 + 3) % TestLlama2Model::kVocab) };
+      expected = model (tok, toks.size () + i);
+      ASSERT_TRUE (expected.ok ()) << expected.status ();
+      actual = pipeline (tok, toks.size () + i);
+      ASSERT_TRUE (actual.ok ()) << actual.status ();
+      expect_logits_near (*expected, *actual);
+    }
+}
+
+TEST_P (TestLlama2Pipeline, test_too_many_devices)
+{
+  PipelineModel pipeline (std::vector<int> (TestLlama2Model::kBlocks + 1, 0));
+  ASSERT_FALSE (pipeline.init (model_.kv, model_.tensors).ok ());
+}
+
+// several instances of device 0 stand in for several devices
+std::vector<TestLlama2PipelineParams> params = {
+  { { 0 }, 4, 13 },
+  { { 0, 0 }, 1, 5 },
+  { { 0, 0 }, 4, 13 },
+  { { 0, 0 }, 32, 13 },
+  { { 0, 0, 0 }, 3, 17 },
+};
+
+INSTANTIATE_TEST_SUITE_P (test_llama2_pipeline, TestLlama2Pipeline,
+                          ::testing::ValuesIn (params));
+}
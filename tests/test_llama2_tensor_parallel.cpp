@@ -0,0 +1,118 @@
+#include "models/llama2_tensor_parallel.h"
+#include "test_common.h"
+#include "test_llama2_model.h"
+#include "gtest/gtest.h"
+#include <vector>
+
+namespace vkllama
+{
+struct TestLlama2TensorParallelParams
+{
+  const std::vector<int> devs;
+  const size_t prompt;
+};
+
+class TestLlama2TensorParallel
+    : public ::testing::TestWithParam<TestLlama2TensorParallelParams>
+{
+public:
+  TestLlama2Model model_;
+};
+
+TEST_P (TestLlama2TensorParallel, test_tensor_parallel_matches_model)
+{
+  auto params = GetParam ();
+  auto toks = model_.prompt (params.prompt);
+
+  Model model (0);
+  ASSERT_EQ (model.init (model_.kv, model_.tensors), absl::OkStatus ());
+  TensorParallelModel parallel (params.devs);
+  ASSERT_EQ (parallel.init (model_.kv, model_.tensors), absl::OkStatus ());
+
+  // the shards split the heads and the hidden columns without gaps
+  ASSERT_EQ (parallel.shards (), params.devs.size ());
+  size_t head = 0, column = 0;
+  for (size_t d = 0; d < parallel.shards (); ++d)
+    {
+      auto heads = parallel.heads (d);
+      auto columns = parallel.columns (d);
+      ASSERT_EQ (heads.first, head);
+      ASSERT_EQ (columns.first, column);
+      ASSERT_GT (heads.second, heads.first);
+      ASSERT_EQ ((columns.second - columns.first)
+                     % TensorParallelModel::kColumnAlign,
+                 0);
+      head = heads.second;
+      column = columns.second;
+    }
+  ASSERT_EQ (head, TestLlama2Model::kHeads);
+  ASSERT_EQ (column, TestLlama2Model::kHidden);
+
+  auto expected = model (toks, 0);
+  ASSERT_TRUE (expected.ok ()) << expected.status ();
+  auto actual = parallel (toks, 0);
+  ASSERT_TRUE (actual.ok ()) << actual.status ();
+  expect_logits_near (*expected, *actual);
+
+  // every shard decodes from the kv cache of its own heads
+  for (size_t i = 0; i < 3; ++i)
+    {
+      const std::vector<uint32_t> tok
+          = { uint32_t ((i * 5 + 3) % TestLlama2Model::kVocab) };
+      expected = model (tok, toks.size () + i);
+      ASSERT_TRUE (expected.ok ()) << expected.status ();
+      actual = parallel (tok, toks.size () + i);
+      ASSERT_TRUE (actual.ok ()) << actual.status ();
+      expect_logits_near (*expected, *actual);
+    }
+}
+
+TEST_P (TestLlama2TensorParallel, test_too_many_devices)
+{
+  TensorParallelModel parallel (
+      std::vector<int> (TestLlama2Model::kHeads + 1, 0));
+  ASSERT_FALSE (parallel.init (model_.kv, model_.tensors).ok ());
+}
+
+TEST (TestLlama2TensorParallelQ8_0, test_q8_0_weights)
+{
+  // every matrix in gguf q8_0, split by rows and by columns of blocks
+  TestLlama2Model weights (true);
+  auto toks = weights.prompt (9);
+
+  Model model (0);
+  ASSERT_EQ (model.init (weights.kv, weights.tensors), absl::OkStatus ());
+  TensorParallelModel parallel ({ 0, 0 });
+  ASSERT_EQ (parallel.init (weights.kv, weights.tensors), absl::OkStatus ());
+
+  auto expected = model (toks, 0);
+  ASSERT_TRUE (expected.ok ()) << expected.status ();
+  auto actual = parallel (toks, 0);
+  ASSERT_TRUE (actual.ok ()) << actual.status ();
+  expect_logits_near (*expected, *actual);
+
+  const std::vector<uint32_t> tok = { 3 };
+  expected = model (tok, toks.size ());
+  ASSERT_TRUE (expected.ok ()) << expected.status ();
+  actual = parallel (tok, toks.size ());
+  ASSERT_TRUE (actual.ok ()) << actual.status ();
+  expect_logits_near (*expected, *actual);
+
+  // a head of 16 columns on a device would split a block of wo
+  TensorParallelModel split ({ 0, 0, 0 });
+  ASSERT_EQ (split.init (weights.kv, weights.tensors).code (),
+             absl::StatusCode::kInvalidArgument);
+}
+
+// several instances of device 0 stand in for several devices
+std::vector<TestLlama2TensorParallelParams> params = {
+  { { 0 }, 7 },
+  { { 0, 0 }, 1 },
+  { { 0, 0 }, 13 },
+  { { 0, 0, 0 }, 11 },
+};
+
+INSTANTIATE_TEST_SUITE_P (test_llama2_tensor_parallel,
+                          TestLlama2TensorParallel,
+                          ::testing::ValuesIn (params));
+}
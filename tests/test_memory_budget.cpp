@@ -0,0 +1,176 @@
+#include "core/gpu_device.h"
+#include "core/memory_pool.h"
+#include "core/tensor.h"
+#include "models/llama2_pipeline.h"
+#include "test_common.h"
+#include "test_llama2_model.h"
+#include "gtest/gtest.h"
+#include <numeric>
+#include <vector>
+
+namespace vkllama
+{
+class TestMemoryBudget : public ::testing::Test
+{
+public:
+  GPUDevice *gpu_;
+  TestLlama2Model model_;
+
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete gpu_;
+  }
+
+  absl::StatusOr<Llama2MemoryPlan>
+  plan (std::vector<size_t> const &budgets, const uint32_t min_maxlen = 16)
+  {
+    return plan_llama2_memory (model_.kv, model_.tensors, budgets,
+                               min_maxlen);
+  }
+};
+
+TEST_F (TestMemoryBudget, test_usage)
+{
+  auto heaps = gpu_->heap_budgets ();
+  ASSERT_FALSE (heaps.empty ());
+  for (auto const &heap : heaps)
+    {
+      ASSERT_GT (heap.size, 0u);
+    }
+  ASSERT_GT (gpu_->device_local_available (), 0u);
+
+  Tensor kvcache (1, 64, 1024, gpu_, FP16);
+  ASSERT_EQ (kvcache.create (KVCACHE_MEMORY), absl::OkStatus ());
+
+  auto usage = gpu_->memory_usage ();
+  ASSERT_EQ (usage.heaps.size (), heaps.size ());
+  ASSERT_GE (usage.pool_bytes[KVCACHE_MEMORY], kvcache.bytes ());
+  ASSERT_EQ (usage.pool_bytes[KVCACHE_MEMORY],
+             gpu_->memory_pool (KVCACHE_MEMORY).stats ().allocated_bytes);
+}
+
+TEST_F (TestMemoryBudget, test_pool_budget)
+{
+  MemoryPool pool (gpu_, ACTIVATION_MEMORY, 64ul << 20);
+  pool.set_budget (1ul << 20);
+  ASSERT_EQ (pool.budget (), 1ul << 20);
+
+  // the chunk shrinks to the budget instead of going over it
+  auto small = pool.acquire (4096);
+  ASSERT_TRUE (small.ok ()) << small.status ();
+  ASSERT_LE (pool.stats ().allocated_bytes, 1ul << 20);
+
+  auto large = pool.acquire (2ul << 20);
+  ASSERT_EQ (large.status ().code (), absl::StatusCode::kResourceExhausted);
+  pool.release (*small);
+
+  pool.set_budget (0);
+  large = pool.acquire (2ul << 20);
+  ASSERT_TRUE (large.ok ()) << large.status ();
+  pool.release (*large);
+}
+
+TEST_F (TestMemoryBudget, test_plan)
+{
+  // the whole model on one device at its context length
+  auto whole = plan ({ size_t (1) << 40 });
+  ASSERT_TRUE (whole.ok ()) << whole.status ();
+  ASSERT_EQ (whole->maxlen, TestLlama2Model::kMaxlen);
+  ASSERT_EQ (whole->blocks.size (), 1u);
+  ASSERT_EQ (whole->blocks[0], TestLlama2Model::kBlocks);
+  const size_t single = whole->device_bytes[0];
+
+  // two devices that hold it together
+  auto split = plan ({ single * 3 / 4, single * 3 / 4 });
+  ASSERT_TRUE (split.ok ()) << split.status ();
+  ASSERT_EQ (split->maxlen, TestLlama2Model::kMaxlen);
+  ASSERT_EQ (split->blocks.size (), 2u);
+  ASSERT_EQ (std::accumulate (split->blocks.cbegin (), split->blocks.cend (),
+                              0u),
+             TestLlama2Model::kBlocks);
+  for (auto bytes : split->device_bytes)
+    {
+      ASSERT_LE (bytes, single * 3 / 4);
+    }
+
+  // one device that only holds a shorter context
+  auto shorter = plan ({ single - 1 });
+  ASSERT_TRUE (shorter.ok ()) << shorter.status ();
+  ASSERT_EQ (shorter->maxlen, TestLlama2Model::kMaxlen / 2);
+  ASSERT_EQ (shorter->blocks.size (), 1u);
+  ASSERT_LT (shorter->device_bytes[0], single);
+
+  // the context is not cut below min_maxlen
+  ASSERT_FALSE (plan ({ single - 1 }, TestLlama2Model::kMaxlen).ok ());
+  ASSERT_FALSE (plan ({ 1024 }).ok ());
+}
+
+TEST_F (TestMemoryBudget, test_plan_q8_0_kvcache)
+{
+  auto fp16 = plan ({ size_t (1) << 40 });
+  ASSERT_TRUE (fp16.ok ()) << fp16.status ();
+  auto q8_0 = plan_llama2_memory (model_.kv, model_.tensors,
+                                  { size_t (1) << 40 }, 16, 512, Q8_0);
+  ASSERT_TRUE (q8_0.ok ()) << q8_0.status ();
+
+  // 36 bytes per 32 items instead of 64
+  const size_t kv_dim = model_.tensors["blk.0.attn_k.weight"].dim[1];
+  ASSERT_EQ (fp16->device_bytes[0] - q8_0->device_bytes[0],
+             size_t (TestLlama2Model::kBlocks) * TestLlama2Model::kMaxlen * 2
+                 * kv_dim / 32 * (64 - 36));
+
+  // a budget the fp16 caches only fit into at a shorter context
+  auto shorter = plan_llama2_memory (model_.kv, model_.tensors,
+                                     { fp16->device_bytes[0] - 1 }, 16, 512,
+                                     Q8_0);
+  ASSERT_TRUE (shorter.ok ()) << shorter.status ();
+  ASSERT_EQ (shorter->maxlen, TestLlama2Model::kMaxlen);
+}
+
+TEST_F (TestMemoryBudget, test_apply_plan)
+{
+  auto whole = plan ({ size_t (1) << 40 });
+  ASSERT_TRUE (whole.ok ()) << whole.status ();
+  auto shorter = plan ({ whole->device_bytes[0] - 1 });
+  ASSERT_TRUE (shorter.ok ()) << shorter.status ();
+
+  Model model (0);
+  model.set_maxlen (shorter->maxlen);
+  ASSERT_EQ (model.init (model_.kv, model_.tensors), absl::OkStatus ());
+  ASSERT_EQ (model.maxlen (), shorter->maxlen);
+  auto logits = model (model_.prompt (7), 0);
+  ASSERT_TRUE (logits.ok ()) << logits.status ();
+
+  // the rope angles of the shorter context end at twice its length
+  ASSERT_EQ (model (model_.prompt (1), 2 * model.maxlen ()).status ().code (),
+             absl::StatusCode::kOutOfRange);
+
+  const size_t single = whole->device_bytes[0];
+  auto split = plan ({ single * 3 / 4, single * 3 / 4 });
+  ASSERT_TRUE (split.ok ()) << split.status ();
+
+  // several instances of device 0 stand in for several devices
+  PipelineModel pipeline ({ 0, 0, 0 });
+  ASSERT_EQ (pipeline.set_split (split->blocks), absl::OkStatus ());
+  ASSERT_EQ (pipeline.init (model_.kv, model_.tensors), absl::OkStatus ());
+  ASSERT_EQ (pipeline.stages (), split->blocks.size ());
+  ASSERT_EQ (pipeline.blocks (0).second, split->blocks[0]);
+
+  auto expected = model (model_.prompt (7), 0);
+  ASSERT_TRUE (expected.ok ()) << expected.status ();
+  auto actual = pipeline (model_.prompt (7), 0);
+  ASSERT_TRUE (actual.ok ()) << actual.status ();
+  expect_logits_near (*expected, *actual);
+
+  ASSERT_FALSE (pipeline.set_split ({ 1, 0 }).ok ());
+  ASSERT_FALSE (pipeline.set_split ({ 1, 1, 1, 1 }).ok ());
+}
+}
@@ -0,0 +1,185 @@
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "core/memory_pool.h"
+#include "ops/transpose.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace vkllama
+{
+struct TestMemoryPoolParams
+{
+  const int C;
+  const int H;
+  const int W;
+  const int tensors;
+};
+
+class TestMemoryPool : public ::testing::TestWithParam<TestMemoryPoolParams>
+{
+public:
+  GPUDevice *gpu_;
+  Command *command_;
+
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    command_ = new Command (gpu_);
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    ASSERT_EQ (command_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete command_;
+    delete gpu_;
+  }
+};
+
+TEST_P (TestMemoryPool, test_sub_allocation)
+{
+  auto params = GetParam ();
+  auto &pool = gpu_->memory_pool (ACTIVATION_MEMORY);
+
+  {
+    std::vector<std::pair<Tensor, std::vector<Eigen::half> > > inputs;
+    for (int i = 0; i < params.tensors; ++i)
+      {
+        ASSERT_EQ (command_->begin (), absl::OkStatus ());
+        auto input = random_tensor<Eigen::half> (gpu_, command_, params.C,
+                                                 params.H, params.W);
+        ASSERT_TRUE (input);
+        ASSERT_EQ (command_->end (), absl::OkStatus ());
+        ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+        inputs.push_back (*input);
+      }
+
+    // the tensors are disjoint aligned ranges of one buffer
+    auto const &first = inputs.front ().first;
+    std::vector<std::pair<VkDeviceSize, VkDeviceSize> > ranges;
+    for (auto const &input : inputs)
+      {
+        auto const &t = input.first;
+        ASSERT_EQ (t.data (), first.data ());
+        ASSERT_EQ (t.offset () % pool.alignment (), 0);
+        ASSERT_GE (t.range (), t.bytes ());
+        ranges.push_back ({ t.offset (), t.offset () + t.bytes () });
+      }
+
+    std::sort (ranges.begin (), ranges.end ());
+    for (size_t i = 1; i < ranges.size (); ++i)
+      {
+        ASSERT_LE (ranges[i - 1].second, ranges[i].first);
+      }
+
+    // two transposes of each tensor give it back, so every dispatch and
+    // download has to address its own range
+    Transpose transpose0 (gpu_, command_, 0), transpose1 (gpu_, command_, 0);
+    ASSERT_EQ (transpose0.init (), absl::OkStatus ());
+    ASSERT_EQ (transpose1.init (), absl::OkStatus ());
+
+    for (auto &input : inputs)
+      {
+        ASSERT_EQ (command_->begin (), absl::OkStatus ());
+        auto t0 = transpose0 (input.first);
+        ASSERT_TRUE (t0.ok ()) << t0.status ();
+        auto t1 = transpose1 (*t0);
+        ASSERT_TRUE (t1.ok ()) << t1.status ();
+
+        std::vector<Eigen::half> output (t1->size ());
+        ASSERT_EQ (command_->download (*t1, output.data (), output.size ()),
+                   absl::OkStatus ());
+        ASSERT_EQ (command_->end (), absl::OkStatus ());
+        ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+
+        for (size_t i = 0; i < output.size (); ++i)
+          {
+            ASSERT_EQ (float (output[i]), float (input.second[i]))
+                << "at " << i;
+          }
+      }
+
+    auto stats = pool.stats ();
+    ASSERT_GE (stats.allocations, params.tensors);
+    ASSERT_GE (stats.in_use_bytes, params.tensors * first.bytes ());
+    ASSERT_GE (stats.allocated_bytes, stats.in_use_bytes);
+    ASSERT_EQ (gpu_->memory_pool (WEIGHT_MEMORY).stats ().allocations, 0);
+  }
+
+  // one empty chunk is kept as a spare
+  auto stats = pool.stats ();
+  ASSERT_EQ (stats.allocations, 0);
+  ASSERT_EQ (stats.in_use_bytes, 0);
+  ASSERT_LE (stats.chunk_count, 1);
+  ASSERT_GE (stats.peak_in_use_bytes,
+             params.tensors * params.C * params.H * params.W * 2);
+}
+
+TEST_P (TestMemoryPool, test_oversized_range)
+{
+  auto params = GetParam ();
+  const VkDeviceSize bytes = params.C * params.H * params.W * 2;
+
+  MemoryPool pool (gpu_, WEIGHT_MEMORY, bytes / 2 + 1);
+  {
+    auto range = pool.acquire (bytes);
+    ASSERT_TRUE (range.ok ()) << range.status ();
+    ASSERT_EQ (range->offset, 0);
+    ASSERT_GE (range->bytes, bytes);
+
+    auto stats = pool.stats ();
+    ASSERT_EQ (stats.chunk_count, 1);
+    ASSERT_GE (stats.allocated_bytes, bytes);
+    pool.release (*range);
+  }
+
+  // a chunk made for one range does not outlive it
+  auto stats = pool.stats ();
+  ASSERT_EQ (stats.chunk_count, 0);
+  ASSERT_EQ (stats.allocated_bytes, 0);
+  ASSERT_EQ (stats.in_use_bytes, 0);
+}
+
+TEST_P (TestMemoryPool, test_unified_upload)
+{
+  auto params = GetParam ();
+  const size_t n = params.C * params.H * params.W;
+
+  Tensor weight (params.C, params.H, params.W, gpu_, FP32);
+  Tensor activation (params.C, params.H, params.W, gpu_, FP32);
+  ASSERT_EQ (weight.create (WEIGHT_MEMORY), absl::OkStatus ());
+  ASSERT_EQ (activation.create (), absl::OkStatus ());
+  ASSERT_EQ (weight.visable (), gpu_->unified_memory ());
+  ASSERT_FALSE (activation.visable ());
+
+  std::vector<float> buf (n), out (n);
+  for (size_t i = 0; i < n; ++i)
+    {
+      buf[i] = float (i % 1021);
+    }
+
+  ASSERT_EQ (command_->begin (), absl::OkStatus ());
+  ASSERT_EQ (command_->upload (buf.data (), n, weight), absl::OkStatus ());
+  ASSERT_EQ (command_->download (weight, out.data (), n), absl::OkStatus ());
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+  ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+  ASSERT_EQ (buf, out);
+
+  // mapped weights never touch staging memory
+  if (gpu_->unified_memory ())
+    {
+      ASSERT_EQ (gpu_->staging ().stats ().allocated_bytes, 0);
+    }
+}
+
+std::vector<TestMemoryPoolParams> params
+    = { { 1, 1, 31, 3 }, { 3, 17, 64, 8 }, { 32, 64, 128, 4 } };
+
+INSTANTIATE_TEST_SUITE_P (test_memory_pool, TestMemoryPool,
+                          ::testing::ValuesIn (params));
+}
@@ -0,0 +1,105 @@
+#include "core/command.h"
+#include "core/float.h"
+#include "core/gpu_device.h"
+#include "ops/cast.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <vector>
+
+namespace vkllama
+{
+struct TestMultiDispatchParams
+{
+  const int C;
+  const int H;
+  const int W;
+  const int dispatches;
+  const bool reusable;
+};
+
+class TestMultiDispatch
+    : public ::testing::TestWithParam<TestMultiDispatchParams>
+{
+public:
+  GPUDevice *gpu_;
+  Command *command_;
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    command_ = new Command (gpu_);
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    ASSERT_EQ (command_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete command_;
+    delete gpu_;
+  }
+};
+
+// one op object dispatched several times in a command buffer, each time on
+// other tensors
+TEST_P (TestMultiDispatch, test_multi_dispatch)
+{
+  auto params = GetParam ();
+
+  ASSERT_EQ (command_->begin (), absl::OkStatus ());
+  std::vector<std::pair<Tensor, std::vector<__vkllama_fp16_t> > > inputs;
+  for (int i = 0; i < params.dispatches; ++i)
+    {
+      auto input = random_tensor<__vkllama_fp16_t> (
+          gpu_, command_, params.C, params.H, params.W,
+          __fp32_to_fp16 (-1.0), __fp32_to_fp16 (1.0));
+      ASSERT_TRUE (input);
+      inputs.push_back (*input);
+    }
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+  ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+
+  Cast cast_op (gpu_, command_, FP16, FP32);
+  ASSERT_EQ (cast_op.init (), absl::OkStatus ());
+
+  // the casted tensors must outlive the command
+  std::vector<Tensor> casted;
+  std::vector<std::vector<float> > outputs (params.dispatches);
+  ASSERT_EQ (command_->begin (params.reusable), absl::OkStatus ());
+  for (int i = 0; i < params.dispatches; ++i)
+    {
+      auto out = cast_op (inputs[i].first);
+      ASSERT_TRUE (out.ok ());
+      casted.push_back (*out);
+      outputs[i].resize (out->size ());
+      ASSERT_EQ (
+          command_->download (*out, outputs[i].data (), outputs[i].size ()),
+          absl::OkStatus ());
+    }
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+
+  for (int r = 0; r < (params.reusable ? 2 : 1); ++r)
+    {
+      ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+      for (int i = 0; i < params.dispatches; ++i)
+        {
+          auto const &expected = inputs[i].second;
+          for (size_t k = 0; k < outputs[i].size (); ++k)
+            {
+              ASSERT_NEAR (outputs[i][k], __fp16_to_fp32 (expected[k].u16),
+                           1e-3)
+                  << "dispatch " << i << " at " << k;
+            }
+        }
+    }
+}
+
+std::vector<TestMultiDispatchParams> params
+    = { { 1, 1, 31, 2, false },
+        { 1, 16, 1024, 8, false },
+        { 1, 16, 1024, 8, true },
+        { 1, 4, 128, 300, false } };
+
+INSTANTIATE_TEST_SUITE_P (test_multi_dispatch, TestMultiDispatch,
+                          ::testing::ValuesIn (params));
+}
@@ -0,0 +1,277 @@
+#include "Eigen/Eigen"
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "ops/multiheadattention_v2.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace vkllama
+{
+struct TestMultiHeadAttentionV2Params
+{
+  const int heads;
+  const int dim;
+  const int in_dim;
+  const int prompt;
+  // tokens decoded one by one after the prompt
+  const int decoded;
+  const int maxlen;
+  const bool kvcache;
+  const DType kvcache_dtype;
+};
+
+class TestMultiHeadAttentionV2
+    : public ::testing::TestWithParam<TestMultiHeadAttentionV2Params>
+{
+public:
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    command_ = new Command (gpu_);
+
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    ASSERT_EQ (command_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete command_;
+    delete gpu_;
+  }
+
+  GPUDevice *gpu_;
+  Command *command_;
+};
+
+// Random [n, k] weights in q8_0 blocks as gguf stores them and the
+// shaders read them, an fp16 scale and 32 int8 items, along with the
+// values they dequantize to.
+static absl::optional<std::pair<Tensor, std::vector<float> > >
+random_q8_0 (GPUDevice *gpu, Command *command, const int n, const int k)
+{
+  const int blocks = (k + 31) / 32;
+  std::vector<float> w (n * k), dequantized (n * k);
+  random_vec (w.data (), n * k, -.1f, .1f);
+
+  std::vector<uint8_t> buf (n * blocks * 34, 0);
+  for (int i = 0; i < n; ++i)
+    {
+      for (int b = 0; b < blocks; ++b)
+        {
+          const int start = b * 32, end = std::min (start + 32, k);
+          float amax = .0f;
+          for (int j = start; j < end; ++j)
+            {
+              amax = std::max (amax, std::fabs (w[i * k + j]));
+            }
+
+          const auto d = __fp32_to_fp16 (amax / 127.0f);
+          const float scale = __fp16_to_fp32 (d.u16);
+          auto *block = buf.data () + (i * blocks + b) * 34;
+          ::memcpy (block, &d, 2);
+          for (int j = start; j < end; ++j)
+            {
+              const int8_t q
+                  = scale > 0 ? (int8_t)std::round (w[i * k + j] / scale) : 0;
+              block[2 + j - start] = (uint8_t)q;
+              dequantized[i * k + j] = q * scale;
+            }
+        }
+    }
+
+  Tensor tensor (1, n, k, gpu, Q8_0);
+  if (!tensor.create ().ok ()
+      || !command->upload (buf.data (), buf.size (), tensor).ok ())
+    {
+      return {};
+    }
+  return std::make_pair (tensor, dequantized);
+}
+
+// rounds blocks of 32 items as a q8_0 kv cache stores them; heads are a
+// multiple of 32 long, so the blocks of a row never straddle two heads
+static void
+round_q8_0 (std::vector<float> &x)
+{
+  for (size_t start = 0; start < x.size (); start += 32)
+    {
+      float amax = .0f;
+      for (size_t i = start; i < start + 32; ++i)
+        {
+          amax = std::max (amax, std::fabs (float (Eigen::half (x[i]))));
+        }
+
+      const float d = float (Eigen::half (amax / 127.0f));
+      for (size_t i = start; i < start + 32; ++i)
+        {
+          const float q
+              = d > 0 ? std::round (float (Eigen::half (x[i])) / d) : .0f;
+          x[i] = std::clamp (q, -127.0f, 127.0f) * d;
+        }
+    }
+}
+
+// rows of x [m, k] times the rows of w [n, k]
+static std::vector<float>
+matmul_tb (std::vector<float> const &x, std::vector<float> const &w,
+           const int m, const int n, const int k)
+{
+  std::vector<float> out (m * n, .0f);
+  for (int i = 0; i < m; ++i)
+    {
+      for (int j = 0; j < n; ++j)
+        {
+          for (int l = 0; l < k; ++l)
+            {
+              out[i * n + j] += x[i * k + l] * w[j * k + l];
+            }
+        }
+    }
+  return out;
+}
+
+TEST_P (TestMultiHeadAttentionV2, test_multiheadattention_v2)
+{
+  auto params = GetParam ();
+  const int N = params.heads * params.dim, K = params.in_dim;
+  const int total = params.prompt + params.decoded;
+
+  ASSERT_EQ (command_->begin (), absl::OkStatus ());
+  auto wk = random_q8_0 (gpu_, command_, N, K);
+  auto wq = random_q8_0 (gpu_, command_, N, K);
+  auto wv = random_q8_0 (gpu_, command_, N, K);
+  auto wo = random_tensor<Eigen::half> (gpu_, command_, 1, K, N,
+                                        Eigen::half (-.1f), Eigen::half (.1f));
+  ASSERT_TRUE (wk && wq && wv && wo);
+
+  MultiHeadAttentionV2 attn (gpu_, command_, wk->first, wq->first, wv->first,
+                             wo->first, params.maxlen, params.dim, true, FP16,
+                             params.kvcache, false, params.kvcache_dtype);
+  ASSERT_EQ (attn.init (), absl::OkStatus ());
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+  ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+
+  // the prompt, then every decoded token in a submission of its own
+  std::vector<float> inputs, outputs;
+  for (int offset = 0; offset < total;)
+    {
+      const int len = offset == 0 ? params.prompt : 1;
+      ASSERT_EQ (command_->begin (), absl::OkStatus ());
+      auto x = random_tensor<Eigen::half> (gpu_, command_, 1, len, K);
+      ASSERT_TRUE (x);
+
+      auto out = attn (x->first, offset);
+      ASSERT_TRUE (out.ok ()) << out.status ();
+      ASSERT_EQ (out->size (), (size_t)len * K);
+
+      std::vector<Eigen::half> out_buf (out->size ());
+      ASSERT_EQ (command_->download (*out, out_buf.data (), out_buf.size ()),
+                 absl::OkStatus ());
+      ASSERT_EQ (command_->end (), absl::OkStatus ());
+      ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+
+      for (auto v : x->second)
+        {
+          inputs.push_back (float (v));
+        }
+      for (auto v : out_buf)
+        {
+          outputs.push_back (float (v));
+        }
+      offset += len;
+    }
+
+  // the projections of all tokens, roped at their positions
+  auto k = matmul_tb (inputs, wk->second, total, N, K);
+  auto q = matmul_tb (inputs, wq->second, total, N, K);
+  auto v = matmul_tb (inputs, wv->second, total, N, K);
+
+  const int D = params.dim;
+  for (int t = 0; t < total; ++t)
+    {
+      for (int n = 0; n < N; n += 2)
+        {
+          const int i = n % D / 2;
+          const float f = t / std::pow (10000.0f, 2.0f * i / D);
+          const float c = std::cos (f), s = std::sin (f);
+          for (auto *p : { &k, &q })
+            {
+              const float x0 = (*p)[t * N + n], x1 = (*p)[t * N + n + 1];
+              (*p)[t * N + n] = x0 * c - x1 * s;
+              (*p)[t * N + n + 1] = x0 * s + x1 * c;
+            }
+        }
+    }
+
+  // k and v are read back from the cache they were quantized into
+  if (params.kvcache && params.kvcache_dtype == Q8_0)
+    {
+      round_q8_0 (k);
+      round_q8_0 (v);
+    }
+
+  std::vector<float> heads (total * N, .0f);
+  const float scale = 1.0f / std::sqrt (float (D));
+  for (int h = 0; h < params.heads; ++h)
+    {
+      for (int t = 0; t < total; ++t)
+        {
+          std::vector<float> scores (t + 1);
+          for (int j = 0; j <= t; ++j)
+            {
+              float acc = .0f;
+              for (int d = 0; d < D; ++d)
+                {
+                  acc += q[t * N + h * D + d] * k[j * N + h * D + d];
+                }
+              scores[j] = acc * scale;
+            }
+
+          const float m = *std::max_element (scores.cbegin (), scores.cend ());
+          float sum = .0f;
+          for (auto &s : scores)
+            {
+              s = std::exp (s - m);
+              sum += s;
+            }
+
+          for (int j = 0; j <= t; ++j)
+            {
+              for (int d = 0; d < D; ++d)
+                {
+                  heads[t * N + h * D + d]
+                      += scores[j] / sum * v[j * N + h * D + d];
+                }
+            }
+        }
+    }
+
+  std::vector<float> wo_buf (wo->second.cbegin (), wo->second.cend ());
+  auto expected = matmul_tb (heads, wo_buf, total, K, N);
+
+  ASSERT_EQ (outputs.size (), expected.size ());
+  for (size_t i = 0; i < expected.size (); ++i)
+    {
+      ASSERT_NEAR (outputs[i], expected[i], 1e-2)
+          << "token " << i / K << " feature " << i % K;
+    }
+}
+
+std::vector<TestMultiHeadAttentionV2Params> params = {
+  { 4, 64, 256, 13, 3, 64, true, FP16 },
+  { 2, 128, 256, 1, 4, 32, true, FP16 },
+  { 4, 64, 256, 300, 2, 512, true, FP16 },
+  { 4, 64, 256, 21, 0, 64, false, FP16 },
+  { 4, 64, 256, 13, 3, 64, true, Q8_0 },
+  { 4, 64, 256, 300, 2, 512, true, Q8_0 },
+};
+
+INSTANTIATE_TEST_SUITE_P (test_multiheadattention_v2, TestMultiHeadAttentionV2,
+                          ::testing::ValuesIn (params));
+}
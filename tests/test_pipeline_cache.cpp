@@ -0,0 +1,48 @@
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "ops/cast.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+namespace vkllama
+{
+TEST (TestPipelineCache, test_reload)
+{
+  char dir[] = "/tmp/vkllama_pipeline_cache_XXXXXX";
+  ASSERT_NE (::mkdtemp (dir), nullptr);
+  ASSERT_EQ (::setenv ("VKLLAMA_PIPELINE_CACHE_DIR", dir, 1), 0);
+
+  {
+    auto gpu = std::make_unique<GPUDevice> ();
+    ASSERT_EQ (gpu->init (), absl::OkStatus ());
+    ASSERT_EQ (gpu->pipeline_cache_loaded_bytes (), 0);
+
+    Command command (gpu.get ());
+    ASSERT_EQ (command.init (), absl::OkStatus ());
+    Cast cast_op (gpu.get (), &command, FP16, FP32);
+    ASSERT_EQ (cast_op.init (), absl::OkStatus ());
+    ASSERT_EQ (gpu->save_pipeline_cache (), absl::OkStatus ());
+  }
+
+  ASSERT_FALSE (std::filesystem::is_empty (dir));
+
+  // a restarted process picks up the pipelines compiled before
+  {
+    auto gpu = std::make_unique<GPUDevice> ();
+    ASSERT_EQ (gpu->init (), absl::OkStatus ());
+    ASSERT_GT (gpu->pipeline_cache_loaded_bytes (), 0);
+
+    Command command (gpu.get ());
+    ASSERT_EQ (command.init (), absl::OkStatus ());
+    Cast cast_op (gpu.get (), &command, FP16, FP32);
+    ASSERT_EQ (cast_op.init (), absl::OkStatus ());
+  }
+
+  std::filesystem::remove_all (dir);
+  ::unsetenv ("VKLLAMA_PIPELINE_CACHE_DIR");
+}
+}
@@ -0,0 +1,74 @@
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "core/pipeline.h"
+#include "ops/cast.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <memory>
+#include <vector>
+
+namespace vkllama
+{
+TEST (TestPipelineRegistry, test_share)
+{
+  GPUDevice gpu;
+  ASSERT_EQ (gpu.init (), absl::OkStatus ());
+  Command command (&gpu);
+  ASSERT_EQ (command.init (), absl::OkStatus ());
+
+  const auto before = gpu.pipelines ().stats ();
+
+  std::vector<std::unique_ptr<Cast> > ops;
+  for (int i = 0; i < 4; ++i)
+    {
+      ops.emplace_back (new Cast (&gpu, &command, FP16, FP32));
+      ASSERT_EQ (ops.back ()->init (), absl::OkStatus ());
+    }
+
+  // the same shader with the same constants is compiled once
+  auto stats = gpu.pipelines ().stats ();
+  ASSERT_EQ (stats.programs, before.programs + 1);
+  ASSERT_EQ (stats.misses, before.misses + 1);
+  ASSERT_EQ (stats.hits, before.hits + 3);
+
+  ops.emplace_back (new Cast (&gpu, &command, FP32, FP16));
+  ASSERT_EQ (ops.back ()->init (), absl::OkStatus ());
+  stats = gpu.pipelines ().stats ();
+  ASSERT_EQ (stats.programs, before.programs + 2);
+
+  // every instance still records with its own descriptor set
+  ASSERT_EQ (command.begin (), absl::OkStatus ());
+  auto input = random_tensor<__vkllama_fp16_t> (
+      &gpu, &command, 1, 4, 33, __fp32_to_fp16 (-1.0), __fp32_to_fp16 (1.0));
+  ASSERT_TRUE (input);
+
+  std::vector<Tensor> outputs;
+  for (int i = 0; i < 4; ++i)
+    {
+      auto out = (*ops[i]) (input->first);
+      ASSERT_TRUE (out.ok ());
+      outputs.push_back (*out);
+    }
+
+  std::vector<std::vector<float> > bufs (outputs.size ());
+  for (size_t i = 0; i < outputs.size (); ++i)
+    {
+      bufs[i].resize (outputs[i].size ());
+      ASSERT_EQ (
+          command.download (outputs[i], bufs[i].data (), bufs[i].size ()),
+          absl::OkStatus ());
+    }
+  ASSERT_EQ (command.end (), absl::OkStatus ());
+  ASSERT_EQ (command.submit_and_wait (), absl::OkStatus ());
+
+  for (auto const &buf : bufs)
+    {
+      for (size_t i = 0; i < buf.size (); ++i)
+        {
+          ASSERT_NEAR (buf[i], __fp16_to_fp32 (input->second[i].u16), 1e-3);
+        }
+    }
+
+  ops.clear ();
+}
+}
@@ -2,6 +2,7 @@
 #include "core/command.h"
 #include "core/gpu_device.h"
 #include "ops/cast.h"
+#include "ops/concat.h"
 #include "ops/slice.h"
 #include "test_common.h"
 #include "gtest/gtest.h"
@@ -101,10 +102,58 @@ TEST_P (TestSlice, test_slice)
   ASSERT_EQ (*diff.data (), 0);
 }
 
+TEST_P (TestSlice, test_slice_view)
+{
+  // whole rows of a row aligned tensor are cut into two views and joined
+  // back by concat without a dispatch
+  auto params = GetParam ();
+  const uint32_t H = params.shape.H, W = 512;
+  ASSERT_EQ (command_->begin (), absl::OkStatus ());
+  auto input0 = random_tensor<Eigen::half> (gpu_, command_, 1, H, W);
+  ASSERT_TRUE (input0);
+  auto &in = input0->first;
+
+  Slice slice_op (gpu_, command_, FP16);
+  Concat concat_op (gpu_, command_, 2, 1, FP16);
+  ASSERT_EQ (slice_op.init (), absl::OkStatus ());
+  ASSERT_EQ (concat_op.init (), absl::OkStatus ());
+
+  const uint32_t split = H / 2;
+  auto head = slice_op (in, { 0, 0, 0 }, { 1, split, W });
+  auto tail = slice_op (in, { 0, split, 0 }, { 1, H - split, W });
+  ASSERT_TRUE (head.ok ()) << head.status ();
+  ASSERT_TRUE (tail.ok ()) << tail.status ();
+  ASSERT_EQ (head->data (), in.data ());
+  ASSERT_EQ (head->offset (), in.offset ());
+  ASSERT_EQ (tail->data (), in.data ());
+  ASSERT_EQ (tail->offset (), in.offset () + split * in.hs ());
+  ASSERT_EQ (tail->shape (), (std::array<size_t, 3>{ 1, H - split, W }));
+
+  auto joined = concat_op ({ *head, *tail });
+  ASSERT_TRUE (joined.ok ()) << joined.status ();
+  ASSERT_EQ (joined->data (), in.data ());
+  ASSERT_EQ (joined->offset (), in.offset ());
+  ASSERT_EQ (joined->shape (), in.shape ());
+
+  std::vector<Eigen::half> tail_buf (tail->size ());
+  ASSERT_EQ (command_->download (*tail, tail_buf.data (), tail_buf.size ()),
+             absl::OkStatus ());
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+  ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+
+  for (size_t i = 0; i < tail_buf.size (); ++i)
+    {
+      ASSERT_EQ (float (tail_buf[i]), float (input0->second[split * W + i]))
+          << "at " << i;
+    }
+}
+
 std::vector<TestSliceParams> params = {
   { 1, { 32, 1024, 100 }, { 0, 0, 0 }, { 32, 33, 100 } },
   { 1, { 1, 65, 33 }, { 0, 0, 0 }, { 1, 33, 22 } },
   { 1, { 3, 65, 33 }, { 1, 5, 8 }, { 1, 33, 22 } },
+  { 1, { 4, 16, 128 }, { 2, 0, 0 }, { 2, 16, 128 } },
+  { 1, { 1, 7, 4096 }, { 0, 6, 0 }, { 1, 1, 4096 } },
 };
 
 INSTANTIATE_TEST_SUITE_P (test_slice, TestSlice, ::testing::ValuesIn (params));
@@ -0,0 +1,104 @@
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "core/staging_pool.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <memory>
+#include <vector>
+
+namespace vkllama
+{
+struct TestStagingPoolParams
+{
+  const int c;
+  const int h;
+  const int w;
+  const int rounds;
+};
+
+class TestStagingPool : public ::testing::TestWithParam<TestStagingPoolParams>
+{
+public:
+  GPUDevice *gpu_;
+  Command *command_;
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    command_ = new Command (gpu_);
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    ASSERT_EQ (command_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete command_;
+    delete gpu_;
+  }
+};
+
+TEST_P (TestStagingPool, test_round_trip)
+{
+  auto params = GetParam ();
+  const size_t n = params.c * params.h * params.w;
+
+  Tensor t (params.c, params.h, params.w, gpu_, FP32, false);
+  ASSERT_EQ (t.create (), absl::OkStatus ());
+
+  std::vector<float> buf (n);
+  std::vector<float> out (n);
+
+  for (int r = 0; r < params.rounds; ++r)
+    {
+      for (size_t i = 0; i < n; ++i)
+        {
+          buf[i] = float (i % 1024) + r;
+        }
+
+      ASSERT_EQ (command_->begin (), absl::OkStatus ());
+      ASSERT_EQ (command_->upload (buf.data (), n, t), absl::OkStatus ());
+      ASSERT_EQ (command_->download (t, out.data (), n), absl::OkStatus ());
+      ASSERT_EQ (command_->end (), absl::OkStatus ());
+      ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+      ASSERT_EQ (buf, out);
+    }
+
+  // after the first round every staging range comes from pooled memory
+  auto stats = gpu_->staging ().stats ();
+  ASSERT_EQ (stats.in_use_bytes, 0);
+  ASSERT_GE (stats.recycled_bytes, (params.rounds - 1) * 2 * t.bytes ());
+  ASSERT_LE (stats.allocated_bytes, gpu_->staging ().budget ());
+}
+
+TEST_P (TestStagingPool, test_over_budget)
+{
+  auto params = GetParam ();
+  const size_t bytes = params.c * params.h * params.w * sizeof (float);
+
+  StagingPool pool (gpu_, 0);
+  {
+    auto buf = pool.acquire (bytes);
+    ASSERT_TRUE (buf.ok ());
+    ASSERT_EQ ((*buf)->offset (), 0);
+    ASSERT_EQ ((*buf)->bytes (), bytes);
+    ASSERT_GE (pool.stats ().in_use_bytes, bytes);
+    ASSERT_GE (pool.stats ().allocated_bytes, bytes);
+  }
+
+  // the dedicated buffer was freed along with its memory
+  auto stats = pool.stats ();
+  ASSERT_EQ (stats.chunk_count, 0);
+  ASSERT_EQ (stats.recycled_bytes, 0);
+  ASSERT_EQ (stats.in_use_bytes, 0);
+  ASSERT_EQ (stats.allocated_bytes, 0);
+}
+
+std::vector<TestStagingPoolParams> params = { { 1, 1, 17, 3 },
+                                              { 1, 32, 4096, 4 },
+                                              { 32, 128, 128, 2 },
+                                              { 4, 1024, 5120, 2 } };
+
+INSTANTIATE_TEST_SUITE_P (test_staging_pool, TestStagingPool,
+                          ::testing::ValuesIn (params));
+}
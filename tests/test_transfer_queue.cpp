@@ -0,0 +1,159 @@
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "ops/transpose.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <cstring>
+#include <vector>
+
+namespace vkllama
+{
+struct TestTransferQueueParams
+{
+  const int C;
+  const int H;
+  const int W;
+};
+
+class TestTransferQueue
+    : public ::testing::TestWithParam<TestTransferQueueParams>
+{
+public:
+  GPUDevice *gpu_;
+  Command *compute_;
+  Command *transfer_;
+
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    compute_ = new Command (gpu_);
+    transfer_ = new Command (gpu_, TRANSFER_QUEUE);
+    ASSERT_EQ (compute_->init (), absl::OkStatus ());
+    ASSERT_EQ (transfer_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete transfer_;
+    delete compute_;
+    delete gpu_;
+  }
+
+  // runs compute after transfer, on the device when timeline semaphores
+  // can chain them, from the host otherwise
+  absl::Status
+  submit_after_transfer_ ()
+  {
+    if (gpu_->support_timeline_semaphore ())
+      {
+        VKLLAMA_STATUS_OK (transfer_->submit ());
+        VKLLAMA_STATUS_OK (Command::submit ({ compute_ }, transfer_));
+        return Command::wait ({ transfer_, compute_ });
+      }
+
+    VKLLAMA_STATUS_OK (transfer_->submit_and_wait ());
+    return compute_->submit_and_wait ();
+  }
+};
+
+TEST_P (TestTransferQueue, test_queue_selection)
+{
+  ASSERT_EQ (compute_->queue_kind (), COMPUTE_QUEUE);
+  ASSERT_EQ (transfer_->queue_kind (), TRANSFER_QUEUE);
+  ASSERT_EQ (compute_->queue_family (), gpu_->queue_family (COMPUTE_QUEUE));
+  ASSERT_EQ (transfer_->queue_family (), gpu_->queue_family (TRANSFER_QUEUE));
+  ASSERT_EQ (gpu_->separate_transfer_queue (),
+             gpu_->queue_family (TRANSFER_QUEUE)
+                     != gpu_->queue_family (COMPUTE_QUEUE)
+                 || gpu_->queue_index (TRANSFER_QUEUE)
+                        != gpu_->queue_index (COMPUTE_QUEUE));
+}
+
+TEST_P (TestTransferQueue, test_upload_then_compute)
+{
+  auto params = GetParam ();
+  const size_t n = params.C * params.H * params.W;
+
+  std::vector<Eigen::half> buf (n);
+  for (size_t i = 0; i < n; ++i)
+    {
+      buf[i] = Eigen::half (float (i % 1021) / 1021.0f);
+    }
+
+  Tensor input (params.C, params.H, params.W, gpu_, FP16);
+  ASSERT_EQ (input.create (), absl::OkStatus ());
+
+  ASSERT_EQ (transfer_->begin (), absl::OkStatus ());
+  ASSERT_EQ (transfer_->upload (buf.data (), n, input), absl::OkStatus ());
+  ASSERT_EQ (transfer_->release (input, COMPUTE_QUEUE), absl::OkStatus ());
+  ASSERT_EQ (transfer_->end (), absl::OkStatus ());
+
+  const bool transferred
+      = gpu_->queue_family (TRANSFER_QUEUE)
+        != gpu_->queue_family (COMPUTE_QUEUE);
+  ASSERT_EQ (input.pending_queue_family (),
+             transferred ? gpu_->queue_family (COMPUTE_QUEUE)
+                         : VK_QUEUE_FAMILY_IGNORED);
+
+  // two transposes give the input back, the first one acquires it
+  Transpose transpose0 (gpu_, compute_, 0), transpose1 (gpu_, compute_, 0);
+  ASSERT_EQ (transpose0.init (), absl::OkStatus ());
+  ASSERT_EQ (transpose1.init (), absl::OkStatus ());
+
+  std::vector<Eigen::half> output (n);
+  ASSERT_EQ (compute_->begin (), absl::OkStatus ());
+  auto t0 = transpose0 (input);
+  ASSERT_TRUE (t0.ok ()) << t0.status ();
+  auto t1 = transpose1 (*t0);
+  ASSERT_TRUE (t1.ok ()) << t1.status ();
+  ASSERT_EQ (compute_->download (*t1, output.data (), n), absl::OkStatus ());
+  ASSERT_EQ (compute_->end (), absl::OkStatus ());
+  ASSERT_EQ (input.pending_queue_family (), VK_QUEUE_FAMILY_IGNORED);
+
+  ASSERT_EQ (submit_after_transfer_ (), absl::OkStatus ());
+  for (size_t i = 0; i < n; ++i)
+    {
+      ASSERT_EQ (float (output[i]), float (buf[i])) << "at " << i;
+    }
+}
+
+TEST_P (TestTransferQueue, test_compute_then_readback)
+{
+  auto params = GetParam ();
+  const size_t n = params.C * params.H * params.W;
+
+  Tensor filled (params.C, params.H, params.W, gpu_, FP32);
+  ASSERT_EQ (filled.create (), absl::OkStatus ());
+
+  const float value = 3.5f;
+  uint32_t bits = 0;
+  ::memcpy (&bits, &value, sizeof (bits));
+  ASSERT_EQ (compute_->begin (), absl::OkStatus ());
+  ASSERT_EQ (compute_->fill (filled, bits), absl::OkStatus ());
+  ASSERT_EQ (compute_->release (filled, TRANSFER_QUEUE), absl::OkStatus ());
+  ASSERT_EQ (compute_->end (), absl::OkStatus ());
+  ASSERT_EQ (compute_->submit_and_wait (), absl::OkStatus ());
+
+  // the readback acquires the tensor on the transfer queue
+  std::vector<float> output (n);
+  ASSERT_EQ (transfer_->begin (), absl::OkStatus ());
+  ASSERT_EQ (transfer_->download (filled, output.data (), n),
+             absl::OkStatus ());
+  ASSERT_EQ (transfer_->end (), absl::OkStatus ());
+  ASSERT_EQ (transfer_->submit_and_wait (), absl::OkStatus ());
+
+  for (size_t i = 0; i < n; ++i)
+    {
+      ASSERT_EQ (output[i], value) << "at " << i;
+    }
+}
+
+std::vector<TestTransferQueueParams> params
+    = { { 1, 1, 31 }, { 3, 17, 64 }, { 32, 64, 128 } };
+
+INSTANTIATE_TEST_SUITE_P (test_transfer_queue, TestTransferQueue,
+                          ::testing::ValuesIn (params));
+}
@@ -6,6 +6,7 @@
 #include "ops/update_kv_cache.h"
 #include "test_common.h"
 #include "gtest/gtest.h"
+#include <cstring>
 #include <memory>
 #include <tuple>
 #include <vector>
@@ -114,6 +115,55 @@ TEST_P (TestUpdateKVCache, test_update_kv_cache)
   ASSERT_EQ (*diff.data (), 0);
 }
 
+TEST_P (TestUpdateKVCache, test_update_kv_cache_q8_0)
+{
+  auto params = GetParam ();
+  ASSERT_EQ (command_->begin (), absl::OkStatus ());
+
+  auto input0 = random_tensor<Eigen::half> (gpu_, command_, params.heads,
+                                            params.seqlen, params.dim);
+  ASSERT_TRUE (input0);
+  auto input = input0->first;
+
+  Tensor cache (params.heads, params.maxlen, params.dim, gpu_, Q8_0, false);
+  ASSERT_EQ (cache.create (), absl::OkStatus ());
+  ASSERT_EQ (command_->fill (cache, 0), absl::OkStatus ());
+
+  UpdateKVCache update_op (gpu_, command_, ::vkllama::Q8_0);
+  ASSERT_EQ (update_op.init (), absl::OkStatus ());
+  ASSERT_EQ (update_op (cache, input, params.offset), absl::OkStatus ());
+
+  // the device layout: rows of packed blocks, an fp16 scale and 32 items
+  std::vector<uint8_t> cache_buf (cache.bytes ());
+  ASSERT_EQ (command_->download (cache, cache_buf.data (), cache_buf.size ()),
+             absl::OkStatus ());
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+  ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+
+  const int blocks = (params.dim + 31) / 32;
+  for (int c = 0; c < params.heads; ++c)
+    {
+      for (int r = 0; r < params.seqlen; ++r)
+        {
+          const int row = (params.offset + r) % params.maxlen;
+          for (int i = 0; i < params.dim; ++i)
+            {
+              const auto *block
+                  = cache_buf.data ()
+                    + ((c * params.maxlen + row) * blocks + i / 32) * 34;
+              uint16_t d;
+              ::memcpy (&d, block, 2);
+              const float actual
+                  = __fp16_to_fp32 (d) * (int8_t)block[2 + i % 32];
+              const float expected = float (
+                  input0->second[(c * params.seqlen + r) * params.dim + i]);
+              ASSERT_NEAR (actual, expected, 1e-2)
+                  << "head " << c << " row " << r << " item " << i;
+            }
+        }
+    }
+}
+
 std::vector<TestUpdateKVCacheParams> params
     = { { 32, 25, 1024, 100, 0 }, { 32, 25, 1024, 100, 1022 } };
 
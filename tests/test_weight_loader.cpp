@@ -0,0 +1,151 @@
+#include "core/command.h"
+#include "core/gpu_device.h"
+#include "core/weight_loader.h"
+#include "test_common.h"
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace vkllama
+{
+struct TestWeightLoaderParams
+{
+  const int C;
+  const int H;
+  const int W;
+  const int groups;
+  const int tensors;
+  const size_t inflight;
+  const size_t threads;
+};
+
+class TestWeightLoader
+    : public ::testing::TestWithParam<TestWeightLoaderParams>
+{
+public:
+  GPUDevice *gpu_;
+  Command *command_;
+
+  void
+  SetUp () override
+  {
+    gpu_ = new GPUDevice ();
+    command_ = new Command (gpu_);
+    ASSERT_EQ (gpu_->init (), absl::OkStatus ());
+    ASSERT_EQ (command_->init (), absl::OkStatus ());
+  }
+
+  void
+  TearDown () override
+  {
+    delete command_;
+    delete gpu_;
+  }
+};
+
+TEST_P (TestWeightLoader, test_pipelined_upload)
+{
+  auto params = GetParam ();
+  const size_t n = params.C * params.H * params.W;
+
+  std::vector<std::vector<float> > host;
+  std::vector<Tensor> weights;
+  std::mt19937 gen (42);
+  std::uniform_real_distribution<float> dist (-1.0f, 1.0f);
+  for (int i = 0; i < params.groups * params.tensors; ++i)
+    {
+      std::vector<float> buf (n);
+      for (auto &v : buf)
+        {
+          v = dist (gen);
+        }
+      host.push_back (std::move (buf));
+
+      Tensor t (params.C, params.H, params.W, gpu_, FP32);
+      ASSERT_EQ (t.create (WEIGHT_MEMORY), absl::OkStatus ());
+      weights.push_back (t);
+    }
+
+  std::vector<std::pair<size_t, size_t> > done;
+  {
+    WeightLoader loader (gpu_, false, params.inflight, params.threads);
+    ASSERT_EQ (loader.init (), absl::OkStatus ());
+    loader.set_callback ([&done] (size_t group, size_t bytes) {
+      done.push_back ({ group, bytes });
+    });
+
+    for (int g = 0; g < params.groups; ++g)
+      {
+        std::vector<WeightLoader::Upload> uploads;
+        for (int i = 0; i < params.tensors; ++i)
+          {
+            const int k = g * params.tensors + i;
+            uploads.push_back (
+                { reinterpret_cast<const uint8_t *> (host[k].data ()),
+                  n * sizeof (float), weights[k] });
+          }
+        ASSERT_EQ (loader.add (uploads), absl::OkStatus ());
+      }
+    ASSERT_EQ (loader.finish (), absl::OkStatus ());
+  }
+
+  // every group is reported once, in order
+  ASSERT_EQ (done.size (), params.groups);
+  for (int g = 0; g < params.groups; ++g)
+    {
+      ASSERT_EQ (done[g].first, g);
+      ASSERT_EQ (done[g].second, params.tensors * n * sizeof (float));
+    }
+
+  for (size_t k = 0; k < weights.size (); ++k)
+    {
+      std::vector<float> output (n);
+      ASSERT_EQ (command_->begin (), absl::OkStatus ());
+      ASSERT_EQ (command_->download (weights[k], output.data (), n),
+                 absl::OkStatus ());
+      ASSERT_EQ (command_->end (), absl::OkStatus ());
+      ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+      ASSERT_EQ (output, host[k]) << "at tensor " << k;
+    }
+}
+
+TEST_F (TestWeightLoader, test_oversized_upload)
+{
+  std::vector<float> host (1024, 1.0f);
+  Tensor small (1, 1, 16, gpu_, FP32);
+  Tensor large (1, 1, 1024, gpu_, FP32);
+  ASSERT_EQ (small.create (WEIGHT_MEMORY), absl::OkStatus ());
+  ASSERT_EQ (large.create (WEIGHT_MEMORY), absl::OkStatus ());
+  auto from = reinterpret_cast<const uint8_t *> (host.data ());
+
+  WeightLoader loader (gpu_, false, 1, 1);
+  ASSERT_EQ (loader.init (), absl::OkStatus ());
+  ASSERT_EQ (
+      loader.add ({ { from, host.size () * sizeof (float), small } }).code (),
+      absl::StatusCode::kOutOfRange);
+
+  // the refused batch left the slot free for the next one
+  ASSERT_EQ (loader.add ({ { from, host.size () * sizeof (float), large } }),
+             absl::OkStatus ());
+  ASSERT_EQ (loader.finish (), absl::OkStatus ());
+
+  std::vector<float> output (1024);
+  ASSERT_EQ (command_->begin (), absl::OkStatus ());
+  ASSERT_EQ (command_->download (large, output.data (), output.size ()),
+             absl::OkStatus ());
+  ASSERT_EQ (command_->end (), absl::OkStatus ());
+  ASSERT_EQ (command_->submit_and_wait (), absl::OkStatus ());
+  ASSERT_EQ (output, host);
+}
+
+std::vector<TestWeightLoaderParams> params = {
+  { 1, 1, 31, 1, 1, 1, 1 },
+  { 3, 17, 64, 5, 3, 2, 4 },
+  // tensors larger than a piece are split over the workers
+  { 1, 1024, 1536, 4, 2, 3, 0 },
+};
+
+INSTANTIATE_TEST_SUITE_P (test_weight_loader, TestWeightLoader,
+                          ::testing::ValuesIn (params));
+}